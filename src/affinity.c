@@ -0,0 +1,346 @@
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2013-2015 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * Kvazaar is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+/*
+ * Worker placement.
+ *
+ * The CPUs that may be used are the ones in the affinity mask of the process,
+ * optionally restricted to the CPUs of one NUMA node. They are then ordered
+ * according to the placement mode using the CPU topology in sysfs:
+ *
+ * - compact: all hardware threads of a core, then the next core of the same
+ *   package, then the next package.
+ * - scatter: one hardware thread per core, alternating between packages,
+ *   before the second hardware threads of the cores are used.
+ *
+ * Only the worker threads are bound. Memory is not: the pictures, the
+ * reconstruction buffers and the CU arrays are allocated and first written
+ * by the thread calling the encoder, so their pages follow the memory
+ * policy of that thread.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// Needed for cpu_set_t and pthread_setaffinity_np.
+#define _GNU_SOURCE
+#endif
+
+#include "affinity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "kvazaar.h"
+
+
+#define AFFINITY_MAX_CPUS 1024
+
+
+/**
+ * \brief Parse a list of CPU numbers such as "0-3,8,10-11".
+ *
+ * \param list    string to parse
+ * \param cpus    returns an allocated array of CPU numbers
+ * \param count   returns the number of CPUs
+ * \return 1 on success, 0 on failure
+ */
+int kvz_affinity_parse_cpu_list(const char *list, int32_t **cpus, int32_t *count)
+{
+  int32_t *values = NULL;
+  int32_t num_values = 0;
+  const char *pos = list;
+
+  *cpus = NULL;
+  *count = 0;
+
+  while (*pos != '\0' && *pos != '\n') {
+    char *end = NULL;
+    long first = strtol(pos, &end, 10);
+    if (end == pos) goto parse_failed;
+    pos = end;
+
+    long last = first;
+    if (*pos == '-') {
+      ++pos;
+      last = strtol(pos, &end, 10);
+      if (end == pos) goto parse_failed;
+      pos = end;
+    }
+
+    if (first < 0 || last < first || last >= AFFINITY_MAX_CPUS) goto parse_failed;
+
+    int32_t *grown = realloc(values, (num_values + last - first + 1) * sizeof(int32_t));
+    if (!grown) goto parse_failed;
+    values = grown;
+
+    for (long cpu = first; cpu <= last; ++cpu) {
+      values[num_values++] = (int32_t)cpu;
+    }
+
+    if (*pos == ',') {
+      ++pos;
+    } else if (*pos != '\0' && *pos != '\n') {
+      goto parse_failed;
+    }
+  }
+
+  *cpus = values;
+  *count = num_values;
+  return 1;
+
+parse_failed:
+  FREE_POINTER(values);
+  return 0;
+}
+
+#ifdef __linux__
+
+typedef struct {
+  int32_t cpu;
+  int package;
+  int core;
+  int core_rank; //!< index of the core within its package
+  int smt;       //!< index of the hardware thread within its core
+} cpu_topology_t;
+
+
+static int read_sysfs_int(const char *path, int fallback)
+{
+  int value = fallback;
+  FILE *f = fopen(path, "r");
+  if (f) {
+    if (fscanf(f, "%d", &value) != 1) value = fallback;
+    fclose(f);
+  }
+  return value;
+}
+
+static int read_sysfs_cpu_list(const char *path, int32_t **cpus, int32_t *count)
+{
+  char buf[4096];
+  FILE *f = fopen(path, "r");
+  if (!f) return 0;
+
+  if (!fgets(buf, sizeof(buf), f)) buf[0] = '\0';
+  fclose(f);
+
+  return kvz_affinity_parse_cpu_list(buf, cpus, count);
+}
+
+static int compare_compact(const void *a, const void *b)
+{
+  const cpu_topology_t *x = a;
+  const cpu_topology_t *y = b;
+  if (x->package != y->package) return x->package < y->package ? -1 : 1;
+  if (x->core_rank != y->core_rank) return x->core_rank < y->core_rank ? -1 : 1;
+  return x->smt - y->smt;
+}
+
+static int compare_scatter(const void *a, const void *b)
+{
+  const cpu_topology_t *x = a;
+  const cpu_topology_t *y = b;
+  if (x->smt != y->smt) return x->smt - y->smt;
+  if (x->core_rank != y->core_rank) return x->core_rank < y->core_rank ? -1 : 1;
+  return x->package - y->package;
+}
+
+/**
+ * \brief Sort CPUs for compact or scatter placement.
+ */
+static int sort_by_topology(int32_t *cpus, int32_t count, int8_t mode)
+{
+  cpu_topology_t *topo = MALLOC(cpu_topology_t, count);
+  if (!topo) return 0;
+
+  for (int i = 0; i < count; ++i) {
+    char path[128];
+    topo[i].cpu = cpus[i];
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpus[i]);
+    topo[i].package = read_sysfs_int(path, 0);
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/core_id", cpus[i]);
+    topo[i].core = read_sysfs_int(path, cpus[i]);
+  }
+
+  // The CPUs are in ascending order, so hardware threads of a core are
+  // numbered in the order they appear.
+  for (int i = 0; i < count; ++i) {
+    topo[i].smt = 0;
+    topo[i].core_rank = 0;
+    for (int j = 0; j < i; ++j) {
+      if (topo[j].package == topo[i].package && topo[j].core == topo[i].core) {
+        topo[i].smt++;
+      }
+    }
+  }
+  for (int i = 0; i < count; ++i) {
+    for (int j = 0; j < count; ++j) {
+      if (topo[j].package == topo[i].package &&
+          topo[j].smt == 0 &&
+          topo[j].core < topo[i].core)
+      {
+        topo[i].core_rank++;
+      }
+    }
+  }
+
+  qsort(topo, count, sizeof(topo[0]),
+        mode == KVZ_THREAD_AFFINITY_SCATTER ? compare_scatter : compare_compact);
+
+  for (int i = 0; i < count; ++i) {
+    cpus[i] = topo[i].cpu;
+  }
+  free(topo);
+  return 1;
+}
+
+#endif // __linux__
+
+/**
+ * \brief Select the CPUs for the worker threads of an encoder.
+ *
+ * \param affinity        returns the placement, free with kvz_affinity_free
+ * \param mode            one of enum kvz_thread_affinity
+ * \param cpu_list        CPUs for KVZ_THREAD_AFFINITY_LIST
+ * \param cpu_list_count  number of CPUs in cpu_list
+ * \param numa_node       restrict to CPUs of this node, or -1
+ * \return 1 on success, 0 on failure
+ */
+int kvz_affinity_init(kvz_affinity_t *affinity,
+                      int8_t mode,
+                      const int32_t *cpu_list,
+                      int32_t cpu_list_count,
+                      int32_t numa_node)
+{
+  affinity->cpus = NULL;
+  affinity->cpu_count = 0;
+  affinity->pin_single = 0;
+
+  if (mode == KVZ_THREAD_AFFINITY_NONE && numa_node < 0) {
+    return 1;
+  }
+
+#ifdef __linux__
+  cpu_set_t available;
+  if (sched_getaffinity(0, sizeof(available), &available) != 0) {
+    fprintf(stderr, "Could not get the CPU affinity of the process.\n");
+    return 0;
+  }
+
+  if (numa_node >= 0) {
+    char path[128];
+    int32_t *node_cpus = NULL;
+    int32_t node_cpu_count = 0;
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", numa_node);
+    if (!read_sysfs_cpu_list(path, &node_cpus, &node_cpu_count)) {
+      fprintf(stderr, "Could not read the CPUs of NUMA node %d.\n", numa_node);
+      return 0;
+    }
+
+    cpu_set_t on_node;
+    CPU_ZERO(&on_node);
+    for (int i = 0; i < node_cpu_count; ++i) {
+      CPU_SET(node_cpus[i], &on_node);
+    }
+    free(node_cpus);
+    CPU_AND(&available, &available, &on_node);
+  }
+
+  affinity->cpus = MALLOC(int32_t, AFFINITY_MAX_CPUS);
+  if (!affinity->cpus) return 0;
+
+  if (mode == KVZ_THREAD_AFFINITY_LIST) {
+    for (int i = 0; i < cpu_list_count; ++i) {
+      if (CPU_ISSET(cpu_list[i], &available)) {
+        affinity->cpus[affinity->cpu_count++] = cpu_list[i];
+      } else {
+        fprintf(stderr, "CPU %d is not available for the encoder. Skipping it.\n",
+                cpu_list[i]);
+      }
+    }
+  } else {
+    for (int cpu = 0; cpu < AFFINITY_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &available)) {
+        affinity->cpus[affinity->cpu_count++] = cpu;
+      }
+    }
+  }
+
+  if (affinity->cpu_count == 0) {
+    fprintf(stderr, "No CPUs available for the encoder threads.\n");
+    kvz_affinity_free(affinity);
+    return 0;
+  }
+
+  if (mode == KVZ_THREAD_AFFINITY_COMPACT || mode == KVZ_THREAD_AFFINITY_SCATTER) {
+    if (!sort_by_topology(affinity->cpus, affinity->cpu_count, mode)) {
+      kvz_affinity_free(affinity);
+      return 0;
+    }
+  }
+
+  affinity->pin_single = mode != KVZ_THREAD_AFFINITY_NONE;
+  return 1;
+
+#else
+  fprintf(stderr, "Thread affinity is only supported on Linux. Ignoring it.\n");
+  return 1;
+#endif
+}
+
+/**
+ * \brief Bind a worker thread to its CPUs.
+ *
+ * \param affinity  placement from kvz_affinity_init
+ * \param thread    thread to bind
+ * \param worker    index of the worker
+ * \return 1 on success, 0 on failure
+ */
+int kvz_affinity_bind(const kvz_affinity_t *affinity, pthread_t thread, int worker)
+{
+  if (affinity->cpu_count == 0) {
+    return 1;
+  }
+
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (affinity->pin_single) {
+    CPU_SET(affinity->cpus[worker % affinity->cpu_count], &set);
+  } else {
+    for (int i = 0; i < affinity->cpu_count; ++i) {
+      CPU_SET(affinity->cpus[i], &set);
+    }
+  }
+  return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#else
+  return 1;
+#endif
+}
+
+void kvz_affinity_free(kvz_affinity_t *affinity)
+{
+  FREE_POINTER(affinity->cpus);
+  affinity->cpu_count = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2013-2015 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * Kvazaar is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+/**
+ * \ingroup Threading
+ * \file
+ * Placement of worker threads on CPUs and NUMA nodes.
+ */
+
+#include "global.h" // IWYU pragma: keep
+
+#include <pthread.h>
+
+
+/**
+ * \brief CPUs assigned to the worker threads of one encoder.
+ *
+ * The CPUs are stored in placement order. When pin_single is set, worker i
+ * runs only on cpus[i % cpu_count]. Otherwise every worker may run on any
+ * of the CPUs.
+ */
+typedef struct {
+  int32_t *cpus;
+  int32_t cpu_count;
+  int pin_single;
+} kvz_affinity_t;
+
+int kvz_affinity_parse_cpu_list(const char *list, int32_t **cpus, int32_t *count);
+
+int kvz_affinity_init(kvz_affinity_t *affinity,
+                      int8_t mode,
+                      const int32_t *cpu_list,
+                      int32_t cpu_list_count,
+                      int32_t numa_node);
+int kvz_affinity_bind(const kvz_affinity_t *affinity, pthread_t thread, int worker);
+void kvz_affinity_free(kvz_affinity_t *affinity);
+
+#endif // AFFINITY_H_
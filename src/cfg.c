@@ -26,6 +26,8 @@
 #include <string.h>
 #include <math.h>
 
+#include "affinity.h"
+
 
 kvz_config *kvz_config_alloc(void)
 {
@@ -75,6 +77,8 @@ int kvz_config_init(kvz_config *cfg)
   cfg->gop_lowdelay    = true;
   cfg->bipred          = 0;
   cfg->target_bitrate  = 0;
+  cfg->pass            = 0;
+  cfg->stats_file      = NULL;
   cfg->hash            = KVZ_HASH_CHECKSUM;
   cfg->lossless        = false;
   cfg->tmvp_enable     = true;
@@ -138,6 +142,30 @@ int kvz_config_init(kvz_config *cfg)
 
   cfg->scaling_list = KVZ_SCALING_LIST_OFF;
 
+  cfg->thread_affinity = KVZ_THREAD_AFFINITY_NONE;
+  cfg->thread_affinity_cpus = NULL;
+  cfg->thread_affinity_cpus_count = 0;
+  cfg->numa_node = -1;
+  cfg->thread_pool = NULL;
+  cfg->trace_file = NULL;
+  cfg->owf_adaptive = 0;
+  cfg->inter_ref_window_right = 1;
+  cfg->inter_ref_window_down = 1;
+  cfg->me_ref_jobs = 0;
+  cfg->lookahead = 0;
+  cfg->lookahead_scale = 2;
+  cfg->scenecut = 0;
+  cfg->cutree = 0;
+  cfg->aq = KVZ_AQ_OFF;
+  cfg->aq_strength = 1.0;
+  cfg->vbv_maxrate = 0;
+  cfg->vbv_bufsize = 0;
+  cfg->crf = 0.0;
+  cfg->picture_roi = 0;
+  cfg->subme_cache = 0;
+  cfg->me_cache = 0;
+  cfg->owf_max = -1;
+
   return 1;
 }
 
@@ -150,6 +178,9 @@ int kvz_config_destroy(kvz_config *cfg)
     FREE_POINTER(cfg->slice_addresses_in_ts);
     FREE_POINTER(cfg->roi.dqps);
     FREE_POINTER(cfg->optional_key);
+    FREE_POINTER(cfg->thread_affinity_cpus);
+    FREE_POINTER(cfg->trace_file);
+    FREE_POINTER(cfg->stats_file);
   }
   free(cfg);
 
@@ -357,7 +388,7 @@ static int parse_slice_specification(const char* const arg, int32_t * const nsli
 
 int kvz_config_parse(kvz_config *cfg, const char *name, const char *value)
 {
-  static const char * const me_names[]          = { "hexbs", "tz", "full", "full8", "full16", "full32", "full64", "dia", NULL };
+  static const char * const me_names[]          = { "hexbs", "tz", "full", "full8", "full16", "full32", "full64", "dia", "pyramid", NULL };
   static const char * const source_scan_type_names[] = { "progressive", "tff", "bff", NULL };
 
   static const char * const overscan_names[]    = { "undef", "show", "crop", NULL };
@@ -383,6 +414,10 @@ int kvz_config_parse(kvz_config *cfg, const char *name, const char *value)
 
   static const char * const scaling_list_names[] = { "off", "custom", "default", NULL };
 
+  static const char * const aq_names[] = { "off", "variance", NULL };
+
+  static const char * const thread_affinity_names[] = { "none", "compact", "scatter", NULL };
+
   static const char * const preset_values[11][23*2] = {
       {
         "ultrafast",
@@ -845,7 +880,48 @@ int kvz_config_parse(kvz_config *cfg, const char *name, const char *value)
       // -1 means automatic selection
       cfg->owf = -1;
     }
-  } else if OPT("slices") {
+  }
+  else if OPT("owf-adaptive")
+    cfg->owf_adaptive = atobool(value);
+  else if OPT("owf-max") {
+    cfg->owf_max = atoi(value);
+    if (cfg->owf_max == 0 && !strcmp(value, "auto")) {
+      cfg->owf_max = -1;
+    }
+  }
+  else if OPT("inter-ref-window") {
+    int right;
+    int down;
+    char extra;
+    if (!strcmp(value, "auto")) {
+      right = -1;
+      down = -1;
+    } else if (sscanf(value, "%dx%d%c", &right, &down, &extra) == 2) {
+      // Separate values for both directions.
+    } else if (sscanf(value, "%d%c", &right, &extra) == 1) {
+      down = right;
+    } else {
+      fprintf(stderr, "Invalid inter-ref-window value: \"%s\"\n", value);
+      return 0;
+    }
+    cfg->inter_ref_window_right = right;
+    cfg->inter_ref_window_down = down;
+  }
+  else if OPT("me-ref-jobs")
+    cfg->me_ref_jobs = atobool(value);
+  else if OPT("lookahead")
+    cfg->lookahead = atoi(value);
+  else if OPT("lookahead-scale")
+    cfg->lookahead_scale = atoi(value);
+  else if OPT("scenecut")
+    cfg->scenecut = atoi(value);
+  else if OPT("cutree")
+    cfg->cutree = atobool(value);
+  else if OPT("aq")
+    return parse_enum(value, aq_names, &cfg->aq);
+  else if OPT("aq-strength")
+    cfg->aq_strength = atof(value);
+  else if OPT("slices") {
     if (!strcmp(value, "tiles")) {
       cfg->slices = KVZ_SLICES_TILES;
       return 1;
@@ -1226,6 +1302,69 @@ int kvz_config_parse(kvz_config *cfg, const char *name, const char *value)
   }
   else if (OPT("fast-residual-cost"))
     cfg->fast_residual_cost_limit = atoi(value);
+  else if OPT("thread-affinity") {
+    FREE_POINTER(cfg->thread_affinity_cpus);
+    cfg->thread_affinity_cpus_count = 0;
+
+    int8_t affinity = 0;
+    if (parse_enum(value, thread_affinity_names, &affinity)) {
+      cfg->thread_affinity = affinity;
+      return 1;
+    }
+
+    if (!kvz_affinity_parse_cpu_list(value,
+                                     &cfg->thread_affinity_cpus,
+                                     &cfg->thread_affinity_cpus_count) ||
+        cfg->thread_affinity_cpus_count == 0)
+    {
+      fprintf(stderr, "Invalid thread-affinity value: \"%s\"\n", value);
+      FREE_POINTER(cfg->thread_affinity_cpus);
+      cfg->thread_affinity_cpus_count = 0;
+      return 0;
+    }
+    cfg->thread_affinity = KVZ_THREAD_AFFINITY_LIST;
+  }
+  else if OPT("numa-node") {
+    char *tailptr = NULL;
+    long node = strtol(value, &tailptr, 10);
+    if (*tailptr != '\0' || node < -1 || node > INT32_MAX) {
+      fprintf(stderr, "Invalid numa-node value: \"%s\"\n", value);
+      return 0;
+    }
+    cfg->numa_node = (int32_t)node;
+  }
+  else if OPT("pass")
+    cfg->pass = atoi(value);
+  else if OPT("stats") {
+    char *stats_file = strdup(value);
+    if (!stats_file) {
+      fprintf(stderr, "Failed to allocate memory for stats file name.\n");
+      return 0;
+    }
+    FREE_POINTER(cfg->stats_file);
+    cfg->stats_file = stats_file;
+  }
+  else if OPT("vbv-maxrate")
+    cfg->vbv_maxrate = atoi(value);
+  else if OPT("vbv-bufsize")
+    cfg->vbv_bufsize = atoi(value);
+  else if OPT("crf")
+    cfg->crf = atof(value);
+  else if OPT("picture-roi")
+    cfg->picture_roi = atobool(value);
+  else if OPT("subme-cache")
+    cfg->subme_cache = atobool(value);
+  else if OPT("me-cache")
+    cfg->me_cache = atobool(value);
+  else if OPT("trace-file") {
+    char *trace_file = strdup(value);
+    if (!trace_file) {
+      fprintf(stderr, "Failed to allocate memory for trace file name.\n");
+      return 0;
+    }
+    FREE_POINTER(cfg->trace_file);
+    cfg->trace_file = trace_file;
+  }
   else {
     return 0;
   }
@@ -1438,6 +1577,43 @@ int kvz_config_validate(const kvz_config *const cfg)
     error = 1;
   }
 
+  if (cfg->owf_max < -1) {
+    fprintf(stderr, "Input error: --owf-max must be nonnegative or -1\n");
+    error = 1;
+  }
+
+  if ((cfg->inter_ref_window_right < 0 || cfg->inter_ref_window_down < 0) &&
+      (cfg->inter_ref_window_right != -1 || cfg->inter_ref_window_down != -1))
+  {
+    fprintf(stderr, "Input error: --inter-ref-window must be nonnegative or auto\n");
+    error = 1;
+  }
+
+  if (cfg->lookahead < 0) {
+    fprintf(stderr, "Input error: --lookahead must be nonnegative\n");
+    error = 1;
+  }
+
+  if (cfg->lookahead_scale != 2 && cfg->lookahead_scale != 4) {
+    fprintf(stderr, "Input error: --lookahead-scale must be 2 or 4\n");
+    error = 1;
+  }
+
+  if (cfg->scenecut < 0 || cfg->scenecut > 100) {
+    fprintf(stderr, "Input error: --scenecut out of range [0..100]\n");
+    error = 1;
+  }
+
+  if (cfg->cutree && cfg->lookahead == 0) {
+    fprintf(stderr, "Input error: --cutree requires --lookahead\n");
+    error = 1;
+  }
+
+  if (cfg->aq_strength < 0.0 || cfg->aq_strength > 3.0) {
+    fprintf(stderr, "Input error: --aq-strength out of range [0.0..3.0]\n");
+    error = 1;
+  }
+
   if (cfg->qp != CLIP_TO_QP(cfg->qp)) {
       fprintf(stderr, "Input error: --qp parameter out of range [0..51]\n");
       error = 1;
@@ -1448,6 +1624,47 @@ int kvz_config_validate(const kvz_config *const cfg)
       error = 1;
   }
 
+  if (cfg->pass < 0 || cfg->pass > 2) {
+    fprintf(stderr, "Input error: --pass must be 0, 1 or 2\n");
+    error = 1;
+  }
+
+  if (cfg->pass > 0 && !cfg->stats_file) {
+    fprintf(stderr, "Input error: --pass requires --stats\n");
+    error = 1;
+  }
+
+  if (cfg->pass == 2 && cfg->target_bitrate == 0) {
+    fprintf(stderr, "Input error: --pass=2 requires --bitrate\n");
+    error = 1;
+  }
+
+  if ((cfg->vbv_maxrate > 0) != (cfg->vbv_bufsize > 0)) {
+    fprintf(stderr, "Input error: --vbv-maxrate and --vbv-bufsize must be used together\n");
+    error = 1;
+  }
+
+  if (cfg->vbv_maxrate > 0 && cfg->target_bitrate > 0 &&
+      (uint32_t)cfg->target_bitrate > cfg->vbv_maxrate) {
+    fprintf(stderr, "Input error: --bitrate must not exceed --vbv-maxrate\n");
+    error = 1;
+  }
+
+  if (cfg->crf < 0.0 || cfg->crf > 51.0) {
+    fprintf(stderr, "Input error: --crf out of range [0..51]\n");
+    error = 1;
+  }
+
+  if (cfg->crf > 0.0 && cfg->target_bitrate > 0) {
+    fprintf(stderr, "Input error: --crf and --bitrate cannot be used together\n");
+    error = 1;
+  }
+
+  if (cfg->crf > 0.0 && cfg->pass > 0) {
+    fprintf(stderr, "Input error: --crf cannot be used with --pass\n");
+    error = 1;
+  }
+
   if (!WITHIN(cfg->pu_depth_inter.min, PU_DEPTH_INTER_MIN, PU_DEPTH_INTER_MAX) ||
       !WITHIN(cfg->pu_depth_inter.max, PU_DEPTH_INTER_MIN, PU_DEPTH_INTER_MAX))
   {
@@ -1533,6 +1750,17 @@ int kvz_config_validate(const kvz_config *const cfg)
     error = 1;
   }
 
+  if (cfg->thread_affinity == KVZ_THREAD_AFFINITY_LIST &&
+      cfg->thread_affinity_cpus_count <= 0) {
+    fprintf(stderr, "Input error: --thread-affinity CPU list is empty.\n");
+    error = 1;
+  }
+
+  if (cfg->numa_node < -1) {
+    fprintf(stderr, "Input error: --numa-node must be nonnegative or -1\n");
+    error = 1;
+  }
+
   if (validate_hevc_level((kvz_config *const) cfg)) {
     // a level error found and it's not okay
     error = 1;
@@ -1652,6 +1880,12 @@ static int validate_hevc_level(kvz_config *const cfg) {
     level_error = 1;
   }
 
+  if (cfg->vbv_maxrate > cfg->max_bitrate) {
+    fprintf(stderr, "%s: VBV maximum rate exceeds %i, which is the maximum %s tier level %g bitrate\n",
+      level_err_prefix, cfg->max_bitrate, cfg->high_tier?"high":"main", lvl);
+    level_error = 1;
+  }
+
   // check the conformance to the level limits
 
   // luma samples
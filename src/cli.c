@@ -65,6 +65,10 @@ static const struct option long_options[] = {
   { "tr-depth-intra",     required_argument, NULL, 0 },
   { "me",                 required_argument, NULL, 0 },
   { "subme",              required_argument, NULL, 0 },
+  { "subme-cache",              no_argument, NULL, 0 },
+  { "no-subme-cache",           no_argument, NULL, 0 },
+  { "me-cache",                 no_argument, NULL, 0 },
+  { "no-me-cache",              no_argument, NULL, 0 },
   { "source-scan-type",   required_argument, NULL, 0 },
   { "sar",                required_argument, NULL, 0 },
   { "overscan",           required_argument, NULL, 0 },
@@ -96,6 +100,11 @@ static const struct option long_options[] = {
   { "bipred",                   no_argument, NULL, 0 },
   { "no-bipred",                no_argument, NULL, 0 },
   { "bitrate",            required_argument, NULL, 0 },
+  { "pass",               required_argument, NULL, 0 },
+  { "stats",              required_argument, NULL, 0 },
+  { "vbv-maxrate",        required_argument, NULL, 0 },
+  { "vbv-bufsize",        required_argument, NULL, 0 },
+  { "crf",                required_argument, NULL, 0 },
   { "preset",             required_argument, NULL, 0 },
   { "mv-rdo",                   no_argument, NULL, 0 },
   { "no-mv-rdo",                no_argument, NULL, 0 },
@@ -134,6 +143,22 @@ static const struct option long_options[] = {
   { "open-gop",                 no_argument, NULL, 0 },
   { "no-open-gop",              no_argument, NULL, 0 },
   { "scaling-list",       required_argument, NULL, 0 },
+  { "thread-affinity",    required_argument, NULL, 0 },
+  { "numa-node",          required_argument, NULL, 0 },
+  { "trace-file",         required_argument, NULL, 0 },
+  { "owf-adaptive",             no_argument, NULL, 0 },
+  { "no-owf-adaptive",          no_argument, NULL, 0 },
+  { "owf-max",            required_argument, NULL, 0 },
+  { "inter-ref-window",   required_argument, NULL, 0 },
+  { "me-ref-jobs",              no_argument, NULL, 0 },
+  { "no-me-ref-jobs",           no_argument, NULL, 0 },
+  { "lookahead",          required_argument, NULL, 0 },
+  { "lookahead-scale",    required_argument, NULL, 0 },
+  { "scenecut",           required_argument, NULL, 0 },
+  { "cutree",                   no_argument, NULL, 0 },
+  { "no-cutree",                no_argument, NULL, 0 },
+  { "aq",                 required_argument, NULL, 0 },
+  { "aq-strength",        required_argument, NULL, 0 },
   {0, 0, 0, 0}
 };
 
@@ -399,6 +424,18 @@ void print_help(void)
     "                                   - lp-<string>: Low-delay P-frame GOP\n"
     "                                     (e.g. lp-g8d4t2, see README)\n"
     "      --(no-)open-gop        : Use open GOP configuration. [enabled]\n"
+    "      --lookahead <integer>  : Number of frames analyzed ahead of the frame\n"
+    "                               being encoded. [0]\n"
+    "      --lookahead-scale <integer> : Downscaling factor of the lookahead\n"
+    "                               analysis, 2 or 4. [2]\n"
+    "      --scenecut <integer>   : Insert an IDR frame and restart the GOP at\n"
+    "                               scene cuts detected by the lookahead.\n"
+    "                               Higher values detect more cuts. [0]\n"
+    "                                   - 0: Disable scene cut detection.\n"
+    "      --(no-)cutree          : Lower the QP of blocks that the lookahead\n"
+    "                               estimates to be referenced by the frames\n"
+    "                               coded after them. Requires --lookahead.\n"
+    "                               [disabled]\n"
     "      --cqmfile <filename>   : Read custom quantization matrices from a file.\n"
     "      --scaling-list <string>: Set scaling list mode. [off]\n"
     "                                   - off: Disable scaling lists.\n"
@@ -407,6 +444,30 @@ void print_help(void)
     "      --bitrate <integer>    : Target bitrate [0]\n"
     "                                   - 0: Disable rate control.\n"
     "                                   - N: Target N bits per second.\n"
+    "      --pass <integer>       : Pass of two-pass rate control. [0]\n"
+    "                                   - 0: Single pass.\n"
+    "                                   - 1: Write statistics to --stats using\n"
+    "                                        a constant QP and fast search.\n"
+    "                                   - 2: Read statistics from --stats and\n"
+    "                                        allocate --bitrate over the\n"
+    "                                        whole sequence. The input, GOP\n"
+    "                                        and intra period must be those\n"
+    "                                        of the first pass.\n"
+    "      --stats <filename>     : Statistics file of two-pass rate control.\n"
+    "      --vbv-maxrate <integer> : Maximum rate in bits per second at which\n"
+    "                               the decoder buffer is filled. Limits the\n"
+    "                               size of the pictures so that the buffer does\n"
+    "                               not underflow and writes HRD parameters.\n"
+    "                               The HRD conformance is not guaranteed since\n"
+    "                               a picture may not fit even at QP 51.\n"
+    "                               Requires --vbv-bufsize. [0]\n"
+    "      --vbv-bufsize <integer> : Size of the decoder buffer in bits. The\n"
+    "                               pictures are estimated from the complexity\n"
+    "                               estimated by the lookahead. [0]\n"
+    "      --crf <float>          : Constant rate factor. Sets the QP of each\n"
+    "                               frame around this value according to the\n"
+    "                               complexity estimated by the lookahead. [0]\n"
+    "                                   - 0: Disable constant rate factor.\n"
     "      --(no-)lossless        : Use lossless coding. [disabled]\n"
     "      --mv-constraint <string> : Constrain movement vectors. [none]\n"
     "                                   - none: No constraint\n"
@@ -422,6 +483,11 @@ void print_help(void)
     "                               in PPS zero.\n"
     "      --(no-)erp-aqp         : Use adaptive QP for 360 degree video with\n"
     "                               equirectangular projection. [disabled]\n"
+    "      --aq <string>          : Adaptive quantization mode. [off]\n"
+    "                                   - off: Disable adaptive quantization.\n"
+    "                                   - variance: Lower the QP of flat areas\n"
+    "                                     and raise it in detailed areas.\n"
+    "      --aq-strength <float>  : Strength of adaptive quantization. [1.0]\n"
     "      --level <number>       : Use the given HEVC level in the output and give\n"
     "                               an error if level limits are exceeded. [6.2]\n"
     "                                   - 1, 2, 2.1, 3, 3.1, 4, 4.1, 5, 5.1, 5.2, 6,\n"
@@ -463,14 +529,26 @@ void print_help(void)
     "                                   - full:  Full Search\n"
     "                                   - full8, full16, full32, full64\n"
     "                                   - dia:   Diamond Search\n"
+    "                                   - pyramid: Hexagon search seeded by\n"
+    "                                     a search on downscaled pictures\n"
     "      --me-steps <integer>   : Motion estimation search step limit. Only\n"
-    "                               affects 'hexbs' and 'dia'. [-1]\n"
+    "                               affects 'hexbs', 'dia' and 'pyramid'. [-1]\n"
     "      --subme <integer>      : Fractional pixel motion estimation level [4]\n"
     "                                   - 0: Integer motion estimation only\n"
     "                                   - 1: + 1/2-pixel horizontal and vertical\n"
     "                                   - 2: + 1/2-pixel diagonal\n"
     "                                   - 3: + 1/4-pixel horizontal and vertical\n"
     "                                   - 4: + 1/4-pixel diagonal\n"
+    "      --(no-)subme-cache     : Interpolate each reference frame once\n"
+    "                               instead of each searched block. Uses 15\n"
+    "                               bytes of memory for each luma pixel of\n"
+    "                               the reference frames. Does not change\n"
+    "                               the output. [disabled]\n"
+    "      --(no-)me-cache        : Start the motion vector search of a PU\n"
+    "                               from the best vectors found for the\n"
+    "                               other PUs of the same LCU and end the\n"
+    "                               search early when they are as good.\n"
+    "                               [disabled]\n"
     "      --pu-depth-inter <int>-<int> : Inter prediction units sizes [0-3]\n"
     "                                   - 0, 1, 2, 3: from 64x64 to 8x8\n"
     "      --pu-depth-intra <int>-<int> : Intra prediction units sizes [1-4]\n"
@@ -501,6 +579,27 @@ void print_help(void)
     "      --owf <integer>        : Frame-level parallelism [auto]\n"
     "                                   - N: Process N+1 frames at a time.\n"
     "                                   - auto: Select automatically.\n"
+    "      --(no-)owf-adaptive    : Vary the number of frames processed at a\n"
+    "                               time between 1 and owf-max+1 depending on\n"
+    "                               how busy the threads are, starting from\n"
+    "                               owf+1. The output delay follows it. Memory\n"
+    "                               use and rate control are as with\n"
+    "                               --owf=owf-max. [disabled]\n"
+    "      --owf-max <integer>    : Upper bound for --owf-adaptive. The output\n"
+    "                               is the same as with --owf=owf-max. [auto]\n"
+    "                                   - auto: max(2*owf, owf+1)\n"
+    "      --inter-ref-window <int>x<int>|<int>|auto :\n"
+    "                               How far right and down in LCUs motion\n"
+    "                               vectors may point when using WPP and OWF.\n"
+    "                               A larger window allows longer motion but\n"
+    "                               makes frames wait longer for their\n"
+    "                               reference frames. [1x1]\n"
+    "                                   - auto: Cover the search range of the\n"
+    "                                           motion estimation.\n"
+    "      --(no-)me-ref-jobs     : Search the reference frames of large\n"
+    "                               prediction units in parallel jobs so that\n"
+    "                               more threads can work on the same LCU.\n"
+    "                               Does not change the output. [disabled]\n"
     "      --(no-)wpp             : Wavefront parallel processing. [enabled]\n"
     "                               Enabling tiles automatically disables WPP.\n"
     "                               To enable WPP with tiles, re-enable it after\n"
@@ -522,6 +621,24 @@ void print_help(void)
     "                                   - tiles: Put tiles in independent slices.\n"
     "                                   - wpp: Put rows in dependent slices.\n"
     "                                   - tiles+wpp: Do both.\n"
+    "      --thread-affinity <string> : Placement of worker threads. [none]\n"
+    "                                   - none: Let the OS place the threads.\n"
+    "                                   - compact: Fill the hardware threads of\n"
+    "                                              a core and socket first.\n"
+    "                                   - scatter: Spread the threads over\n"
+    "                                              sockets and cores.\n"
+    "                                   - <list>: Pin the threads to the listed\n"
+    "                                             CPUs in order, e.g. 0-3,8.\n"
+    "      --numa-node <integer>  : Run the worker threads on the CPUs of the\n"
+    "                               given NUMA node. Memory is not bound. Use\n"
+    "                               e.g. numactl --membind to also place the\n"
+    "                               buffers on the node. [-1]\n"
+    "                                   - -1: Disabled.\n"
+    "                                   - N: Bind to node N.\n"
+    "      --trace-file <filename> : Write the scheduling of the jobs of the\n"
+    "                               worker threads to a file in Chrome trace\n"
+    "                               event format. View it with\n"
+    "                               chrome://tracing or ui.perfetto.dev.\n"
     "\n"
     /* Word wrap to this width to stay under 80 characters (including ") *************/
     "Video Usability Information:\n"
@@ -562,6 +679,9 @@ void print_frame_info(const kvz_frame_info *const info,
           info->qp,
           "BPI"[info->slice_type % 3],
           bytes << 3);
+  if (info->irap_reason == KVZ_IRAP_SCENECUT) {
+    fprintf(stderr, " scene cut");
+  }
   if (print_psnr) {
     fprintf(stderr, " PSNR Y %2.4f U %2.4f V %2.4f",
             frame_psnr[0], frame_psnr[1], frame_psnr[2]);
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "affinity.h"
 #include "cfg.h"
 #include "strategyselector.h"
 
@@ -38,7 +39,11 @@
 static const double ERP_AQP_STRENGTH = 3.0;
 
 
-static int encoder_control_init_gop_layer_weights(encoder_control_t * const);
+static int encoder_control_init_gop_layer_weights(const encoder_control_t * const,
+                                                  encoder_rc_params_t * const);
+static void encoder_control_init_target_bits(const encoder_control_t * const,
+                                             int32_t,
+                                             encoder_rc_params_t * const);
 
 static unsigned cfg_num_threads(void)
 {
@@ -51,6 +56,77 @@ static unsigned cfg_num_threads(void)
 }
 
 
+/**
+ * \brief Check if an integer motion estimation algorithm is a full search.
+ */
+static bool ime_is_full_search(enum kvz_ime_algorithm ime_algorithm)
+{
+  switch (ime_algorithm) {
+    case KVZ_IME_FULL:
+    case KVZ_IME_FULL8:
+    case KVZ_IME_FULL16:
+    case KVZ_IME_FULL32:
+    case KVZ_IME_FULL64:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * \brief Get the number of LCUs that motion vectors found by the integer
+ * motion estimation may reach.
+ */
+static int get_me_range_lcu(const kvz_config *const cfg)
+{
+  // Search range around the starting point in pixels. The searches without
+  // a fixed range are limited by the number of steps or by the largest
+  // pattern distance used by TZ search.
+  int range = 96;
+  switch (cfg->ime_algorithm) {
+    case KVZ_IME_FULL64: range = 64; break;
+    case KVZ_IME_FULL32:
+    case KVZ_IME_FULL:   range = 32; break;
+    case KVZ_IME_FULL16: range = 16; break;
+    case KVZ_IME_FULL8:  range = 8;  break;
+    case KVZ_IME_HEXBS:
+      // The large hexagon moves at most two pixels per step.
+      if (cfg->me_max_steps != (uint32_t)-1) {
+        range = MIN(range, 2 * (int)MIN(cfg->me_max_steps, 48) + 1);
+      }
+      break;
+    case KVZ_IME_DIA:
+      if (cfg->me_max_steps != (uint32_t)-1) {
+        range = MIN(range, (int)MIN(cfg->me_max_steps, 96) + 1);
+      }
+      break;
+    case KVZ_IME_PYRAMID:
+      // The coarse search reaches ME_PYRAMID_RANGE pixels on the coarsest
+      // level and one pixel on each finer level before the hexagon search.
+      if (cfg->me_max_steps != (uint32_t)-1) {
+        const int coarse_range = (ME_PYRAMID_RANGE << ME_PYRAMID_LEVELS) +
+                                 (1 << ME_PYRAMID_LEVELS) - 2;
+        range = MIN(range, coarse_range + 2 * (int)MIN(cfg->me_max_steps, 48) + 1);
+      }
+      break;
+    default:
+      break;
+  }
+
+  // Fractional motion estimation needs 4 pixels outside the block and the
+  // pixels must have been filtered.
+  int margin = 4;
+  if (cfg->sao_type) {
+    margin += SAO_DELAY_PX;
+  } else if (cfg->deblock_enable) {
+    margin += DEBLOCK_DELAY_PX;
+  }
+
+  // The block may be at the bottom right corner of its LCU.
+  return CEILDIV(range + margin, LCU_WIDTH);
+}
+
+
 static int get_max_parallelism(const encoder_control_t *const encoder)
 {
   const int width_lcu  = CEILDIV(encoder->cfg.width, LCU_WIDTH);
@@ -197,6 +273,46 @@ static void init_erp_aqp_roi(encoder_control_t* encoder,
 }
 
 
+/**
+ * \brief Create a pool of worker threads that can be shared by encoders.
+ *
+ * \param cfg   configuration with the number and placement of threads
+ * \return      the pool or NULL on failure
+ */
+threadqueue_pool_t * kvz_encoder_thread_pool_init(const kvz_config *const cfg)
+{
+  kvz_affinity_t affinity;
+  if (!kvz_affinity_init(&affinity,
+                         cfg->thread_affinity,
+                         cfg->thread_affinity_cpus,
+                         cfg->thread_affinity_cpus_count,
+                         cfg->numa_node))
+  {
+    return NULL;
+  }
+
+  int thread_count = cfg->threads;
+  if (thread_count < 0) {
+    thread_count = cfg_num_threads();
+    if (affinity.cpu_count > 0) {
+      thread_count = MIN(thread_count, affinity.cpu_count);
+    }
+  }
+
+  threadqueue_pool_t *pool = kvz_threadqueue_pool_init(thread_count);
+  if (!pool) {
+    fprintf(stderr, "Could not initialize thread pool.\n");
+  } else if (!kvz_threadqueue_pool_set_affinity(pool, &affinity)) {
+    fprintf(stderr, "Could not set thread affinity.\n");
+    kvz_threadqueue_pool_free(pool);
+    pool = NULL;
+  }
+
+  kvz_affinity_free(&affinity);
+  return pool;
+}
+
+
 /**
  * \brief Allocate and initialize an encoder control structure.
  *
@@ -230,6 +346,39 @@ encoder_control_t* kvz_encoder_control_init(const kvz_config *const cfg)
   encoder->cfg.tiles_width_split = NULL;
   encoder->cfg.tiles_height_split = NULL;
   encoder->cfg.slice_addresses_in_ts = NULL;
+  encoder->cfg.thread_affinity_cpus = NULL;
+  encoder->cfg.trace_file = NULL;
+  encoder->cfg.stats_file = NULL;
+
+  if (encoder->cfg.pass == 1) {
+    // The first pass is encoded with a constant QP so that the bits reflect
+    // the complexity of the frames. Use the search settings of the
+    // ultrafast preset that do not change the frame structure.
+    static const char * const first_pass_settings[] = {
+      "rd", "0",
+      "pu-depth-intra", "2-3",
+      "pu-depth-inter", "2-3",
+      "me", "hexbs",
+      "subme", "2",
+      "rdoq", "0",
+      "rdoq-skip", "0",
+      "transform-skip", "0",
+      "mv-rdo", "0",
+      "full-intra-search", "0",
+      "smp", "0",
+      "amp", "0",
+      "cu-split-termination", "zero",
+      "me-early-termination", "sensitive",
+      NULL
+    };
+    for (int i = 0; first_pass_settings[i]; i += 2) {
+      kvz_config_parse(&encoder->cfg, first_pass_settings[i], first_pass_settings[i + 1]);
+    }
+    encoder->cfg.target_bitrate = 0;
+    encoder->cfg.crf            = 0.0;
+    encoder->cfg.vbv_maxrate    = 0;
+    encoder->cfg.vbv_bufsize    = 0;
+  }
 
   if (encoder->cfg.gop_len > 0) {
     if (encoder->cfg.gop_lowdelay) {
@@ -237,12 +386,47 @@ encoder_control_t* kvz_encoder_control_init(const kvz_config *const cfg)
     }
   }
 
-  encoder->max_inter_ref_lcu.right = 1;
-  encoder->max_inter_ref_lcu.down  = 1;
+  // Pictures are coded at the same time as their references only with OWF
+  // and WPP.
+  encoder->constrain_inter_ref = encoder->cfg.owf != 0 && encoder->cfg.wpp;
+
+  if (encoder->cfg.inter_ref_window_right < 0) {
+    const int range_lcu = get_me_range_lcu(&encoder->cfg);
+    encoder->max_inter_ref_lcu.right = range_lcu;
+    encoder->max_inter_ref_lcu.down  = range_lcu;
+    if (encoder->constrain_inter_ref) {
+      fprintf(stderr, "--inter-ref-window=auto value set to %dx%d.\n",
+              range_lcu, range_lcu);
+    }
+  } else {
+    encoder->max_inter_ref_lcu.right = encoder->cfg.inter_ref_window_right;
+    encoder->max_inter_ref_lcu.down  = encoder->cfg.inter_ref_window_down;
+  }
+
+  if (encoder->cfg.thread_pool) {
+    // The threads of a shared pool are placed when the pool is created.
+    encoder->cfg.threads = kvz_threadqueue_pool_thread_count(encoder->cfg.thread_pool);
+    encoder->cfg.thread_affinity = KVZ_THREAD_AFFINITY_NONE;
+    encoder->cfg.numa_node = -1;
+  }
+
+  kvz_affinity_t affinity;
+  if (!kvz_affinity_init(&affinity,
+                         encoder->cfg.thread_affinity,
+                         cfg->thread_affinity_cpus,
+                         cfg->thread_affinity_cpus_count,
+                         encoder->cfg.numa_node))
+  {
+    goto init_failed;
+  }
 
   int max_threads = encoder->cfg.threads;
   if (max_threads < 0) {
     max_threads = cfg_num_threads();
+    if (affinity.cpu_count > 0) {
+      // Don't start more threads than there are CPUs to run them on.
+      max_threads = MIN(max_threads, affinity.cpu_count);
+    }
   }
   max_threads = MAX(1, max_threads);
 
@@ -286,11 +470,51 @@ encoder_control_t* kvz_encoder_control_init(const kvz_config *const cfg)
     }
   }
 
-  encoder->threadqueue = kvz_threadqueue_init(encoder->cfg.threads);
+  // Encoder states, rate control and reference dependencies are set up for
+  // the largest depth so that the bitstream does not depend on the depth
+  // chosen at runtime.
+  encoder->owf_start = encoder->cfg.owf;
+  if (encoder->cfg.owf_adaptive) {
+    int owf_max = encoder->cfg.owf_max;
+    if (owf_max < 0) {
+      owf_max = MAX(2 * encoder->cfg.owf, encoder->cfg.owf + 1);
+    }
+    if (encoder->cfg.source_scan_type != KVZ_INTERLACING_NONE && owf_max % 2 == 1) {
+      owf_max += 1;
+    }
+    encoder->owf_start = MIN(encoder->cfg.owf, owf_max);
+    encoder->cfg.owf = owf_max;
+  }
+
+  if (encoder->cfg.thread_pool) {
+    encoder->threadqueue = kvz_threadqueue_init_shared(encoder->cfg.thread_pool);
+  } else {
+    encoder->threadqueue = kvz_threadqueue_init(encoder->cfg.threads);
+  }
+  const int affinity_set = encoder->threadqueue &&
+                           kvz_threadqueue_set_affinity(encoder->threadqueue, &affinity);
+  kvz_affinity_free(&affinity);
   if (!encoder->threadqueue) {
     fprintf(stderr, "Could not initialize threadqueue.\n");
     goto init_failed;
   }
+  if (!affinity_set) {
+    fprintf(stderr, "Could not set thread affinity.\n");
+    goto init_failed;
+  }
+  // The adaptive OWF depth follows the idle time of the queue.
+  if (encoder->cfg.owf_adaptive &&
+      !kvz_threadqueue_count_starved_time(encoder->threadqueue)) {
+    goto init_failed;
+  }
+
+  if (cfg->trace_file) {
+    encoder->trace = kvz_trace_open(cfg->trace_file);
+    if (!encoder->trace) {
+      goto init_failed;
+    }
+    kvz_threadqueue_set_trace(encoder->threadqueue, encoder->trace);
+  }
 
   encoder->bitdepth = KVZ_BIT_DEPTH;
 
@@ -324,15 +548,24 @@ encoder_control_t* kvz_encoder_control_init(const kvz_config *const cfg)
 
   kvz_encoder_control_input_init(encoder, encoder->cfg.width, encoder->cfg.height);
 
-  if (encoder->cfg.framerate_num != 0) {
-    double framerate = encoder->cfg.framerate_num / (double)encoder->cfg.framerate_denom;
-    encoder->target_avg_bppic = encoder->cfg.target_bitrate / framerate;
-  } else {
-    encoder->target_avg_bppic = encoder->cfg.target_bitrate / encoder->cfg.framerate;
+  encoder_control_init_target_bits(encoder, encoder->cfg.target_bitrate, &encoder->rc);
+  encoder->rc.crf = encoder->cfg.crf;
+  encoder->rc.target_bits_offset = 0;
+  encoder->rc.vbv_maxrate = encoder->cfg.vbv_maxrate;
+
+  if (cfg->pass == 1) {
+    encoder->rc_stats = kvz_rc_stats_create(cfg->stats_file, encoder);
+    if (!encoder->rc_stats) {
+      goto init_failed;
+    }
+  } else if (cfg->pass == 2) {
+    encoder->rc_stats = kvz_rc_stats_read(cfg->stats_file, encoder);
+    if (!encoder->rc_stats) {
+      goto init_failed;
+    }
   }
-  encoder->target_avg_bpp = encoder->target_avg_bppic / encoder->in.pixels_per_pic;
 
-  if (!encoder_control_init_gop_layer_weights(encoder)) {
+  if (!encoder_control_init_gop_layer_weights(encoder, &encoder->rc)) {
     goto init_failed;
   }
 
@@ -373,11 +606,26 @@ encoder_control_t* kvz_encoder_control_init(const kvz_config *const cfg)
     }
   }
 
+  encoder->pps.init_qp = encoder->cfg.qp;
+  encoder->rc.qp = encoder->cfg.qp;
+
+  encoder->search.rdo                = encoder->cfg.rdo;
+  encoder->search.ime_algorithm      = encoder->cfg.ime_algorithm;
+  encoder->search.pu_depth_inter.min = encoder->cfg.pu_depth_inter.min;
+  encoder->search.pu_depth_inter.max = encoder->cfg.pu_depth_inter.max;
+  encoder->search.pu_depth_intra.min = encoder->cfg.pu_depth_intra.min;
+  encoder->search.pu_depth_intra.max = encoder->cfg.pu_depth_intra.max;
+
   // NOTE: When tr_depth_inter is equal to 0, the transform is still split
   // for SMP and AMP partition units.
   encoder->tr_depth_inter = 0;
 
-  if (encoder->cfg.target_bitrate > 0 || encoder->cfg.roi.dqps) {
+  if (encoder->cfg.aq != KVZ_AQ_OFF) {
+    // Adaptive quantization sets the QP for each 16x16 quantization group.
+    encoder->max_qp_delta_depth = 2;
+  } else if (encoder->cfg.target_bitrate > 0 || encoder->cfg.roi.dqps ||
+             encoder->cfg.picture_roi || encoder->cfg.cutree ||
+             encoder->cfg.vbv_bufsize > 0) {
     encoder->max_qp_delta_depth = 0;
   } else {
     encoder->max_qp_delta_depth = -1;
@@ -639,6 +887,11 @@ encoder_control_t* kvz_encoder_control_init(const kvz_config *const cfg)
     }
   }
 
+  // The VBV model keeps the pictures within the buffer as far as the
+  // highest QP allows. The signalled HRD is not guaranteed beyond that.
+  encoder->vui.hrd_parameters_present_flag =
+    encoder->vui.timing_info_present_flag && encoder->cfg.vbv_bufsize > 0;
+
   if (encoder->cfg.vps_period >= 0) {
     encoder->cfg.vps_period = encoder->cfg.vps_period * encoder->cfg.intra_period;
   } else {
@@ -658,6 +911,133 @@ init_failed:
   return NULL;
 }
 
+/**
+ * \brief Change the configuration of an encoder control structure.
+ *
+ * Takes the rate control and search parameters from cfg. Other fields of
+ * cfg are ignored. The changes are meant to be read when the next picture
+ * is started, so parameters that are written in the parameter sets or that
+ * the dependencies between the pictures rely on cannot change.
+ *
+ * \param encoder          encoder control to change
+ * \param cfg              new configuration
+ * \param frames_started   number of pictures started so far
+ * \return 1 on success, 0 on failure
+ */
+int kvz_encoder_control_reconfigure(encoder_control_t *const encoder,
+                                    const kvz_config *const cfg,
+                                    int32_t frames_started)
+{
+  if (!cfg) {
+    fprintf(stderr, "Config object must not be null!\n");
+    return 0;
+  }
+
+  if (!kvz_config_validate(cfg)) {
+    return 0;
+  }
+
+  int error = 0;
+
+  if (encoder->cfg.pass > 0) {
+    fprintf(stderr, "Reconfigure error: two-pass encoding cannot be reconfigured\n");
+    error = 1;
+  }
+
+  if ((cfg->target_bitrate > 0) != (encoder->cfg.target_bitrate > 0)) {
+    fprintf(stderr, "Reconfigure error: rate control cannot be enabled or disabled\n");
+    error = 1;
+  }
+
+  if ((cfg->crf > 0.0) != (encoder->cfg.crf > 0.0)) {
+    fprintf(stderr, "Reconfigure error: --crf cannot be enabled or disabled\n");
+    error = 1;
+  }
+
+  if ((cfg->vbv_bufsize > 0) != (encoder->cfg.vbv_bufsize > 0)) {
+    fprintf(stderr, "Reconfigure error: VBV cannot be enabled or disabled\n");
+    error = 1;
+  } else if (cfg->vbv_bufsize != encoder->cfg.vbv_bufsize) {
+    fprintf(stderr, "Reconfigure error: --vbv-bufsize cannot be changed\n");
+    error = 1;
+  }
+
+  if (encoder->vui.hrd_parameters_present_flag &&
+      cfg->vbv_maxrate != encoder->cfg.vbv_maxrate) {
+    // The rate is signalled in the HRD parameters of the SPS.
+    fprintf(stderr, "Reconfigure error: --vbv-maxrate cannot be changed when "
+                    "the HRD parameters are signalled\n");
+    error = 1;
+  }
+
+  // The level is signalled in the SPS so the maximum bitrate of the level
+  // stays the one the encoder was opened with.
+  if (cfg->target_bitrate > encoder->cfg.max_bitrate) {
+    fprintf(stderr, "Reconfigure error: --bitrate exceeds the maximum bitrate of the level\n");
+    error = 1;
+  }
+
+  if (cfg->vbv_maxrate > encoder->cfg.max_bitrate) {
+    fprintf(stderr, "Reconfigure error: --vbv-maxrate exceeds the maximum bitrate of the level\n");
+    error = 1;
+  }
+
+  if (encoder->cfg.inter_ref_window_right < 0) {
+    // The pictures being coded wait only for the LCUs of their reference
+    // pictures that the original motion estimation may reach.
+    kvz_config me_cfg = encoder->cfg;
+    me_cfg.ime_algorithm = cfg->ime_algorithm;
+    if (get_me_range_lcu(&me_cfg) > encoder->max_inter_ref_lcu.right) {
+      fprintf(stderr, "Reconfigure error: --me must not search further than before\n");
+      error = 1;
+    }
+  }
+
+  // The pictures are prepared only for the motion estimation the encoder
+  // was opened with. Pyramid search needs the downscaled pictures and the
+  // full searches need the sums of the blocks of the references.
+  if ((cfg->ime_algorithm == KVZ_IME_PYRAMID &&
+       encoder->cfg.ime_algorithm != KVZ_IME_PYRAMID) ||
+      (ime_is_full_search(cfg->ime_algorithm) &&
+       !ime_is_full_search(encoder->cfg.ime_algorithm))) {
+    fprintf(stderr, "Reconfigure error: --me can be changed to pyramid or full "
+                    "search only if the encoder was opened with it\n");
+    error = 1;
+  }
+
+  if (error) {
+    return 0;
+  }
+
+  // The pictures started so far keep their target bits.
+  encoder_rc_params_t rc = encoder->rc;
+  encoder_control_init_target_bits(encoder, cfg->target_bitrate, &rc);
+  rc.target_bits_offset += (encoder->rc.target_avg_bppic - rc.target_avg_bppic) * frames_started;
+  if (!encoder_control_init_gop_layer_weights(encoder, &rc)) {
+    return 0;
+  }
+
+  if (!encoder->cfg.roi.dqps) {
+    // With a delta QP map, the QP is part of the map.
+    rc.qp = cfg->qp;
+  }
+  rc.crf = cfg->crf;
+  rc.vbv_maxrate = cfg->vbv_maxrate;
+
+  // The new parameters are staged here and copied into each picture when it
+  // is started. The configuration itself is shared by the pictures being
+  // coded and is not changed.
+  encoder->rc = rc;
+  encoder->search.rdo                = cfg->rdo;
+  encoder->search.ime_algorithm      = cfg->ime_algorithm;
+  encoder->search.pu_depth_inter.min = cfg->pu_depth_inter.min;
+  encoder->search.pu_depth_inter.max = cfg->pu_depth_inter.max;
+  encoder->search.pu_depth_intra.min = cfg->pu_depth_intra.min;
+  encoder->search.pu_depth_intra.max = cfg->pu_depth_intra.max;
+
+  return 1;
+}
+
 /**
  * \brief Free an encoder control structure.
  */
@@ -688,6 +1068,13 @@ void kvz_encoder_control_free(encoder_control_t *const encoder)
   kvz_threadqueue_free(encoder->threadqueue);
   encoder->threadqueue = NULL;
 
+  // The trace can be closed once no thread is running jobs of the queue.
+  kvz_trace_close(encoder->trace);
+  encoder->trace = NULL;
+
+  kvz_rc_stats_close(encoder->rc_stats);
+  encoder->rc_stats = NULL;
+
   free(encoder);
 }
 
@@ -738,6 +1125,23 @@ void kvz_encoder_control_input_init(encoder_control_t * const encoder,
   #endif
 }
 
+/**
+ * \brief Set the target bits per picture and per pixel from the target
+ * bitrate.
+ */
+static void encoder_control_init_target_bits(const encoder_control_t * const encoder,
+                                             int32_t target_bitrate,
+                                             encoder_rc_params_t * const rc)
+{
+  if (encoder->cfg.framerate_num != 0) {
+    double framerate = encoder->cfg.framerate_num / (double)encoder->cfg.framerate_denom;
+    rc->target_avg_bppic = target_bitrate / framerate;
+  } else {
+    rc->target_avg_bppic = target_bitrate / encoder->cfg.framerate;
+  }
+  rc->target_avg_bpp = rc->target_avg_bppic / encoder->in.pixels_per_pic;
+}
+
 /**
  * \brief Initialize GOP layer weights.
  * \return 1 on success, 0 on failure.
@@ -745,7 +1149,8 @@ void kvz_encoder_control_input_init(encoder_control_t * const encoder,
  * Selects appropriate weights for layers according to the target bpp.
  * Only GOP structures with exactly four layers are supported.
  */
-static int encoder_control_init_gop_layer_weights(encoder_control_t * const encoder)
+static int encoder_control_init_gop_layer_weights(const encoder_control_t * const encoder,
+                                                  encoder_rc_params_t * const rc)
 {
 
   kvz_gop_config const * const gop = encoder->cfg.gop;
@@ -759,7 +1164,7 @@ static int encoder_control_init_gop_layer_weights(encoder_control_t * const enco
   switch (num_layers) {
     case 0:
     case 1:
-      encoder->gop_layer_weights[0] = 1;
+      rc->gop_layer_weights[0] = 1;
       break;
 
     // Use the first layers of the 4-layer weights.
@@ -770,49 +1175,49 @@ static int encoder_control_init_gop_layer_weights(encoder_control_t * const enco
       if (encoder->cfg.gop_lowdelay) {
         // These weights are based on http://doi.org/10.1109/TIP.2014.2336550
         // They are meant for lp-g4d3r4t1 gop, but work ok for others.
-        if (encoder->target_avg_bpp <= 0.05) {
-          encoder->gop_layer_weights[0] = 14;
-          encoder->gop_layer_weights[1] = 3;
-          encoder->gop_layer_weights[2] = 2;
-          encoder->gop_layer_weights[3] = 1;
-        } else if (encoder->target_avg_bpp <= 0.1) {
-          encoder->gop_layer_weights[0] = 12;
-          encoder->gop_layer_weights[1] = 3;
-          encoder->gop_layer_weights[2] = 2;
-          encoder->gop_layer_weights[3] = 1;
-        } else if (encoder->target_avg_bpp <= 0.2) {
-          encoder->gop_layer_weights[0] = 10;
-          encoder->gop_layer_weights[1] = 3;
-          encoder->gop_layer_weights[2] = 2;
-          encoder->gop_layer_weights[3] = 1;
+        if (rc->target_avg_bpp <= 0.05) {
+          rc->gop_layer_weights[0] = 14;
+          rc->gop_layer_weights[1] = 3;
+          rc->gop_layer_weights[2] = 2;
+          rc->gop_layer_weights[3] = 1;
+        } else if (rc->target_avg_bpp <= 0.1) {
+          rc->gop_layer_weights[0] = 12;
+          rc->gop_layer_weights[1] = 3;
+          rc->gop_layer_weights[2] = 2;
+          rc->gop_layer_weights[3] = 1;
+        } else if (rc->target_avg_bpp <= 0.2) {
+          rc->gop_layer_weights[0] = 10;
+          rc->gop_layer_weights[1] = 3;
+          rc->gop_layer_weights[2] = 2;
+          rc->gop_layer_weights[3] = 1;
         } else {
-          encoder->gop_layer_weights[0] = 6;
-          encoder->gop_layer_weights[1] = 3;
-          encoder->gop_layer_weights[2] = 2;
-          encoder->gop_layer_weights[3] = 1;
+          rc->gop_layer_weights[0] = 6;
+          rc->gop_layer_weights[1] = 3;
+          rc->gop_layer_weights[2] = 2;
+          rc->gop_layer_weights[3] = 1;
         }
       } else {
         // These weights are from http://doi.org/10.1109/TIP.2014.2336550
-        if (encoder->target_avg_bpp <= 0.05) {
-          encoder->gop_layer_weights[0] = 30;
-          encoder->gop_layer_weights[1] = 8;
-          encoder->gop_layer_weights[2] = 4;
-          encoder->gop_layer_weights[3] = 1;
-        } else if (encoder->target_avg_bpp <= 0.1) {
-          encoder->gop_layer_weights[0] = 25;
-          encoder->gop_layer_weights[1] = 7;
-          encoder->gop_layer_weights[2] = 4;
-          encoder->gop_layer_weights[3] = 1;
-        } else if (encoder->target_avg_bpp <= 0.2) {
-          encoder->gop_layer_weights[0] = 20;
-          encoder->gop_layer_weights[1] = 6;
-          encoder->gop_layer_weights[2] = 4;
-          encoder->gop_layer_weights[3] = 1;
+        if (rc->target_avg_bpp <= 0.05) {
+          rc->gop_layer_weights[0] = 30;
+          rc->gop_layer_weights[1] = 8;
+          rc->gop_layer_weights[2] = 4;
+          rc->gop_layer_weights[3] = 1;
+        } else if (rc->target_avg_bpp <= 0.1) {
+          rc->gop_layer_weights[0] = 25;
+          rc->gop_layer_weights[1] = 7;
+          rc->gop_layer_weights[2] = 4;
+          rc->gop_layer_weights[3] = 1;
+        } else if (rc->target_avg_bpp <= 0.2) {
+          rc->gop_layer_weights[0] = 20;
+          rc->gop_layer_weights[1] = 6;
+          rc->gop_layer_weights[2] = 4;
+          rc->gop_layer_weights[3] = 1;
         } else {
-          encoder->gop_layer_weights[0] = 15;
-          encoder->gop_layer_weights[1] = 5;
-          encoder->gop_layer_weights[2] = 4;
-          encoder->gop_layer_weights[3] = 1;
+          rc->gop_layer_weights[0] = 15;
+          rc->gop_layer_weights[1] = 5;
+          rc->gop_layer_weights[2] = 4;
+          rc->gop_layer_weights[3] = 1;
         }
       }
       break;
@@ -825,10 +1230,10 @@ static int encoder_control_init_gop_layer_weights(encoder_control_t * const enco
   // Normalize weights so that the sum of weights in a GOP is one.
   double sum_weights = 0;
   for (int i = 0; i < gop_len; ++i) {
-    sum_weights += encoder->gop_layer_weights[gop[i].layer - 1];
+    sum_weights += rc->gop_layer_weights[gop[i].layer - 1];
   }
   for (int i = 0; i < num_layers; ++i) {
-    encoder->gop_layer_weights[i] /= sum_weights;
+    rc->gop_layer_weights[i] /= sum_weights;
   }
 
   return 1;
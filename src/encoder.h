@@ -28,10 +28,52 @@
 
 #include "global.h" // IWYU pragma: keep
 #include "kvazaar.h"
+#include "rc_stats.h"
 #include "scalinglist.h"
 #include "threadqueue.h"
 
 
+/**
+ * \brief Search parameters that can change between pictures.
+ */
+typedef struct encoder_search_params_t
+{
+  int32_t rdo;
+  enum kvz_ime_algorithm ime_algorithm;
+  struct {
+    int32_t min;
+    int32_t max;
+  } pu_depth_inter, pu_depth_intra;
+} encoder_search_params_t;
+
+/**
+ * \brief Rate control parameters that can change between pictures.
+ */
+typedef struct encoder_rc_params_t
+{
+  //! Constant QP of the pictures.
+  int32_t qp;
+
+  //! Constant rate factor of the pictures.
+  double crf;
+
+  //! Target average bits per picture.
+  double target_avg_bppic;
+
+  //! Target average bits per pixel.
+  double target_avg_bpp;
+
+  //! Difference between the target bits of the pictures started before the
+  //! target bitrate was last changed and target_avg_bppic times their number.
+  double target_bits_offset;
+
+  //! Picture weights when GOP is used.
+  double gop_layer_weights[MAX_GOP_LAYERS];
+
+  //! Rate at which bits enter the VBV buffer in bits per second.
+  uint32_t vbv_maxrate;
+} encoder_rc_params_t;
+
 /* Encoder control options, the main struct */
 typedef struct encoder_control_t
 {
@@ -81,6 +123,9 @@ typedef struct encoder_control_t
     int8_t frame_field_info_present_flag;
 
     int8_t timing_info_present_flag;
+
+    /* HRD parameters of the VBV buffer model */
+    int8_t hrd_parameters_present_flag;
   } vui;
 
   //scaling list
@@ -109,22 +154,35 @@ typedef struct encoder_control_t
 
   threadqueue_queue_t *threadqueue;
 
-  //! Target average bits per picture.
-  double target_avg_bppic;
+  //! Trace of the thread queue activity, or NULL.
+  kvz_trace_t *trace;
 
-  //! Target average bits per pixel.
-  double target_avg_bpp;
+  //! Statistics file of two-pass rate control, or NULL.
+  kvz_rc_stats_t *rc_stats;
 
-  //! Picture weights when GOP is used.
-  double gop_layer_weights[MAX_GOP_LAYERS];
+  /**
+   * \brief Parameters of the pictures started next.
+   *
+   * Changed by kvz_encoder_control_reconfigure. Each picture copies them
+   * when it is started and the encoder states read only the copy, so the
+   * pictures being coded are not affected.
+   */
+  encoder_search_params_t search;
+  encoder_rc_params_t rc;
 
   int8_t max_qp_delta_depth;
 
   int tr_depth_inter;
 
+  //! Initial OWF depth. Equal to cfg.owf unless cfg.owf_adaptive is set,
+  //! in which case cfg.owf is the upper bound of the depth.
+  int owf_start;
+
   //! pic_parameter_set
   struct {
     uint8_t dependent_slice_segments_enabled_flag;
+    //! QP signaled in the PPS. Does not follow reconfiguration of cfg.qp.
+    int8_t init_qp;
   } pps;
 
   //! Maximum motion vector distance as number of LCUs.
@@ -133,10 +191,17 @@ typedef struct encoder_control_t
     int down;
   } max_inter_ref_lcu;
 
+  //! Whether motion vectors are limited to max_inter_ref_lcu.
+  bool constrain_inter_ref;
+
 } encoder_control_t;
 
+threadqueue_pool_t * kvz_encoder_thread_pool_init(const kvz_config *cfg);
 encoder_control_t* kvz_encoder_control_init(const kvz_config *cfg);
 void kvz_encoder_control_free(encoder_control_t *encoder);
+int kvz_encoder_control_reconfigure(encoder_control_t *encoder,
+                                    const kvz_config *cfg,
+                                    int32_t frames_started);
 
 void kvz_encoder_control_input_init(encoder_control_t *encoder, int32_t width, int32_t height);
 #endif
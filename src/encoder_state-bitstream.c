@@ -35,12 +35,17 @@
 #include "kvazaar.h"
 #include "kvz_math.h"
 #include "nal.h"
+#include "rate_control.h"
 #include "scalinglist.h"
 #include "tables.h"
 #include "threadqueue.h"
 #include "videoframe.h"
 
 
+//! Length of the HRD delay syntax elements in bits
+#define HRD_DELAY_LENGTH 24
+
+
 static void encoder_state_write_bitstream_aud(encoder_state_t * const state)
 {
   bitstream_t * const stream = &state->stream;
@@ -188,6 +193,64 @@ static void encoder_state_write_bitstream_scaling_list(bitstream_t *stream,
 }
 
 
+/**
+ * \brief Get the scale and the value of a HRD bit rate or CPB size.
+ *
+ * The value is rounded up to the nearest one that can be signalled.
+ *
+ * \param x       bit rate or CPB size
+ * \param shift   6 for bit rates and 4 for CPB sizes
+ * \param scale   returns the scale
+ * \param value   returns the value
+ * \return        the signalled bit rate or CPB size
+ */
+static uint64_t hrd_scale_and_value(uint32_t x, int shift, int *scale, uint32_t *value)
+{
+  // Keep the values small since they are coded with Exp-Golomb codes.
+  *scale = 0;
+  while (*scale < 15 && (x >> (shift + *scale)) >= (1 << 15)) {
+    ++*scale;
+  }
+  const uint64_t unit = 1ull << (shift + *scale);
+  *value = (uint32_t)((x + unit - 1) / unit);
+  return *value * unit;
+}
+
+/**
+ * \brief Write HRD parameters of the VBV buffer model.
+ */
+static void encoder_state_write_bitstream_hrd_parameters(bitstream_t *stream,
+                                                         encoder_state_t * const state)
+{
+  const kvz_config * const cfg = &state->encoder_control->cfg;
+
+  int bit_rate_scale, cpb_size_scale;
+  uint32_t bit_rate_value, cpb_size_value;
+  hrd_scale_and_value(cfg->vbv_maxrate, 6, &bit_rate_scale, &bit_rate_value);
+  hrd_scale_and_value(cfg->vbv_bufsize, 4, &cpb_size_scale, &cpb_size_value);
+
+  WRITE_U(stream, 1, 1, "nal_hrd_parameters_present_flag");
+  WRITE_U(stream, 0, 1, "vcl_hrd_parameters_present_flag");
+  WRITE_U(stream, 0, 1, "sub_pic_hrd_params_present_flag");
+  WRITE_U(stream, bit_rate_scale, 4, "bit_rate_scale");
+  WRITE_U(stream, cpb_size_scale, 4, "cpb_size_scale");
+  WRITE_U(stream, HRD_DELAY_LENGTH - 1, 5, "initial_cpb_removal_delay_length_minus1");
+  WRITE_U(stream, HRD_DELAY_LENGTH - 1, 5, "au_cpb_removal_delay_length_minus1");
+  WRITE_U(stream, HRD_DELAY_LENGTH - 1, 5, "dpb_output_delay_length_minus1");
+
+  // for each sub-layer
+  for (int i = 0; i < 2; i++) {
+    WRITE_U(stream, 1, 1, "fixed_pic_rate_general_flag");
+    WRITE_UE(stream, 0, "elemental_duration_in_tc_minus1");
+    WRITE_UE(stream, 0, "cpb_cnt_minus1");
+
+    // sub_layer_hrd_parameters
+    WRITE_UE(stream, bit_rate_value - 1, "bit_rate_value_minus1");
+    WRITE_UE(stream, cpb_size_value - 1, "cpb_size_value_minus1");
+    WRITE_U(stream, 0, 1, "cbr_flag");
+  }
+}
+
 static void encoder_state_write_bitstream_VUI(bitstream_t *stream,
                                               encoder_state_t * const state)
 {
@@ -287,7 +350,10 @@ static void encoder_state_write_bitstream_VUI(bitstream_t *stream,
     WRITE_U(stream, encoder->vui.time_scale, 32, "vui_time_scale");
 
     WRITE_U(stream, 0, 1, "vui_poc_proportional_to_timing_flag");
-    WRITE_U(stream, 0, 1, "vui_hrd_parameters_present_flag");    
+    WRITE_U(stream, encoder->vui.hrd_parameters_present_flag, 1, "vui_hrd_parameters_present_flag");
+    if (encoder->vui.hrd_parameters_present_flag) {
+      encoder_state_write_bitstream_hrd_parameters(stream, state);
+    }
   }
   
   WRITE_U(stream, 0, 1, "bitstream_restriction_flag");
@@ -457,7 +523,7 @@ static void encoder_state_write_bitstream_pic_parameter_set(bitstream_t* stream,
   
   // If tiles and slices = tiles is enabled, signal QP in the slice header. Keeping the PPS constant for OMAF etc
   bool signal_qp_in_slice_header = (encoder->cfg.slices & KVZ_SLICES_TILES) && encoder->tiles_enable;
-  WRITE_SE(stream, signal_qp_in_slice_header ?0:(((int8_t)encoder->cfg.qp) - 26), "pic_init_qp_minus26");
+  WRITE_SE(stream, signal_qp_in_slice_header ?0:(encoder->pps.init_qp - 26), "pic_init_qp_minus26");
 
   WRITE_U(stream, 0, 1, "constrained_intra_pred_flag");
   WRITE_U(stream, encoder->cfg.trskip_enable, 1, "transform_skip_enabled_flag");
@@ -614,11 +680,48 @@ static void encoder_state_write_active_parameter_sets_sei_message(encoder_state_
 }
 */
 
+/**
+ * \brief Write a buffering period SEI message for the VBV buffer model.
+ */
+static void encoder_state_write_buffering_period_sei_message(encoder_state_t * const state)
+{
+  const kvz_config * const cfg = &state->encoder_control->cfg;
+  bitstream_t * const stream = &state->stream;
+
+  int scale;
+  uint32_t value;
+  const double bit_rate = hrd_scale_and_value(cfg->vbv_maxrate, 6, &scale, &value);
+  const double cpb_size = hrd_scale_and_value(cfg->vbv_bufsize, 4, &scale, &value);
+
+  // Time it takes to fill the buffer to its current level in units of a
+  // 90 kHz clock.
+  const double initial_delay = MIN(state->frame->vbv_fullness, cpb_size) * 90000.0 / bit_rate;
+
+  WRITE_U(stream, 0, 8, "last_payload_type_byte"); //buffering_period
+  WRITE_U(stream, 10, 8, "last_payload_size_byte");
+  WRITE_UE(stream, 0, "bp_seq_parameter_set_id");
+  WRITE_U(stream, 0, 1, "irap_cpb_params_present_flag");
+  WRITE_U(stream, 0, 1, "concatenation_flag");
+  WRITE_U(stream, 0, HRD_DELAY_LENGTH, "au_cpb_removal_delay_delta_minus1");
+  WRITE_U(stream, MAX(1, (uint32_t)initial_delay), HRD_DELAY_LENGTH, "nal_initial_cpb_removal_delay");
+  WRITE_U(stream, 0, HRD_DELAY_LENGTH, "nal_initial_cpb_removal_offset");
+
+  kvz_bitstream_align(stream);
+}
+
 static void encoder_state_write_picture_timing_sei_message(encoder_state_t * const state) {
 
+  const encoder_control_t * const encoder = state->encoder_control;
   bitstream_t * const stream = &state->stream;
 
-  if (state->encoder_control->vui.frame_field_info_present_flag){
+  int payload_bits = 0;
+  if (encoder->vui.frame_field_info_present_flag) payload_bits += 7;
+  if (encoder->vui.hrd_parameters_present_flag)   payload_bits += 2 * HRD_DELAY_LENGTH;
+
+  WRITE_U(stream, 1, 8, "last_payload_type_byte"); //pic_timing
+  WRITE_U(stream, (payload_bits + 7) / 8, 8, "last_payload_size_byte");
+
+  if (encoder->vui.frame_field_info_present_flag){
 
     int8_t odd_picture = state->frame->num % 2;
     int8_t pic_struct = 0; //0: progressive picture, 1: top field, 2: bottom field, 3...
@@ -642,14 +745,28 @@ static void encoder_state_write_picture_timing_sei_message(encoder_state_t * con
       break;
     }
 
-    WRITE_U(stream, 1, 8, "last_payload_type_byte"); //pic_timing
-    WRITE_U(stream, 1, 8, "last_payload_size_byte");
     WRITE_U(stream, pic_struct, 4, "pic_struct");
     WRITE_U(stream, source_scan_type, 2, "source_scan_type");
     WRITE_U(stream, 0, 1, "duplicate_flag");
+  }
+
+  if (encoder->vui.hrd_parameters_present_flag) {
+    const uint32_t delay_mask = (1u << HRD_DELAY_LENGTH) - 1;
+
+    // Pictures are output in order after a delay of as many pictures as
+    // can be reordered.
+    const int32_t reorder_delay =
+      encoder->cfg.gop_len > 0 && !encoder->cfg.gop_lowdelay ? encoder->cfg.gop_len : 0;
+    const int32_t dpb_output_delay =
+      (int32_t)state->frame->input_num + reorder_delay - state->frame->num;
 
-    kvz_bitstream_align(stream);
+    WRITE_U(stream, MAX(0, state->frame->hrd_cpb_removal_delay - 1) & delay_mask,
+            HRD_DELAY_LENGTH, "au_cpb_removal_delay_minus1");
+    WRITE_U(stream, MAX(0, dpb_output_delay) & delay_mask,
+            HRD_DELAY_LENGTH, "pic_dpb_output_delay");
   }
+
+  kvz_bitstream_align(stream);
 }
 
 
@@ -813,7 +930,7 @@ static void kvz_encoder_state_write_bitstream_slice_header_independent(
   {
     // If tiles are enabled, signal the full QP here (relative to the base value of 26)
     bool signal_qp_in_slice_header = (encoder->cfg.slices & KVZ_SLICES_TILES) && encoder->tiles_enable;
-    int slice_qp_delta = state->frame->QP - (signal_qp_in_slice_header ? 26 : encoder->cfg.qp);
+    int slice_qp_delta = state->frame->QP - (signal_qp_in_slice_header ? 26 : encoder->pps.init_qp);
     WRITE_SE(stream, slice_qp_delta, "slice_qp_delta");
   }
 }
@@ -1009,8 +1126,13 @@ static void encoder_state_write_bitstream_main(encoder_state_t * const state)
     kvz_bitstream_add_rbsp_trailing_bits(stream);
   }
 
-  //SEI messages for interlacing
-  if (encoder->vui.frame_field_info_present_flag) {
+  if (encoder->cfg.vbv_bufsize > 0) {
+    kvz_update_vbv_fullness(state);
+  }
+
+  //SEI messages for interlacing and the VBV buffer model
+  if (encoder->vui.frame_field_info_present_flag ||
+      encoder->vui.hrd_parameters_present_flag) {
     // These should be optional, needed for earlier versions
     // of HM decoder to accept bitstream
     //kvz_nal_write(stream, KVZ_NAL_PREFIX_SEI_NUT, 0, 0);
@@ -1019,6 +1141,9 @@ static void encoder_state_write_bitstream_main(encoder_state_t * const state)
 
     kvz_nal_write(stream, KVZ_NAL_PREFIX_SEI_NUT, 0, state->frame->first_nal);
     state->frame->first_nal = false;
+    if (encoder->vui.hrd_parameters_present_flag && state->frame->is_irap) {
+      encoder_state_write_buffering_period_sei_message(state);
+    }
     encoder_state_write_picture_timing_sei_message(state);
 
     // spec:sei_rbsp() rbsp_trailing_bits
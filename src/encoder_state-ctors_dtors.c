@@ -32,6 +32,7 @@
 #include "image.h"
 #include "imagelist.h"
 #include "kvazaar.h"
+#include "lookahead.h"
 #include "threadqueue.h"
 #include "videoframe.h"
 
@@ -51,11 +52,66 @@ static int encoder_state_config_frame_init(encoder_state_t * const state) {
   state->frame->done = 1;
   state->frame->rc_alpha = 3.2003;
   state->frame->rc_beta = -1.367;
+  state->frame->two_pass_bits = 0;
+  state->frame->two_pass_estimated_bits = 0;
+  state->frame->vbv_fullness = 0;
+  state->frame->vbv_estimated_bits = 0;
+  for (int i = 0; i <= MAX_GOP_LAYERS; i++) {
+    state->frame->vbv_bits_ratios[i] = 1.0;
+    state->frame->vbv_complexities[i] = 0;
+    state->frame->vbv_coded_lambdas[i] = 0;
+  }
+  state->frame->vbv_model_bits = 0;
+  state->frame->vbv_lambda = 0;
+  state->frame->vbv_predictor = 0;
+  state->frame->vbv_max_bits = 0;
+  state->frame->vbv_soft_max_bits = 0;
+  state->frame->hrd_bp_num = 0;
+  state->frame->hrd_cpb_removal_delay = 0;
+  state->frame->crf_complexity_sum = 0;
+  state->frame->crf_complexity_count = 0;
+  state->frame->input_num = 0;
+  state->frame->seq_num = 0;
+  state->frame->lookahead = NULL;
 
   const encoder_control_t * const encoder = state->encoder_control;
   const int num_lcus = encoder->in.width_in_lcu * encoder->in.height_in_lcu;
   state->frame->lcu_stats = MALLOC(lcu_stats_t, num_lcus);
 
+  state->frame->lcu_weights_job = NULL;
+  state->frame->lcu_weights_rows = NULL;
+  if (encoder->cfg.target_bitrate > 0 || encoder->cfg.vbv_bufsize > 0) {
+    state->frame->lcu_weights_rows = MALLOC(lcu_weights_row_t, encoder->in.height_in_lcu);
+    for (int y = 0; y < encoder->in.height_in_lcu; y++) {
+      state->frame->lcu_weights_rows[y].state = state;
+      state->frame->lcu_weights_rows[y].lcu_y = y;
+    }
+  }
+
+  state->frame->aq_activity = NULL;
+  state->frame->aq_activity_mean = 0.0;
+  for (int i = 0; i < ME_PYRAMID_LEVELS; i++) {
+    state->frame->pyramid[i] = NULL;
+    for (int j = 0; j < MAX_REF_PIC_COUNT; j++) {
+      state->frame->pyramid_pool[j][i] = NULL;
+    }
+  }
+  state->frame->pyramid_job = NULL;
+  state->frame->pyramid_rows = NULL;
+  if (encoder->cfg.ime_algorithm == KVZ_IME_PYRAMID) {
+    state->frame->pyramid_rows = MALLOC(pyramid_row_t, encoder->in.height_in_lcu);
+    for (int y = 0; y < encoder->in.height_in_lcu; y++) {
+      state->frame->pyramid_rows[y].state = state;
+      state->frame->pyramid_rows[y].lcu_y = y;
+    }
+  }
+  state->frame->subpel_planes = NULL;
+  state->frame->subpel_planes_release_job = NULL;
+  if (encoder->cfg.aq != KVZ_AQ_OFF) {
+    const int num_blocks = (encoder->in.width / 8) * (encoder->in.height / 8);
+    state->frame->aq_activity = MALLOC(double, num_blocks);
+  }
+
   return 1;
 }
 
@@ -64,6 +120,22 @@ static void encoder_state_config_frame_finalize(encoder_state_t * const state) {
 
   kvz_image_list_destroy(state->frame->ref);
   FREE_POINTER(state->frame->lcu_stats);
+  kvz_threadqueue_free_job(&state->frame->lcu_weights_job);
+  FREE_POINTER(state->frame->lcu_weights_rows);
+  FREE_POINTER(state->frame->aq_activity);
+  for (int i = 0; i < ME_PYRAMID_LEVELS; i++) {
+    kvz_image_free(state->frame->pyramid[i]);
+    state->frame->pyramid[i] = NULL;
+    for (int j = 0; j < MAX_REF_PIC_COUNT; j++) {
+      kvz_image_free(state->frame->pyramid_pool[j][i]);
+      state->frame->pyramid_pool[j][i] = NULL;
+    }
+  }
+  kvz_threadqueue_free_job(&state->frame->pyramid_job);
+  FREE_POINTER(state->frame->pyramid_rows);
+  kvz_subpel_planes_free(&state->frame->subpel_planes);
+  kvz_threadqueue_free_job(&state->frame->subpel_planes_release_job);
+  kvz_lookahead_frame_free(&state->frame->lookahead);
 }
 
 static int encoder_state_config_tile_init(encoder_state_t * const state, 
@@ -312,6 +384,7 @@ int kvz_encoder_state_init(encoder_state_t * const child_state, encoder_state_t
   child_state->children = MALLOC(encoder_state_t, 1);
   child_state->children[0].encoder_control = NULL;
   child_state->crypto_hdl = NULL;
+  child_state->mv_cache = NULL;
   child_state->must_code_qp_delta = false;
   child_state->tqj_bitstream_written = NULL;
   child_state->tqj_recon_done = NULL;
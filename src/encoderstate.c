@@ -20,6 +20,7 @@
 
 #include "encoderstate.h"
 
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +37,7 @@
 #include "search.h"
 #include "tables.h"
 #include "threadqueue.h"
+#include "threads.h"
 
 
 int kvz_encoder_state_match_children_of_previous_frame(encoder_state_t * const state) {
@@ -718,6 +720,164 @@ static void encoder_state_worker_encode_lcu(void * opaque)
   }
 }
 
+/**
+ * \brief Get the scheduling priority of a job belonging to a frame.
+ *
+ * Jobs of older frames come first. Within a frame, jobs come in the order
+ * in which the wavefront reaches them, so that the jobs on the critical
+ * path of the oldest frame in flight are run first.
+ *
+ * \param ctrl           encoder control
+ * \param frame_num      number of the frame
+ * \param lcu_x          LCU column of the job in the frame
+ * \param lcu_y          LCU row of the job in the frame
+ * \return priority for kvz_threadqueue_job_set_priority
+ */
+int32_t kvz_encoder_job_priority(const encoder_control_t *ctrl,
+                                 int32_t frame_num,
+                                 int lcu_x,
+                                 int lcu_y)
+{
+  // WPP needs two LCUs of progress on a row before the next row can start.
+  const uint32_t frame_span = ctrl->in.width_in_lcu + 2 * ctrl->in.height_in_lcu;
+  const uint32_t start_time = (uint32_t)frame_num * frame_span +
+                              lcu_x + 2 * lcu_y;
+  // Earlier start means higher priority.
+  return (int32_t)(0u - start_time);
+}
+
+/**
+ * \brief Get the scheduling priority of a job belonging to the frame of an
+ * encoder state.
+ *
+ * \see kvz_encoder_job_priority
+ */
+int32_t kvz_encoder_state_job_priority(const encoder_state_t *state,
+                                       int lcu_x,
+                                       int lcu_y)
+{
+  return kvz_encoder_job_priority(state->encoder_control,
+                                  state->frame->num,
+                                  lcu_x,
+                                  lcu_y);
+}
+
+/**
+ * \brief Get the rows of LCUs encoded by a state and its children.
+ */
+static void encoder_state_lcu_rows(const encoder_state_t * const state,
+                                   int *first_row,
+                                   int *last_row)
+{
+  if (state->is_leaf) {
+    const int offset = state->tile->lcu_offset_y;
+    *first_row = MIN(*first_row, offset + state->lcu_order[0].position.y);
+    *last_row  = MAX(*last_row,
+                     offset + state->lcu_order[state->lcu_order_count - 1].position.y);
+  }
+  for (int i = 0; state->children[i].encoder_control; ++i) {
+    encoder_state_lcu_rows(&state->children[i], first_row, last_row);
+  }
+}
+
+/**
+ * \brief Make a job wait for the interpolated planes of the reference
+ * frames.
+ *
+ * Only the rows that the motion vectors may reach are waited for.
+ *
+ * \param state   encoder state
+ * \param job     job to add the dependencies to
+ * \param lcu_y   last row of LCUs that the job encodes
+ */
+static void encoder_state_add_subpel_planes_deps(const encoder_state_t * const state,
+                                                 threadqueue_job_t * const job,
+                                                 int lcu_y)
+{
+  const encoder_control_t * const ctrl = state->encoder_control;
+  const image_list_t * const ref = state->frame->ref;
+
+  if (state->frame->slicetype == KVZ_SLICE_I) return;
+
+  for (int i = 0; i < ref->used_size; i++) {
+    const subpel_planes_t * const planes = ref->subpel_planes[i];
+    if (!planes) continue;
+
+    int row = planes->height_in_lcu - 1;
+    if (ctrl->constrain_inter_ref) {
+      row = MIN(row, lcu_y + ctrl->max_inter_ref_lcu.down);
+    }
+    kvz_threadqueue_job_dep_add(job, planes->row_jobs[row]);
+  }
+}
+
+/**
+ * \brief Wait until the interpolated planes of the reference frames are
+ * done.
+ *
+ * Used when the LCUs are encoded without jobs.
+ */
+static void encoder_state_wait_subpel_planes(const encoder_state_t * const state)
+{
+  const image_list_t * const ref = state->frame->ref;
+
+  if (state->frame->slicetype == KVZ_SLICE_I) return;
+
+  for (int i = 0; i < ref->used_size; i++) {
+    const subpel_planes_t * const planes = ref->subpel_planes[i];
+    if (planes) {
+      kvz_threadqueue_waitfor(state->encoder_control->threadqueue,
+                              planes->row_jobs[planes->height_in_lcu - 1]);
+    }
+  }
+}
+
+/**
+ * \brief Make a job wait for the motion estimation pyramids of the frame
+ * and its reference frames.
+ */
+static void encoder_state_add_pyramid_deps(const encoder_state_t * const state,
+                                           threadqueue_job_t * const job)
+{
+  const image_list_t * const ref = state->frame->ref;
+
+  if (state->frame->pyramid_job) {
+    kvz_threadqueue_job_dep_add(job, state->frame->pyramid_job);
+  }
+
+  if (state->frame->slicetype == KVZ_SLICE_I) return;
+
+  for (int i = 0; i < ref->used_size; i++) {
+    if (ref->pyramid_jobs[i]) {
+      kvz_threadqueue_job_dep_add(job, ref->pyramid_jobs[i]);
+    }
+  }
+}
+
+/**
+ * \brief Wait until the motion estimation pyramids of the frame and its
+ * reference frames are done.
+ *
+ * Used when the LCUs are encoded without jobs.
+ */
+static void encoder_state_wait_pyramids(const encoder_state_t * const state)
+{
+  threadqueue_queue_t * const threadqueue = state->encoder_control->threadqueue;
+  const image_list_t * const ref = state->frame->ref;
+
+  if (state->frame->pyramid_job) {
+    kvz_threadqueue_waitfor(threadqueue, state->frame->pyramid_job);
+  }
+
+  if (state->frame->slicetype == KVZ_SLICE_I) return;
+
+  for (int i = 0; i < ref->used_size; i++) {
+    if (ref->pyramid_jobs[i]) {
+      kvz_threadqueue_waitfor(threadqueue, ref->pyramid_jobs[i]);
+    }
+  }
+}
+
 static void encoder_state_encode_leaf(encoder_state_t * const state)
 {
   assert(state->is_leaf);
@@ -741,6 +901,12 @@ static void encoder_state_encode_leaf(encoder_state_t * const state)
     // Encode every LCU in order and perform SAO reconstruction after every
     // frame is encoded. Deblocking and SAO search is done during LCU encoding.
 
+    encoder_state_wait_subpel_planes(state);
+    encoder_state_wait_pyramids(state);
+    if (state->frame->lcu_weights_job) {
+      kvz_threadqueue_waitfor(ctrl->threadqueue, state->frame->lcu_weights_job);
+    }
+
     for (int i = 0; i < state->lcu_order_count; ++i) {
       encoder_state_worker_encode_lcu(&state->lcu_order[i]);
     }
@@ -778,11 +944,21 @@ static void encoder_state_encode_leaf(encoder_state_t * const state)
       const lcu_order_element_t * const lcu = &state->lcu_order[i];
 
       kvz_threadqueue_free_job(&state->tile->wf_jobs[lcu->id]);
-      state->tile->wf_jobs[lcu->id] = kvz_threadqueue_job_create(encoder_state_worker_encode_lcu, (void*)lcu);
+      state->tile->wf_jobs[lcu->id] = kvz_threadqueue_job_create(ctrl->threadqueue, encoder_state_worker_encode_lcu, (void*)lcu);
       threadqueue_job_t **job = &state->tile->wf_jobs[lcu->id];
 
       // If job object was returned, add dependancies and allow it to run.
       if (job[0]) {
+        kvz_threadqueue_job_set_priority(job[0], kvz_encoder_state_job_priority(
+            state,
+            lcu->position.x + state->tile->lcu_offset_x,
+            lcu->position.y + state->tile->lcu_offset_y));
+        kvz_threadqueue_job_set_trace_info(job[0], "LCU",
+                                           state->frame->num,
+                                           state->tile->id,
+                                           lcu->position.x + state->tile->lcu_offset_x,
+                                           lcu->position.y + state->tile->lcu_offset_y);
+
         // Add inter frame dependancies when ecoding more than one frame at
         // once. The added dependancy is for the first LCU of each wavefront
         // row to depend on the reconstruction status of the row below in the
@@ -803,6 +979,24 @@ static void encoder_state_encode_leaf(encoder_state_t * const state)
           kvz_threadqueue_job_dep_add(job[0], ref_state->tile->wf_jobs[dep_lcu->id]);
         }
 
+        // The first LCUs of the leaf wait for the rate control weights and
+        // the motion estimation pyramids. The rest depend on them through
+        // the WPP dependancies.
+        if (!lcu->left && !lcu->above) {
+          if (state->frame->lcu_weights_job) {
+            kvz_threadqueue_job_dep_add(job[0], state->frame->lcu_weights_job);
+          }
+          encoder_state_add_pyramid_deps(state, job[0]);
+        }
+
+        // The first LCU of each row waits for the interpolated planes of
+        // the reference frames. The rest depend on it through the LCU on
+        // the left.
+        if (!lcu->left) {
+          encoder_state_add_subpel_planes_deps(state, job[0],
+                                               lcu->position.y + state->tile->lcu_offset_y);
+        }
+
         // Add local WPP dependancy to the LCU on the left.
         if (lcu->left) {
           kvz_threadqueue_job_dep_add(job[0], job[-1]);
@@ -915,7 +1109,20 @@ static void encoder_state_encode(encoder_state_t * const main_state) {
         if (main_state->children[i].type != ENCODER_STATE_TYPE_WAVEFRONT_ROW) {
           kvz_threadqueue_free_job(&main_state->children[i].tqj_recon_done);
           main_state->children[i].tqj_recon_done =
-            kvz_threadqueue_job_create(encoder_state_worker_encode_children, &main_state->children[i]);
+            kvz_threadqueue_job_create(main_state->encoder_control->threadqueue,
+                                       encoder_state_worker_encode_children,
+                                       &main_state->children[i]);
+          kvz_threadqueue_job_set_priority(
+              main_state->children[i].tqj_recon_done,
+              kvz_encoder_state_job_priority(&main_state->children[i],
+                                             main_state->children[i].tile->lcu_offset_x,
+                                             main_state->children[i].tile->lcu_offset_y));
+          kvz_threadqueue_job_set_trace_info(
+              main_state->children[i].tqj_recon_done,
+              main_state->children[i].type == ENCODER_STATE_TYPE_TILE ? "tile" : "slice",
+              main_state->children[i].frame->num,
+              main_state->children[i].tile->id,
+              -1, -1);
           if (main_state->children[i].previous_encoder_state != &main_state->children[i] &&
               main_state->children[i].previous_encoder_state->tqj_recon_done &&
               !main_state->children[i].frame->is_irap)
@@ -935,6 +1142,18 @@ static void encoder_state_encode(encoder_state_t * const main_state) {
               }
             }
           }
+          int first_row = INT_MAX;
+          int last_row  = -1;
+          encoder_state_lcu_rows(&main_state->children[i], &first_row, &last_row);
+          encoder_state_add_subpel_planes_deps(&main_state->children[i],
+                                               main_state->children[i].tqj_recon_done,
+                                               last_row);
+          encoder_state_add_pyramid_deps(&main_state->children[i],
+                                         main_state->children[i].tqj_recon_done);
+          if (main_state->frame->lcu_weights_job) {
+            kvz_threadqueue_job_dep_add(main_state->children[i].tqj_recon_done,
+                                        main_state->frame->lcu_weights_job);
+          }
           kvz_threadqueue_submit(main_state->encoder_control->threadqueue, main_state->children[i].tqj_recon_done);
         } else {
           //Wavefront rows have parallelism at LCU level, so we should not launch multiple threads here!
@@ -1152,19 +1371,242 @@ static void encoder_state_init_children(encoder_state_t * const state) {
   }
 }
 
-static void normalize_lcu_weights(encoder_state_t * const state)
+/**
+ * \brief Downscale a row of LCUs on every level of the pyramid.
+ *
+ * The rows of a level are made from the same row of the level above.
+ */
+static void encoder_state_worker_pyramid_row(void *opaque)
+{
+  const pyramid_row_t * const row = opaque;
+  encoder_state_t * const state = row->state;
+
+  const kvz_picture *pic = state->tile->frame->source;
+  for (int i = 0; i < ME_PYRAMID_LEVELS; i++) {
+    const int32_t row_height = LCU_WIDTH >> (i + 1);
+    int32_t y_end = (row->lcu_y + 1) * row_height;
+    if (row->lcu_y == state->encoder_control->in.height_in_lcu - 1) {
+      // The last row includes the rows added by rounding up the size.
+      y_end = state->frame->pyramid[i]->height;
+    }
+    kvz_image_downscale_rows(pic, state->frame->pyramid[i],
+                             row->lcu_y * row_height, y_end);
+    pic = state->frame->pyramid[i];
+  }
+}
+
+/**
+ * \brief Start downscaling the source picture for pyramid motion
+ * estimation.
+ *
+ * The pyramid is kept with the reconstructed picture when the frame is
+ * used as a reference. It is made for every picture if the encoder was
+ * opened with pyramid search, since the search may be switched back to it
+ * while the picture is still a reference. The LCUs of the frame and of the
+ * frames referring to it must depend on state->frame->pyramid_job.
+ */
+static void encoder_state_init_pyramid(encoder_state_t * const state)
+{
+  const encoder_control_t * const encoder = state->encoder_control;
+
+  // The jobs of the previous frame of the state are done since the frame
+  // has been output.
+  kvz_threadqueue_free_job(&state->frame->pyramid_job);
+
+  if (encoder->cfg.ime_algorithm != KVZ_IME_PYRAMID) return;
+
+  // Keep the pyramid of the previous frame for reuse.
+  kvz_picture *(*pool)[ME_PYRAMID_LEVELS] = state->frame->pyramid_pool;
+  if (state->frame->pyramid[0]) {
+    int free_slot = 0;
+    while (free_slot < MAX_REF_PIC_COUNT && pool[free_slot][0]) free_slot++;
+    for (int i = 0; i < ME_PYRAMID_LEVELS; i++) {
+      if (free_slot < MAX_REF_PIC_COUNT) {
+        pool[free_slot][i] = state->frame->pyramid[i];
+      } else {
+        kvz_image_free(state->frame->pyramid[i]);
+      }
+      state->frame->pyramid[i] = NULL;
+    }
+  }
+
+  // Reuse a pyramid that the reference lists no longer hold. The lists are
+  // only changed by the thread calling the encoder, like this function.
+  for (int slot = 0; slot < MAX_REF_PIC_COUNT; slot++) {
+    if (pool[slot][0] && pool[slot][0]->refcount == 1) {
+      for (int i = 0; i < ME_PYRAMID_LEVELS; i++) {
+        state->frame->pyramid[i] = pool[slot][i];
+        pool[slot][i] = NULL;
+      }
+      break;
+    }
+  }
+
+  const kvz_picture *pic = state->tile->frame->source;
+  for (int i = 0; i < ME_PYRAMID_LEVELS; i++) {
+    kvz_picture **level = &state->frame->pyramid[i];
+    if (!*level) {
+      *level = kvz_image_downscale_alloc(pic);
+    }
+    if (!*level) {
+      // Pyramid motion estimation falls back to a full resolution search.
+      fprintf(stderr, "Failed to allocate the motion estimation pyramid!\n");
+      for (int j = 0; j < i; j++) {
+        kvz_image_free(state->frame->pyramid[j]);
+        state->frame->pyramid[j] = NULL;
+      }
+      return;
+    }
+    pic = *level;
+  }
+
+  threadqueue_queue_t * const threadqueue = encoder->threadqueue;
+  const int32_t last_row = encoder->in.height_in_lcu - 1;
+
+  state->frame->pyramid_job = kvz_threadqueue_job_create(
+      threadqueue, encoder_state_worker_pyramid_row,
+      &state->frame->pyramid_rows[last_row]);
+  kvz_threadqueue_job_set_priority(state->frame->pyramid_job,
+      kvz_encoder_state_job_priority(state, 0, last_row));
+  kvz_threadqueue_job_set_trace_info(state->frame->pyramid_job, "pyramid",
+                                     state->frame->num, -1, -1, last_row);
+
+  for (int y = 0; y < last_row; y++) {
+    threadqueue_job_t *job = kvz_threadqueue_job_create(
+        threadqueue, encoder_state_worker_pyramid_row, &state->frame->pyramid_rows[y]);
+    kvz_threadqueue_job_set_priority(job, kvz_encoder_state_job_priority(state, 0, y));
+    kvz_threadqueue_job_set_trace_info(job, "pyramid", state->frame->num, -1, -1, y);
+    kvz_threadqueue_job_dep_add(state->frame->pyramid_job, job);
+    kvz_threadqueue_submit(threadqueue, job);
+    kvz_threadqueue_free_job(&job);
+  }
+
+  kvz_threadqueue_submit(threadqueue, state->frame->pyramid_job);
+}
+
+/**
+ * \brief Allocate the interpolated planes and the integral image of the
+ * reconstructed picture.
+ *
+ * The planes of the previous frame of the state are released once the
+ * jobs filling them are done.
+ */
+static void encoder_state_init_subpel_planes(encoder_state_t * const state)
+{
+  const encoder_control_t * const encoder = state->encoder_control;
+  const kvz_config * const cfg = &encoder->cfg;
+
+  subpel_planes_t *planes = state->frame->subpel_planes;
+  if (planes) {
+    // The reference lists may keep the planes after this so they must not
+    // be freed while the jobs are running. Hand the reference of the state
+    // over to a job that drops it once the last row is done.
+    threadqueue_job_t *last_row = planes->row_jobs[planes->height_in_lcu - 1];
+    threadqueue_job_t *job = kvz_threadqueue_job_create(
+        encoder->threadqueue, kvz_subpel_planes_worker_release, planes);
+    kvz_threadqueue_job_set_trace_info(job, "subpel release", state->frame->num, -1, -1, -1);
+    if (last_row) {
+      kvz_threadqueue_job_dep_add(job, last_row);
+    }
+    // Chain the jobs so that waiting for the last one releases every plane.
+    if (state->frame->subpel_planes_release_job) {
+      kvz_threadqueue_job_dep_add(job, state->frame->subpel_planes_release_job);
+      kvz_threadqueue_free_job(&state->frame->subpel_planes_release_job);
+    }
+    kvz_threadqueue_submit(encoder->threadqueue, job);
+    state->frame->subpel_planes_release_job = job;
+    state->frame->subpel_planes = NULL;
+  }
+
+  // Only the frames used as references are searched.
+  const bool is_ref = !cfg->gop_len ||
+                      !state->frame->poc ||
+                      cfg->gop[state->frame->gop_offset].is_ref;
+  if (!is_ref) return;
+
+  const bool interpolate = cfg->subme_cache && cfg->fme_level > 0;
+  // The full search skips motion vectors based on the sums of the blocks.
+  // The sums are made if the encoder was opened with a full search, since
+  // the search may be switched back to it while the picture is a reference.
+  bool sums = false;
+  switch (cfg->ime_algorithm) {
+    case KVZ_IME_FULL:
+    case KVZ_IME_FULL8:
+    case KVZ_IME_FULL16:
+    case KVZ_IME_FULL32:
+    case KVZ_IME_FULL64:
+      sums = true;
+      break;
+    default:
+      break;
+  }
+  if (!interpolate && !sums) return;
+
+  state->frame->subpel_planes = kvz_subpel_planes_alloc(encoder,
+                                                        state->tile->frame->rec,
+                                                        interpolate,
+                                                        sums);
+  if (!state->frame->subpel_planes) {
+    // Motion estimation falls back to interpolating each block and
+    // computing the SAD of every vector.
+    fprintf(stderr, "Failed to allocate the interpolated reference planes!\n");
+  }
+}
+
+/**
+ * \brief Make a job wait for the reconstruction of the LCUs of the frame
+ * on the given rows.
+ */
+static void encoder_state_add_recon_deps(const encoder_state_t * const state,
+                                         threadqueue_job_t * const job,
+                                         int first_row,
+                                         int last_row)
 {
-  if (state->frame->num == 0) return;
+  if (state->tqj_recon_done) {
+    int state_first = INT_MAX;
+    int state_last  = -1;
+    encoder_state_lcu_rows(state, &state_first, &state_last);
+    if (state_first <= last_row && state_last >= first_row) {
+      kvz_threadqueue_job_dep_add(job, state->tqj_recon_done);
+    }
+    return;
+  }
 
-  const uint32_t num_lcus = state->encoder_control->in.width_in_lcu *
-                            state->encoder_control->in.height_in_lcu;
-  double sum = 0.0;
-  for (uint32_t i = 0; i < num_lcus; i++) {
-    sum += state->frame->lcu_stats[i].weight;
+  // Children of a state without a job are either encoded in their own jobs
+  // or done already.
+  for (int i = 0; state->children[i].encoder_control; ++i) {
+    encoder_state_add_recon_deps(&state->children[i], job, first_row, last_row);
   }
+}
 
-  for (uint32_t i = 0; i < num_lcus; i++) {
-    state->frame->lcu_stats[i].weight /= sum;
+/**
+ * \brief Start the jobs interpolating the reconstructed picture.
+ *
+ * A row of LCUs is interpolated when the reconstruction of the rows next
+ * to it is final since deblocking, SAO and the interpolation filter reach
+ * over the LCU boundary.
+ */
+static void encoder_state_start_subpel_planes(encoder_state_t * const state)
+{
+  subpel_planes_t * const planes = state->frame->subpel_planes;
+  if (!planes) return;
+
+  threadqueue_queue_t * const threadqueue = state->encoder_control->threadqueue;
+
+  for (int y = 0; y < planes->height_in_lcu; y++) {
+    threadqueue_job_t *job = kvz_threadqueue_job_create(
+        threadqueue, kvz_subpel_planes_worker_interpolate_row, &planes->rows[y]);
+    kvz_threadqueue_job_set_priority(job, kvz_encoder_state_job_priority(
+        state, state->encoder_control->in.width_in_lcu, y));
+    kvz_threadqueue_job_set_trace_info(job, "subpel", state->frame->num, -1, -1, y);
+
+    encoder_state_add_recon_deps(state, job, y - 1, y + 1);
+    if (y > 0) {
+      kvz_threadqueue_job_dep_add(job, planes->row_jobs[y - 1]);
+    }
+
+    kvz_threadqueue_submit(threadqueue, job);
+    planes->row_jobs[y] = job;
   }
 }
 
@@ -1186,12 +1628,16 @@ static void encoder_state_init_new_frame(encoder_state_t * const state, kvz_pict
   // setting it based on the intra period
   bool is_closed_normal_gop = false;
 
+  // The GOP structure and the intra period start over at each coded video
+  // sequence.
+  const int32_t seq_num = state->frame->seq_num;
+
   // Set POC.
-  if (state->frame->num == 0) {
+  if (seq_num == 0) {
     state->frame->poc = 0;
   } else if (cfg->gop_len && !cfg->gop_lowdelay) {
 
-    int32_t framenum = state->frame->num - 1;
+    int32_t framenum = seq_num - 1;
     // Handle closed GOP
     // Closed GOP structure has an extra IDR between the GOPs
     if (cfg->intra_period > 0 && !cfg->open_gop) {
@@ -1215,13 +1661,13 @@ static void encoder_state_init_new_frame(encoder_state_t * const state, kvz_pict
     
     kvz_videoframe_set_poc(state->tile->frame, state->frame->poc);
   } else if (cfg->intra_period > 0) {
-    state->frame->poc = state->frame->num % cfg->intra_period;
+    state->frame->poc = seq_num % cfg->intra_period;
   } else {
-    state->frame->poc = state->frame->num;
+    state->frame->poc = seq_num;
   }
 
   // Check whether the frame is a keyframe or not.
-  if (state->frame->num == 0 || state->frame->poc == 0) {
+  if (seq_num == 0 || state->frame->poc == 0) {
     state->frame->is_irap = true;
   } else if(!is_closed_normal_gop) { // In closed-GOP IDR frames are poc==0 so skip this check
     state->frame->is_irap =
@@ -1232,9 +1678,20 @@ static void encoder_state_init_new_frame(encoder_state_t * const state, kvz_pict
     state->frame->irap_poc = state->frame->poc;
   }
 
+  // Set the timing of the picture in the hypothetical reference decoder.
+  // Buffering periods start at IRAP pictures.
+  if (state->frame->num == 0) {
+    state->frame->hrd_bp_num = 0;
+    state->frame->hrd_cpb_removal_delay = 0;
+  } else {
+    const int32_t prev_bp_num = state->previous_encoder_state->frame->hrd_bp_num;
+    state->frame->hrd_cpb_removal_delay = state->frame->num - prev_bp_num;
+    state->frame->hrd_bp_num = state->frame->is_irap ? state->frame->num : prev_bp_num;
+  }
+
   // Set pictype.
   if (state->frame->is_irap) {
-    if (state->frame->num == 0 ||
+    if (seq_num == 0 ||
         cfg->intra_period == 1 ||
         cfg->gop_len == 0 ||
         cfg->gop_lowdelay ||
@@ -1262,10 +1719,16 @@ static void encoder_state_init_new_frame(encoder_state_t * const state, kvz_pict
     state->frame->slicetype = KVZ_SLICE_P;
   }
 
-  if (cfg->target_bitrate > 0 && state->frame->num > cfg->owf) {
-    normalize_lcu_weights(state);
-  }
+  // The parameters may change between pictures.
+  state->frame->search = state->encoder_control->search;
+  state->frame->rc     = state->encoder_control->rc;
+
+  encoder_state_init_pyramid(state);
+  encoder_state_init_subpel_planes(state);
+
+  kvz_init_lcu_weights(state);
   kvz_set_picture_lambda_and_qp(state);
+  kvz_init_aq_activity(state);
 
   encoder_state_init_children(state);
 }
@@ -1288,9 +1751,18 @@ void kvz_encode_one_frame(encoder_state_t * const state, kvz_picture* frame)
 {
   encoder_state_init_new_frame(state, frame);
   encoder_state_encode(state);
+  encoder_state_start_subpel_planes(state);
 
   threadqueue_job_t *job =
-    kvz_threadqueue_job_create(kvz_encoder_state_worker_write_bitstream, state);
+    kvz_threadqueue_job_create(state->encoder_control->threadqueue,
+                               kvz_encoder_state_worker_write_bitstream,
+                               state);
+  // Writing the bitstream is the last job of the frame.
+  kvz_threadqueue_job_set_priority(job, kvz_encoder_state_job_priority(
+      state,
+      state->encoder_control->in.width_in_lcu,
+      state->encoder_control->in.height_in_lcu - 1));
+  kvz_threadqueue_job_set_trace_info(job, "bitstream", state->frame->num, -1, -1, -1);
 
   _encode_one_frame_add_bitstream_deps(state, job);
   if (state->previous_encoder_state != state && state->previous_encoder_state->tqj_bitstream_written) {
@@ -1357,7 +1829,10 @@ void kvz_encoder_prepare(encoder_state_t *state)
                    prev_state->tile->frame->rec,
                    prev_state->tile->frame->cu_array,
                    prev_state->frame->poc,
-                   prev_state->frame->ref_LX);
+                   prev_state->frame->ref_LX,
+                   prev_state->frame->pyramid,
+                   prev_state->frame->pyramid_job,
+                   prev_state->frame->subpel_planes);
     kvz_cu_array_free(&state->tile->frame->cu_array);
     unsigned height = state->tile->frame->height_in_lcu * LCU_WIDTH;
     unsigned width  = state->tile->frame->width_in_lcu  * LCU_WIDTH;
@@ -34,12 +34,17 @@
 #include "image.h"
 #include "imagelist.h"
 #include "kvazaar.h"
+#include "lookahead.h"
+#include "subpel_planes.h"
 #include "tables.h"
 #include "threadqueue.h"
 #include "videoframe.h"
 #include "extras/crypto.h"
 
 
+// Forward declarations.
+struct inter_mv_cache_t;
+
 typedef enum {
   ENCODER_STATE_TYPE_INVALID = 'i',
   ENCODER_STATE_TYPE_MAIN = 'M',
@@ -53,9 +58,26 @@ typedef struct lcu_stats_t {
   //! \brief Number of bits that were spent
   uint32_t bits;
 
-  //! \brief Weight of the LCU for rate control
+  /**
+   * \brief Weight of the LCU for rate control
+   *
+   * Squared complexity of the LCU estimated from the source picture,
+   * normalized to sum to one over the frame.
+   */
   double weight;
 
+  /**
+   * \brief Share of the LCU of the complexity of the frame
+   *
+   * Complexity of the LCU estimated from the source picture, normalized to
+   * sum to one over the frame.
+   */
+  double complexity;
+
+  //! \brief QP offset added to this LCU to keep the picture within its VBV
+  //! limit
+  int8_t vbv_dqp;
+
   //! \brief Lambda value which was used for this LCU
   double lambda;
 
@@ -66,6 +88,24 @@ typedef struct lcu_stats_t {
   double rc_beta;
 } lcu_stats_t;
 
+/**
+ * \brief Parameters of a job computing the rate control weights of a row
+ * of LCUs.
+ */
+typedef struct lcu_weights_row_t {
+  struct encoder_state_t *state;
+  int32_t lcu_y;
+} lcu_weights_row_t;
+
+/**
+ * \brief Parameters of a job downscaling a row of LCUs for pyramid motion
+ * estimation.
+ */
+typedef struct pyramid_row_t {
+  struct encoder_state_t *state;
+  int32_t lcu_y;
+} pyramid_row_t;
+
 
 typedef struct encoder_state_config_frame_t {
   /**
@@ -121,6 +161,69 @@ typedef struct encoder_state_config_frame_t {
   double rc_alpha;
   double rc_beta;
 
+  //! Number of bits written in the second pass of two-pass encoding.
+  double two_pass_bits;
+
+  //! Number of bits estimated from the first pass for the same pictures.
+  double two_pass_estimated_bits;
+
+  //! Fullness of the VBV buffer in bits before this picture is removed.
+  double vbv_fullness;
+
+  //! Number of bits estimated for this picture by the VBV model.
+  double vbv_estimated_bits;
+
+  //! Corrections of the bit estimates of the VBV model for I-pictures and
+  //! each GOP layer.
+  double vbv_bits_ratios[MAX_GOP_LAYERS + 1];
+
+  //! Lookahead costs of the last I-picture and the last picture of each GOP
+  //! layer.
+  double vbv_complexities[MAX_GOP_LAYERS + 1];
+
+  //! Lambdas the last written I-picture and the last written picture of each
+  //! GOP layer were coded with.
+  double vbv_coded_lambdas[MAX_GOP_LAYERS + 1];
+
+  //! Number of bits the uncorrected model estimated for this picture.
+  double vbv_model_bits;
+
+  //! Lambda of the picture when the bits were estimated.
+  double vbv_lambda;
+
+  //! Index of the correction used for this picture.
+  int8_t vbv_predictor;
+
+  //! Maximum number of bits of this picture allowed by the VBV model.
+  //! The pictures started after this one count on it not being exceeded.
+  double vbv_max_bits;
+
+  //! Number of bits of this picture above which the LCUs are coded with a
+  //! higher QP.
+  double vbv_soft_max_bits;
+
+  //! Number of the picture with the active buffering period SEI.
+  int32_t hrd_bp_num;
+
+  //! CPB removal delay of this picture in clock ticks.
+  int32_t hrd_cpb_removal_delay;
+
+  //! Sum of the complexities of the pictures up to this one in coding
+  //! order, each decayed by its distance from this picture.
+  double crf_complexity_sum;
+
+  //! Sum of the weights of the complexities in crf_complexity_sum.
+  double crf_complexity_count;
+
+  /**
+   * \brief Search and rate control parameters of this picture.
+   *
+   * Copied from the encoder control when the picture is started so that
+   * reconfiguring the encoder does not affect the pictures being coded.
+   */
+  encoder_search_params_t search;
+  encoder_rc_params_t rc;
+
   /**
    * \brief Indicates that this encoder state is ready for encoding the
    * next frame i.e. kvz_encoder_prepare has been called.
@@ -141,11 +244,96 @@ typedef struct encoder_state_config_frame_t {
    */
   lcu_stats_t *lcu_stats;
 
+  /**
+   * \brief Job computing the weights in lcu_stats, or NULL if rate control
+   * is not used.
+   *
+   * The LCUs of the frame depend on this job.
+   */
+  threadqueue_job_t *lcu_weights_job;
+
+  //! \brief Parameters of the jobs computing the weights of each LCU row
+  lcu_weights_row_t *lcu_weights_rows;
+
   /**
    * \brief Whether next NAL is the first NAL in the access unit.
    */
   bool first_nal;
 
+  /**
+   * \brief Number of the frame in input order.
+   */
+  int64_t input_num;
+
+  /**
+   * \brief Number of the frame counted from the start of the coded video
+   * sequence.
+   *
+   * Equal to num unless a scene cut has started a new sequence.
+   */
+  int32_t seq_num;
+
+  /**
+   * \brief Lookahead analysis of the frame, or NULL if lookahead is not
+   * used.
+   */
+  lookahead_frame_t *lookahead;
+
+  /**
+   * \brief Spatial activity of each 8x8 luma block of the frame.
+   *
+   * Base-2 logarithm of the variance of the block. Used for adaptive
+   * quantization.
+   */
+  double *aq_activity;
+
+  //! \brief Mean of aq_activity over the frame
+  double aq_activity_mean;
+
+  /**
+   * \brief Downscaled luma of the source picture for pyramid motion
+   * estimation.
+   *
+   * Level n + 1 of the pyramid is at index n. NULL unless the frame uses
+   * pyramid motion estimation.
+   */
+  kvz_picture *pyramid[ME_PYRAMID_LEVELS];
+
+  /**
+   * \brief Pyramids of the previous frames of the state.
+   *
+   * A pyramid is reused for a new frame once the reference lists no longer
+   * hold it.
+   */
+  kvz_picture *pyramid_pool[MAX_REF_PIC_COUNT][ME_PYRAMID_LEVELS];
+
+  /**
+   * \brief Job downscaling the last LCU row of the pyramid.
+   *
+   * Depends on the jobs of the other rows so the pyramid is done when the
+   * job is done. NULL if there is no pyramid.
+   */
+  threadqueue_job_t *pyramid_job;
+
+  //! \brief Parameters of the jobs downscaling each LCU row
+  pyramid_row_t *pyramid_rows;
+
+  /**
+   * \brief Interpolated luma planes of the reconstructed picture for
+   * fractional motion estimation.
+   *
+   * NULL unless subme_cache is enabled and the frame is used as a
+   * reference.
+   */
+  subpel_planes_t *subpel_planes;
+
+  /**
+   * \brief Job releasing the planes of the previous frame.
+   *
+   * Depends on the job releasing the planes of the frame before that.
+   */
+  threadqueue_job_t *subpel_planes_release_job;
+
 } encoder_state_config_frame_t;
 
 typedef struct encoder_state_config_tile_t {
@@ -262,6 +450,11 @@ typedef struct encoder_state_t {
   //! \brief Quantization parameter for the current LCU
   int8_t qp;
 
+  //! \brief Lambda of the current LCU before adaptive quantization
+  double lcu_lambda;
+  //! \brief QP of the current LCU before adaptive quantization
+  int8_t lcu_qp;
+
   /**
    * \brief Whether a QP delta value must be coded for the current LCU.
    */
@@ -285,6 +478,12 @@ typedef struct encoder_state_t {
    */
   lcu_coeff_t *coeff;
 
+  /**
+   * \brief Motion vectors found in the current LCU, or NULL if
+   * --me-cache is disabled.
+   */
+  struct inter_mv_cache_t *mv_cache;
+
   //Jobs to wait for
   threadqueue_job_t * tqj_recon_done; //Reconstruction is done
   threadqueue_job_t * tqj_bitstream_written; //Bitstream is written
@@ -303,6 +502,14 @@ void kvz_encoder_create_ref_lists(const encoder_state_t *const state);
 
 lcu_stats_t* kvz_get_lcu_stats(encoder_state_t *state, int lcu_x, int lcu_y);
 
+int32_t kvz_encoder_job_priority(const encoder_control_t *ctrl,
+                                 int32_t frame_num,
+                                 int lcu_x,
+                                 int lcu_y);
+int32_t kvz_encoder_state_job_priority(const encoder_state_t *state,
+                                       int lcu_x,
+                                       int lcu_y);
+
 
 int kvz_get_cu_ref_qp(const encoder_state_t *state, int x, int y, int last_qp);
 
@@ -312,9 +519,10 @@ int kvz_get_cu_ref_qp(const encoder_state_t *state, int x, int y, int last_qp);
 static INLINE bool encoder_state_must_write_vps(const encoder_state_t *state)
 {
   const int32_t frame = state->frame->num;
+  const int32_t seq_frame = state->frame->seq_num;
   const int32_t vps_period = state->encoder_control->cfg.vps_period;
 
-  return (vps_period >  0 && frame % vps_period == 0) ||
+  return (vps_period >  0 && seq_frame % vps_period == 0) ||
          (vps_period >= 0 && frame == 0);
 }
 
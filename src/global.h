@@ -176,6 +176,19 @@ typedef int16_t coeff_t;
 
 #define MAX_REF_PIC_COUNT 16
 
+/**
+ * \brief Number of downscaled levels used by pyramid motion estimation.
+ *
+ * Level n has the resolution of the picture divided by 2^n.
+ */
+#define ME_PYRAMID_LEVELS 2
+
+/**
+ * \brief Search range of pyramid motion estimation on the coarsest level,
+ * in pixels of that level.
+ */
+#define ME_PYRAMID_RANGE 8
+
 #define AMVP_MAX_NUM_CANDS 2
 #define AMVP_MAX_NUM_CANDS_MEM 3
 #define MRG_MAX_NUM_CANDS 5
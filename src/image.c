@@ -56,8 +56,9 @@ kvz_picture * kvz_image_alloc(enum kvz_chroma_format chroma_format, const int32_
 
   im->chroma_format = chroma_format;
 
-  //Allocate memory
-  im->fulldata = MALLOC(kvz_pixel, (luma_size + 2 * chroma_size));
+  // Allocate memory. The SIMD implementations of SAD may read up to 16
+  // bytes past the end of the last row of a block.
+  im->fulldata = MALLOC(kvz_pixel, (luma_size + 2 * chroma_size) + 16);
   if (!im->fulldata) {
     free(im);
     return NULL;
@@ -85,6 +86,13 @@ kvz_picture * kvz_image_alloc(enum kvz_chroma_format chroma_format, const int32_
 
   im->interlacing = KVZ_INTERLACING_NONE;
 
+  im->frame_type = KVZ_FRAME_AUTO;
+  im->qp = -1;
+  im->lambda = 0;
+  im->roi.width = 0;
+  im->roi.height = 0;
+  im->roi.dqps = NULL;
+
   return im;
 }
 
@@ -112,15 +120,63 @@ void kvz_image_free(kvz_picture *const im)
   } else {
     free(im->fulldata);
   }
+  free(im->roi.dqps);
 
   // Make sure freed data won't be used.
   im->base_image = NULL;
   im->fulldata = NULL;
+  im->roi.dqps = NULL;
   im->y = im->u = im->v = NULL;
   im->data[COLOR_Y] = im->data[COLOR_U] = im->data[COLOR_V] = NULL;
   free(im);
 }
 
+/**
+ * \brief Allocate a luma-only image for the downscaled luma of an image.
+ *
+ * The size is half of the size of the image rounded up to even numbers.
+ *
+ * \param im  image to downscale
+ * \return luma-only image, or NULL on failure
+ */
+kvz_picture *kvz_image_downscale_alloc(const kvz_picture *im)
+{
+  const int32_t width  = ((im->width  + 1) / 2 + 1) & ~1;
+  const int32_t height = ((im->height + 1) / 2 + 1) & ~1;
+  return kvz_image_alloc(KVZ_CSP_400, width, height);
+}
+
+/**
+ * \brief Downscale rows of the luma of an image by two in both directions.
+ *
+ * Each pixel is the average of a 2x2 block. The last column and row of the
+ * image are repeated to fill the rounded up size of the result.
+ *
+ * \param im      image to downscale
+ * \param scaled  image allocated with kvz_image_downscale_alloc
+ * \param y_begin first row of scaled to fill
+ * \param y_end   row of scaled after the last row to fill
+ */
+void kvz_image_downscale_rows(const kvz_picture *im,
+                              kvz_picture *scaled,
+                              int32_t y_begin,
+                              int32_t y_end)
+{
+  const int32_t width = scaled->width;
+
+  for (int y = y_begin; y < MIN(y_end, scaled->height); y++) {
+    const int y0 = MIN(2 * y,     im->height - 1);
+    const int y1 = MIN(2 * y + 1, im->height - 1);
+    for (int x = 0; x < width; x++) {
+      const int x0 = MIN(2 * x,     im->width - 1);
+      const int x1 = MIN(2 * x + 1, im->width - 1);
+      const int sum = im->y[x0 + y0 * im->stride] + im->y[x1 + y0 * im->stride] +
+                      im->y[x0 + y1 * im->stride] + im->y[x1 + y1 * im->stride];
+      scaled->y[x + y * scaled->stride] = (kvz_pixel)((sum + 2) >> 2);
+    }
+  }
+}
+
 /**
  * \brief Get a new pointer to an image.
  *
@@ -170,6 +226,13 @@ kvz_picture *kvz_image_make_subimage(kvz_picture *const orig_image,
   im->pts = 0;
   im->dts = 0;
 
+  im->frame_type = KVZ_FRAME_AUTO;
+  im->qp = -1;
+  im->lambda = 0;
+  im->roi.width = 0;
+  im->roi.height = 0;
+  im->roi.dqps = NULL;
+
   return im;
 }
 
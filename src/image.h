@@ -60,6 +60,12 @@ void kvz_image_free(kvz_picture *im);
 
 kvz_picture *kvz_image_copy_ref(kvz_picture *im);
 
+kvz_picture *kvz_image_downscale_alloc(const kvz_picture *im);
+void kvz_image_downscale_rows(const kvz_picture *im,
+                              kvz_picture *scaled,
+                              int32_t y_begin,
+                              int32_t y_end);
+
 kvz_picture *kvz_image_make_subimage(kvz_picture *const orig_image,
                              const unsigned x_offset,
                              const unsigned y_offset,
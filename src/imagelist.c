@@ -24,6 +24,7 @@
 #include <stdlib.h>
 
 #include "image.h"
+#include "subpel_planes.h"
 #include "threads.h"
 
 
@@ -40,6 +41,9 @@ image_list_t * kvz_image_list_alloc(int size)
   list->cu_arrays = malloc(sizeof(cu_array_t*)   * size);
   list->pocs      = malloc(sizeof(int32_t)       * size);
   list->ref_LXs   = malloc(sizeof(*list->ref_LXs) * size);
+  list->pyramids  = malloc(sizeof(*list->pyramids) * size);
+  list->pyramid_jobs = malloc(sizeof(*list->pyramid_jobs) * size);
+  list->subpel_planes = malloc(sizeof(*list->subpel_planes) * size);
   list->used_size = 0;
 
   return list;
@@ -57,8 +61,12 @@ int kvz_image_list_resize(image_list_t *list, unsigned size)
   list->cu_arrays = (cu_array_t**)realloc(list->cu_arrays, sizeof(cu_array_t*) * size);
   list->pocs = realloc(list->pocs, sizeof(int32_t) * size);
   list->ref_LXs = realloc(list->ref_LXs, sizeof(*list->ref_LXs) * size);
+  list->pyramids = realloc(list->pyramids, sizeof(*list->pyramids) * size);
+  list->pyramid_jobs = realloc(list->pyramid_jobs, sizeof(*list->pyramid_jobs) * size);
+  list->subpel_planes = realloc(list->subpel_planes, sizeof(*list->subpel_planes) * size);
   list->size = size;
-  return size == 0 || (list->images && list->cu_arrays && list->pocs);
+  return size == 0 || (list->images && list->cu_arrays && list->pocs && list->pyramids &&
+                       list->pyramid_jobs && list->subpel_planes);
 }
 
 /**
@@ -80,6 +88,12 @@ int kvz_image_list_destroy(image_list_t *list)
         list->ref_LXs[i][0][j] = 0;
         list->ref_LXs[i][1][j] = 0;
       }
+      for (int l = 0; l < ME_PYRAMID_LEVELS; l++) {
+        kvz_image_free(list->pyramids[i][l]);
+        list->pyramids[i][l] = NULL;
+      }
+      kvz_threadqueue_free_job(&list->pyramid_jobs[i]);
+      kvz_subpel_planes_free(&list->subpel_planes[i]);
     }
   }
 
@@ -88,11 +102,17 @@ int kvz_image_list_destroy(image_list_t *list)
     free(list->cu_arrays);
     free(list->pocs);
     free(list->ref_LXs);
+    free(list->pyramids);
+    free(list->pyramid_jobs);
+    free(list->subpel_planes);
   }
   list->images = NULL;
   list->cu_arrays = NULL;
   list->pocs = NULL;
   list->ref_LXs = NULL;
+  list->pyramids = NULL;
+  list->pyramid_jobs = NULL;
+  list->subpel_planes = NULL;
   free(list);
   return 1;
 }
@@ -101,9 +121,15 @@ int kvz_image_list_destroy(image_list_t *list)
  * \brief Add picture to the front of the picturelist
  * \param pic picture pointer to add
  * \param picture_list list to use
+ * \param pyramid downscaled pictures of the picture, may contain NULLs
+ * \param pyramid_job job after which the pyramid is done or NULL
+ * \param subpel_planes interpolated planes of the picture or NULL
  * \return 1 on success
  */
-int kvz_image_list_add(image_list_t *list, kvz_picture *im, cu_array_t *cua, int32_t poc, uint8_t ref_LX[2][16])
+int kvz_image_list_add(image_list_t *list, kvz_picture *im, cu_array_t *cua, int32_t poc, uint8_t ref_LX[2][16],
+                       kvz_picture *pyramid[ME_PYRAMID_LEVELS],
+                       threadqueue_job_t *pyramid_job,
+                       subpel_planes_t *subpel_planes)
 {
   int i = 0;
   if (KVZ_ATOMIC_INC(&(im->refcount)) == 1) {
@@ -131,6 +157,11 @@ int kvz_image_list_add(image_list_t *list, kvz_picture *im, cu_array_t *cua, int
       list->ref_LXs[i][0][j] = list->ref_LXs[i - 1][0][j];
       list->ref_LXs[i][1][j] = list->ref_LXs[i - 1][1][j];
     }
+    for (int l = 0; l < ME_PYRAMID_LEVELS; l++) {
+      list->pyramids[i][l] = list->pyramids[i - 1][l];
+    }
+    list->pyramid_jobs[i] = list->pyramid_jobs[i - 1];
+    list->subpel_planes[i] = list->subpel_planes[i - 1];
   }
 
   list->images[0] = im;
@@ -140,6 +171,11 @@ int kvz_image_list_add(image_list_t *list, kvz_picture *im, cu_array_t *cua, int
     list->ref_LXs[0][0][j] = ref_LX[0][j];
     list->ref_LXs[0][1][j] = ref_LX[1][j];
   }
+  for (int l = 0; l < ME_PYRAMID_LEVELS; l++) {
+    list->pyramids[0][l] = pyramid[l] ? kvz_image_copy_ref(pyramid[l]) : NULL;
+  }
+  list->pyramid_jobs[0] = pyramid_job ? kvz_threadqueue_copy_ref(pyramid_job) : NULL;
+  list->subpel_planes[0] = subpel_planes ? kvz_subpel_planes_copy_ref(subpel_planes) : NULL;
   
   list->used_size++;
   return 1;
@@ -163,6 +199,13 @@ int kvz_image_list_rem(image_list_t * const list, const unsigned n)
 
   kvz_cu_array_free(&list->cu_arrays[n]);
 
+  for (int l = 0; l < ME_PYRAMID_LEVELS; l++) {
+    kvz_image_free(list->pyramids[n][l]);
+  }
+  kvz_threadqueue_free_job(&list->pyramid_jobs[n]);
+
+  kvz_subpel_planes_free(&list->subpel_planes[n]);
+
   // The last item is easy to remove
   if (n == list->used_size - 1) {
     list->images[n] = NULL;
@@ -172,6 +215,11 @@ int kvz_image_list_rem(image_list_t * const list, const unsigned n)
       list->ref_LXs[n][0][j] = 0;
       list->ref_LXs[n][1][j] = 0;
     }
+    for (int l = 0; l < ME_PYRAMID_LEVELS; l++) {
+      list->pyramids[n][l] = NULL;
+    }
+    list->pyramid_jobs[n] = NULL;
+    list->subpel_planes[n] = NULL;
     list->used_size--;
   } else {
     int i = n;
@@ -184,6 +232,11 @@ int kvz_image_list_rem(image_list_t * const list, const unsigned n)
         list->ref_LXs[i][0][j] = list->ref_LXs[i + 1][0][j];
         list->ref_LXs[i][1][j] = list->ref_LXs[i + 1][1][j];
       }
+      for (int l = 0; l < ME_PYRAMID_LEVELS; l++) {
+        list->pyramids[i][l] = list->pyramids[i + 1][l];
+      }
+      list->pyramid_jobs[i] = list->pyramid_jobs[i + 1];
+      list->subpel_planes[i] = list->subpel_planes[i + 1];
     }
     list->images[list->used_size - 1] = NULL;
     list->cu_arrays[list->used_size - 1] = NULL;
@@ -192,6 +245,11 @@ int kvz_image_list_rem(image_list_t * const list, const unsigned n)
       list->ref_LXs[list->used_size - 1][0][j] = 0;
       list->ref_LXs[list->used_size - 1][1][j] = 0;
     }
+    for (int l = 0; l < ME_PYRAMID_LEVELS; l++) {
+      list->pyramids[list->used_size - 1][l] = NULL;
+    }
+    list->pyramid_jobs[list->used_size - 1] = NULL;
+    list->subpel_planes[list->used_size - 1] = NULL;
     list->used_size--;
   }
 
@@ -205,7 +263,9 @@ int kvz_image_list_copy_contents(image_list_t *target, image_list_t *source) {
   }
   
   for (i = source->used_size - 1; i >= 0; --i) {
-    kvz_image_list_add(target, source->images[i], source->cu_arrays[i], source->pocs[i], source->ref_LXs[i]);
+    kvz_image_list_add(target, source->images[i], source->cu_arrays[i], source->pocs[i], source->ref_LXs[i],
+                       source->pyramids[i], source->pyramid_jobs[i],
+                       source->subpel_planes[i]);
   }
   return 1;
 }
@@ -29,6 +29,7 @@
 #include "cu.h"
 #include "global.h" // IWYU pragma: keep
 #include "kvazaar.h"
+#include "threadqueue.h"
 
 
 /**
@@ -40,6 +41,12 @@ typedef struct
   cu_array_t* *cu_arrays;
   int32_t *pocs;
   uint8_t (*ref_LXs)[2][16]; //!< L0 and L1 reference index list for each image
+  //! Downscaled source luma of each image for pyramid motion estimation, or NULLs
+  struct kvz_picture* (*pyramids)[ME_PYRAMID_LEVELS];
+  //! Job after which the pyramid of each image is done, or NULL
+  threadqueue_job_t* *pyramid_jobs;
+  //! Interpolated luma planes of each image for fractional motion estimation, or NULL
+  struct subpel_planes_t* *subpel_planes;
   uint32_t size;       //!< \brief Array size.
   uint32_t used_size;
 
@@ -49,7 +56,10 @@ typedef struct
 image_list_t * kvz_image_list_alloc(int size);
 int kvz_image_list_resize(image_list_t *list, unsigned size);
 int kvz_image_list_destroy(image_list_t *list);
-int kvz_image_list_add(image_list_t *list, kvz_picture *im, cu_array_t* cua, int32_t poc, uint8_t ref_LX[2][16]);
+int kvz_image_list_add(image_list_t *list, kvz_picture *im, cu_array_t* cua, int32_t poc, uint8_t ref_LX[2][16],
+                       kvz_picture *pyramid[ME_PYRAMID_LEVELS],
+                       threadqueue_job_t *pyramid_job,
+                       struct subpel_planes_t *subpel_planes);
 int kvz_image_list_rem(image_list_t *list, unsigned n);
 
 int kvz_image_list_copy_contents(image_list_t *target, image_list_t *source);
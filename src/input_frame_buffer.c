@@ -33,6 +33,8 @@ void kvz_init_input_frame_buffer(input_frame_buffer_t *input_buffer)
   input_buffer->num_out = 0;
   input_buffer->delay = 0;
   input_buffer->gop_skipped = 0;
+  input_buffer->seq_start = 0;
+  input_buffer->scenecut_num = -1;
 }
 
 /**
@@ -41,17 +43,25 @@ void kvz_init_input_frame_buffer(input_frame_buffer_t *input_buffer)
  * Returns the image that should be encoded next if there is a suitable
  * image available.
  *
+ * If scenecut is set or img_in requests an IDR picture, img_in starts a
+ * new coded video sequence. The pictures before it are output as at the
+ * end of the input and the GOP structure is restarted from img_in, which is
+ * coded as an IDR picture. Scene cuts less than a GOP after the start of
+ * the current sequence are ignored.
+ *
  * The caller must not modify img_in after calling this function.
  *
- * \param buf     an input frame buffer
- * \param state   a main encoder state
- * \param img_in  input frame or NULL
- * \return        pointer to the next picture, or NULL if no picture is
- *                available
+ * \param buf       an input frame buffer
+ * \param state     a main encoder state
+ * \param img_in    input frame or NULL
+ * \param scenecut  whether img_in starts a new scene
+ * \return          pointer to the next picture, or NULL if no picture is
+ *                  available
  */
 kvz_picture* kvz_encoder_feed_frame(input_frame_buffer_t *buf,
                                     encoder_state_t *const state,
-                                    kvz_picture *const img_in)
+                                    kvz_picture *const img_in,
+                                    bool scenecut)
 {
   const encoder_control_t* const encoder = state->encoder_control;
   const kvz_config* const cfg = &encoder->cfg;
@@ -63,21 +73,41 @@ kvz_picture* kvz_encoder_feed_frame(input_frame_buffer_t *buf,
   // Check for closed gop, we need an extra frame in the buffer in this case
   if (!cfg->open_gop && cfg->intra_period > 0 && cfg->gop_len > 0) is_closed_gop = true;
 
+  // Number of pictures needed before the first picture of a sequence can
+  // be output.
+  const int64_t gop_frames = cfg->gop_len + (is_closed_gop ? 1 : 0);
+
+  // Start a new sequence from img_in, unless the current sequence is too
+  // short or the previous scene cut is still being handled. Requested IDR
+  // pictures only need a picture before them in the current sequence.
+  const bool force_idr = img_in != NULL && img_in->frame_type == KVZ_FRAME_IDR;
+  const int64_t min_seq_len = force_idr ? 1 : MAX(gop_frames, 1);
+  const bool start_seq = img_in != NULL &&
+                         (scenecut || force_idr) &&
+                         buf->scenecut_num < 0 &&
+                         (int64_t)(buf->num_in - buf->seq_start) >= min_seq_len;
+
   if (cfg->gop_len == 0 || cfg->gop_lowdelay) {
     // No reordering of output pictures necessary.
 
     if (img_in == NULL) return NULL;
 
+    if (start_seq) {
+      buf->seq_start = buf->num_out;
+    }
+
     img_in->dts = img_in->pts;
     state->frame->gop_offset = 0;
     if (cfg->gop_len > 0) {
       // Using a low delay GOP structure.
-      uint64_t frame_num = buf->num_out;
+      uint64_t frame_num = buf->num_out - buf->seq_start;
       if (cfg->intra_period) {
         frame_num %= cfg->intra_period;
       }
       state->frame->gop_offset = (frame_num + cfg->gop_len - 1) % cfg->gop_len;
     }
+    state->frame->seq_num = (int32_t)(buf->num_out - buf->seq_start);
+    state->frame->input_num = buf->num_out;
     buf->num_in++;
     buf->num_out++;
     return kvz_image_copy_ref(img_in);
@@ -97,24 +127,45 @@ kvz_picture* kvz_encoder_feed_frame(input_frame_buffer_t *buf,
     assert(buf->pic_buffer[buf_idx] == NULL);
     buf->pic_buffer[buf_idx] = kvz_image_copy_ref(img_in);
     buf->pts_buffer[buf_idx] = img_in->pts;
+    if (start_seq) {
+      buf->scenecut_num = buf->num_in;
+    }
     buf->num_in++;
 
-    if (buf->num_in < cfg->gop_len + is_closed_gop ? 1 : 0) {
-      // Not enough frames to start output.
-      return 0;
-
-    } else if (buf->num_in == cfg->gop_len + is_closed_gop ? 1 : 0) {
+    if (buf->num_in == gop_frames) {
       // Now we known the PTSs that are needed to compute the delay.
       buf->delay = buf->pts_buffer[gop_buf_size - 1] - img_in->pts;
     }
   }
 
-  if (buf->num_out == buf->num_in) {
+  if (buf->scenecut_num >= 0 && buf->num_out == (uint64_t)buf->scenecut_num) {
+    // All pictures of the previous sequence have been output.
+    buf->seq_start = buf->scenecut_num;
+    buf->scenecut_num = -1;
+    buf->gop_skipped = 0;
+  }
+
+  // Number of pictures of the current sequence input and output. Pictures
+  // after a pending scene cut belong to the next sequence.
+  const uint64_t seq_end = buf->scenecut_num >= 0 ? (uint64_t)buf->scenecut_num : buf->num_in;
+  const int64_t seq_in  = seq_end - buf->seq_start;
+  const int64_t seq_out = buf->num_out - buf->seq_start;
+
+  // Whether the rest of the sequence is output without waiting for more
+  // pictures.
+  const bool seq_ending = img_in == NULL || buf->scenecut_num >= 0;
+
+  if (seq_out == seq_in) {
     // All frames returned.
     return NULL;
   }
 
-  if (img_in == NULL && buf->num_in < cfg->gop_len + is_closed_gop ? 1 : 0) {
+  if (!seq_ending && seq_in < gop_frames) {
+    // Not enough frames to start output.
+    return NULL;
+  }
+
+  if (img_in == NULL && buf->num_in < gop_frames) {
     // End of the sequence but we have less than a single GOP of frames. Use
     // the difference between the PTSs of the first and the last frame as the
     // delay.
@@ -123,9 +174,9 @@ kvz_picture* kvz_encoder_feed_frame(input_frame_buffer_t *buf,
     buf->delay = buf->pts_buffer[first_pic_idx] - buf->pts_buffer[last_pic_idx];
   }
 
-  // Index of the next output picture, in range [-1, +inf). Values
-  // i and j refer to the same indices in buf->pic_buffer iff
-  // i === j (mod gop_buf_size).
+  // Index of the next output picture in the sequence, in range [-1, +inf).
+  // Values i and j refer to the same indices in buf->pic_buffer iff
+  // seq_start + i === seq_start + j (mod gop_buf_size).
   int64_t idx_out;
 
   // DTS of the output picture.
@@ -134,37 +185,36 @@ kvz_picture* kvz_encoder_feed_frame(input_frame_buffer_t *buf,
   // Number of the next output picture in the GOP.
   int gop_offset;
 
-  if (buf->num_out == 0) {
-    // Output the first frame.
+  if (seq_out == 0) {
+    // Output the first frame of the sequence.
     idx_out = -1;
-    dts_out = buf->pts_buffer[gop_buf_size - 1] + buf->delay;
     gop_offset = 0; // highest quality picture
 
   } else {
-    gop_offset = (buf->num_out - 1) % cfg->gop_len;
+    gop_offset = (seq_out - 1) % cfg->gop_len;
     
     // For closed gop, calculate the gop_offset again
     if (!cfg->open_gop && cfg->intra_period > 0) {
       // Offset the GOP position for each extra I-frame added to the structure
       // in closed gop case
-      int num_extra_frames = (buf->num_out - 1) / (cfg->intra_period + 1);
-      gop_offset = (buf->num_out - 1 - num_extra_frames) % cfg->gop_len;
+      int num_extra_frames = (seq_out - 1) / (cfg->intra_period + 1);
+      gop_offset = (seq_out - 1 - num_extra_frames) % cfg->gop_len;
     }
 
     // Index of the first picture in the GOP that is being output.
-    int gop_start_idx = buf->num_out - 1 - gop_offset;
+    int gop_start_idx = seq_out - 1 - gop_offset;
 
     // Skip pictures until we find an available one.
     gop_offset += buf->gop_skipped;
 
     // Every closed-gop IRAP handled here
-    if (is_closed_gop && (!cfg->open_gop && ((buf->num_out - 1) % (cfg->intra_period + 1)) == cfg->intra_period)) {
+    if (is_closed_gop && (!cfg->open_gop && ((seq_out - 1) % (cfg->intra_period + 1)) == cfg->intra_period)) {
       idx_out = gop_start_idx;
     } else {
       for (;;) {
-        assert(gop_offset < cfg->gop_len + is_closed_gop ? 1 : 0);
+        assert(gop_offset < gop_frames);
         idx_out = gop_start_idx + cfg->gop[gop_offset].poc_offset - 1;
-        if (idx_out < buf->num_in - 1) {
+        if (idx_out < seq_in - 1) {
           // An available picture found.
           break;
         }
@@ -172,26 +222,32 @@ kvz_picture* kvz_encoder_feed_frame(input_frame_buffer_t *buf,
         gop_offset++;
       }
     }
+  }
 
-    if (buf->num_out < cfg->gop_len - 1) {
-      // This picture needs a DTS that is less than the PTS of the first
-      // frame so the delay must be applied.
-      int dts_idx = buf->num_out - 1;
-      dts_out = buf->pts_buffer[dts_idx % gop_buf_size] + buf->delay;
-    } else {
-      int dts_idx = buf->num_out - (cfg->gop_len - 1);
-      dts_out = buf->pts_buffer[dts_idx % gop_buf_size];
-    }
+  // DTS values run over sequences so they stay increasing across scene
+  // cuts.
+  if (buf->num_out == 0) {
+    dts_out = buf->pts_buffer[gop_buf_size - 1] + buf->delay;
+  } else if (buf->num_out < cfg->gop_len - 1) {
+    // This picture needs a DTS that is less than the PTS of the first
+    // frame so the delay must be applied.
+    int dts_idx = buf->num_out - 1;
+    dts_out = buf->pts_buffer[dts_idx % gop_buf_size] + buf->delay;
+  } else {
+    int dts_idx = buf->num_out - (cfg->gop_len - 1);
+    dts_out = buf->pts_buffer[dts_idx % gop_buf_size];
   }
 
   // Index in buf->pic_buffer and buf->pts_buffer.
-  int buf_idx = (idx_out + gop_buf_size) % gop_buf_size;
+  int buf_idx = ((int64_t)buf->seq_start + idx_out + gop_buf_size) % gop_buf_size;
 
   kvz_picture* next_pic = buf->pic_buffer[buf_idx];
   assert(next_pic != NULL);
   next_pic->dts = dts_out;
   buf->pic_buffer[buf_idx] = NULL;
   state->frame->gop_offset = gop_offset;
+  state->frame->seq_num = (int32_t)seq_out;
+  state->frame->input_num = buf->seq_start + idx_out + 1;
 
   buf->num_out++;
   return next_pic;
@@ -60,12 +60,30 @@ typedef struct input_frame_buffer_t {
    */
   int gop_skipped;
 
+  /** \brief Number of the input picture that started the current coded
+   * video sequence.
+   *
+   * This is zero unless a scene cut has restarted the sequence. Since all
+   * pictures of the previous sequence have been output before the new one
+   * is started, this is also the number of pictures output before the
+   * sequence.
+   */
+  uint64_t seq_start;
+
+  /** \brief Number of the input picture that starts the next coded video
+   * sequence, or -1 if no scene cut is pending.
+   *
+   * The pictures before it are output as at the end of the input.
+   */
+  int64_t scenecut_num;
+
 } input_frame_buffer_t;
 
 void kvz_init_input_frame_buffer(input_frame_buffer_t *input_buffer);
 
 kvz_picture* kvz_encoder_feed_frame(input_frame_buffer_t *buf,
                                     struct encoder_state_t *const state,
-                                    struct kvz_picture *const img_in);
+                                    struct kvz_picture *const img_in,
+                                    bool scenecut);
 
 #endif // INPUT_FRAME_BUFFER_H_
@@ -35,25 +35,58 @@
 #include "image.h"
 #include "input_frame_buffer.h"
 #include "kvazaar_internal.h"
+#include "lookahead.h"
+#include "rc_stats.h"
 #include "strategyselector.h"
 #include "threadqueue.h"
 #include "videoframe.h"
 
+/**
+ * \brief Fraction of worker time spent idle above which the OWF depth is
+ * increased.
+ */
+#define OWF_IDLE_GROW 0.10
+
+/**
+ * \brief Fraction of worker time spent idle below which the OWF depth may
+ * be decreased.
+ */
+#define OWF_IDLE_SHRINK 0.02
+
+/**
+ * \brief Number of ready jobs per worker thread above which the OWF depth
+ * may be decreased.
+ */
+#define OWF_READY_SHRINK 2
+
 
 static void kvazaar_close(kvz_encoder *encoder)
 {
   if (encoder) {
     // The threadqueue must be stopped before freeing states.
     if (encoder->control) {
+      // The planes released by jobs would be leaked if the jobs did not run.
+      for (unsigned i = 0; encoder->states && i < encoder->num_encoder_states; ++i) {
+        threadqueue_job_t *job = encoder->states[i].frame
+          ? encoder->states[i].frame->subpel_planes_release_job
+          : NULL;
+        if (job) {
+          kvz_threadqueue_waitfor(encoder->control->threadqueue, job);
+        }
+      }
       kvz_threadqueue_stop(encoder->control->threadqueue);
     }
 
+    kvz_lookahead_free(encoder->lookahead);
+    encoder->lookahead = NULL;
+
     if (encoder->states) {
       // Flush input frame buffer.
       kvz_picture *pic = NULL;
       while ((pic = kvz_encoder_feed_frame(&encoder->input_buffer,
                                            &encoder->states[0],
-                                           NULL)) != NULL) {
+                                           NULL,
+                                           false)) != NULL) {
         kvz_image_free(pic);
         pic = NULL;
       }
@@ -96,11 +129,23 @@ static kvz_encoder * kvazaar_open(const kvz_config *cfg)
   encoder->num_encoder_states = encoder->control->cfg.owf + 1;
   encoder->cur_state_num = 0;
   encoder->out_state_num = 0;
+  encoder->frames_input = 0;
   encoder->frames_started = 0;
   encoder->frames_done = 0;
+  encoder->owf_depth = encoder->control->owf_start;
+  encoder->owf_idle_time = 0;
+  KVZ_GET_TIME(&encoder->owf_sample_time);
 
   kvz_init_input_frame_buffer(&encoder->input_buffer);
 
+  if (encoder->control->cfg.lookahead > 0 || encoder->control->cfg.scenecut > 0 ||
+      encoder->control->cfg.crf > 0.0 || encoder->control->cfg.vbv_bufsize > 0) {
+    encoder->lookahead = kvz_lookahead_init(encoder->control);
+    if (!encoder->lookahead) {
+      goto kvazaar_open_failure;
+    }
+  }
+
   encoder->states = calloc(encoder->num_encoder_states, sizeof(encoder_state_t));
   if (!encoder->states) {
     goto kvazaar_open_failure;
@@ -135,6 +180,28 @@ kvazaar_open_failure:
 }
 
 
+static kvz_thread_pool * kvazaar_thread_pool_create(const kvz_config *cfg)
+{
+  // The number of CPUs used for --threads=auto is detected here.
+  if (!kvz_strategyselector_init(cfg->cpuid, KVZ_BIT_DEPTH)) {
+    fprintf(stderr, "Failed to initialize strategies.\n");
+    return NULL;
+  }
+
+  return kvz_encoder_thread_pool_init(cfg);
+}
+
+
+static int kvazaar_reconfigure(kvz_encoder *enc, const kvz_config *cfg)
+{
+  // Discard const from the pointer. The encoder states read the changed
+  // fields only when they start a new frame.
+  return kvz_encoder_control_reconfigure((encoder_control_t*)enc->control,
+                                         cfg,
+                                         enc->frames_started);
+}
+
+
 static void set_frame_info(kvz_frame_info *const info, const encoder_state_t *const state)
 {
   info->poc = state->frame->poc,
@@ -155,6 +222,16 @@ static void set_frame_info(kvz_frame_info *const info, const encoder_state_t *co
 
   info->ref_list_len[0] = state->frame->ref_LX_size[0];
   info->ref_list_len[1] = state->frame->ref_LX_size[1];
+
+  if (!state->frame->is_irap) {
+    info->irap_reason = KVZ_IRAP_NONE;
+  } else if (state->frame->num == 0) {
+    info->irap_reason = KVZ_IRAP_FIRST;
+  } else if (state->frame->seq_num == 0) {
+    info->irap_reason = KVZ_IRAP_SCENECUT;
+  } else {
+    info->irap_reason = KVZ_IRAP_PERIOD;
+  }
 }
 
 
@@ -222,6 +299,117 @@ static int yuv_io_extract_field(const kvz_picture *frame_in, unsigned source_sca
 }
 
 
+/**
+ * \brief Adjust the OWF depth to the load of the worker threads and wait
+ * until the next frame may be started.
+ *
+ * The depth is increased when the workers have no jobs of this encoder to
+ * run and decreased when they are busy and have plenty of jobs waiting.
+ * Idle time is measured for the queue of this encoder, so other encoders
+ * sharing the thread pool do not affect it. Encoder states are allocated
+ * for cfg.owf + 1 frames, cfg.owf being the upper bound of the depth, and
+ * used in the same order regardless of the depth, so the bitstream does not
+ * depend on it. The depth limits how many of them are being encoded at the
+ * same time and how many frames are started before a frame is output. It
+ * does not reduce the memory used by the states.
+ */
+static void kvazaar_adapt_owf(kvz_encoder *enc)
+{
+  const encoder_control_t * const ctrl = enc->control;
+  threadqueue_pool_t * const pool = kvz_threadqueue_pool(ctrl->threadqueue);
+  const int thread_count = kvz_threadqueue_pool_thread_count(pool);
+  if (thread_count == 0) {
+    // Frames are encoded one at a time anyway.
+    return;
+  }
+
+  KVZ_CLOCK_T now;
+  KVZ_GET_TIME(&now);
+  const double idle_time = kvz_threadqueue_idle_time(ctrl->threadqueue);
+  const double wall_time = KVZ_CLOCK_T_DIFF(enc->owf_sample_time, now);
+
+  if (wall_time > 0) {
+    const double idle_fraction =
+      (idle_time - enc->owf_idle_time) / (wall_time * thread_count);
+    const int ready_jobs = kvz_threadqueue_ready_count(ctrl->threadqueue);
+    // Keep the depth even with interlaced coding so that both fields of a
+    // frame are output by the same call.
+    const unsigned step = ctrl->cfg.source_scan_type != KVZ_INTERLACING_NONE ? 2 : 1;
+
+    if (idle_fraction > OWF_IDLE_GROW && enc->owf_depth + step <= ctrl->cfg.owf) {
+      enc->owf_depth += step;
+    } else if (idle_fraction < OWF_IDLE_SHRINK &&
+               ready_jobs > OWF_READY_SHRINK * thread_count &&
+               enc->owf_depth >= step) {
+      enc->owf_depth -= step;
+    }
+  }
+  enc->owf_idle_time = idle_time;
+  enc->owf_sample_time = now;
+
+  // Frames are completed in order, so waiting for the last frame that has
+  // to be completed leaves at most owf_depth frames in progress.
+  const unsigned in_progress = enc->frames_started - enc->frames_done;
+  if (in_progress > enc->owf_depth) {
+    const unsigned excess = in_progress - enc->owf_depth;
+    encoder_state_t *state =
+      &enc->states[(enc->out_state_num + excess - 1) % enc->num_encoder_states];
+    kvz_threadqueue_waitfor(ctrl->threadqueue, state->tqj_bitstream_written);
+  }
+}
+
+
+/**
+ * \brief Get the next frame to encode.
+ *
+ * With lookahead, input frames are passed to the input frame buffer only
+ * after they have gone through the lookahead, along with the scene cuts
+ * detected in them. At the end of the input, frames are passed on until
+ * there is a frame to encode.
+ *
+ * \param pic_in   input frame or NULL at the end of the input
+ * \param frame    Returns the next frame to encode or NULL
+ * \return 1 on success, 0 on failure
+ */
+static int kvazaar_next_frame(kvz_encoder *enc,
+                              encoder_state_t *state,
+                              kvz_picture *pic_in,
+                              kvz_picture **frame)
+{
+  if (!enc->lookahead) {
+    *frame = kvz_encoder_feed_frame(&enc->input_buffer, state, pic_in, false);
+    return 1;
+  }
+
+  if (pic_in && !kvz_lookahead_push(enc->lookahead, pic_in)) {
+    return 0;
+  }
+
+  *frame = NULL;
+  for (;;) {
+    bool scenecut = false;
+    kvz_picture *analyzed = kvz_lookahead_pop(enc->lookahead, pic_in == NULL, &scenecut);
+    if (!analyzed && pic_in) {
+      // The lookahead is not full yet.
+      break;
+    }
+
+    *frame = kvz_encoder_feed_frame(&enc->input_buffer, state, analyzed, scenecut);
+    kvz_image_free(analyzed);
+
+    if (*frame || pic_in || !analyzed) break;
+  }
+
+  if (*frame) {
+    kvz_lookahead_frame_free(&state->frame->lookahead);
+    state->frame->lookahead = kvz_lookahead_take(enc->lookahead, state->frame->input_num);
+    assert(state->frame->lookahead);
+  }
+
+  return 1;
+}
+
+
 static int kvazaar_encode(kvz_encoder *enc,
                           kvz_picture *pic_in,
                           kvz_data_chunk **data_out,
@@ -235,6 +423,33 @@ static int kvazaar_encode(kvz_encoder *enc,
   if (pic_out) *pic_out = NULL;
   if (src_out) *src_out = NULL;
 
+  if (pic_in != NULL && pic_in->roi.dqps != NULL) {
+    if (!enc->control->cfg.picture_roi) {
+      fprintf(stderr, "Delta QP maps of pictures require picture_roi.\n");
+      return 0;
+    }
+    if (pic_in->roi.width <= 0 || pic_in->roi.height <= 0) {
+      fprintf(stderr, "Delta QP map of a picture must have a positive size.\n");
+      return 0;
+    }
+  }
+
+  if (enc->control->cfg.pass == 2) {
+    // The bits of the second pass are allocated to the frames of the first.
+    const int32_t num_frames = kvz_rc_stats_num_frames(enc->control->rc_stats);
+    if (pic_in != NULL && enc->frames_input >= (unsigned)num_frames) {
+      fprintf(stderr, "Input has more frames than the stats file.\n");
+      return 0;
+    }
+    if (pic_in == NULL && enc->frames_input < (unsigned)num_frames) {
+      fprintf(stderr, "Input has fewer frames than the stats file.\n");
+      return 0;
+    }
+  }
+  if (pic_in != NULL) {
+    enc->frames_input += 1;
+  }
+
   encoder_state_t *state = &enc->states[enc->cur_state_num];
 
   if (!state->frame->prepared) {
@@ -246,9 +461,15 @@ static int kvazaar_encode(kvz_encoder *enc,
     CHECKPOINT_MARK("read source frame: %d", state->frame->num + enc->control->cfg.seek);
   }
 
-  kvz_picture* frame = kvz_encoder_feed_frame(&enc->input_buffer, state, pic_in);
+  kvz_picture* frame = NULL;
+  if (!kvazaar_next_frame(enc, state, pic_in, &frame)) {
+    return 0;
+  }
   if (frame) {
     assert(state->frame->num == enc->frames_started);
+    if (enc->control->cfg.owf_adaptive) {
+      kvazaar_adapt_owf(enc);
+    }
     // Start encoding.
     kvz_encode_one_frame(state, frame);
     enc->frames_started += 1;
@@ -264,9 +485,11 @@ static int kvazaar_encode(kvz_encoder *enc,
     enc->cur_state_num = (enc->cur_state_num + 1) % (enc->num_encoder_states);
   }
 
+  // The oldest frame is output once owf_depth frames have been started
+  // after it. With a fixed depth, this is when all encoder states are in use.
   encoder_state_t *output_state = &enc->states[enc->out_state_num];
   if (!output_state->frame->done &&
-      (pic_in == NULL || enc->cur_state_num == enc->out_state_num)) {
+      (pic_in == NULL || enc->frames_started - enc->frames_done > enc->owf_depth)) {
 
     kvz_threadqueue_waitfor(enc->control->threadqueue, output_state->tqj_bitstream_written);
     // The job pointer must be set to NULL here since it won't be usable after
@@ -280,6 +503,12 @@ static int kvazaar_encode(kvz_encoder *enc,
     if (src_out) *src_out = kvz_image_copy_ref(output_state->tile->frame->source);
     if (info_out) set_frame_info(info_out, output_state);
 
+    if (enc->control->cfg.pass == 1 &&
+        !kvz_rc_stats_write_frame(enc->control->rc_stats, output_state)) {
+      fprintf(stderr, "Failed to write stats file!\n");
+      return 0;
+    }
+
     output_state->frame->done = 1;
     output_state->frame->prepared = 0;
     enc->frames_done += 1;
@@ -291,6 +520,38 @@ static int kvazaar_encode(kvz_encoder *enc,
 }
 
 
+/**
+ * \brief Copy the parameters of an input frame to one of its fields.
+ *
+ * A requested IDR picture is started from the first field.
+ *
+ * \return 1 on success, 0 on failure
+ */
+static int copy_field_parameters(const kvz_picture *frame,
+                                 kvz_picture *field,
+                                 bool first)
+{
+  field->pts = frame->pts;
+  field->dts = frame->dts;
+  field->interlacing = frame->interlacing;
+
+  field->frame_type = first ? frame->frame_type : KVZ_FRAME_AUTO;
+  field->qp = frame->qp;
+  field->lambda = frame->lambda;
+
+  if (frame->roi.dqps) {
+    const size_t size = (size_t)frame->roi.width * frame->roi.height;
+    field->roi.dqps = MALLOC(int8_t, size);
+    if (!field->roi.dqps) return 0;
+    memcpy(field->roi.dqps, frame->roi.dqps, size * sizeof(int8_t));
+    field->roi.width  = frame->roi.width;
+    field->roi.height = frame->roi.height;
+  }
+
+  return 1;
+}
+
+
 static int kvazaar_field_encoding_adapter(kvz_encoder *enc,
                                           kvz_picture *pic_in,
                                           kvz_data_chunk **data_out,
@@ -324,15 +585,12 @@ static int kvazaar_field_encoding_adapter(kvz_encoder *enc,
 
     yuv_io_extract_field(pic_in, pic_in->interlacing, 0, first_field);
     yuv_io_extract_field(pic_in, pic_in->interlacing, 1, second_field);
-    
-    first_field->pts = pic_in->pts;
-    first_field->dts = pic_in->dts;
-    first_field->interlacing = pic_in->interlacing;
 
     // Should the second field have higher pts and dts? It shouldn't affect anything.
-    second_field->pts = pic_in->pts;
-    second_field->dts = pic_in->dts;
-    second_field->interlacing = pic_in->interlacing;
+    if (!copy_field_parameters(pic_in, first_field, true) ||
+        !copy_field_parameters(pic_in, second_field, false)) {
+      goto kvazaar_field_encoding_adapter_failure;
+    }
   }
 
   if (!kvazaar_encode(enc, first_field, &first.data_out, &first.len_out, pic_out, NULL, info_out)) {
@@ -392,6 +650,11 @@ static const kvz_api kvz_8bit_api = {
   .encoder_encode = kvazaar_field_encoding_adapter,
 
   .picture_alloc_csp = kvz_image_alloc,
+
+  .thread_pool_create = kvazaar_thread_pool_create,
+  .thread_pool_destroy = kvz_threadqueue_pool_free,
+
+  .encoder_reconfigure = kvazaar_reconfigure,
 };
 
 
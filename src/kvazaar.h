@@ -81,6 +81,13 @@ typedef uint16_t kvz_pixel;
  */
 typedef struct kvz_encoder kvz_encoder;
 
+/**
+ * \brief Opaque data structure representing a pool of worker threads.
+ *
+ * A pool may be shared by several encoders.
+ */
+typedef struct kvz_thread_pool kvz_thread_pool;
+
 /**
  * \brief Integer motion estimation algorithms.
  */
@@ -93,6 +100,7 @@ enum kvz_ime_algorithm {
   KVZ_IME_FULL32 = 5, //! \since 3.6.0
   KVZ_IME_FULL64 = 6, //! \since 3.6.0
   KVZ_IME_DIA = 7, // Experimental. TODO: change into a proper doc comment
+  KVZ_IME_PYRAMID = 8,
 };
 
 /**
@@ -106,6 +114,15 @@ enum kvz_interlacing
   KVZ_INTERLACING_BFF = 2, // bottom field first
 };
 
+/**
+ * \brief Frame types that can be requested for input pictures.
+ */
+enum kvz_frame_type
+{
+  KVZ_FRAME_AUTO = 0, //!< Let the encoder choose the type.
+  KVZ_FRAME_IDR  = 1, //!< Start a new coded video sequence with an IDR picture.
+};
+
 /**
 * \brief Constrain movement vectors.
 * \since 3.3.0
@@ -207,12 +224,30 @@ enum kvz_sao {
   KVZ_SAO_FULL = 3
 };
 
+/**
+ * \brief Adaptive quantization modes.
+ */
+enum kvz_aq {
+  KVZ_AQ_OFF = 0,
+  KVZ_AQ_VARIANCE = 1, /*!< \brief QP follows the luma variance of CUs. */
+};
+
 enum kvz_scalinglist {
   KVZ_SCALING_LIST_OFF = 0,
   KVZ_SCALING_LIST_CUSTOM = 1,
   KVZ_SCALING_LIST_DEFAULT = 2,  
 };
 
+/**
+ * \brief Placement of worker threads on CPUs.
+ */
+enum kvz_thread_affinity {
+  KVZ_THREAD_AFFINITY_NONE = 0,    /*!< \brief Let the OS place the threads. */
+  KVZ_THREAD_AFFINITY_COMPACT = 1, /*!< \brief Fill one core and socket before the next. */
+  KVZ_THREAD_AFFINITY_SCATTER = 2, /*!< \brief Spread threads over sockets and cores. */
+  KVZ_THREAD_AFFINITY_LIST = 3,    /*!< \brief Pin threads to thread_affinity_cpus in order. */
+};
+
 // Map from input format to chroma format.
 #define KVZ_FORMAT2CSP(format) ((enum kvz_chroma_format)"\0\1\2\3"[format])
 
@@ -384,6 +419,179 @@ typedef struct kvz_config
   /** \brief Type of scaling lists to use */
   int8_t scaling_list;
 
+  /** \brief How worker threads are placed on CPUs. See kvz_thread_affinity. */
+  int8_t thread_affinity;
+  /** \brief CPUs used with KVZ_THREAD_AFFINITY_LIST. */
+  int32_t *thread_affinity_cpus;
+  int32_t thread_affinity_cpus_count;
+
+  /**
+   * \brief NUMA node whose CPUs the worker threads run on. -1 to disable.
+   *
+   * Memory is not bound to the node.
+   */
+  int32_t numa_node;
+
+  /**
+   * \brief Pool of worker threads to use, or NULL to create one.
+   *
+   * When set, options threads, thread_affinity and numa_node are ignored
+   * and the settings of the pool are used instead.
+   */
+  kvz_thread_pool *thread_pool;
+
+  /**
+   * \brief File to write a trace of the thread queue activity to, or NULL.
+   *
+   * The trace is in the Chrome trace event format.
+   */
+  char *trace_file;
+
+  /**
+   * \brief Pass of two-pass rate control.
+   *
+   * 0 for single pass encoding. The first pass writes statistics to
+   * stats_file and the second pass reads them. The second pass must encode
+   * the same frames with the same GOP and intra period.
+   */
+  int8_t pass;
+
+  /**
+   * \brief Statistics file of two-pass rate control, or NULL.
+   */
+  char *stats_file;
+
+  /**
+   * \brief Adjust the number of frames encoded in parallel at runtime.
+   *
+   * The number starts from owf and is varied between 0 and owf_max
+   * depending on how busy the worker threads of this encoder are. The
+   * number of frames started before a frame is output follows it. Memory
+   * is allocated for owf_max and the rate control lags behind by owf_max
+   * frames as with a fixed owf equal to owf_max.
+   */
+  int8_t owf_adaptive;
+
+  /**
+   * \brief Distance in LCUs to the right and down in the reference
+   * picture that motion vectors may refer to when using WPP with OWF.
+   *
+   * Each LCU waits until the LCU at this distance has been completed in
+   * the reference picture. A smaller window lets more frames be encoded in
+   * parallel and a larger one allows longer motion vectors. -1 selects the
+   * window from the motion estimation search range.
+   */
+  int32_t inter_ref_window_right;
+  int32_t inter_ref_window_down;
+
+  /**
+   * \brief Search the reference pictures of large prediction units in
+   * separate jobs.
+   *
+   * Lets more threads work on the same LCU. Only used with worker threads.
+   */
+  int8_t me_ref_jobs;
+
+  /**
+   * \brief Number of frames analyzed ahead of the frame being encoded.
+   *
+   * 0 disables the lookahead.
+   */
+  int32_t lookahead;
+
+  /**
+   * \brief Downscaling factor of the lookahead analysis, 2 or 4.
+   */
+  int8_t lookahead_scale;
+
+  /**
+   * \brief Scene cut detection threshold.
+   *
+   * A frame is coded as an IDR picture starting a new GOP if its estimated
+   * inter cost is at least (100 - scenecut) percent of its intra cost.
+   * 0 disables scene cut detection. Uses the lookahead analysis.
+   */
+  int32_t scenecut;
+
+  /**
+   * \brief Lower the QP of blocks that are referenced by the frames coded
+   * after them.
+   *
+   * The QP offsets are estimated by propagating the lookahead costs over
+   * the GOP references in reverse coding order. Requires the lookahead.
+   */
+  int8_t cutree;
+
+  /** \brief Adaptive quantization mode. See kvz_aq. */
+  int8_t aq;
+
+  /**
+   * \brief Strength of adaptive quantization.
+   *
+   * The QP offset of a CU changes by this much when the variance of the CU
+   * doubles.
+   */
+  double aq_strength;
+
+  /**
+   * \brief Maximum rate at which the decoder buffer is filled in bits per
+   * second.
+   *
+   * Enables the VBV buffer model together with vbv_bufsize. Zero disables
+   * the model. The buffer is signalled with HRD parameters but the stream
+   * is not guaranteed to conform to them if a picture does not fit in the
+   * buffer even at the highest QP.
+   */
+  uint32_t vbv_maxrate;
+
+  /**
+   * \brief Size of the decoder buffer in bits.
+   */
+  uint32_t vbv_bufsize;
+
+  /**
+   * \brief Constant rate factor.
+   *
+   * Sets the QP of each frame from this value and the complexity of the
+   * frame estimated by the lookahead. Zero disables constant rate factor
+   * coding.
+   */
+  double crf;
+
+  /**
+   * \brief Whether input pictures may carry delta QP maps.
+   *
+   * Enables signaling a QP for each LCU so that kvz_picture::roi can be
+   * used.
+   */
+  int8_t picture_roi;
+
+  /**
+   * \brief Interpolate each reference frame once for fractional motion
+   * estimation.
+   *
+   * The quarter-pixel luma planes of reference frames are computed one LCU
+   * row at a time and kept with the frames. Does not change the output.
+   */
+  int8_t subme_cache;
+
+  /**
+   * \brief Reuse the motion vectors found for other PUs of the same LCU.
+   *
+   * The best vectors found for each 8x8 block of an LCU are used as
+   * starting points for the PUs overlapping the block and may end the
+   * integer search of a PU early.
+   */
+  int8_t me_cache;
+
+  /**
+   * \brief Upper bound of the OWF depth when owf_adaptive is set.
+   *
+   * The bitstream is the same as with a fixed owf equal to this value.
+   * -1 selects max(2 * owf, owf + 1).
+   */
+  int32_t owf_max;
+
 } kvz_config;
 
 /**
@@ -414,6 +622,33 @@ typedef struct kvz_picture {
   enum kvz_chroma_format chroma_format;
 
   int32_t ref_pocs[16];
+
+  /**
+   * \brief Frame type requested for an input picture.
+   *
+   * An IDR request is ignored while the pictures before the previous IDR
+   * picture started by a request or a scene cut are still being output.
+   */
+  enum kvz_frame_type frame_type;
+
+  int32_t qp;              //!< \brief QP of an input picture, or -1 to let the encoder choose it.
+  double lambda;           //!< \brief Lambda of an input picture, or 0 to derive it from the QP.
+
+  /**
+   * \brief Map of delta QPs of an input picture for region of interest
+   * coding, or NULL.
+   *
+   * The map divides the picture into width times height blocks in raster
+   * order. The delta QPs are added to those of kvz_config::roi. Requires
+   * kvz_config::picture_roi.
+   *
+   * The map must be allocated with malloc. It is freed by picture_free.
+   */
+  struct {
+    int32_t width;
+    int32_t height;
+    int8_t *dqps;
+  } roi;
 } kvz_picture;
 
 /**
@@ -486,6 +721,16 @@ enum kvz_slice_type {
   KVZ_SLICE_I = 2,
 };
 
+/**
+ * \brief Reason for coding a frame as an IRAP picture.
+ */
+enum kvz_irap_reason {
+  KVZ_IRAP_NONE = 0,     /*!< \brief Not an IRAP picture. */
+  KVZ_IRAP_FIRST = 1,    /*!< \brief First frame of the sequence. */
+  KVZ_IRAP_PERIOD = 2,   /*!< \brief Intra period. */
+  KVZ_IRAP_SCENECUT = 3, /*!< \brief Scene cut detected by the lookahead. */
+};
+
 /**
  * \brief Other information about an encoded frame
  */
@@ -524,6 +769,11 @@ typedef struct kvz_frame_info {
    */
   int ref_list_len[2];
 
+  /**
+   * \brief Reason for coding the frame as an IRAP picture
+   */
+  enum kvz_irap_reason irap_reason;
+
 } kvz_frame_info;
 
 /**
@@ -701,6 +951,57 @@ typedef struct kvz_api {
    * \return        allocated picture, or NULL if allocation failed.
    */
   kvz_picture * (*picture_alloc_csp)(enum kvz_chroma_format chroma_fomat, int32_t width, int32_t height);
+
+  /**
+   * \brief Create a pool of worker threads.
+   *
+   * The pool can be shared by several encoders by setting the thread_pool
+   * field of their configs. The encoders take turns in running their jobs
+   * on the threads of the pool.
+   *
+   * The number of threads and their placement are taken from options
+   * threads, thread_affinity and numa_node of the given config.
+   *
+   * The returned pool should be deallocated by calling thread_pool_destroy.
+   *
+   * \param cfg   configuration
+   * \return      created pool, or NULL if creation failed.
+   */
+  kvz_thread_pool * (*thread_pool_create)(const kvz_config *cfg);
+
+  /**
+   * \brief Deallocate a pool of worker threads.
+   *
+   * If pool is NULL, do nothing. Otherwise, the pool must have been
+   * returned from thread_pool_create and all encoders using it must have
+   * been closed.
+   */
+  void          (*thread_pool_destroy)(kvz_thread_pool *pool);
+
+  /**
+   * \brief Change the configuration of an encoder.
+   *
+   * Applies target_bitrate, vbv_maxrate, qp, crf, rdo, ime_algorithm,
+   * pu_depth_inter and pu_depth_intra of cfg to the frames that are started
+   * after this call. The frames that are already being encoded are not
+   * affected and are not flushed. Other fields of cfg are ignored.
+   *
+   * The configuration is rejected if it would enable or disable rate
+   * control, crf or VBV, or change vbv_bufsize. vbv_maxrate can be changed
+   * only if framerate_num is zero. Otherwise the rate is signalled in the
+   * HRD parameters of the SPS. target_bitrate and vbv_maxrate must not
+   * exceed the maximum bitrate of the level the encoder was opened with.
+   * The configuration is also rejected if ime_algorithm searches further
+   * than the motion estimation the encoder was opened with. ime_algorithm
+   * can be changed to pyramid or to a full search only if the encoder was
+   * opened with the same kind of search. Two-pass encoding cannot be
+   * reconfigured. When a delta QP map is used, qp is ignored.
+   *
+   * \param encoder   encoder
+   * \param cfg       new configuration
+   * \return          1 on success, 0 if the configuration was rejected.
+   */
+  int           (*encoder_reconfigure)(kvz_encoder *encoder, const kvz_config *cfg);
 } kvz_api;
 
 
@@ -30,6 +30,7 @@
 
 #include "kvazaar.h"
 #include "input_frame_buffer.h"
+#include "threads.h"
 
 
 // Forward declarations.
@@ -59,8 +60,38 @@ struct kvz_encoder {
    */
   input_frame_buffer_t input_buffer;
 
+  /**
+   * \brief Lookahead, or NULL if it is not used.
+   */
+  struct lookahead_t *lookahead;
+
+  /**
+   * \brief Number of frames input to the encoder.
+   */
+  unsigned frames_input;
+
   unsigned frames_started;
   unsigned frames_done;
+
+  /**
+   * \brief Number of frames that may be encoded in parallel with the
+   * oldest frame in progress.
+   *
+   * Equal to cfg.owf unless cfg.owf_adaptive is set, in which case it is
+   * varied between 0 and cfg.owf starting from control->owf_start.
+   */
+  unsigned owf_depth;
+
+  /**
+   * \brief Idle time of the worker threads with respect to the queue of
+   * this encoder when owf_depth was last adjusted.
+   */
+  double owf_idle_time;
+
+  /**
+   * \brief Time when owf_depth was last adjusted.
+   */
+  KVZ_CLOCK_T owf_sample_time;
 };
 
 #endif // KVAZAAR_INTERNAL_H_
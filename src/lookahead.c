@@ -0,0 +1,1083 @@
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2013-2015 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * Kvazaar is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+/*
+ * Lookahead analysis of input frames.
+ *
+ * Input frames go through the lookahead before they are passed to the
+ * input frame buffer. A frame stays in the lookahead until cfg.lookahead
+ * frames after it have been input, so the analysis of the following frames
+ * is available when it is encoded.
+ *
+ * Each frame is downscaled and the costs of intra and inter prediction are
+ * estimated for each block of the downscaled frame with SATD. The analysis
+ * is done in two jobs per frame. The first one downscales the frame and
+ * estimates intra costs. The second one estimates inter costs with a simple
+ * motion search from the previous frame in input order, so it depends on
+ * the first jobs of both frames. The jobs of consecutive frames run in
+ * parallel with each other and with the encoding of earlier frames.
+ *
+ * With cfg.cutree, the costs are also estimated against the nearest
+ * preceding and following reference of each frame in the GOP structure,
+ * once both of them have been input. When a frame leaves the lookahead, a
+ * job propagates the share of the cost of each block that is predicted
+ * from a reference backwards through the frames coded after it, from the
+ * last coded frame to the first one, like the macroblock tree of x264. The
+ * amount of information each block passes to the frames coded after it is
+ * converted into a QP offset. The coding order and the references follow
+ * the GOP structure from the first frame. Scene cuts and the extra
+ * pictures of closed GOPs are not taken into account.
+ */
+
+#include "lookahead.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "encoder.h"
+#include "encoderstate.h"
+#include "image.h"
+#include "strategies/strategies-picture.h"
+#include "threads.h"
+
+
+/**
+ * \brief Maximum distance of the motion vectors in downscaled pixels.
+ */
+#define LOOKAHEAD_SEARCH_RANGE 16
+
+/**
+ * \brief Maximum number of steps in the motion search.
+ */
+#define LOOKAHEAD_SEARCH_STEPS 16
+
+/**
+ * \brief Multiplier of the QP offsets from cost propagation.
+ *
+ * Equal to the default strength of the macroblock tree in x264.
+ */
+#define LOOKAHEAD_CUTREE_STRENGTH 2.0
+
+
+struct lookahead_t {
+  const encoder_control_t *encoder;
+
+  /**
+   * \brief Frames in input order that have not been taken by the encoder.
+   */
+  lookahead_frame_t **frames;
+  int32_t frames_size;
+  int32_t count;
+
+  /**
+   * \brief Number of frames at the start of frames that have been returned
+   * by kvz_lookahead_pop.
+   */
+  int32_t released;
+
+  /**
+   * \brief Number of frames input.
+   */
+  int64_t num_in;
+
+  /**
+   * \brief The frame input last, or NULL.
+   */
+  lookahead_frame_t *last;
+
+  /**
+   * \brief The frames input last, frame n at index n % KVZ_MAX_GOP_LENGTH.
+   *
+   * Keeps the preceding references of the frames alive after they have
+   * been taken by the encoder. Used with cfg.cutree.
+   */
+  lookahead_frame_t *recent[KVZ_MAX_GOP_LENGTH];
+};
+
+
+/**
+ * \brief Downscale the luma of the picture by averaging.
+ */
+static void lookahead_downscale(lookahead_frame_t *frame)
+{
+  const kvz_picture *pic = frame->pic;
+  const int scale = frame->scale;
+  const int width  = CEILDIV(pic->width, scale);
+  const int height = CEILDIV(pic->height, scale);
+  const int count  = scale * scale;
+
+  for (int y = 0; y < frame->lowres_height; y++) {
+    const int src_y = MIN(y, height - 1) * scale;
+    kvz_pixel *dst = &frame->lowres->y[y * frame->lowres_width];
+
+    for (int x = 0; x < frame->lowres_width; x++) {
+      const int src_x = MIN(x, width - 1) * scale;
+      int sum = 0;
+      for (int j = 0; j < scale; j++) {
+        const kvz_pixel *row = &pic->y[MIN(src_y + j, pic->height - 1) * pic->stride];
+        for (int i = 0; i < scale; i++) {
+          sum += row[MIN(src_x + i, pic->width - 1)];
+        }
+      }
+      dst[x] = (kvz_pixel)((sum + count / 2) / count);
+    }
+  }
+}
+
+
+/**
+ * \brief Estimate the cost of intra coding a block.
+ *
+ * The block is predicted with DC, planar, horizontal and vertical modes
+ * from the neighbouring pixels of the source.
+ *
+ * \return SATD of the best prediction
+ */
+static uint32_t lookahead_intra_cost(const lookahead_frame_t *frame, int x, int y)
+{
+  const int size = LOOKAHEAD_BLOCK_SIZE;
+  const int stride = frame->lowres_width;
+  const kvz_pixel *block = &frame->lowres->y[y * stride + x];
+
+  kvz_pixel top[LOOKAHEAD_BLOCK_SIZE];
+  kvz_pixel left[LOOKAHEAD_BLOCK_SIZE];
+  for (int i = 0; i < size; i++) {
+    if (y > 0) {
+      top[i] = block[i - stride];
+    } else if (x > 0) {
+      top[i] = block[-1];
+    } else {
+      top[i] = 1 << (KVZ_BIT_DEPTH - 1);
+    }
+    if (x > 0) {
+      left[i] = block[i * stride - 1];
+    } else {
+      left[i] = top[0];
+    }
+  }
+
+  ALIGNED(16) kvz_pixel pred[LOOKAHEAD_BLOCK_SIZE * LOOKAHEAD_BLOCK_SIZE];
+  uint32_t best_cost = UINT32_MAX;
+
+  // DC
+  int sum = 0;
+  for (int i = 0; i < size; i++) {
+    sum += top[i] + left[i];
+  }
+  for (int i = 0; i < size * size; i++) {
+    pred[i] = (kvz_pixel)((sum + size) / (2 * size));
+  }
+  best_cost = MIN(best_cost, kvz_satd_any_size(size, size, pred, size, block, stride));
+
+  // Planar
+  for (int j = 0; j < size; j++) {
+    for (int i = 0; i < size; i++) {
+      pred[j * size + i] = (kvz_pixel)(((size - 1 - i) * left[j] + (i + 1) * top[size - 1] +
+                                        (size - 1 - j) * top[i] + (j + 1) * left[size - 1] +
+                                        size) / (2 * size));
+    }
+  }
+  best_cost = MIN(best_cost, kvz_satd_any_size(size, size, pred, size, block, stride));
+
+  // Horizontal
+  for (int j = 0; j < size; j++) {
+    for (int i = 0; i < size; i++) {
+      pred[j * size + i] = left[j];
+    }
+  }
+  best_cost = MIN(best_cost, kvz_satd_any_size(size, size, pred, size, block, stride));
+
+  // Vertical
+  for (int j = 0; j < size; j++) {
+    for (int i = 0; i < size; i++) {
+      pred[j * size + i] = top[i];
+    }
+  }
+  best_cost = MIN(best_cost, kvz_satd_any_size(size, size, pred, size, block, stride));
+
+  return best_cost;
+}
+
+
+/**
+ * \brief Job downscaling a frame and estimating intra costs.
+ */
+static void lookahead_intra_job(void *opaque)
+{
+  lookahead_frame_t *frame = opaque;
+
+  lookahead_downscale(frame);
+
+  uint64_t intra_cost = 0;
+  for (int by = 0; by < frame->height_blocks; by++) {
+    for (int bx = 0; bx < frame->width_blocks; bx++) {
+      const uint32_t cost = lookahead_intra_cost(frame,
+                                                 bx * LOOKAHEAD_BLOCK_SIZE,
+                                                 by * LOOKAHEAD_BLOCK_SIZE);
+      frame->intra_costs[by * frame->width_blocks + bx] = cost;
+      intra_cost += cost;
+    }
+  }
+  frame->intra_cost = intra_cost;
+}
+
+
+/**
+ * \brief Calculate SAD of a block for a motion vector.
+ *
+ * \return the SAD, or UINT32_MAX if the vector is not allowed
+ */
+static uint32_t lookahead_sad(const lookahead_frame_t *frame,
+                              const kvz_pixel *ref,
+                              int x, int y,
+                              vector2d_t mv)
+{
+  if (abs(mv.x) > LOOKAHEAD_SEARCH_RANGE || abs(mv.y) > LOOKAHEAD_SEARCH_RANGE ||
+      x + mv.x < 0 || x + mv.x > frame->lowres_width  - LOOKAHEAD_BLOCK_SIZE ||
+      y + mv.y < 0 || y + mv.y > frame->lowres_height - LOOKAHEAD_BLOCK_SIZE) {
+    return UINT32_MAX;
+  }
+
+  const int stride = frame->lowres_width;
+  return kvz_reg_sad(&frame->lowres->y[y * stride + x],
+                     &ref[(y + mv.y) * stride + x + mv.x],
+                     LOOKAHEAD_BLOCK_SIZE, LOOKAHEAD_BLOCK_SIZE,
+                     stride, stride);
+}
+
+
+/**
+ * \brief Estimate the cost of predicting a block from a reference frame.
+ *
+ * The search starts from the best of the zero vector and the vectors of
+ * the blocks on the left and above and continues with a small diamond.
+ *
+ * \param ref_frame  the reference frame
+ * \param mvs        motion vectors of the blocks of the frame to ref_frame
+ * \param mv_out     Returns the best motion vector
+ * \return SATD of the best prediction
+ */
+static uint32_t lookahead_inter_cost(const lookahead_frame_t *frame,
+                                     const lookahead_frame_t *ref_frame,
+                                     const vector2d_t *mvs,
+                                     int bx, int by,
+                                     vector2d_t *mv_out)
+{
+  static const vector2d_t diamond[4] = { { 0, -1 }, { -1, 0 }, { 1, 0 }, { 0, 1 } };
+
+  const kvz_pixel *ref = ref_frame->lowres->y;
+  const int x = bx * LOOKAHEAD_BLOCK_SIZE;
+  const int y = by * LOOKAHEAD_BLOCK_SIZE;
+
+  vector2d_t best_mv = { 0, 0 };
+  uint32_t best_sad = lookahead_sad(frame, ref, x, y, best_mv);
+
+  vector2d_t cands[2];
+  int num_cands = 0;
+  if (bx > 0) cands[num_cands++] = mvs[by * frame->width_blocks + bx - 1];
+  if (by > 0) cands[num_cands++] = mvs[(by - 1) * frame->width_blocks + bx];
+  for (int i = 0; i < num_cands; i++) {
+    const uint32_t sad = lookahead_sad(frame, ref, x, y, cands[i]);
+    if (sad < best_sad) {
+      best_sad = sad;
+      best_mv = cands[i];
+    }
+  }
+
+  for (int step = 0; step < LOOKAHEAD_SEARCH_STEPS; step++) {
+    const vector2d_t center = best_mv;
+    for (int i = 0; i < 4; i++) {
+      const vector2d_t mv = { center.x + diamond[i].x, center.y + diamond[i].y };
+      const uint32_t sad = lookahead_sad(frame, ref, x, y, mv);
+      if (sad < best_sad) {
+        best_sad = sad;
+        best_mv = mv;
+      }
+    }
+    if (best_mv.x == center.x && best_mv.y == center.y) break;
+  }
+
+  *mv_out = best_mv;
+
+  const int stride = frame->lowres_width;
+  return kvz_satd_any_size(LOOKAHEAD_BLOCK_SIZE, LOOKAHEAD_BLOCK_SIZE,
+                           &frame->lowres->y[y * stride + x], stride,
+                           &ref[(y + best_mv.y) * stride + x + best_mv.x], stride);
+}
+
+
+/**
+ * \brief Job estimating inter costs of a frame.
+ */
+static void lookahead_inter_job(void *opaque)
+{
+  lookahead_frame_t *frame = opaque;
+  const int num_blocks = frame->width_blocks * frame->height_blocks;
+
+  if (!frame->prev) {
+    // Nothing to predict from.
+    memcpy(frame->inter_costs, frame->intra_costs, num_blocks * sizeof(uint32_t));
+    memset(frame->mvs, 0, num_blocks * sizeof(vector2d_t));
+    frame->inter_cost = frame->intra_cost;
+    return;
+  }
+
+  uint64_t inter_cost = 0;
+  for (int by = 0; by < frame->height_blocks; by++) {
+    for (int bx = 0; bx < frame->width_blocks; bx++) {
+      const int index = by * frame->width_blocks + bx;
+      const uint32_t cost = lookahead_inter_cost(frame, frame->prev, frame->mvs,
+                                                 bx, by, &frame->mvs[index]);
+      frame->inter_costs[index] = cost;
+      inter_cost += MIN(cost, frame->intra_costs[index]);
+    }
+  }
+  frame->inter_cost = inter_cost;
+}
+
+
+/**
+ * \brief Job estimating the costs of predicting the blocks of a frame from
+ * its references in the GOP structure.
+ */
+static void lookahead_ref_job(void *opaque)
+{
+  lookahead_frame_t *frame = opaque;
+  const int num_blocks = frame->width_blocks * frame->height_blocks;
+
+  for (int by = 0; by < frame->height_blocks; by++) {
+    for (int bx = 0; bx < frame->width_blocks; bx++) {
+      const int index = by * frame->width_blocks + bx;
+      uint32_t best_cost = UINT32_MAX;
+      uint8_t best_list = 0;
+      for (int list = 0; list < 2; list++) {
+        if (!frame->refs[list]) continue;
+        vector2d_t *mvs = &frame->ref_mvs[list * num_blocks];
+        const uint32_t cost = lookahead_inter_cost(frame, frame->refs[list], mvs,
+                                                   bx, by, &mvs[index]);
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_list = (uint8_t)list;
+        }
+      }
+      frame->ref_costs[index] = best_cost;
+      frame->ref_lists[index] = best_list;
+    }
+  }
+}
+
+
+/**
+ * \brief Job propagating the costs of the frames in the window of a frame
+ * back to it and computing its QP offsets.
+ */
+static void lookahead_propagate_job(void *opaque)
+{
+  lookahead_frame_t *frame = opaque;
+  const int size = LOOKAHEAD_BLOCK_SIZE;
+  const int width_blocks = frame->width_blocks;
+  const int num_blocks = width_blocks * frame->height_blocks;
+
+  // Amount of cost propagated to each block of the frame (index 0) and of
+  // the frames in the window (index i + 1 for window[i]).
+  double *propagate = calloc((frame->window_size + 1) * num_blocks, sizeof(double));
+  if (!propagate) {
+    fprintf(stderr, "Could not allocate lookahead propagation buffer!\n");
+    return;
+  }
+
+  // The window is in reverse coding order, so the costs propagated to a
+  // frame are complete when it is reached.
+  for (int i = 0; i < frame->window_size; i++) {
+    const lookahead_frame_t *cur = frame->window[i];
+    const double *cur_propagate = &propagate[(i + 1) * num_blocks];
+    const int32_t *ref_indices = &frame->window_refs[2 * i];
+    if (ref_indices[0] < 0 && ref_indices[1] < 0) continue;
+
+    for (int by = 0; by < frame->height_blocks; by++) {
+      for (int bx = 0; bx < width_blocks; bx++) {
+        const int index = by * width_blocks + bx;
+        const int list = cur->ref_costs ? cur->ref_lists[index] : 0;
+        if (ref_indices[list] < 0) continue;
+
+        const uint32_t intra = cur->intra_costs[index];
+        const uint32_t inter = MIN(cur->ref_costs ? cur->ref_costs[index]
+                                                  : cur->inter_costs[index],
+                                   intra);
+        if (inter == intra) continue;
+
+        // The share of the information of the block that comes from the
+        // reference frame.
+        const double amount = (intra + cur_propagate[index]) * (intra - inter) / intra;
+
+        // Split the amount between the blocks the reference area overlaps
+        // in proportion to the overlap. Motion vectors never point outside
+        // the downscaled frame.
+        const vector2d_t mv = cur->ref_costs ? cur->ref_mvs[list * num_blocks + index]
+                                             : cur->mvs[index];
+        const int x = bx * size + mv.x;
+        const int y = by * size + mv.y;
+        const int ref_bx = x / size;
+        const int ref_by = y / size;
+        const int fx = x % size;
+        const int fy = y % size;
+        const int ref_index = ref_by * width_blocks + ref_bx;
+        const double scale = amount / (size * size);
+        double *ref_propagate = &propagate[ref_indices[list] * num_blocks];
+
+        ref_propagate[ref_index] += (size - fx) * (size - fy) * scale;
+        if (fx) ref_propagate[ref_index + 1] += fx * (size - fy) * scale;
+        if (fy) ref_propagate[ref_index + width_blocks] += (size - fx) * fy * scale;
+        if (fx && fy) ref_propagate[ref_index + width_blocks + 1] += fx * fy * scale;
+      }
+    }
+  }
+
+  for (int i = 0; i < num_blocks; i++) {
+    const uint32_t intra = frame->intra_costs[i];
+    frame->qp_offsets[i] = intra == 0 ? 0.0 :
+      -LOOKAHEAD_CUTREE_STRENGTH * log2((intra + propagate[i]) / intra);
+  }
+
+  free(propagate);
+}
+
+
+/**
+ * \brief Create a lookahead.
+ *
+ * \return the lookahead, or NULL on failure
+ */
+lookahead_t * kvz_lookahead_init(const encoder_control_t *encoder)
+{
+  lookahead_t *lookahead = MALLOC(lookahead_t, 1);
+  if (!lookahead) {
+    return NULL;
+  }
+
+  lookahead->encoder  = encoder;
+  lookahead->count    = 0;
+  lookahead->released = 0;
+  lookahead->num_in   = 0;
+  lookahead->last     = NULL;
+  FILL(lookahead->recent, 0);
+
+  // The frames released from the lookahead wait in the input frame buffer
+  // until they are encoded.
+  lookahead->frames_size = encoder->cfg.lookahead + 3 * KVZ_MAX_GOP_LENGTH + 1;
+  lookahead->frames = MALLOC(lookahead_frame_t*, lookahead->frames_size);
+  if (!lookahead->frames) {
+    free(lookahead);
+    return NULL;
+  }
+
+  return lookahead;
+}
+
+
+/**
+ * \brief Release the references to the frames in the window of a frame.
+ */
+static void lookahead_release_window(lookahead_frame_t *frame)
+{
+  for (int i = 0; i < frame->window_size; i++) {
+    kvz_lookahead_frame_free(&frame->window[i]);
+  }
+  FREE_POINTER(frame->window);
+  FREE_POINTER(frame->window_refs);
+  frame->window_size = 0;
+}
+
+
+/**
+ * \brief Release a reference to a frame.
+ *
+ * The frame is freed when the last reference is released. Sets the
+ * pointer to NULL.
+ */
+void kvz_lookahead_frame_free(lookahead_frame_t **frame_ptr)
+{
+  lookahead_frame_t *frame = *frame_ptr;
+  *frame_ptr = NULL;
+  if (!frame) return;
+
+  if (KVZ_ATOMIC_DEC(&frame->refcount) > 0) return;
+
+  kvz_threadqueue_free_job(&frame->intra_job);
+  kvz_threadqueue_free_job(&frame->inter_job);
+  kvz_threadqueue_free_job(&frame->ref_job);
+  kvz_threadqueue_free_job(&frame->propagate_job);
+  lookahead_release_window(frame);
+  kvz_lookahead_frame_free(&frame->prev);
+  kvz_lookahead_frame_free(&frame->refs[0]);
+  kvz_lookahead_frame_free(&frame->refs[1]);
+  kvz_image_free(frame->pic);
+  kvz_image_free(frame->lowres);
+  FREE_POINTER(frame->intra_costs);
+  FREE_POINTER(frame->inter_costs);
+  FREE_POINTER(frame->mvs);
+  FREE_POINTER(frame->ref_costs);
+  FREE_POINTER(frame->ref_lists);
+  FREE_POINTER(frame->ref_mvs);
+  FREE_POINTER(frame->qp_offsets);
+  free(frame);
+}
+
+
+/**
+ * \brief Free a lookahead and the frames in it.
+ *
+ * The thread queue must have been stopped.
+ */
+void kvz_lookahead_free(lookahead_t *lookahead)
+{
+  if (!lookahead) return;
+
+  for (int i = 0; i < lookahead->count; i++) {
+    // The windows may refer back to the frames.
+    lookahead_release_window(lookahead->frames[i]);
+  }
+  for (int i = 0; i < lookahead->count; i++) {
+    kvz_lookahead_frame_free(&lookahead->frames[i]);
+  }
+  kvz_lookahead_frame_free(&lookahead->last);
+  for (int i = 0; i < KVZ_MAX_GOP_LENGTH; i++) {
+    kvz_lookahead_frame_free(&lookahead->recent[i]);
+  }
+  FREE_POINTER(lookahead->frames);
+  FREE_POINTER(lookahead);
+}
+
+
+/**
+ * \brief Create a frame and allocate the buffers for the analysis.
+ *
+ * \return the frame, or NULL on failure
+ */
+static lookahead_frame_t * lookahead_frame_alloc(const kvz_config *cfg, kvz_picture *pic)
+{
+  lookahead_frame_t *frame = calloc(1, sizeof(lookahead_frame_t));
+  if (!frame) {
+    return NULL;
+  }
+
+  frame->refcount      = 1;
+  frame->pic           = kvz_image_copy_ref(pic);
+  frame->scale         = cfg->lookahead_scale;
+  frame->width_blocks  = CEILDIV(CEILDIV(pic->width,  frame->scale), LOOKAHEAD_BLOCK_SIZE);
+  frame->height_blocks = CEILDIV(CEILDIV(pic->height, frame->scale), LOOKAHEAD_BLOCK_SIZE);
+  frame->lowres_width  = frame->width_blocks  * LOOKAHEAD_BLOCK_SIZE;
+  frame->lowres_height = frame->height_blocks * LOOKAHEAD_BLOCK_SIZE;
+
+  const int num_blocks = frame->width_blocks * frame->height_blocks;
+  frame->lowres      = kvz_image_alloc(KVZ_CSP_400, frame->lowres_width, frame->lowres_height);
+  frame->intra_costs = MALLOC(uint32_t, num_blocks);
+  frame->inter_costs = MALLOC(uint32_t, num_blocks);
+  frame->mvs         = MALLOC(vector2d_t, num_blocks);
+  if (cfg->cutree) {
+    frame->qp_offsets = calloc(num_blocks, sizeof(double));
+  }
+
+  if (!frame->lowres || !frame->intra_costs || !frame->inter_costs || !frame->mvs ||
+      (cfg->cutree && !frame->qp_offsets)) {
+    kvz_lookahead_frame_free(&frame);
+    return NULL;
+  }
+
+  return frame;
+}
+
+
+/**
+ * \brief Set the position of a frame in coding order and the distances to
+ * its nearest references according to the GOP structure.
+ */
+static void lookahead_set_gop_position(const kvz_config *cfg, lookahead_frame_t *frame)
+{
+  const int64_t num = frame->num;
+  const bool intra = num == 0 || (cfg->intra_period > 0 && num % cfg->intra_period == 0);
+
+  frame->coding_num = num;
+  frame->ref_dists[0] = 0;
+  frame->ref_dists[1] = 0;
+
+  const kvz_gop_config *gop = NULL;
+  if (cfg->gop_len == 0) {
+    if (!intra) frame->ref_dists[0] = 1;
+    return;
+  } else if (cfg->gop_lowdelay) {
+    const int64_t pos = cfg->intra_period > 0 ? num % cfg->intra_period : num;
+    gop = &cfg->gop[(pos + cfg->gop_len - 1) % cfg->gop_len];
+  } else if (num > 0) {
+    // Pictures are coded one GOP at a time in the order of cfg.gop.
+    const int64_t gop_start = (num - 1) / cfg->gop_len * cfg->gop_len;
+    for (int i = 0; i < cfg->gop_len; i++) {
+      if (gop_start + cfg->gop[i].poc_offset == num) {
+        gop = &cfg->gop[i];
+        frame->coding_num = gop_start + 1 + i;
+        break;
+      }
+    }
+  }
+  if (intra || !gop) return;
+
+  for (int i = 0; i < gop->ref_neg_count; i++) {
+    const int dist = gop->ref_neg[i];
+    if (dist > 0 && dist <= MIN(num, KVZ_MAX_GOP_LENGTH) &&
+        (frame->ref_dists[0] == 0 || dist < frame->ref_dists[0])) {
+      frame->ref_dists[0] = dist;
+    }
+  }
+  for (int i = 0; i < gop->ref_pos_count; i++) {
+    const int dist = gop->ref_pos[i];
+    if (dist > 0 && (frame->ref_dists[1] == 0 || dist < frame->ref_dists[1])) {
+      frame->ref_dists[1] = dist;
+    }
+  }
+}
+
+
+/**
+ * \brief Start estimating the costs of a frame against its references once
+ * they are known.
+ *
+ * The following reference is set when it has been input. At the end of the
+ * input, a missing following reference is left out.
+ *
+ * \param flush   whether the end of the input has been reached
+ * \return 1 on success, 0 on failure
+ */
+static int lookahead_set_refs(lookahead_t *lookahead, lookahead_frame_t *frame, bool flush)
+{
+  const encoder_control_t *const encoder = lookahead->encoder;
+  if (frame->refs_set) return 1;
+
+  if (frame->ref_dists[1] > 0) {
+    const int64_t next_num = frame->num + frame->ref_dists[1];
+    if (next_num < lookahead->num_in) {
+      frame->refs[1] = lookahead->recent[next_num % KVZ_MAX_GOP_LENGTH];
+      KVZ_ATOMIC_INC(&frame->refs[1]->refcount);
+    } else if (!flush) {
+      return 1;
+    }
+  }
+  frame->refs_set = true;
+
+  if (!frame->refs[1] && (!frame->refs[0] || frame->refs[0] == frame->prev)) {
+    // The inter costs from the previous frame are used.
+    return 1;
+  }
+
+  const int num_blocks = frame->width_blocks * frame->height_blocks;
+  frame->ref_costs = MALLOC(uint32_t, num_blocks);
+  frame->ref_lists = MALLOC(uint8_t, num_blocks);
+  frame->ref_mvs   = MALLOC(vector2d_t, 2 * num_blocks);
+  frame->ref_job   = kvz_threadqueue_job_create(encoder->threadqueue, lookahead_ref_job, frame);
+  if (!frame->ref_costs || !frame->ref_lists || !frame->ref_mvs || !frame->ref_job) {
+    // Leave the frame out of the propagation.
+    FREE_POINTER(frame->ref_costs);
+    FREE_POINTER(frame->ref_lists);
+    FREE_POINTER(frame->ref_mvs);
+    kvz_threadqueue_free_job(&frame->ref_job);
+    kvz_lookahead_frame_free(&frame->refs[0]);
+    kvz_lookahead_frame_free(&frame->refs[1]);
+    return 0;
+  }
+
+  kvz_threadqueue_job_set_priority(frame->ref_job,
+                                   kvz_encoder_job_priority(encoder, (int32_t)frame->num, 0, 0));
+  kvz_threadqueue_job_set_trace_info(frame->ref_job, "lookahead ref",
+                                     (int32_t)frame->num, -1, -1, -1);
+  kvz_threadqueue_job_dep_add(frame->ref_job, frame->intra_job);
+  for (int list = 0; list < 2; list++) {
+    if (frame->refs[list]) {
+      kvz_threadqueue_job_dep_add(frame->ref_job, frame->refs[list]->intra_job);
+    }
+  }
+  kvz_threadqueue_submit(encoder->threadqueue, frame->ref_job);
+
+  return 1;
+}
+
+
+/**
+ * \brief Pass an input frame to the lookahead and start analyzing it.
+ *
+ * \return 1 on success, 0 on failure
+ */
+int kvz_lookahead_push(lookahead_t *lookahead, kvz_picture *pic)
+{
+  const encoder_control_t *const encoder = lookahead->encoder;
+
+  if (lookahead->count == lookahead->frames_size) {
+    const int new_size = lookahead->frames_size * 2;
+    lookahead_frame_t **frames = realloc(lookahead->frames,
+                                         new_size * sizeof(lookahead_frame_t*));
+    if (!frames) {
+      fprintf(stderr, "Could not realloc lookahead->frames!\n");
+      return 0;
+    }
+    lookahead->frames      = frames;
+    lookahead->frames_size = new_size;
+  }
+
+  lookahead_frame_t *frame = lookahead_frame_alloc(&encoder->cfg, pic);
+  if (!frame) {
+    fprintf(stderr, "Could not allocate lookahead frame!\n");
+    return 0;
+  }
+  frame->num = lookahead->num_in;
+
+  frame->intra_job = kvz_threadqueue_job_create(encoder->threadqueue, lookahead_intra_job, frame);
+  frame->inter_job = kvz_threadqueue_job_create(encoder->threadqueue, lookahead_inter_job, frame);
+  if (!frame->intra_job || !frame->inter_job) {
+    kvz_lookahead_frame_free(&frame);
+    return 0;
+  }
+
+  // Lookahead jobs belong to frames after the ones being encoded so they
+  // get a lower priority than the jobs of those.
+  const int32_t priority = kvz_encoder_job_priority(encoder, (int32_t)frame->num, 0, 0);
+  kvz_threadqueue_job_set_priority(frame->intra_job, priority);
+  kvz_threadqueue_job_set_priority(frame->inter_job, priority);
+  kvz_threadqueue_job_set_trace_info(frame->intra_job, "lookahead intra",
+                                     (int32_t)frame->num, -1, -1, -1);
+  kvz_threadqueue_job_set_trace_info(frame->inter_job, "lookahead inter",
+                                     (int32_t)frame->num, -1, -1, -1);
+
+  kvz_threadqueue_job_dep_add(frame->inter_job, frame->intra_job);
+  if (lookahead->last) {
+    frame->prev = lookahead->last;
+    KVZ_ATOMIC_INC(&frame->prev->refcount);
+    kvz_threadqueue_job_dep_add(frame->inter_job, frame->prev->intra_job);
+  }
+
+  kvz_threadqueue_submit(encoder->threadqueue, frame->intra_job);
+  kvz_threadqueue_submit(encoder->threadqueue, frame->inter_job);
+
+  kvz_lookahead_frame_free(&lookahead->last);
+  lookahead->last = frame;
+  KVZ_ATOMIC_INC(&frame->refcount);
+
+  lookahead->frames[lookahead->count++] = frame;
+  lookahead->num_in++;
+
+  if (encoder->cfg.cutree) {
+    lookahead_set_gop_position(&encoder->cfg, frame);
+    if (frame->ref_dists[0] > 0) {
+      frame->refs[0] = lookahead->recent[(frame->num - frame->ref_dists[0]) % KVZ_MAX_GOP_LENGTH];
+      KVZ_ATOMIC_INC(&frame->refs[0]->refcount);
+    }
+
+    lookahead_frame_t **recent = &lookahead->recent[frame->num % KVZ_MAX_GOP_LENGTH];
+    kvz_lookahead_frame_free(recent);
+    *recent = frame;
+    KVZ_ATOMIC_INC(&frame->refcount);
+
+    // Frames waiting for this one as their following reference.
+    for (int i = 0; i < lookahead->count; i++) {
+      if (!lookahead_set_refs(lookahead, lookahead->frames[i], false)) {
+        fprintf(stderr, "Could not start lookahead reference analysis!\n");
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+
+/**
+ * \brief Wait until the analysis of a frame is done.
+ */
+static void lookahead_frame_wait(lookahead_t *lookahead, lookahead_frame_t *frame)
+{
+  // Run the jobs here if no worker has started them yet.
+  if (frame->prev) {
+    kvz_threadqueue_join(lookahead->encoder->threadqueue, frame->prev->intra_job);
+  }
+  kvz_threadqueue_join(lookahead->encoder->threadqueue, frame->intra_job);
+  kvz_threadqueue_join(lookahead->encoder->threadqueue, frame->inter_job);
+}
+
+
+/**
+ * \brief Wait until the costs of a frame against its references are known.
+ *
+ * The references of the frame must have been set.
+ */
+static void lookahead_frame_wait_refs(lookahead_t *lookahead, lookahead_frame_t *frame)
+{
+  lookahead_frame_wait(lookahead, frame);
+  if (frame->ref_job) {
+    for (int list = 0; list < 2; list++) {
+      if (frame->refs[list]) {
+        kvz_threadqueue_join(lookahead->encoder->threadqueue, frame->refs[list]->intra_job);
+      }
+    }
+    kvz_threadqueue_join(lookahead->encoder->threadqueue, frame->ref_job);
+  }
+}
+
+
+/**
+ * \brief Check whether a frame starts a new scene.
+ *
+ * A frame starts a new scene when predicting it from the previous frame
+ * saves less than cfg.scenecut percent of the cost of intra coding it.
+ * Waits until the analysis of the frame is done.
+ */
+static bool lookahead_is_scenecut(lookahead_t *lookahead, lookahead_frame_t *frame)
+{
+  const int32_t threshold = lookahead->encoder->cfg.scenecut;
+  if (threshold == 0 || !frame->prev) return false;
+
+  lookahead_frame_wait(lookahead, frame);
+
+  return frame->inter_cost * 100 >= frame->intra_cost * (100 - threshold);
+}
+
+
+/**
+ * \brief Start propagating costs to a frame from the frames coded after it.
+ *
+ * The frames in the lookahead that are coded after the frame and whose
+ * references are known form its window. If the window cannot be allocated,
+ * the QP offsets of the frame stay zero.
+ */
+static void lookahead_start_propagate(lookahead_t *lookahead, int index)
+{
+  const encoder_control_t *const encoder = lookahead->encoder;
+  lookahead_frame_t *frame = lookahead->frames[index];
+
+  int window_size = 0;
+  for (int i = 0; i < lookahead->count; i++) {
+    const lookahead_frame_t *other = lookahead->frames[i];
+    if (other->coding_num > frame->coding_num && other->refs_set) {
+      window_size++;
+    }
+  }
+  if (window_size == 0) return;
+
+  frame->window      = MALLOC(lookahead_frame_t*, window_size);
+  frame->window_refs = MALLOC(int32_t, 2 * window_size);
+  frame->propagate_job = kvz_threadqueue_job_create(encoder->threadqueue,
+                                                    lookahead_propagate_job,
+                                                    frame);
+  if (!frame->window || !frame->window_refs || !frame->propagate_job) {
+    FREE_POINTER(frame->window);
+    FREE_POINTER(frame->window_refs);
+    kvz_threadqueue_free_job(&frame->propagate_job);
+    return;
+  }
+
+  kvz_threadqueue_job_set_priority(frame->propagate_job,
+                                   kvz_encoder_job_priority(encoder, (int32_t)frame->num, 0, 0));
+  kvz_threadqueue_job_set_trace_info(frame->propagate_job, "lookahead propagate",
+                                     (int32_t)frame->num, -1, -1, -1);
+
+  // Sort the window by insertion into reverse coding order.
+  kvz_threadqueue_job_dep_add(frame->propagate_job, frame->intra_job);
+  for (int i = 0; i < lookahead->count; i++) {
+    lookahead_frame_t *other = lookahead->frames[i];
+    if (other->coding_num <= frame->coding_num || !other->refs_set) continue;
+
+    int pos = frame->window_size;
+    while (pos > 0 && frame->window[pos - 1]->coding_num < other->coding_num) {
+      frame->window[pos] = frame->window[pos - 1];
+      pos--;
+    }
+    KVZ_ATOMIC_INC(&other->refcount);
+    frame->window[pos] = other;
+    frame->window_size++;
+    kvz_threadqueue_job_dep_add(frame->propagate_job,
+                                other->ref_job ? other->ref_job : other->inter_job);
+  }
+
+  // Find the references of the frames in the window. They are coded before
+  // the frames referring to them, so they come later in the window.
+  for (int i = 0; i < window_size; i++) {
+    for (int list = 0; list < 2; list++) {
+      const lookahead_frame_t *ref = frame->window[i]->refs[list];
+      int32_t ref_index = -1;
+      if (ref == frame) {
+        ref_index = 0;
+      } else if (ref) {
+        for (int j = i + 1; j < window_size; j++) {
+          if (frame->window[j] == ref) {
+            ref_index = j + 1;
+            break;
+          }
+        }
+      }
+      frame->window_refs[2 * i + list] = ref_index;
+    }
+  }
+
+  kvz_threadqueue_submit(encoder->threadqueue, frame->propagate_job);
+}
+
+
+/**
+ * \brief Get the next frame to pass to the encoder.
+ *
+ * A frame is returned when cfg.lookahead frames after it have been input,
+ * or at the end of the input.
+ *
+ * \param flush     whether the end of the input has been reached
+ * \param scenecut  Returns whether the frame starts a new scene
+ * \return a new reference to the picture, or NULL if no frame is available
+ */
+kvz_picture * kvz_lookahead_pop(lookahead_t *lookahead, bool flush, bool *scenecut)
+{
+  const int waiting = lookahead->count - lookahead->released;
+  if (waiting > lookahead->encoder->cfg.lookahead || (flush && waiting > 0)) {
+    lookahead_frame_t *frame = lookahead->frames[lookahead->released];
+    if (lookahead->encoder->cfg.cutree) {
+      if (flush) {
+        // The following references that have not been input are left out.
+        for (int i = lookahead->released; i < lookahead->count; i++) {
+          if (!lookahead_set_refs(lookahead, lookahead->frames[i], true)) {
+            fprintf(stderr, "Could not start lookahead reference analysis!\n");
+          }
+        }
+      }
+      lookahead_start_propagate(lookahead, lookahead->released);
+    }
+    lookahead->released++;
+    *scenecut = lookahead_is_scenecut(lookahead, frame);
+    return kvz_image_copy_ref(frame->pic);
+  }
+  *scenecut = false;
+  return NULL;
+}
+
+
+/**
+ * \brief Take the analysis of a frame returned by kvz_lookahead_pop.
+ *
+ * Blocks until the analysis is done. The caller receives the ownership of
+ * the frame.
+ *
+ * \param num   number of the frame in input order
+ * \return the frame, or NULL if it was not found
+ */
+lookahead_frame_t * kvz_lookahead_take(lookahead_t *lookahead, int64_t num)
+{
+  for (int i = 0; i < lookahead->released; i++) {
+    lookahead_frame_t *frame = lookahead->frames[i];
+    if (frame->num != num) continue;
+
+    lookahead->count--;
+    lookahead->released--;
+    memmove(&lookahead->frames[i], &lookahead->frames[i + 1],
+            (lookahead->count - i) * sizeof(lookahead_frame_t*));
+
+    lookahead_frame_wait(lookahead, frame);
+
+    if (frame->propagate_job) {
+      for (int j = 0; j < frame->window_size; j++) {
+        lookahead_frame_wait_refs(lookahead, frame->window[j]);
+      }
+      kvz_threadqueue_join(lookahead->encoder->threadqueue, frame->propagate_job);
+    }
+    lookahead_release_window(frame);
+
+    // The previous frame and the references are no longer needed.
+    // Releasing them keeps the frames from forming a chain back to the
+    // start of the sequence.
+    kvz_lookahead_frame_free(&frame->prev);
+    // The costs against the references may still be estimated for the
+    // windows of other frames.
+    lookahead_frame_wait_refs(lookahead, frame);
+    kvz_lookahead_frame_free(&frame->refs[0]);
+    kvz_lookahead_frame_free(&frame->refs[1]);
+
+    return frame;
+  }
+  return NULL;
+}
+
+
+/**
+ * \brief Get the mean QP offset of the blocks covering an area.
+ *
+ * \param x       x-coordinate of the area in pixels
+ * \param y       y-coordinate of the area in pixels
+ * \param width   width of the area in pixels
+ * \param height  height of the area in pixels
+ * \return the QP offset, or 0 if no offsets have been computed
+ */
+double kvz_lookahead_qp_offset(const lookahead_frame_t *frame,
+                               int x, int y, int width, int height)
+{
+  if (!frame || !frame->qp_offsets) return 0.0;
+
+  const int block_size = LOOKAHEAD_BLOCK_SIZE * frame->scale;
+  const int bx_begin = x / block_size;
+  const int by_begin = y / block_size;
+  const int bx_end = MIN(CEILDIV(x + width,  block_size), frame->width_blocks);
+  const int by_end = MIN(CEILDIV(y + height, block_size), frame->height_blocks);
+  if (bx_begin >= bx_end || by_begin >= by_end) return 0.0;
+
+  double sum = 0.0;
+  for (int by = by_begin; by < by_end; by++) {
+    for (int bx = bx_begin; bx < bx_end; bx++) {
+      sum += frame->qp_offsets[by * frame->width_blocks + bx];
+    }
+  }
+  return sum / ((bx_end - bx_begin) * (by_end - by_begin));
+}
+
+
+/**
+ * \brief Get the sum of the costs of the blocks covering an area.
+ *
+ * \param x       x-coordinate of the area in pixels
+ * \param y       y-coordinate of the area in pixels
+ * \param width   width of the area in pixels
+ * \param height  height of the area in pixels
+ * \param intra   whether to use only the intra costs
+ * \return the sum of the costs in downscaled pixels
+ */
+uint64_t kvz_lookahead_cost(const lookahead_frame_t *frame,
+                            int x, int y, int width, int height,
+                            bool intra)
+{
+  const int block_size = LOOKAHEAD_BLOCK_SIZE * frame->scale;
+  const int bx_begin = x / block_size;
+  const int by_begin = y / block_size;
+  const int bx_end = MIN(CEILDIV(x + width,  block_size), frame->width_blocks);
+  const int by_end = MIN(CEILDIV(y + height, block_size), frame->height_blocks);
+
+  uint64_t sum = 0;
+  for (int by = by_begin; by < by_end; by++) {
+    for (int bx = bx_begin; bx < bx_end; bx++) {
+      const int index = by * frame->width_blocks + bx;
+      if (intra) {
+        sum += frame->intra_costs[index];
+      } else {
+        sum += MIN(frame->intra_costs[index], frame->inter_costs[index]);
+      }
+    }
+  }
+  return sum;
+}
@@ -0,0 +1,214 @@
+#ifndef LOOKAHEAD_H_
+#define LOOKAHEAD_H_
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2013-2015 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * Kvazaar is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+/**
+ * \ingroup Control
+ * \file
+ * Pre-analysis of input frames before they are encoded.
+ */
+
+#include "global.h" // IWYU pragma: keep
+#include "cu.h"
+#include "kvazaar.h"
+#include "threadqueue.h"
+
+
+// Forward declaration.
+struct encoder_control_t;
+
+/**
+ * \brief Width and height of the blocks the costs are estimated for, in
+ * downscaled pixels.
+ */
+#define LOOKAHEAD_BLOCK_SIZE 8
+
+/**
+ * \brief Analysis of a single input frame.
+ *
+ * The fields other than num and pic are valid after the job of the frame
+ * has been completed.
+ */
+typedef struct lookahead_frame_t {
+  /**
+   * \brief Number of the frame in input order.
+   */
+  int64_t num;
+
+  /**
+   * \brief Position of the frame in coding order according to the GOP
+   * structure.
+   */
+  int64_t coding_num;
+
+  /**
+   * \brief The input picture.
+   */
+  kvz_picture *pic;
+
+  /**
+   * \brief Downscaled luma of the picture.
+   *
+   * The size is rounded up to full blocks by repeating the last column and
+   * row.
+   */
+  kvz_picture *lowres;
+  int32_t lowres_width;
+  int32_t lowres_height;
+
+  /**
+   * \brief Downscaling factor.
+   */
+  int32_t scale;
+
+  /**
+   * \brief Size of the picture in blocks.
+   */
+  int32_t width_blocks;
+  int32_t height_blocks;
+
+  /**
+   * \brief SATD cost of the best intra prediction of each block.
+   */
+  uint32_t *intra_costs;
+
+  /**
+   * \brief SATD cost of the best prediction of each block from the
+   * previous frame.
+   *
+   * Equal to intra_costs for the first frame.
+   */
+  uint32_t *inter_costs;
+
+  /**
+   * \brief Motion vector of each block in downscaled pixels.
+   */
+  vector2d_t *mvs;
+
+  /**
+   * \brief Sum of intra_costs.
+   */
+  uint64_t intra_cost;
+
+  /**
+   * \brief Sum of the lower of the intra and inter costs of each block.
+   */
+  uint64_t inter_cost;
+
+  /**
+   * \brief QP offset of each block estimated by propagating the costs of
+   * the frames coded after it, or NULL if cfg.cutree is disabled.
+   */
+  double *qp_offsets;
+
+  /**
+   * \brief Previous frame in input order, or NULL.
+   */
+  struct lookahead_frame_t *prev;
+
+  /**
+   * \brief Distances in input order to the nearest preceding (index 0) and
+   * following (index 1) reference of the frame in the GOP structure, or
+   * zero if there is none. Used with cfg.cutree.
+   */
+  int32_t ref_dists[2];
+
+  /**
+   * \brief The references at ref_dists, or NULL if there is none.
+   *
+   * Set when both references have been input, or at the end of the input.
+   */
+  struct lookahead_frame_t *refs[2];
+  bool refs_set;
+
+  /**
+   * \brief SATD cost of the best prediction of each block from refs, or
+   * NULL if the only reference is prev, in which case inter_costs is used.
+   */
+  uint32_t *ref_costs;
+
+  /**
+   * \brief Index to refs of the reference used for each block.
+   */
+  uint8_t *ref_lists;
+
+  /**
+   * \brief Motion vectors of the blocks to refs[0] followed by those to
+   * refs[1], in downscaled pixels.
+   */
+  vector2d_t *ref_mvs;
+
+  /**
+   * \brief Frames coded after the frame that the costs are propagated from,
+   * in reverse coding order.
+   */
+  struct lookahead_frame_t **window;
+  int32_t window_size;
+
+  /**
+   * \brief For each frame in the window and each of its refs, the index of
+   * the reference in the window plus one, zero for this frame and -1 if
+   * the reference is not in the window.
+   */
+  int32_t *window_refs;
+
+  /**
+   * \brief Job downscaling the picture and estimating intra costs.
+   */
+  threadqueue_job_t *intra_job;
+
+  /**
+   * \brief Job estimating inter costs. The analysis is done when this job
+   * is completed.
+   */
+  threadqueue_job_t *inter_job;
+
+  /**
+   * \brief Job estimating ref_costs, or NULL if it is not needed.
+   */
+  threadqueue_job_t *ref_job;
+
+  /**
+   * \brief Job computing qp_offsets, or NULL if cfg.cutree is disabled.
+   */
+  threadqueue_job_t *propagate_job;
+
+  int32_t refcount;
+} lookahead_frame_t;
+
+typedef struct lookahead_t lookahead_t;
+
+lookahead_t * kvz_lookahead_init(const struct encoder_control_t *encoder);
+void kvz_lookahead_free(lookahead_t *lookahead);
+
+int kvz_lookahead_push(lookahead_t *lookahead, kvz_picture *pic);
+kvz_picture * kvz_lookahead_pop(lookahead_t *lookahead, bool flush, bool *scenecut);
+lookahead_frame_t * kvz_lookahead_take(lookahead_t *lookahead, int64_t num);
+
+void kvz_lookahead_frame_free(lookahead_frame_t **frame_ptr);
+
+double kvz_lookahead_qp_offset(const lookahead_frame_t *frame,
+                               int x, int y, int width, int height);
+uint64_t kvz_lookahead_cost(const lookahead_frame_t *frame,
+                            int x, int y, int width, int height,
+                            bool intra);
+
+#endif // LOOKAHEAD_H_
@@ -21,15 +21,53 @@
 #include "rate_control.h"
 
 #include <math.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "encoder.h"
 #include "kvazaar.h"
+#include "lookahead.h"
+#include "rc_stats.h"
+#include "strategies/strategies-picture.h"
 
 
 static const int SMOOTHING_WINDOW = 40;
 static const double MIN_LAMBDA    = 0.1;
 static const double MAX_LAMBDA    = 10000;
 
+//! Slope of the R-lambda curve in the second pass of two-pass encoding
+static const double TWO_PASS_BETA = -1.367;
+
+//! Maximum absolute QP offset of adaptive quantization
+static const int AQ_MAX_DQP = 12;
+
+//! Fullness of the VBV buffer before the first picture as a fraction of the
+//! buffer size
+static const double VBV_INITIAL_FULLNESS = 0.9;
+
+//! Fraction of the VBV buffer kept free for the error of the bit estimates
+static const double VBV_MARGIN = 0.1;
+
+//! Slope of the R-lambda curve assumed at most when raising the QP of a LCU
+//! to keep the picture within its VBV limit. The slopes learned from the
+//! earlier pictures are too flat when the content changes.
+static const double VBV_MAX_BETA = -1.367;
+
+//! Lookahead cost per downscaled pixel of a picture coded at the constant
+//! rate factor QP
+static const double CRF_REFERENCE_COMPLEXITY = 2.5;
+
+//! How much the QP of constant rate factor coding follows the complexity.
+//! At 0 the quantizer step is proportional to the complexity, at 1 the QP
+//! is constant.
+static const double CRF_QCOMPRESS = 0.6;
+
+//! Decay of the complexities of the previous pictures per picture
+static const double CRF_COMPLEXITY_DECAY = 0.5;
+
+//! Maximum absolute QP offset set from the complexity
+static const double CRF_MAX_DQP = 8.0;
+
 /**
  * \brief Clip lambda value to a valid range.
  */
@@ -89,7 +127,8 @@ static double gop_allocate_bits(encoder_state_t * const state)
 
   // Equation 12 from https://doi.org/10.1109/TIP.2014.2336550
   double gop_target_bits =
-    (encoder->target_avg_bppic * (pictures_coded + SMOOTHING_WINDOW) - bits_coded)
+    (state->frame->rc.target_avg_bppic * (pictures_coded + SMOOTHING_WINDOW) +
+     state->frame->rc.target_bits_offset - bits_coded)
     * MAX(1, encoder->cfg.gop_len) / SMOOTHING_WINDOW;
   // Allocate at least 200 bits for each GOP like HM does.
   return MAX(200, gop_target_bits);
@@ -100,7 +139,7 @@ static double gop_allocate_bits(encoder_state_t * const state)
  * \param state   the main encoder state
  * \return        number of header bits
  */
-static uint64_t pic_header_bits(encoder_state_t * const state)
+static uint64_t pic_header_bits(const encoder_state_t * const state)
 {
   const kvz_config* cfg = &state->encoder_control->cfg;
 
@@ -131,6 +170,11 @@ static uint64_t pic_header_bits(encoder_state_t * const state)
     bits += 1392;
   }
 
+  if (state->encoder_control->vui.hrd_parameters_present_flag) {
+    // picture timing and buffering period SEI
+    bits += 104 + (state->frame->is_irap ? 96 : 0);
+  }
+
   return bits;
 }
 
@@ -159,7 +203,7 @@ static double pic_allocate_bits(encoder_state_t * const state)
     return state->frame->cur_gop_target_bits;
   }
 
-  const double pic_weight = encoder->gop_layer_weights[
+  const double pic_weight = state->frame->rc.gop_layer_weights[
     encoder->cfg.gop[state->frame->gop_offset].layer - 1];
   const double pic_target_bits =
     state->frame->cur_gop_target_bits * pic_weight - pic_header_bits(state);
@@ -167,6 +211,182 @@ static double pic_allocate_bits(encoder_state_t * const state)
   return MAX(100, pic_target_bits);
 }
 
+/**
+ * Allocate bits for the current picture from the first pass statistics.
+ *
+ * The bits planned for the remaining pictures are scaled so that they add
+ * up to the bits that remain of the target of the whole sequence.
+ *
+ * \param state   the main encoder state
+ * \param stats   first pass statistics of the picture
+ * \return        target number of bits, including headers
+ */
+static double pic_allocate_bits_two_pass(encoder_state_t * const state,
+                                         const kvz_rc_stats_frame_t *stats)
+{
+  const encoder_control_t * const encoder = state->encoder_control;
+
+  // At this point, total_bits_coded of the current state contains the
+  // number of bits written encoder->owf frames before the current frame.
+  const int pictures_coded = MAX(0, state->frame->num - encoder->cfg.owf);
+  const double bits_coded = state->frame->num > encoder->cfg.owf ?
+                            state->frame->total_bits_coded : 0;
+
+  const double bits_left = kvz_rc_stats_total_target_bits(encoder->rc_stats) - bits_coded;
+  const double bits_planned = kvz_rc_stats_target_bits_from(encoder->rc_stats, pictures_coded);
+  const double scale = CLIP(0.5, 2.0, bits_left / MAX(1.0, bits_planned));
+
+  return MAX(100, stats->target_bits * scale);
+}
+
+/**
+ * \brief Update the accuracy of the bit estimates of the second pass.
+ *
+ * Adds the bits of the last picture coded with the current state and the
+ * bits estimated for it from the first pass statistics to the sums
+ * inherited from the previous state.
+ *
+ * \param state   the main encoder state
+ */
+static void update_two_pass_bits(encoder_state_t * const state)
+{
+  const encoder_control_t * const encoder = state->encoder_control;
+
+  if (state->frame->num > 0) {
+    const encoder_state_config_frame_t *prev = state->previous_encoder_state->frame;
+    state->frame->two_pass_bits           = prev->two_pass_bits;
+    state->frame->two_pass_estimated_bits = prev->two_pass_estimated_bits;
+  }
+
+  if (state->frame->num <= encoder->cfg.owf) return;
+
+  // The picture last coded with this state.
+  const kvz_rc_stats_frame_t *stats = kvz_rc_stats_get_frame(
+    encoder->rc_stats, state->frame->num - encoder->cfg.owf - 1);
+  if (!stats) return;
+
+  state->frame->two_pass_bits += state->stats_bitstream_length * 8;
+  state->frame->two_pass_estimated_bits +=
+    MAX(1, stats->bits) * pow(state->frame->lambda / stats->lambda, 1.0 / TWO_PASS_BETA);
+}
+
+/**
+ * \brief Get the number of bits that enter the VBV buffer during one picture.
+ *
+ * Uses the rate of the current picture, which may have been changed by
+ * reconfiguring the encoder.
+ */
+static double vbv_picture_fill(const encoder_state_t * const state)
+{
+  const encoder_control_t * const ctrl = state->encoder_control;
+  const uint32_t maxrate = state->frame->rc.vbv_maxrate;
+  if (ctrl->vui.timing_info_present_flag) {
+    return maxrate * (double)ctrl->vui.num_units_in_tick / ctrl->vui.time_scale;
+  }
+  return maxrate / ctrl->cfg.framerate;
+}
+
+/**
+ * \brief Compute the fullness of the VBV buffer after a picture.
+ *
+ * \param state     the main encoder state of the current picture
+ * \param fullness  fullness before the picture is removed from the buffer
+ * \param bits      number of bits in the picture
+ * \return          fullness before the next picture is removed
+ */
+static double vbv_fullness_after(const encoder_state_t * const state,
+                                 double fullness,
+                                 double bits)
+{
+  return MIN(state->encoder_control->cfg.vbv_bufsize,
+             fullness - bits + vbv_picture_fill(state));
+}
+
+/**
+ * \brief Project the number of bits in the LCUs of a picture that have not
+ * been written.
+ *
+ * The estimate of the LCUs that have not been written is scaled by how much
+ * the written LCUs exceeded their share of the estimate. The shares follow
+ * the complexities of the LCUs. A tenth of the LCUs to project coded as
+ * estimated is added to the written ones so that the first LCUs do not swing
+ * the ratio.
+ *
+ * \param estimate        number of bits estimated for the LCUs of the picture
+ * \param share           sum of the complexities of the LCUs to project
+ * \param unadjusted_bits number of bits the written LCUs would have taken
+ *                        without the QP offsets added by the VBV model
+ * \param progress        sum of the complexities of the written LCUs
+ * \return                projected number of bits
+ */
+static double vbv_projected_bits_left(double estimate,
+                                      double share,
+                                      double unadjusted_bits,
+                                      double progress)
+{
+  const double prior = 0.1 * estimate * share;
+  const double ratio = (unadjusted_bits + prior) / MAX(1.0, estimate * progress + prior);
+
+  return estimate * MAX(0.0, share - progress) * MAX(1.0, ratio);
+}
+
+/**
+ * \brief Estimate the fullness of the VBV buffer before the current picture.
+ *
+ * The bits of the pictures that are still being coded are not known so
+ * the maximums set for them when they were started are used instead.
+ * Depends only on pictures that were written or started before the current
+ * one, so the result does not depend on the timing of the jobs.
+ *
+ * \param state   the main encoder state
+ * \return        estimated fullness in bits
+ */
+static double vbv_estimate_fullness(const encoder_state_t * const state)
+{
+  const encoder_control_t * const ctrl = state->encoder_control;
+
+  double fullness;
+  if (state->frame->num > ctrl->cfg.owf) {
+    // The picture last coded with this state has been written.
+    fullness = vbv_fullness_after(state,
+                                  state->frame->vbv_fullness,
+                                  state->stats_bitstream_length * 8);
+  } else {
+    fullness = ctrl->cfg.vbv_bufsize * VBV_INITIAL_FULLNESS;
+  }
+
+  // Go through the pictures being coded from the oldest to the newest.
+  // The states are reused in order, so the state i steps back is still
+  // coding picture num - i.
+  const int pics_in_flight = MIN(state->frame->num, ctrl->cfg.owf);
+  for (int i = pics_in_flight; i > 0; i--) {
+    const encoder_state_t *pic_state = state;
+    for (int j = 0; j < i; j++) {
+      pic_state = pic_state->previous_encoder_state;
+    }
+    fullness = vbv_fullness_after(state, fullness, pic_state->frame->vbv_max_bits);
+  }
+
+  return fullness;
+}
+
+/**
+ * \brief Get the maximum number of bits of a picture.
+ *
+ * Leaves a margin for the error of the estimates.
+ *
+ * \param state     the main encoder state
+ * \param fullness  fullness of the VBV buffer before the picture
+ * \return          maximum number of bits
+ */
+static double vbv_max_picture_bits(const encoder_state_t * const state,
+                                   double fullness)
+{
+  const double bufsize = state->encoder_control->cfg.vbv_bufsize;
+  return MAX(MAX(fullness - VBV_MARGIN * bufsize, 0.5 * fullness),
+             0.1 * vbv_picture_fill(state));
+}
+
 static int8_t lambda_to_qp(const double lambda)
 {
   const int8_t qp = 4.2005 * log(lambda) + 13.7223 + 0.5;
@@ -206,6 +426,362 @@ static double qp_to_lamba(encoder_state_t * const state, int qp)
   return lambda;
 }
 
+/**
+ * \brief Get the complexity of the current picture for constant rate factor
+ * coding.
+ *
+ * The complexity is the lookahead cost per downscaled pixel, averaged with
+ * the previous pictures so that the QP changes smoothly. The sums are
+ * inherited from the previous state.
+ *
+ * \param state   the main encoder state
+ * \return        complexity of the picture
+ */
+static double crf_complexity(encoder_state_t * const state)
+{
+  const lookahead_frame_t * const frame = state->frame->lookahead;
+
+  double sum   = 0;
+  double count = 0;
+  if (state->frame->num > 0) {
+    const encoder_state_config_frame_t *prev = state->previous_encoder_state->frame;
+    sum   = prev->crf_complexity_sum * CRF_COMPLEXITY_DECAY;
+    count = prev->crf_complexity_count * CRF_COMPLEXITY_DECAY;
+  }
+
+  if (frame) {
+    const double pixels = frame->width_blocks * frame->height_blocks *
+                          LOOKAHEAD_BLOCK_SIZE * LOOKAHEAD_BLOCK_SIZE;
+    sum   += frame->inter_cost / pixels;
+    count += 1;
+  }
+
+  state->frame->crf_complexity_sum   = sum;
+  state->frame->crf_complexity_count = count;
+
+  return count > 0 ? sum / count : CRF_REFERENCE_COMPLEXITY;
+}
+
+/**
+ * \brief Set lambda and QP of the current picture from the constant rate
+ * factor.
+ *
+ * The quantizer step follows the complexity of the picture to the power of
+ * 1 - CRF_QCOMPRESS, so that complex pictures, where errors are less
+ * visible, are coded with a higher QP. The QP offsets of the GOP are added
+ * as with constant QP.
+ *
+ * \param state   the main encoder state
+ */
+static void crf_set_picture_lambda_and_qp(encoder_state_t * const state)
+{
+  const encoder_control_t * const ctrl = state->encoder_control;
+  kvz_gop_config const * const gop = &ctrl->cfg.gop[state->frame->gop_offset];
+
+  const double complexity = crf_complexity(state);
+  double qp = state->frame->rc.crf + CLIP(-CRF_MAX_DQP, CRF_MAX_DQP,
+    6.0 * (1.0 - CRF_QCOMPRESS) * log2(complexity / CRF_REFERENCE_COMPLEXITY));
+
+  if (ctrl->cfg.gop_len > 0 && state->frame->slicetype != KVZ_SLICE_I) {
+    qp += gop->qp_offset;
+  }
+  qp = CLIP(0.0, 51.0, qp);
+
+  // Keep the fractional part of the QP in lambda.
+  state->frame->QP     = (int8_t)lround(qp);
+  state->frame->lambda = clip_lambda(qp_to_lamba(state, state->frame->QP) *
+                                     pow(2.0, (qp - state->frame->QP) / 3.0));
+}
+
+/**
+ * \brief Get the lambda the picture last coded with the state was coded
+ * with.
+ *
+ * The LCUs are coded with a higher lambda than the picture when the picture
+ * would exceed its VBV limit.
+ *
+ * \param state   the main encoder state
+ * \return        lambda of the picture raised by the mean QP offset that
+ *                the VBV model added to the LCUs
+ */
+static double vbv_coded_lambda(const encoder_state_t * const state)
+{
+  const int num_lcus = state->encoder_control->in.width_in_lcu *
+                       state->encoder_control->in.height_in_lcu;
+  double dqp_sum = 0;
+  for (int i = 0; i < num_lcus; i++) {
+    dqp_sum += state->frame->lcu_stats[i].vbv_dqp;
+  }
+  return state->frame->lambda * pow(2.0, dqp_sum / num_lcus / 3.0);
+}
+
+/**
+ * \brief Limit the bits of the current picture to what the VBV buffer allows.
+ *
+ * Raises lambda and QP of the picture if the R-lambda model estimates that
+ * the picture would drain the buffer. Sets the limits that the LCUs of the
+ * picture are kept within. The bits left in the buffer above the estimate
+ * are shared with the pictures coded in parallel with this one.
+ *
+ * \param state         the main encoder state
+ * \param coded_lambda  lambda the picture last coded with the state was
+ *                      coded with
+ */
+static void vbv_limit_picture_bits(encoder_state_t * const state,
+                                   double coded_lambda)
+{
+  const encoder_control_t * const ctrl = state->encoder_control;
+  const double pixels   = ctrl->in.pixels_per_pic;
+
+  // Correct the estimates of the R-lambda model by how the estimates matched
+  // the bits of the previous pictures of the same kind. The picture last
+  // coded with this state is the newest one that has been written. The
+  // correction follows larger pictures at once so that the buffer is not
+  // drained twice by the same mistake.
+  double *bits_ratios = state->frame->vbv_bits_ratios;
+  double *complexities = state->frame->vbv_complexities;
+  double *coded_lambdas = state->frame->vbv_coded_lambdas;
+  if (state->frame->num > 0) {
+    memcpy(bits_ratios,
+           state->previous_encoder_state->frame->vbv_bits_ratios,
+           sizeof(state->frame->vbv_bits_ratios));
+    memcpy(complexities,
+           state->previous_encoder_state->frame->vbv_complexities,
+           sizeof(state->frame->vbv_complexities));
+    memcpy(coded_lambdas,
+           state->previous_encoder_state->frame->vbv_coded_lambdas,
+           sizeof(state->frame->vbv_coded_lambdas));
+  }
+  if (state->frame->num > ctrl->cfg.owf) {
+    const int last = state->frame->vbv_predictor;
+    const double model_bits = state->frame->vbv_model_bits *
+      pow(coded_lambda / state->frame->vbv_lambda, 1.0 / state->frame->rc_beta);
+    const double observed = state->stats_bitstream_length * 8 / MAX(1.0, model_bits);
+    bits_ratios[last] = CLIP(0.25, 4.0, observed > bits_ratios[last] ?
+                                        observed :
+                                        sqrt(bits_ratios[last] * observed));
+    coded_lambdas[last] = coded_lambda;
+  }
+
+  // I-pictures and each layer of the GOP are estimated separately.
+  int predictor = 0;
+  if (state->frame->slicetype != KVZ_SLICE_I) {
+    predictor = ctrl->cfg.gop_len > 0 ? ctrl->cfg.gop[state->frame->gop_offset].layer : 1;
+  }
+  const double bits_ratio = bits_ratios[predictor];
+
+  // Scale the estimate by how the lookahead cost changed from the previous
+  // picture of the same kind, so that scene cuts are not underestimated.
+  // The inter costs are against the previous input picture rather than the
+  // references so the change is damped.
+  double complexity_ratio = 1.0;
+  const lookahead_frame_t * const lookahead = state->frame->lookahead;
+  if (lookahead) {
+    const double complexity = state->frame->slicetype == KVZ_SLICE_I ?
+                              lookahead->intra_cost : lookahead->inter_cost;
+    if (complexities[predictor] > 0) {
+      complexity_ratio = CLIP(0.25, 4.0, sqrt(complexity / complexities[predictor]));
+    }
+    complexities[predictor] = MAX(1.0, complexity);
+  }
+
+  const double fullness = vbv_estimate_fullness(state);
+  const double max_bits = vbv_max_picture_bits(state, fullness);
+
+  const double model_bits = pixels * complexity_ratio *
+    pow(state->frame->lambda / state->frame->rc_alpha, 1.0 / state->frame->rc_beta);
+  double bits = bits_ratio * model_bits;
+  // Do not let lambda fall far below that of the previous picture of the
+  // same kind. The model is unreliable that far away from where it was
+  // corrected.
+  const double min_lambda = 0.25 * coded_lambdas[predictor];
+  if (bits > max_bits || state->frame->lambda < min_lambda) {
+    const double target_bpp = MIN(bits, max_bits) / (bits_ratio * complexity_ratio * pixels);
+    const double lambda = MAX(min_lambda, clip_lambda(
+      state->frame->rc_alpha * pow(target_bpp, state->frame->rc_beta)));
+
+    if (ctrl->cfg.target_bitrate > 0) {
+      state->frame->lambda = lambda;
+      state->frame->QP     = lambda_to_qp(lambda);
+      state->frame->cur_pic_target_bits = MIN(
+        state->frame->cur_pic_target_bits,
+        MAX(100, max_bits - pic_header_bits(state)));
+    } else {
+      // Keep the relation between QP and lambda of constant QP coding.
+      const int dqp = (int)ceil(3.0 * log2(lambda / state->frame->lambda));
+      state->frame->QP     = CLIP_TO_QP(state->frame->QP + dqp);
+      state->frame->lambda = qp_to_lamba(state, state->frame->QP);
+    }
+    bits = MIN(bits, max_bits);
+  }
+
+  const int pics_in_parallel = 1 + ctrl->cfg.owf;
+
+  state->frame->vbv_predictor      = predictor;
+  state->frame->vbv_model_bits     = bits / bits_ratio;
+  state->frame->vbv_lambda         = state->frame->lambda;
+  state->frame->vbv_estimated_bits = bits;
+  state->frame->vbv_max_bits       = bits + (fullness - bits) / pics_in_parallel;
+  state->frame->vbv_soft_max_bits  = bits + (max_bits - bits) / pics_in_parallel;
+}
+
+/**
+ * \brief Count the bits of the LCUs of the current picture that are always
+ * written before the given LCU.
+ *
+ * Only the LCUs that the LCU waits for, directly or through other LCUs, are
+ * counted, so that the result does not depend on the timing of the jobs.
+ * The LCUs of a leaf state are coded in order and with WPP each row waits
+ * for the LCU above right. LCUs in other tiles and slices are not counted.
+ *
+ * \param state                 the encoder state of the LCU
+ * \param pos                   location of the LCU in the tile as number of
+ *                              LCUs
+ * \param beta                  slope of the R-lambda curve
+ * \param[out] unadjusted_bits  number of bits the counted LCUs would have
+ *                              taken without the QP offsets added by the
+ *                              VBV model
+ * \param[out] progress         sum of the complexities of the counted LCUs
+ * \return                      number of bits in the counted LCUs
+ */
+static double vbv_bits_before_lcu(encoder_state_t * const state,
+                                  vector2d_t pos,
+                                  double beta,
+                                  double *unadjusted_bits,
+                                  double *progress)
+{
+  const int id = pos.x + pos.y * state->tile->frame->width_in_lcu;
+  const lcu_order_element_t *lcu = &state->lcu_order[id - state->lcu_order[0].id];
+
+  double bits = 0;
+  *unadjusted_bits = 0;
+  *progress = 0;
+  int count = lcu->index;
+  while (true) {
+    encoder_state_t * const leaf = lcu->encoder_state;
+    for (int i = 0; i < count; i++) {
+      const vector2d_t p = leaf->lcu_order[i].position;
+      const lcu_stats_t * const stats = kvz_get_lcu_stats(leaf, p.x, p.y);
+      bits             += stats->bits;
+      *unadjusted_bits += stats->bits * pow(2.0, -stats->vbv_dqp / (3.0 * beta));
+      *progress        += stats->complexity;
+    }
+
+    if (!lcu->above || lcu->above->encoder_state == leaf) break;
+    // Wavefront row above. It is done up to the LCU above right.
+    lcu = lcu->above->right ? lcu->above->right : lcu->above;
+    count = lcu->index + 1;
+  }
+
+  return bits;
+}
+
+/**
+ * \brief Get the sum of the complexities of the LCUs coded by a state and
+ * its children.
+ */
+static double vbv_state_complexity(const encoder_state_t * const state)
+{
+  double complexity = 0;
+  if (state->is_leaf) {
+    for (int i = 0; i < state->lcu_order_count; i++) {
+      const vector2d_t p = state->lcu_order[i].position;
+      complexity += kvz_get_lcu_stats((encoder_state_t*)state, p.x, p.y)->complexity;
+    }
+  }
+  for (int i = 0; state->children[i].encoder_control; i++) {
+    complexity += vbv_state_complexity(&state->children[i]);
+  }
+  return complexity;
+}
+
+/**
+ * \brief Raise lambda and QP of the current LCU if the picture is about to
+ * take more bits than the VBV buffer allows.
+ *
+ * The bits of the picture are projected from the LCUs that are always
+ * written before the current one, so that the QP does not depend on the
+ * timing of the jobs. Tiles and slices are coded in parallel so each of
+ * them is kept within its share of the limits by the complexity. Above the
+ * soft limit the QP is raised by the R-lambda model. Above the hard limit
+ * the LCU is coded with the highest QP.
+ *
+ * \param state   the encoder state of the LCU
+ * \param pos     location of the LCU in the tile as number of LCUs
+ */
+static void vbv_adjust_lcu_lambda_and_qp(encoder_state_t * const state,
+                                         vector2d_t pos)
+{
+  const encoder_state_config_frame_t * const frame = state->frame;
+  lcu_stats_t * const lcu = kvz_get_lcu_stats(state, pos.x, pos.y);
+
+  lcu->vbv_dqp = 0;
+
+  // The LCUs of wavefront rows wait for the rows above so the share is
+  // that of the tile or slice.
+  const encoder_state_t * const region =
+    state->type == ENCODER_STATE_TYPE_WAVEFRONT_ROW ? state->parent : state;
+  const double share = vbv_state_complexity(region);
+
+  const double header_bits   = pic_header_bits(state);
+  const double max_bits      = (frame->vbv_max_bits - header_bits) * share;
+  const double soft_max_bits = (frame->vbv_soft_max_bits - header_bits) * share;
+  const double beta          = MIN(VBV_MAX_BETA, frame->rc_beta);
+
+  double unadjusted_bits;
+  double progress;
+  const double bits_coded = vbv_bits_before_lcu(state, pos, beta,
+                                                &unadjusted_bits, &progress);
+  const double bits_left  = vbv_projected_bits_left(
+    MAX(1.0, frame->vbv_estimated_bits - header_bits),
+    share, unadjusted_bits, progress);
+  if (bits_coded + bits_left <= soft_max_bits) return;
+
+  int dqp;
+  if (bits_coded + bits_left > max_bits) {
+    dqp = 51 - state->qp;
+  } else {
+    const double scale = (soft_max_bits - bits_coded) / MAX(1.0, bits_left);
+    const double lambda_factor = pow(MAX(0.001, scale), beta);
+    dqp = MIN(51 - state->qp, (int)lround(3.0 * log2(lambda_factor)));
+  }
+  if (dqp <= 0) return;
+
+  lcu->vbv_dqp       = dqp;
+  state->qp         += dqp;
+  state->lambda      = clip_lambda(state->lambda * pow(2.0, dqp / 3.0));
+  state->lambda_sqrt = sqrt(state->lambda);
+}
+
+/**
+ * \brief Update the fullness of the VBV buffer before the current picture.
+ *
+ * Must be called when the bitstream of the current picture is written.
+ * Uses the number of bits written for the previous picture. Warns if the
+ * previous picture did not fit in the buffer.
+ *
+ * \param state   the main encoder state
+ */
+void kvz_update_vbv_fullness(encoder_state_t * const state)
+{
+  const encoder_control_t * const ctrl = state->encoder_control;
+
+  if (state->frame->num == 0) {
+    state->frame->vbv_fullness = ctrl->cfg.vbv_bufsize * VBV_INITIAL_FULLNESS;
+  } else {
+    const encoder_state_t * const prev = state->previous_encoder_state;
+    if (prev->stats_bitstream_length * 8 > prev->frame->vbv_fullness) {
+      fprintf(stderr,
+              "Warning: frame %d does not fit in the VBV buffer. The stream "
+              "does not conform to the signalled HRD.\n",
+              prev->frame->num);
+    }
+    state->frame->vbv_fullness = vbv_fullness_after(state,
+                                                    prev->frame->vbv_fullness,
+                                                    prev->stats_bitstream_length * 8);
+  }
+}
+
 /**
  * \brief Allocate bits and set lambda and QP for the current picture.
  * \param state the main encoder state
@@ -213,41 +789,86 @@ static double qp_to_lamba(encoder_state_t * const state, int qp)
 void kvz_set_picture_lambda_and_qp(encoder_state_t * const state)
 {
   const encoder_control_t * const ctrl = state->encoder_control;
+  const bool vbv = ctrl->cfg.vbv_bufsize > 0;
+
+  double coded_lambda = state->frame->lambda;
+  if ((ctrl->cfg.target_bitrate > 0 || vbv) && state->frame->num > ctrl->cfg.owf) {
+    // At least one frame has been written.
+    if (vbv) {
+      coded_lambda = vbv_coded_lambda(state);
+    }
+    update_parameters(state->stats_bitstream_length * 8,
+                      ctrl->in.pixels_per_pic,
+                      coded_lambda,
+                      &state->frame->rc_alpha,
+                      &state->frame->rc_beta);
+  }
 
   if (ctrl->cfg.target_bitrate > 0) {
     // Rate control enabled
 
-    if (state->frame->num > ctrl->cfg.owf) {
-      // At least one frame has been written.
-      update_parameters(state->stats_bitstream_length * 8,
-                        ctrl->in.pixels_per_pic,
-                        state->frame->lambda,
-                        &state->frame->rc_alpha,
-                        &state->frame->rc_beta);
-    }
+    const kvz_rc_stats_frame_t *stats = ctrl->rc_stats ?
+      kvz_rc_stats_get_frame(ctrl->rc_stats, state->frame->num) : NULL;
 
-    const double pic_target_bits = pic_allocate_bits(state);
-    const double target_bpp = pic_target_bits / ctrl->in.pixels_per_pic;
-    double lambda = state->frame->rc_alpha * pow(target_bpp, state->frame->rc_beta);
+    double pic_target_bits;
+    double lambda;
+    if (stats) {
+      // Second pass. Move along the R-lambda curve from the point the
+      // first pass measured for this picture, correcting the estimate with
+      // how the estimates matched the pictures coded so far.
+      update_two_pass_bits(state);
+      const double correction = state->frame->two_pass_estimated_bits > 0 ?
+        state->frame->two_pass_bits / state->frame->two_pass_estimated_bits : 1.0;
+      const double target_bits = pic_allocate_bits_two_pass(state, stats);
+      lambda = stats->lambda * pow(target_bits / (correction * MAX(1, stats->bits)),
+                                   TWO_PASS_BETA);
+      pic_target_bits = MAX(100, target_bits - pic_header_bits(state));
+    } else {
+      pic_target_bits = pic_allocate_bits(state);
+      const double target_bpp = pic_target_bits / ctrl->in.pixels_per_pic;
+      lambda = state->frame->rc_alpha * pow(target_bpp, state->frame->rc_beta);
+    }
     lambda = clip_lambda(lambda);
 
     state->frame->lambda              = lambda;
     state->frame->QP                  = lambda_to_qp(lambda);
     state->frame->cur_pic_target_bits = pic_target_bits;
 
+  } else if (ctrl->cfg.crf > 0.0) {
+    crf_set_picture_lambda_and_qp(state);
+
   } else {
     // Rate control disabled
     kvz_gop_config const * const gop = &ctrl->cfg.gop[state->frame->gop_offset];
     const int gop_len = ctrl->cfg.gop_len;
 
     if (gop_len > 0 && state->frame->slicetype != KVZ_SLICE_I) {
-      state->frame->QP = CLIP_TO_QP(ctrl->cfg.qp + gop->qp_offset);
+      state->frame->QP = CLIP_TO_QP(state->frame->rc.qp + gop->qp_offset);
     } else {
-      state->frame->QP = ctrl->cfg.qp;
+      state->frame->QP = state->frame->rc.qp;
     }
 
     state->frame->lambda = qp_to_lamba(state, state->frame->QP);
   }
+
+  const kvz_picture * const source = state->tile->frame->source;
+  if (source->qp >= 0 || source->lambda > 0) {
+    // The input picture overrides the choice of the encoder.
+    if (source->qp >= 0) {
+      state->frame->QP = CLIP_TO_QP(source->qp);
+    } else {
+      state->frame->QP = lambda_to_qp(source->lambda);
+    }
+    if (source->lambda > 0) {
+      state->frame->lambda = clip_lambda(source->lambda);
+    } else {
+      state->frame->lambda = qp_to_lamba(state, state->frame->QP);
+    }
+  }
+
+  if (vbv) {
+    vbv_limit_picture_bits(state, coded_lambda);
+  }
 }
 
 /**
@@ -259,13 +880,18 @@ void kvz_set_picture_lambda_and_qp(encoder_state_t * const state)
 static double lcu_allocate_bits(encoder_state_t * const state,
                                 vector2d_t pos)
 {
+  const encoder_control_t * const ctrl = state->encoder_control;
+  const kvz_rc_stats_frame_t *stats = ctrl->rc_stats ?
+    kvz_rc_stats_get_frame(ctrl->rc_stats, state->frame->num) : NULL;
+
   double lcu_weight;
-  if (state->frame->num > state->encoder_control->cfg.owf) {
-    lcu_weight = kvz_get_lcu_stats(state, pos.x, pos.y)->weight;
+  if (stats && stats->lcu_bits_sum > 0) {
+    // Second pass. Use the share of the bits of the LCU in the first pass.
+    const int index = pos.x + state->tile->lcu_offset_x +
+                      (pos.y + state->tile->lcu_offset_y) * ctrl->in.width_in_lcu;
+    lcu_weight = stats->lcu_bits[index] / (double)stats->lcu_bits_sum;
   } else {
-    const uint32_t num_lcus = state->encoder_control->in.width_in_lcu *
-                              state->encoder_control->in.height_in_lcu;
-    lcu_weight = 1.0 / num_lcus;
+    lcu_weight = kvz_get_lcu_stats(state, pos.x, pos.y)->weight;
   }
 
   // Target number of bits for the current LCU.
@@ -279,23 +905,35 @@ void kvz_set_lcu_lambda_and_qp(encoder_state_t * const state,
                                vector2d_t pos)
 {
   const encoder_control_t * const ctrl = state->encoder_control;
+  const kvz_picture * const source = state->tile->frame->source;
 
-  if (ctrl->cfg.roi.dqps != NULL) {
+  if (ctrl->cfg.roi.dqps != NULL || source->roi.dqps != NULL) {
     vector2d_t lcu = {
       pos.x + state->tile->lcu_offset_x,
       pos.y + state->tile->lcu_offset_y
     };
-    vector2d_t roi = {
-      lcu.x * ctrl->cfg.roi.width / ctrl->in.width_in_lcu,
-      lcu.y * ctrl->cfg.roi.height / ctrl->in.height_in_lcu
-    };
-    int roi_index = roi.x + roi.y * ctrl->cfg.roi.width;
-    int dqp = ctrl->cfg.roi.dqps[roi_index];
+    int dqp = 0;
+    if (ctrl->cfg.roi.dqps != NULL) {
+      vector2d_t roi = {
+        lcu.x * ctrl->cfg.roi.width / ctrl->in.width_in_lcu,
+        lcu.y * ctrl->cfg.roi.height / ctrl->in.height_in_lcu
+      };
+      int roi_index = roi.x + roi.y * ctrl->cfg.roi.width;
+      dqp += ctrl->cfg.roi.dqps[roi_index];
+    }
+    if (source->roi.dqps != NULL) {
+      vector2d_t roi = {
+        lcu.x * source->roi.width / ctrl->in.width_in_lcu,
+        lcu.y * source->roi.height / ctrl->in.height_in_lcu
+      };
+      int roi_index = roi.x + roi.y * source->roi.width;
+      dqp += source->roi.dqps[roi_index];
+    }
     state->qp = CLIP_TO_QP(state->frame->QP + dqp);
     state->lambda = qp_to_lamba(state, state->qp);
     state->lambda_sqrt = sqrt(state->frame->lambda);
 
-  } else if (ctrl->cfg.target_bitrate > 0) {
+  } else if (ctrl->cfg.target_bitrate > 0 && source->qp < 0 && source->lambda <= 0) {
     lcu_stats_t *lcu         = kvz_get_lcu_stats(state, pos.x, pos.y);
     const uint32_t pixels    = MIN(LCU_WIDTH, state->tile->frame->width  - LCU_WIDTH * pos.x) *
                                MIN(LCU_WIDTH, state->tile->frame->height - LCU_WIDTH * pos.y);
@@ -339,4 +977,231 @@ void kvz_set_lcu_lambda_and_qp(encoder_state_t * const state,
     state->lambda      = state->frame->lambda;
     state->lambda_sqrt = sqrt(state->frame->lambda);
   }
+
+  const bool is_ref = ctrl->cfg.gop_len == 0 ||
+                      state->frame->is_irap ||
+                      ctrl->cfg.gop[state->frame->gop_offset].is_ref;
+  if (ctrl->cfg.cutree && is_ref) {
+    // Lower the QP of LCUs that later frames are predicted from. Pictures
+    // that are not used for reference gain nothing from a lower QP.
+    const int dqp = (int)lround(kvz_lookahead_qp_offset(
+      state->frame->lookahead,
+      (pos.x + state->tile->lcu_offset_x) * LCU_WIDTH,
+      (pos.y + state->tile->lcu_offset_y) * LCU_WIDTH,
+      LCU_WIDTH, LCU_WIDTH));
+    const int8_t qp = CLIP_TO_QP(state->qp + dqp);
+    if (qp != state->qp) {
+      state->lambda      = clip_lambda(state->lambda * pow(2.0, (qp - state->qp) / 3.0));
+      state->lambda_sqrt = sqrt(state->lambda);
+      state->qp          = qp;
+    }
+  }
+
+  if (ctrl->cfg.vbv_bufsize > 0) {
+    vbv_adjust_lcu_lambda_and_qp(state, pos);
+  }
+
+  kvz_get_lcu_stats(state, pos.x, pos.y)->lambda = state->lambda;
+
+  state->lcu_qp     = state->qp;
+  state->lcu_lambda = state->lambda;
+}
+
+/**
+ * \brief Estimate the complexity of an area of the source picture.
+ *
+ * Sum of the SATDs of the 8x8 luma blocks with their mean removed.
+ */
+static uint32_t source_complexity(const kvz_picture *src,
+                                  int x, int y, int width, int height)
+{
+  ALIGNED(16) kvz_pixel flat[8 * 8];
+  uint32_t sum = 0;
+
+  for (int by = y; by + 8 <= y + height; by += 8) {
+    for (int bx = x; bx + 8 <= x + width; bx += 8) {
+      const kvz_pixel *block = &src->y[bx + by * src->stride];
+      int mean = 0;
+      for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+          mean += block[j + i * src->stride];
+        }
+      }
+      memset(flat, (mean + 32) >> 6, sizeof(flat));
+      sum += kvz_satd_any_size(8, 8, block, src->stride, flat, 8);
+    }
+  }
+  return sum;
+}
+
+/**
+ * \brief Job computing the rate control weights of a row of LCUs.
+ *
+ * The weights are not normalized.
+ */
+static void lcu_weights_row_job(void *opaque)
+{
+  const lcu_weights_row_t * const row = opaque;
+  encoder_state_t * const state = row->state;
+  const encoder_control_t * const ctrl = state->encoder_control;
+  const lookahead_frame_t * const lookahead = state->frame->lookahead;
+
+  for (int lcu_x = 0; lcu_x < ctrl->in.width_in_lcu; lcu_x++) {
+    const int x = lcu_x * LCU_WIDTH;
+    const int y = row->lcu_y * LCU_WIDTH;
+    const int width  = MIN(LCU_WIDTH, ctrl->in.width  - x);
+    const int height = MIN(LCU_WIDTH, ctrl->in.height - y);
+
+    // Prefer the motion compensated costs of the lookahead when they are
+    // available.
+    double cost;
+    if (lookahead) {
+      cost = kvz_lookahead_cost(lookahead, x, y, width, height,
+                                state->frame->slicetype == KVZ_SLICE_I);
+    } else {
+      cost = source_complexity(state->tile->frame->source, x, y, width, height);
+    }
+    lcu_stats_t * const stats = kvz_get_lcu_stats(state, lcu_x, row->lcu_y);
+    stats->weight     = cost * cost;
+    stats->complexity = cost;
+  }
+}
+
+/**
+ * \brief Job normalizing the rate control weights and the complexities of
+ * the frame.
+ */
+static void lcu_weights_normalize_job(void *opaque)
+{
+  encoder_state_t * const state = opaque;
+  lcu_stats_t * const stats = state->frame->lcu_stats;
+  const uint32_t num_lcus = state->encoder_control->in.width_in_lcu *
+                            state->encoder_control->in.height_in_lcu;
+  double weight_sum     = 0.0;
+  double complexity_sum = 0.0;
+  for (uint32_t i = 0; i < num_lcus; i++) {
+    weight_sum     += stats[i].weight;
+    complexity_sum += stats[i].complexity;
+  }
+
+  for (uint32_t i = 0; i < num_lcus; i++) {
+    if (weight_sum > 0.0) {
+      stats[i].weight     /= weight_sum;
+      stats[i].complexity /= complexity_sum;
+    } else {
+      // Flat picture. Split the bits evenly.
+      stats[i].weight     = 1.0 / num_lcus;
+      stats[i].complexity = 1.0 / num_lcus;
+    }
+  }
+}
+
+/**
+ * \brief Start computing the rate control weights of the LCUs of the frame.
+ *
+ * The weights are computed by one job per LCU row. The LCUs of the frame
+ * must depend on state->frame->lcu_weights_job. Must be called after the
+ * source picture and the slice type of the frame have been set.
+ */
+void kvz_init_lcu_weights(encoder_state_t * const state)
+{
+  const encoder_control_t * const ctrl = state->encoder_control;
+  // The VBV model uses the complexities to tell how much of the picture
+  // has been coded.
+  if (ctrl->cfg.target_bitrate <= 0 && ctrl->cfg.vbv_bufsize <= 0) return;
+
+  threadqueue_queue_t * const threadqueue = ctrl->threadqueue;
+  const int32_t priority = kvz_encoder_state_job_priority(state, 0, 0);
+
+  kvz_threadqueue_free_job(&state->frame->lcu_weights_job);
+  state->frame->lcu_weights_job =
+    kvz_threadqueue_job_create(threadqueue, lcu_weights_normalize_job, state);
+  kvz_threadqueue_job_set_priority(state->frame->lcu_weights_job, priority);
+  kvz_threadqueue_job_set_trace_info(state->frame->lcu_weights_job,
+                                     "LCU weights", state->frame->num,
+                                     -1, -1, -1);
+
+  for (int y = 0; y < ctrl->in.height_in_lcu; y++) {
+    threadqueue_job_t *job = kvz_threadqueue_job_create(
+        threadqueue, lcu_weights_row_job, &state->frame->lcu_weights_rows[y]);
+    kvz_threadqueue_job_set_priority(job, priority);
+    kvz_threadqueue_job_set_trace_info(job, "LCU weights", state->frame->num,
+                                       -1, -1, y);
+    kvz_threadqueue_job_dep_add(state->frame->lcu_weights_job, job);
+    kvz_threadqueue_submit(threadqueue, job);
+    kvz_threadqueue_free_job(&job);
+  }
+
+  kvz_threadqueue_submit(threadqueue, state->frame->lcu_weights_job);
+}
+
+/**
+ * \brief Compute the spatial activity of the frame for adaptive quantization.
+ *
+ * Must be called after the source picture of the frame has been set.
+ */
+void kvz_init_aq_activity(encoder_state_t * const state)
+{
+  const encoder_control_t * const ctrl = state->encoder_control;
+  if (ctrl->cfg.aq == KVZ_AQ_OFF) return;
+
+  const kvz_picture * const src = state->tile->frame->source;
+  const int width_in_blocks  = ctrl->in.width  / 8;
+  const int height_in_blocks = ctrl->in.height / 8;
+
+  double sum = 0.0;
+  for (int y = 0; y < height_in_blocks; y++) {
+    for (int x = 0; x < width_in_blocks; x++) {
+      const kvz_pixel *block = &src->y[8 * x + 8 * y * src->stride];
+      const unsigned var = kvz_pixel_var_8x8(block, src->stride);
+      // The variance is scaled by 64 but the scale is cancelled out when
+      // the mean is subtracted.
+      const double activity = log2(MAX(var, 1));
+      state->frame->aq_activity[x + y * width_in_blocks] = activity;
+      sum += activity;
+    }
+  }
+  state->frame->aq_activity_mean = sum / (width_in_blocks * height_in_blocks);
+}
+
+/**
+ * \brief Set QP and lambda for a CU when adaptive quantization is used.
+ *
+ * The QP of the LCU is offset according to how the spatial activity of the
+ * CU differs from the average activity of the frame.
+ *
+ * \param state  encoder state
+ * \param x      x-coordinate of the CU in the tile in pixels
+ * \param y      y-coordinate of the CU in the tile in pixels
+ * \param depth  depth of the CU in the quadtree
+ */
+void kvz_set_cu_lambda_and_qp(encoder_state_t * const state,
+                              int x, int y, int depth)
+{
+  const encoder_control_t * const ctrl = state->encoder_control;
+  const int width_in_blocks  = ctrl->in.width  / 8;
+  const int height_in_blocks = ctrl->in.height / 8;
+  const int cu_blocks = (LCU_WIDTH >> depth) / 8;
+
+  const int x_begin = (x + state->tile->offset_x) / 8;
+  const int y_begin = (y + state->tile->offset_y) / 8;
+  const int x_end = MIN(x_begin + cu_blocks, width_in_blocks);
+  const int y_end = MIN(y_begin + cu_blocks, height_in_blocks);
+
+  double sum = 0.0;
+  for (int by = y_begin; by < y_end; by++) {
+    for (int bx = x_begin; bx < x_end; bx++) {
+      sum += state->frame->aq_activity[bx + by * width_in_blocks];
+    }
+  }
+  const double activity = sum / ((x_end - x_begin) * (y_end - y_begin));
+
+  // Offset the QP by one for each doubling of the variance like x264 does.
+  const double offset = ctrl->cfg.aq_strength *
+                        (activity - state->frame->aq_activity_mean);
+  const int dqp = CLIP(-AQ_MAX_DQP, AQ_MAX_DQP, (int)lround(offset));
+
+  state->qp          = CLIP_TO_QP(state->lcu_qp + dqp);
+  state->lambda      = state->lcu_lambda * pow(2.0, (state->qp - state->lcu_qp) / 3.0);
+  state->lambda_sqrt = sqrt(state->lambda);
 }
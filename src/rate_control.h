@@ -35,4 +35,13 @@ void kvz_set_picture_lambda_and_qp(encoder_state_t * const state);
 void kvz_set_lcu_lambda_and_qp(encoder_state_t * const state,
                                vector2d_t pos);
 
+void kvz_update_vbv_fullness(encoder_state_t * const state);
+
+void kvz_init_lcu_weights(encoder_state_t * const state);
+
+void kvz_init_aq_activity(encoder_state_t * const state);
+
+void kvz_set_cu_lambda_and_qp(encoder_state_t * const state,
+                              int x, int y, int depth);
+
 #endif // RATE_CONTROL_H_
@@ -0,0 +1,400 @@
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2013-2015 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * Kvazaar is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+/*
+ * Statistics file of two-pass rate control.
+ *
+ * The first pass writes a record for each frame in coding order. The file
+ * starts with a header identifying the format, the picture size and the
+ * frame structure:
+ *
+ *   magic "KVZS", version (u32), width, height, width_in_lcu,
+ *   height_in_lcu, gop_len, gop_lowdelay, intra_period (u32 each)
+ *
+ * Each frame record is followed by a record for each LCU in raster order:
+ *
+ *   frame: num (u32), poc (u32), slicetype (u8), qp (u8), lambda (f64),
+ *          bits (u64)
+ *   LCU:   bits (u32)
+ *
+ * All values are little-endian.
+ *
+ * The second pass reads the whole file and allocates the target number of
+ * bits of the sequence to the frames in proportion to the bits they took
+ * in the first pass. It must code the same frames with the same frame
+ * structure.
+ */
+
+#include "rc_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "encoder.h"
+#include "encoderstate.h"
+
+
+#define RC_STATS_MAGIC "KVZS"
+#define RC_STATS_VERSION 2
+
+
+struct kvz_rc_stats_t {
+  //! \brief File being written in the first pass, or NULL
+  FILE *file;
+
+  int32_t width_in_lcu;
+  int32_t height_in_lcu;
+
+  //! \brief Frames read in the second pass
+  kvz_rc_stats_frame_t *frames;
+  int32_t num_frames;
+
+  //! \brief Sum of target_bits of frame i and the frames after it
+  double *target_bits_from;
+};
+
+
+static void put_uint(FILE *file, uint64_t value, int bytes)
+{
+  uint8_t buf[8];
+  for (int i = 0; i < bytes; i++) {
+    buf[i] = (uint8_t)(value >> (8 * i));
+  }
+  fwrite(buf, 1, bytes, file);
+}
+
+static void put_double(FILE *file, double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  put_uint(file, bits, 8);
+}
+
+/**
+ * \brief Read a little-endian integer.
+ * \return 1 on success, 0 at the end of the file
+ */
+static int get_uint(FILE *file, uint64_t *value, int bytes)
+{
+  uint8_t buf[8];
+  if (fread(buf, 1, bytes, file) != (size_t)bytes) return 0;
+  *value = 0;
+  for (int i = 0; i < bytes; i++) {
+    *value |= (uint64_t)buf[i] << (8 * i);
+  }
+  return 1;
+}
+
+static int get_double(FILE *file, double *value)
+{
+  uint64_t bits;
+  if (!get_uint(file, &bits, 8)) return 0;
+  memcpy(value, &bits, sizeof(*value));
+  return 1;
+}
+
+
+/**
+ * \brief Create a statistics file for the first pass and write the header.
+ *
+ * \return the statistics, or NULL on failure
+ */
+kvz_rc_stats_t * kvz_rc_stats_create(const char *filename,
+                                     const encoder_control_t *encoder)
+{
+  kvz_rc_stats_t *stats = calloc(1, sizeof(kvz_rc_stats_t));
+  if (!stats) return NULL;
+
+  stats->file = fopen(filename, "wb");
+  if (!stats->file) {
+    fprintf(stderr, "Could not open stats file \"%s\"!\n", filename);
+    free(stats);
+    return NULL;
+  }
+  stats->width_in_lcu  = encoder->in.width_in_lcu;
+  stats->height_in_lcu = encoder->in.height_in_lcu;
+
+  fwrite(RC_STATS_MAGIC, 1, 4, stats->file);
+  put_uint(stats->file, RC_STATS_VERSION, 4);
+  put_uint(stats->file, encoder->in.width, 4);
+  put_uint(stats->file, encoder->in.height, 4);
+  put_uint(stats->file, stats->width_in_lcu, 4);
+  put_uint(stats->file, stats->height_in_lcu, 4);
+  put_uint(stats->file, encoder->cfg.gop_len, 4);
+  put_uint(stats->file, encoder->cfg.gop_lowdelay, 4);
+  put_uint(stats->file, encoder->cfg.intra_period, 4);
+
+  return stats;
+}
+
+
+/**
+ * \brief Read a single frame record.
+ * \return 1 on success, 0 at the end of the file or on failure
+ */
+static int read_frame(FILE *file, int num_lcus, kvz_rc_stats_frame_t *frame)
+{
+  uint64_t num, poc, slicetype, qp;
+  if (!get_uint(file, &num, 4) ||
+      !get_uint(file, &poc, 4) ||
+      !get_uint(file, &slicetype, 1) ||
+      !get_uint(file, &qp, 1) ||
+      !get_double(file, &frame->lambda) ||
+      !get_uint(file, &frame->bits, 8)) {
+    return 0;
+  }
+  frame->num       = (int32_t)num;
+  frame->poc       = (int32_t)poc;
+  frame->slicetype = (int8_t)slicetype;
+  frame->qp        = (int8_t)qp;
+
+  frame->lcu_bits = MALLOC(uint32_t, num_lcus);
+  if (!frame->lcu_bits) return 0;
+
+  frame->lcu_bits_sum = 0;
+  for (int i = 0; i < num_lcus; i++) {
+    uint64_t bits;
+    if (!get_uint(file, &bits, 4)) return 0;
+    frame->lcu_bits[i] = (uint32_t)bits;
+    frame->lcu_bits_sum += bits;
+  }
+  return 1;
+}
+
+
+/**
+ * \brief Allocate the target bits of the sequence to the frames.
+ *
+ * The first pass uses a constant QP, so its bits show how the frames
+ * differ in complexity at a constant quality. Scaling them all by the same
+ * factor keeps the quality constant.
+ */
+static int plan_bits(kvz_rc_stats_t *stats, const encoder_control_t *encoder)
+{
+  uint64_t total_bits = 0;
+  for (int i = 0; i < stats->num_frames; i++) {
+    total_bits += stats->frames[i].bits;
+  }
+  const double target = encoder->rc.target_avg_bppic * stats->num_frames;
+  const double scale = target / MAX(1, total_bits);
+
+  stats->target_bits_from = MALLOC(double, stats->num_frames + 1);
+  if (!stats->target_bits_from) return 0;
+
+  stats->target_bits_from[stats->num_frames] = 0.0;
+  for (int i = stats->num_frames - 1; i >= 0; i--) {
+    stats->frames[i].target_bits = stats->frames[i].bits * scale;
+    stats->target_bits_from[i] = stats->target_bits_from[i + 1] +
+                                 stats->frames[i].target_bits;
+  }
+  return 1;
+}
+
+
+/**
+ * \brief Read a statistics file written by the first pass and allocate bits
+ * for the second pass.
+ *
+ * \return the statistics, or NULL on failure
+ */
+kvz_rc_stats_t * kvz_rc_stats_read(const char *filename,
+                                   const encoder_control_t *encoder)
+{
+  FILE *file = fopen(filename, "rb");
+  if (!file) {
+    fprintf(stderr, "Could not open stats file \"%s\"!\n", filename);
+    return NULL;
+  }
+
+  kvz_rc_stats_t *stats = calloc(1, sizeof(kvz_rc_stats_t));
+  if (!stats) goto failed;
+
+  char magic[4];
+  uint64_t version, width, height, width_in_lcu, height_in_lcu;
+  uint64_t gop_len, gop_lowdelay, intra_period;
+  if (fread(magic, 1, 4, file) != 4 ||
+      memcmp(magic, RC_STATS_MAGIC, 4) != 0 ||
+      !get_uint(file, &version, 4) ||
+      version != RC_STATS_VERSION ||
+      !get_uint(file, &width, 4) ||
+      !get_uint(file, &height, 4) ||
+      !get_uint(file, &width_in_lcu, 4) ||
+      !get_uint(file, &height_in_lcu, 4) ||
+      !get_uint(file, &gop_len, 4) ||
+      !get_uint(file, &gop_lowdelay, 4) ||
+      !get_uint(file, &intra_period, 4)) {
+    fprintf(stderr, "Invalid stats file \"%s\"!\n", filename);
+    goto failed;
+  }
+  if (width != (uint64_t)encoder->in.width ||
+      height != (uint64_t)encoder->in.height) {
+    fprintf(stderr, "Stats file \"%s\" is for a different resolution!\n", filename);
+    goto failed;
+  }
+  if (gop_len != (uint64_t)encoder->cfg.gop_len ||
+      gop_lowdelay != (uint64_t)encoder->cfg.gop_lowdelay ||
+      intra_period != (uint64_t)encoder->cfg.intra_period) {
+    fprintf(stderr, "Stats file \"%s\" is for a different GOP or intra period!\n", filename);
+    goto failed;
+  }
+  stats->width_in_lcu  = (int32_t)width_in_lcu;
+  stats->height_in_lcu = (int32_t)height_in_lcu;
+  const int num_lcus = stats->width_in_lcu * stats->height_in_lcu;
+
+  int32_t frames_size = 0;
+  for (;;) {
+    if (stats->num_frames == frames_size) {
+      frames_size = MAX(64, frames_size * 2);
+      kvz_rc_stats_frame_t *frames = realloc(stats->frames,
+                                             frames_size * sizeof(kvz_rc_stats_frame_t));
+      if (!frames) goto failed;
+      stats->frames = frames;
+    }
+
+    kvz_rc_stats_frame_t *frame = &stats->frames[stats->num_frames];
+    memset(frame, 0, sizeof(*frame));
+    if (!read_frame(file, num_lcus, frame)) {
+      FREE_POINTER(frame->lcu_bits);
+      break;
+    }
+    if (frame->num != stats->num_frames) {
+      fprintf(stderr, "Invalid stats file \"%s\"!\n", filename);
+      stats->num_frames++;
+      goto failed;
+    }
+    stats->num_frames++;
+  }
+
+  if (!feof(file) || stats->num_frames == 0) {
+    fprintf(stderr, "Invalid stats file \"%s\"!\n", filename);
+    goto failed;
+  }
+  if (!plan_bits(stats, encoder)) goto failed;
+
+  fclose(file);
+  return stats;
+
+failed:
+  fclose(file);
+  kvz_rc_stats_close(stats);
+  return NULL;
+}
+
+
+/**
+ * \brief Close the file and free the statistics.
+ *
+ * \return 1 on success, 0 if writing the file failed
+ */
+int kvz_rc_stats_close(kvz_rc_stats_t *stats)
+{
+  if (!stats) return 1;
+
+  int success = 1;
+  if (stats->file) {
+    success = !ferror(stats->file);
+    if (fclose(stats->file)) success = 0;
+    if (!success) {
+      fprintf(stderr, "Failed to write stats file!\n");
+    }
+  }
+
+  for (int i = 0; i < stats->num_frames; i++) {
+    FREE_POINTER(stats->frames[i].lcu_bits);
+  }
+  FREE_POINTER(stats->frames);
+  FREE_POINTER(stats->target_bits_from);
+  free(stats);
+
+  return success;
+}
+
+
+/**
+ * \brief Write the statistics of an encoded frame.
+ *
+ * Frames must be written in coding order after their bitstream has been
+ * written.
+ *
+ * \param state   the main encoder state of the frame
+ * \return 1 on success, 0 on failure
+ */
+int kvz_rc_stats_write_frame(kvz_rc_stats_t *stats, const encoder_state_t *state)
+{
+  FILE *file = stats->file;
+
+  put_uint(file, (uint32_t)state->frame->num, 4);
+  put_uint(file, (uint32_t)state->frame->poc, 4);
+  put_uint(file, (uint8_t)state->frame->slicetype, 1);
+  put_uint(file, (uint8_t)state->frame->QP, 1);
+  put_double(file, state->frame->lambda);
+  put_uint(file, (uint64_t)state->stats_bitstream_length * 8, 8);
+
+  const int num_lcus = stats->width_in_lcu * stats->height_in_lcu;
+  for (int i = 0; i < num_lcus; i++) {
+    put_uint(file, state->frame->lcu_stats[i].bits, 4);
+  }
+
+  return !ferror(file);
+}
+
+
+/**
+ * \brief Get the first pass statistics of a frame.
+ *
+ * \param num   frame number in coding order
+ * \return the statistics, or NULL if the frame is not in the file
+ */
+const kvz_rc_stats_frame_t * kvz_rc_stats_get_frame(const kvz_rc_stats_t *stats,
+                                                    int32_t num)
+{
+  if (num < 0 || num >= stats->num_frames) return NULL;
+  return &stats->frames[num];
+}
+
+
+/**
+ * \brief Get the number of frames in the statistics.
+ */
+int32_t kvz_rc_stats_num_frames(const kvz_rc_stats_t *stats)
+{
+  return stats->num_frames;
+}
+
+
+/**
+ * \brief Get the number of bits allocated to a frame and the frames after
+ * it in the second pass.
+ */
+double kvz_rc_stats_target_bits_from(const kvz_rc_stats_t *stats, int32_t num)
+{
+  return stats->target_bits_from[CLIP(0, stats->num_frames, num)];
+}
+
+
+/**
+ * \brief Get the number of bits allocated to the whole sequence in the
+ * second pass.
+ */
+double kvz_rc_stats_total_target_bits(const kvz_rc_stats_t *stats)
+{
+  return stats->target_bits_from[0];
+}
@@ -0,0 +1,78 @@
+#ifndef RC_STATS_H_
+#define RC_STATS_H_
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2013-2015 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * Kvazaar is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+/**
+ * \ingroup Control
+ * \file
+ * Statistics file of two-pass rate control.
+ */
+
+#include "global.h" // IWYU pragma: keep
+
+
+// Forward declarations.
+struct encoder_control_t;
+struct encoder_state_t;
+
+/**
+ * \brief Statistics of a frame encoded in the first pass.
+ */
+typedef struct {
+  int32_t num; /*!< \brief Frame number in coding order */
+  int32_t poc;
+  int8_t slicetype;
+  int8_t qp;
+  double lambda;
+
+  //! \brief Number of bits in the frame, including headers
+  uint64_t bits;
+
+  //! \brief Number of bits in each LCU in raster order
+  uint32_t *lcu_bits;
+  //! \brief Sum of lcu_bits
+  uint64_t lcu_bits_sum;
+
+  /**
+   * \brief Number of bits allocated for the frame in the second pass.
+   */
+  double target_bits;
+} kvz_rc_stats_frame_t;
+
+typedef struct kvz_rc_stats_t kvz_rc_stats_t;
+
+kvz_rc_stats_t * kvz_rc_stats_create(const char *filename,
+                                     const struct encoder_control_t *encoder);
+kvz_rc_stats_t * kvz_rc_stats_read(const char *filename,
+                                   const struct encoder_control_t *encoder);
+int kvz_rc_stats_close(kvz_rc_stats_t *stats);
+
+int kvz_rc_stats_write_frame(kvz_rc_stats_t *stats,
+                             const struct encoder_state_t *state);
+
+const kvz_rc_stats_frame_t * kvz_rc_stats_get_frame(const kvz_rc_stats_t *stats,
+                                                    int32_t num);
+int32_t kvz_rc_stats_num_frames(const kvz_rc_stats_t *stats);
+double kvz_rc_stats_target_bits_from(const kvz_rc_stats_t *stats,
+                                     int32_t num);
+double kvz_rc_stats_total_target_bits(const kvz_rc_stats_t *stats);
+
+#endif // RC_STATS_H_
@@ -29,6 +29,7 @@
 #include "inter.h"
 #include "intra.h"
 #include "kvazaar.h"
+#include "rate_control.h"
 #include "rdo.h"
 #include "search_inter.h"
 #include "search_intra.h"
@@ -442,6 +443,17 @@ static double search_cu(encoder_state_t * const state, int x, int y, int depth,
     return 0;
   }
 
+  // Each quantization group gets its own QP with adaptive quantization. The
+  // QP of the parent CU is restored before returning.
+  const bool set_cu_qp = ctrl->cfg.aq != KVZ_AQ_OFF &&
+                         depth <= ctrl->max_qp_delta_depth;
+  const int8_t parent_qp = state->qp;
+  const double parent_lambda = state->lambda;
+  const double parent_lambda_sqrt = state->lambda_sqrt;
+  if (set_cu_qp) {
+    kvz_set_cu_lambda_and_qp(state, x, y, depth);
+  }
+
   cur_cu = LCU_GET_CU_AT_PX(lcu, x_local, y_local);
   // Assign correct depth
   cur_cu->depth = depth > MAX_DEPTH ? MAX_DEPTH : depth;
@@ -455,12 +467,12 @@ static double search_cu(encoder_state_t * const state, int x, int y, int depth,
   if (x + cu_width <= frame->width &&
       y + cu_width <= frame->height)
   {
-    int cu_width_inter_min = LCU_WIDTH >> ctrl->cfg.pu_depth_inter.max;
+    int cu_width_inter_min = LCU_WIDTH >> state->frame->search.pu_depth_inter.max;
     bool can_use_inter =
       state->frame->slicetype != KVZ_SLICE_I &&
       depth <= MAX_DEPTH &&
       (
-        WITHIN(depth, ctrl->cfg.pu_depth_inter.min, ctrl->cfg.pu_depth_inter.max) ||
+        WITHIN(depth, state->frame->search.pu_depth_inter.min, state->frame->search.pu_depth_inter.max) ||
         // When the split was forced because the CTU is partially outside the
         // frame, we permit inter coding even if pu_depth_inter would
         // otherwise forbid it.
@@ -512,13 +524,13 @@ static double search_cu(encoder_state_t * const state, int x, int y, int depth,
     // Try to skip intra search in rd==0 mode.
     // This can be quite severe on bdrate. It might be better to do this
     // decision after reconstructing the inter frame.
-    bool skip_intra = state->encoder_control->cfg.rdo == 0
+    bool skip_intra = state->frame->search.rdo == 0
                       && cur_cu->type != CU_NOTSET
                       && cost / (cu_width * cu_width) < INTRA_THRESHOLD;
 
-    int32_t cu_width_intra_min = LCU_WIDTH >> ctrl->cfg.pu_depth_intra.max;
+    int32_t cu_width_intra_min = LCU_WIDTH >> state->frame->search.pu_depth_intra.max;
     bool can_use_intra =
-        WITHIN(depth, ctrl->cfg.pu_depth_intra.min, ctrl->cfg.pu_depth_intra.max) ||
+        WITHIN(depth, state->frame->search.pu_depth_intra.min, state->frame->search.pu_depth_intra.max) ||
         // When the split was forced because the CTU is partially outside
         // the frame, we permit intra coding even if pu_depth_intra would
         // otherwise forbid it.
@@ -555,7 +567,7 @@ static double search_cu(encoder_state_t * const state, int x, int y, int depth,
         // rd2. Possibly because the luma mode search already takes chroma
         // into account, so there is less of a chanse of luma mode being
         // really bad for chroma.
-        if (ctrl->cfg.rdo == 3) {
+        if (state->frame->search.rdo == 3) {
           cur_cu->intra.mode_chroma = kvz_search_cu_intra_chroma(state, x, y, depth, lcu);
           lcu_fill_cu_info(lcu, x_local, y_local, cu_width, cu_width, cur_cu);
         }
@@ -646,9 +658,9 @@ static double search_cu(encoder_state_t * const state, int x, int y, int depth,
     // If the CU is partially outside the frame, we need to split it even
     // if pu_depth_intra and pu_depth_inter would not permit it.
     cur_cu->type == CU_NOTSET ||
-    depth < ctrl->cfg.pu_depth_intra.max ||
+    depth < state->frame->search.pu_depth_intra.max ||
     (state->frame->slicetype != KVZ_SLICE_I &&
-      depth < ctrl->cfg.pu_depth_inter.max);
+      depth < state->frame->search.pu_depth_inter.max);
 
   // Recursively split all the way to max search depth.
   if (can_split_cu) {
@@ -749,6 +761,12 @@ static double search_cu(encoder_state_t * const state, int x, int y, int depth,
 
   assert(cur_cu->type != CU_NOTSET);
 
+  if (set_cu_qp) {
+    state->qp          = parent_qp;
+    state->lambda      = parent_lambda;
+    state->lambda_sqrt = parent_lambda_sqrt;
+  }
+
   return cost;
 }
 
@@ -906,11 +924,18 @@ void kvz_search_lcu(encoder_state_t * const state, const int x, const int y, con
     work_tree[depth] = work_tree[0];
   }
 
+  // The motion vector cache only holds the vectors of this LCU.
+  inter_mv_cache_t mv_cache;
+  if (state->encoder_control->cfg.me_cache) {
+    memset(mv_cache.entries, 0,
+           state->frame->ref->used_size * sizeof(mv_cache.entries[0]));
+    state->mv_cache = &mv_cache;
+  }
+
   // Start search from depth 0.
-  double cost = search_cu(state, x, y, 0, work_tree);
+  search_cu(state, x, y, 0, work_tree);
 
-  // Save squared cost for rate control.
-  kvz_get_lcu_stats(state, x / LCU_WIDTH, y / LCU_WIDTH)->weight = cost * cost;
+  state->mv_cache = NULL;
 
   // The best decisions through out the LCU got propagated back to depth 0,
   // so copy those back to the frame.
@@ -33,9 +33,31 @@
 #include "search.h"
 #include "strategies/strategies-ipol.h"
 #include "strategies/strategies-picture.h"
+#include "subpel_planes.h"
+#include "threadqueue.h"
 #include "transform.h"
 #include "videoframe.h"
 
+/**
+ * \brief Smallest PU, in luma pixels, whose reference frames are searched
+ * in parallel jobs with --me-ref-jobs.
+ *
+ * The search of smaller PUs is too short to be worth a job.
+ */
+#define ME_REF_JOBS_MIN_PU_AREA (32 * 32)
+
+/**
+ * \brief Largest number of motion vectors whose SADs check_mv_costs
+ * computes in one call to kvz_reg_sad_multi.
+ */
+#define MAX_MV_BATCH 8
+
+/**
+ * \brief Largest number of motion vectors taken from the motion vector
+ * cache for a PU.
+ */
+#define MAX_CACHED_MVS 4
+
 typedef struct {
   encoder_state_t *state;
 
@@ -78,6 +100,13 @@ typedef struct {
    * \brief Bit cost of best_mv
    */
   uint32_t best_bitcost;
+
+  /**
+   * \brief Integer motion vectors found for the blocks of the PU in the
+   * motion vector cache
+   */
+  vector2d_t cached_mvs[MAX_CACHED_MVS];
+  int32_t num_cached_mvs;
 } inter_search_info_t;
 
 
@@ -91,7 +120,7 @@ static INLINE bool fracmv_within_tile(const inter_search_info_t *info, int x, in
   const bool is_frac_luma   = x % 4 != 0 || y % 4 != 0;
   const bool is_frac_chroma = x % 8 != 0 || y % 8 != 0;
 
-  if (ctrl->cfg.owf && ctrl->cfg.wpp) {
+  if (ctrl->constrain_inter_ref) {
     // Check that the block does not reference pixels that are not final.
 
     // Margin as luma pixels.
@@ -181,6 +210,39 @@ static INLINE bool intmv_within_tile(const inter_search_info_t *info, int x, int
 }
 
 
+/**
+ * \brief Add the bit cost of an integer motion vector to its SAD and update
+ * the best motion vector.
+ *
+ * \return true if info->best_mv was changed, false otherwise
+ */
+static bool update_best_mv(inter_search_info_t *info, int x, int y, uint32_t cost)
+{
+  if (cost >= info->best_cost) return false;
+
+  uint32_t bitcost = 0;
+  cost += info->mvd_cost_func(
+      info->state,
+      x, y, 2,
+      info->mv_cand,
+      info->merge_cand,
+      info->num_merge_cand,
+      info->ref_idx,
+      &bitcost
+  );
+
+  if (cost >= info->best_cost) return false;
+
+  // Set to motion vector in quarter pixel precision.
+  info->best_mv.x = x * 4;
+  info->best_mv.y = y * 4;
+  info->best_cost = cost;
+  info->best_bitcost = bitcost;
+
+  return true;
+}
+
+
 /**
  * \brief Calculate cost for an integer motion vector.
  *
@@ -196,7 +258,6 @@ static bool check_mv_cost(inter_search_info_t *info, int x, int y)
 {
   if (!intmv_within_tile(info, x, y)) return false;
 
-  uint32_t bitcost = 0;
   uint32_t cost = kvz_image_calc_sad(
       info->pic,
       info->ref,
@@ -208,27 +269,77 @@ static bool check_mv_cost(inter_search_info_t *info, int x, int y)
       info->height
   );
 
-  if (cost >= info->best_cost) return false;
+  return update_best_mv(info, x, y, cost);
+}
 
-  cost += info->mvd_cost_func(
-      info->state,
-      x, y, 2,
-      info->mv_cand,
-      info->merge_cand,
-      info->num_merge_cand,
-      info->ref_idx,
-      &bitcost
-  );
 
-  if (cost >= info->best_cost) return false;
+/**
+ * \brief Calculate costs for several integer motion vectors.
+ *
+ * Equal to calling check_mv_cost for each vector in order, but the SADs of
+ * the vectors referring to blocks inside the frame are computed with a
+ * single call to kvz_reg_sad_multi for up to MAX_MV_BATCH vectors at a time.
+ *
+ * \param info  search info
+ * \param mvs   integer motion vectors
+ * \param num   number of vectors in mvs
+ * \return index of the last vector that changed info->best_mv, or -1 if
+ *         none of them did
+ */
+static int check_mv_costs(inter_search_info_t *info, const vector2d_t *mvs, int num)
+{
+  const kvz_picture *pic = info->pic;
+  const kvz_picture *ref = info->ref;
+  const int offset_x = info->state->tile->offset_x + info->origin.x;
+  const int offset_y = info->state->tile->offset_y + info->origin.y;
+  const kvz_pixel *block = &pic->y[info->origin.y * pic->stride + info->origin.x];
 
-  // Set to motion vector in quarter pixel precision.
-  info->best_mv.x = x * 4;
-  info->best_mv.y = y * 4;
-  info->best_cost = cost;
-  info->best_bitcost = bitcost;
+  int best_index = -1;
 
-  return true;
+  for (int start = 0; start < num; start += MAX_MV_BATCH) {
+    const int count = MIN(num - start, MAX_MV_BATCH);
+
+    // Indices and top-left pixels of the vectors whose SAD is computed with
+    // kvz_reg_sad_multi.
+    int indices[MAX_MV_BATCH];
+    const kvz_pixel *ref_blocks[MAX_MV_BATCH];
+    unsigned sads[MAX_MV_BATCH];
+    int num_inside = 0;
+
+    for (int i = start; i < start + count; ++i) {
+      const int ref_x = offset_x + mvs[i].x;
+      const int ref_y = offset_y + mvs[i].y;
+      if (ref_x >= 0 && ref_x <= ref->width  - info->width &&
+          ref_y >= 0 && ref_y <= ref->height - info->height &&
+          intmv_within_tile(info, mvs[i].x, mvs[i].y))
+      {
+        indices[num_inside] = i;
+        ref_blocks[num_inside] = &ref->y[ref_y * ref->stride + ref_x];
+        num_inside++;
+      }
+    }
+
+    if (num_inside > 0) {
+      kvz_reg_sad_multi(block, ref_blocks, num_inside,
+                        info->width, info->height,
+                        pic->stride, ref->stride,
+                        sads);
+    }
+
+    for (int i = start, j = 0; i < start + count; ++i) {
+      bool improved;
+      if (j < num_inside && indices[j] == i) {
+        improved = update_best_mv(info, mvs[i].x, mvs[i].y,
+                                  sads[j] >> (KVZ_BIT_DEPTH - 8));
+        j++;
+      } else {
+        improved = check_mv_cost(info, mvs[i].x, mvs[i].y);
+      }
+      if (improved) best_index = i;
+    }
+  }
+
+  return best_index;
 }
 
 
@@ -276,8 +387,8 @@ static bool mv_in_merge(const inter_search_info_t *info, vector2d_t mv)
 /**
  * \brief Select starting point for integer motion estimation search.
  *
- * Checks the zero vector, extra_mv and merge candidates and updates
- * info->best_mv to the best one.
+ * Checks the zero vector, extra_mv, merge candidates and the vectors
+ * from the motion vector cache and updates info->best_mv to the best one.
  */
 static void select_starting_point(inter_search_info_t *info, vector2d_t extra_mv)
 {
@@ -304,6 +415,8 @@ static void select_starting_point(inter_search_info_t *info, vector2d_t extra_mv
 
     check_mv_cost(info, x, y);
   }
+
+  check_mv_costs(info, info->cached_mvs, info->num_cached_mvs);
 }
 
 
@@ -434,14 +547,16 @@ static bool early_terminate(inter_search_info_t *info)
       threshold = info->best_cost;
     }
 
-    int best_index = 6;
+    vector2d_t mvs[4];
     for (int i = first_index; i <= last_index; i++) {
-      int x = mv.x + small_hexbs[i].x;
-      int y = mv.y + small_hexbs[i].y;
+      mvs[i - first_index].x = mv.x + small_hexbs[i].x;
+      mvs[i - first_index].y = mv.y + small_hexbs[i].y;
+    }
 
-      if (check_mv_cost(info, x, y)) {
-        best_index = i;
-      }
+    int best_index = 6;
+    const int best = check_mv_costs(info, mvs, last_index - first_index + 1);
+    if (best >= 0) {
+      best_index = first_index + best;
     }
 
     // Adjust the movement vector
@@ -560,16 +675,12 @@ void kvz_tz_pattern_search(inter_search_info_t *info,
   }
 
   // Compute SAD values for all chosen points.
-  int best_index = -1;
+  vector2d_t mvs[8];
   for (int i = 0; i < n_points; i++) {
-    vector2d_t offset = pattern[pattern_type][i];
-    int x = mv.x + offset.x;
-    int y = mv.y + offset.y;
-
-    if (check_mv_cost(info, x, y)) {
-      best_index = i;
-    }
+    mvs[i].x = mv.x + pattern[pattern_type][i].x;
+    mvs[i].y = mv.y + pattern[pattern_type][i].y;
   }
+  const int best_index = check_mv_costs(info, mvs, n_points);
 
   if (best_index >= 0) {
     *best_dist = iDist;
@@ -585,9 +696,17 @@ void kvz_tz_raster_search(inter_search_info_t *info,
 
   //compute SAD values for every point in the iRaster downsampled version of the current search area
   for (int y = iSearchRange; y >= -iSearchRange; y -= iRaster) {
+    vector2d_t mvs[MAX_MV_BATCH];
+    int num = 0;
     for (int x = -iSearchRange; x <= iSearchRange; x += iRaster) {
-      check_mv_cost(info, mv.x + x, mv.y + y);
+      mvs[num].x = mv.x + x;
+      mvs[num].y = mv.y + y;
+      if (++num == MAX_MV_BATCH) {
+        check_mv_costs(info, mvs, num);
+        num = 0;
+      }
     }
+    check_mv_costs(info, mvs, num);
   }
 }
 
@@ -731,10 +850,14 @@ static void hexagon_search(inter_search_info_t *info, vector2d_t extra_mv, uint3
   int best_index = 0;
 
   // Search the initial 7 points of the hexagon.
+  vector2d_t mvs[8];
   for (int i = 1; i < 7; ++i) {
-    if (check_mv_cost(info, mv.x + large_hexbs[i].x, mv.y + large_hexbs[i].y)) {
-      best_index = i;
-    }
+    mvs[i - 1].x = mv.x + large_hexbs[i].x;
+    mvs[i - 1].y = mv.y + large_hexbs[i].y;
+  }
+  const int best_initial = check_mv_costs(info, mvs, 6);
+  if (best_initial >= 0) {
+    best_index = 1 + best_initial;
   }
 
   // Iteratively search the 3 new points around the best match, until the best
@@ -760,10 +883,12 @@ static void hexagon_search(inter_search_info_t *info, vector2d_t extra_mv, uint3
 
     // Iterate through the next 3 points.
     for (int i = 0; i < 3; ++i) {
-      vector2d_t offset = large_hexbs[start + i];
-      if (check_mv_cost(info, mv.x + offset.x, mv.y + offset.y)) {
-        best_index = start + i;
-      }
+      mvs[i].x = mv.x + large_hexbs[start + i].x;
+      mvs[i].y = mv.y + large_hexbs[start + i].y;
+    }
+    const int best_new = check_mv_costs(info, mvs, 3);
+    if (best_new >= 0) {
+      best_index = start + best_new;
     }
   }
 
@@ -773,8 +898,10 @@ static void hexagon_search(inter_search_info_t *info, vector2d_t extra_mv, uint3
 
   // Do the final step of the search with a small pattern.
   for (int i = 1; i < 9; ++i) {
-    check_mv_cost(info, mv.x + small_hexbs[i].x, mv.y + small_hexbs[i].y);
+    mvs[i - 1].x = mv.x + small_hexbs[i].x;
+    mvs[i - 1].y = mv.y + small_hexbs[i].y;
   }
+  check_mv_costs(info, mvs, 8);
 }
 
 /**
@@ -832,10 +959,14 @@ static void diamond_search(inter_search_info_t *info, vector2d_t extra_mv, uint3
   enum diapos best_index = DIA_CENTER;
 
   // initial search of the points of the diamond
+  vector2d_t mvs[5];
   for (int i = 0; i < 5; ++i) {
-    if (check_mv_cost(info, mv.x + diamond[i].x, mv.y + diamond[i].y)) {
-      best_index = i;
-    }
+    mvs[i].x = mv.x + diamond[i].x;
+    mvs[i].y = mv.y + diamond[i].y;
+  }
+  const int best_initial = check_mv_costs(info, mvs, 5);
+  if (best_initial >= 0) {
+    best_index = best_initial;
   }
 
   if (best_index == DIA_CENTER) {
@@ -859,14 +990,22 @@ static void diamond_search(inter_search_info_t *info, vector2d_t extra_mv, uint3
     if (steps > 0) steps -= 1;
 
     // search the points of the diamond
+    enum diapos dirs[4];
+    int num = 0;
     for (int i = 0; i < 4; ++i) {
       // this is where we came from so it's checked already
       if (i == from_dir) continue;
 
-      if (check_mv_cost(info, mv.x + diamond[i].x, mv.y + diamond[i].y)) {
-        best_index = i;
-        better_found = 1;
-      }
+      dirs[num] = i;
+      mvs[num].x = mv.x + diamond[i].x;
+      mvs[num].y = mv.y + diamond[i].y;
+      num++;
+    }
+
+    const int best = check_mv_costs(info, mvs, num);
+    if (best >= 0) {
+      best_index = dirs[best];
+      better_found = 1;
     }
 
     if (better_found) {
@@ -883,28 +1022,279 @@ static void diamond_search(inter_search_info_t *info, vector2d_t extra_mv, uint3
 }
 
 
+/**
+ * \brief Calculate the cost of an integer motion vector on a level of the
+ * motion estimation pyramid.
+ *
+ * The SAD is scaled to full resolution so that it is comparable with the
+ * bit cost of the vector.
+ *
+ * \param info   search info
+ * \param level  level of the pyramid, 1 for half resolution
+ * \param x      horizontal component of the vector in pixels of the level
+ * \param y      vertical component of the vector in pixels of the level
+ * \return the cost, or UINT32_MAX if the referred block is not inside the
+ *         picture or violates the MV constraints
+ */
+static uint32_t pyramid_mv_cost(inter_search_info_t *info, int level, int x, int y)
+{
+  const kvz_picture *pic = info->state->frame->pyramid[level - 1];
+  const kvz_picture *ref = info->state->frame->ref->pyramids[info->ref_idx][level - 1];
+
+  const int block_x = (info->state->tile->offset_x + info->origin.x) >> level;
+  const int block_y = (info->state->tile->offset_y + info->origin.y) >> level;
+  const int width   = info->width  >> level;
+  const int height  = info->height >> level;
+
+  if (block_x + x < 0 || block_x + x + width  > ref->width ||
+      block_y + y < 0 || block_y + y + height > ref->height ||
+      !intmv_within_tile(info, x << level, y << level))
+  {
+    return UINT32_MAX;
+  }
+
+  uint32_t cost = kvz_reg_sad(&pic->y[block_x + block_y * pic->stride],
+                              &ref->y[block_x + x + (block_y + y) * ref->stride],
+                              width, height,
+                              pic->stride, ref->stride) << (2 * level);
+
+  uint32_t bitcost = 0;
+  cost += info->mvd_cost_func(
+      info->state,
+      x << level, y << level, 2,
+      info->mv_cand,
+      info->merge_cand,
+      info->num_merge_cand,
+      info->ref_idx,
+      &bitcost
+  );
+  return cost;
+}
+
+
+/**
+ * \brief Do motion search using a pyramid of downscaled pictures.
+ *
+ * The best of the zero vector, extra_mv and the merge candidates is used
+ * as the center of a full search on the coarsest level of the pyramid
+ * that the block size allows. The result is refined on each finer level
+ * and given as the extra vector to a hexagon search at full resolution.
+ * This lets the search follow motion that is too fast for the hexagon
+ * search alone.
+ *
+ * \param info      search info
+ * \param extra_mv  extra motion vector to check
+ * \param steps     how many steps the hexagon search does at maximum
+ */
+static void pyramid_search(inter_search_info_t *info, vector2d_t extra_mv, uint32_t steps)
+{
+  const image_list_t *ref_list = info->state->frame->ref;
+
+  // Use the coarsest level that the pyramids of both pictures have and
+  // where the block is at least 4x4 pixels.
+  int levels = 0;
+  while (levels < ME_PYRAMID_LEVELS &&
+         info->state->frame->pyramid[levels] &&
+         ref_list->pyramids[info->ref_idx][levels] &&
+         (info->width  >> (levels + 1)) >= 4 &&
+         (info->height >> (levels + 1)) >= 4)
+  {
+    levels++;
+  }
+
+  if (levels > 0) {
+    // Select the starting point on the coarsest level.
+    vector2d_t cands[2 + MRG_MAX_NUM_CANDS] = {
+      { 0, 0 },
+      { extra_mv.x >> (2 + levels), extra_mv.y >> (2 + levels) },
+    };
+    int num_cands = 2;
+    for (int i = 0; i < info->num_merge_cand; ++i) {
+      if (info->merge_cand[i].dir == 3) continue;
+      const int16_t *mv = info->merge_cand[i].mv[info->merge_cand[i].dir - 1];
+      cands[num_cands].x = mv[0] >> (2 + levels);
+      cands[num_cands].y = mv[1] >> (2 + levels);
+      num_cands++;
+    }
+
+    vector2d_t best = { 0, 0 };
+    uint32_t best_cost = UINT32_MAX;
+    for (int i = 0; i < num_cands; i++) {
+      const uint32_t cost = pyramid_mv_cost(info, levels, cands[i].x, cands[i].y);
+      if (cost < best_cost) {
+        best = cands[i];
+        best_cost = cost;
+      }
+    }
+
+    if (best_cost < UINT32_MAX) {
+      // Full search around the starting point.
+      const vector2d_t start = best;
+      for (int y = -ME_PYRAMID_RANGE; y <= ME_PYRAMID_RANGE; y++) {
+        for (int x = -ME_PYRAMID_RANGE; x <= ME_PYRAMID_RANGE; x++) {
+          const uint32_t cost = pyramid_mv_cost(info, levels, start.x + x, start.y + y);
+          if (cost < best_cost) {
+            best.x = start.x + x;
+            best.y = start.y + y;
+            best_cost = cost;
+          }
+        }
+      }
+
+      // Refine the vector on the finer levels.
+      int level = levels;
+      while (level > 1) {
+        level--;
+        const vector2d_t center = { best.x * 2, best.y * 2 };
+        best = center;
+        best_cost = pyramid_mv_cost(info, level, center.x, center.y);
+        for (int y = -1; y <= 1; y++) {
+          for (int x = -1; x <= 1; x++) {
+            if (x == 0 && y == 0) continue;
+            const uint32_t cost = pyramid_mv_cost(info, level, center.x + x, center.y + y);
+            if (cost < best_cost) {
+              best.x = center.x + x;
+              best.y = center.y + y;
+              best_cost = cost;
+            }
+          }
+        }
+      }
+
+      // Keep the better of extra_mv and the refined vector at full
+      // resolution.
+      info->best_cost = UINT32_MAX;
+      check_mv_cost(info, extra_mv.x >> 2, extra_mv.y >> 2);
+      check_mv_cost(info, best.x << level, best.y << level);
+      if (info->best_cost < UINT32_MAX) {
+        extra_mv = info->best_mv;
+      }
+    }
+  }
+
+  hexagon_search(info, extra_mv, steps);
+}
+
+
+/**
+ * \brief State of the full search.
+ */
+typedef struct {
+  /**
+   * \brief Planes of the reference frame with the integral image, or NULL
+   */
+  const subpel_planes_t *planes;
+  /**
+   * \brief Sum of the pixels of the searched block
+   */
+  uint32_t block_sum;
+
+  /**
+   * \brief Motion vectors waiting to be checked with check_mv_costs
+   */
+  vector2d_t mvs[MAX_MV_BATCH];
+  int num_mvs;
+} full_search_t;
+
+
+static void full_search_flush(inter_search_info_t *info, full_search_t *search)
+{
+  check_mv_costs(info, search->mvs, search->num_mvs);
+  search->num_mvs = 0;
+}
+
+
+/**
+ * \brief Check an integer motion vector in the full search.
+ *
+ * The absolute difference between the sums of the pixels of two blocks is
+ * a lower bound for their SAD. Vectors whose lower bound is not below the
+ * best cost are skipped since check_mv_cost would reject them anyway, so
+ * the result equals checking every vector. The sums of the blocks reaching
+ * outside the frame are those of the padded reference.
+ *
+ * The vectors are checked in batches of MAX_MV_BATCH, so full_search_flush
+ * must be called after the last one.
+ */
+static void full_search_add_mv(inter_search_info_t *info,
+                               full_search_t *search,
+                               int x,
+                               int y)
+{
+  if (search->planes) {
+    const uint32_t ref_sum = kvz_subpel_planes_block_sum(
+        search->planes,
+        info->state->tile->offset_x + info->origin.x + x,
+        info->state->tile->offset_y + info->origin.y + y,
+        info->width,
+        info->height);
+    const uint32_t diff = ref_sum > search->block_sum ?
+                          ref_sum - search->block_sum :
+                          search->block_sum - ref_sum;
+    if ((diff >> (KVZ_BIT_DEPTH - 8)) >= info->best_cost) return;
+  }
+
+  search->mvs[search->num_mvs].x = x;
+  search->mvs[search->num_mvs].y = y;
+  if (++search->num_mvs == MAX_MV_BATCH) {
+    full_search_flush(info, search);
+  }
+}
+
+
+/**
+ * \brief Check every integer motion vector within search_range of center.
+ */
+static void search_mv_full_area(inter_search_info_t *info,
+                                full_search_t *search,
+                                int32_t search_range,
+                                vector2d_t center)
+{
+  for (int y = -search_range; y <= search_range; y++) {
+    for (int x = -search_range; x <= search_range; x++) {
+      full_search_add_mv(info, search, center.x + x, center.y + y);
+    }
+  }
+  full_search_flush(info, search);
+}
+
+
 static void search_mv_full(inter_search_info_t *info,
                            int32_t search_range,
                            vector2d_t extra_mv)
 {
-  // Search around the 0-vector.
-  for (int y = -search_range; y <= search_range; y++) {
-    for (int x = -search_range; x <= search_range; x++) {
-      check_mv_cost(info, x, y);
+  full_search_t search = {
+    .planes    = info->state->frame->ref->subpel_planes[info->ref_idx],
+    .block_sum = 0,
+    .num_mvs   = 0,
+  };
+  if (search.planes && search.planes->sums) {
+    assert(search.planes->rec == info->ref);
+    const kvz_picture *pic = info->pic;
+    for (int y = 0; y < info->height; y++) {
+      const kvz_pixel *row = &pic->y[(info->origin.y + y) * pic->stride + info->origin.x];
+      for (int x = 0; x < info->width; x++) {
+        search.block_sum += row[x];
+      }
     }
+  } else {
+    search.planes = NULL;
   }
 
+  // Check the vectors from the motion vector cache first so that the
+  // vectors worse than them can be skipped.
+  check_mv_costs(info, info->cached_mvs, info->num_cached_mvs);
+
+  // Search around the 0-vector.
+  search_mv_full_area(info, &search, search_range, (vector2d_t){ 0, 0 });
+
   // Change to integer precision.
   extra_mv.x >>= 2;
   extra_mv.y >>= 2;
 
   // Check around extra_mv if it's not one of the merge candidates.
   if (!mv_in_merge(info, extra_mv)) {
-    for (int y = -search_range; y <= search_range; y++) {
-      for (int x = -search_range; x <= search_range; x++) {
-        check_mv_cost(info, extra_mv.x + x, extra_mv.y + y);
-      }
-    }
+    search_mv_full_area(info, &search, search_range, extra_mv);
   }
 
   // Select starting point from among merge candidates. These should include
@@ -949,9 +1339,11 @@ static void search_mv_full(inter_search_info_t *info,
         }
         if (already_tested) continue;
 
-        check_mv_cost(info, x, y);
+        full_search_add_mv(info, &search, x, y);
       }
     }
+
+    full_search_flush(info, &search);
   }
 }
 
@@ -1005,20 +1397,50 @@ static void search_frac(inter_search_info_t *info)
   int8_t sample_off_x = 0;
   int8_t sample_off_y = 0;
 
-  kvz_get_extended_block(orig.x, orig.y, mv.x - 1, mv.y - 1,
-                state->tile->offset_x,
-                state->tile->offset_y,
-                ref->y, ref->width, ref->height, KVZ_LUMA_FILTER_TAPS,
-                internal_width+1, internal_height+1,
-                &src);
+  // Position of the block in the reference frame in quarter pixels.
+  const vector2d_t block_pos = {
+    (orig.x + state->tile->offset_x) * 4,
+    (orig.y + state->tile->offset_y) * 4,
+  };
+  // Position of the block at the integer mv in the reference frame.
+  const vector2d_t ref_pos = {
+    orig.x + state->tile->offset_x + mv.x,
+    orig.y + state->tile->offset_y + mv.y,
+  };
+
+  // Use the interpolated planes of the reference when every searched
+  // position is inside the frame. The blocks reaching outside the frame
+  // are interpolated from the padded reference.
+  const subpel_planes_t *planes = state->frame->ref->subpel_planes[info->ref_idx];
+  if (planes &&
+      (!planes->planes[1] ||
+       ref_pos.x < 1 || ref_pos.x + width  > planes->width ||
+       ref_pos.y < 1 || ref_pos.y + height > planes->height))
+  {
+    planes = NULL;
+  }
+  assert(!planes || planes->rec == ref);
 
   kvz_pixel *tmp_pic = pic->y + orig.y * pic->stride + orig.x;
   int tmp_stride = pic->stride;
-                  
+
   // Search integer position
-  costs[0] = kvz_satd_any_size(width, height,
-                            tmp_pic, tmp_stride,
-                            src.orig_topleft + src.stride + 1, src.stride);
+  if (planes) {
+    costs[0] = kvz_satd_any_size(width, height,
+                                 tmp_pic, tmp_stride,
+                                 ref->y + ref_pos.y * ref->stride + ref_pos.x, ref->stride);
+  } else {
+    kvz_get_extended_block(orig.x, orig.y, mv.x - 1, mv.y - 1,
+                  state->tile->offset_x,
+                  state->tile->offset_y,
+                  ref->y, ref->width, ref->height, KVZ_LUMA_FILTER_TAPS,
+                  internal_width+1, internal_height+1,
+                  &src);
+
+    costs[0] = kvz_satd_any_size(width, height,
+                              tmp_pic, tmp_stride,
+                              src.orig_topleft + src.stride + 1, src.stride);
+  }
 
   costs[0] += info->mvd_cost_func(state,
                                   mv.x, mv.y, 2,
@@ -1047,18 +1469,6 @@ static void search_frac(inter_search_info_t *info)
 
     const int mv_shift = (step < 2) ? 1 : 0;
 
-    filter_steps[step](state->encoder_control,
-      src.orig_topleft,
-      src.stride,
-      internal_width,
-      internal_height,
-      filtered,
-      intermediate,
-      fme_level,
-      hor_first_cols,
-      sample_off_x,
-      sample_off_y);
-          
     const vector2d_t *pattern[4] = { &square[i], &square[i + 1], &square[i + 2], &square[i + 3] };
 
     int8_t within_tile[4];
@@ -1067,13 +1477,49 @@ static void search_frac(inter_search_info_t *info)
         fracmv_within_tile(info, (mv.x + pattern[j]->x) * (1 << mv_shift), (mv.y + pattern[j]->y) * (1 << mv_shift));
     };
 
-    kvz_pixel *filtered_pos[4] = { 0 };
-    filtered_pos[0] = &filtered[0][0];
-    filtered_pos[1] = &filtered[1][0];
-    filtered_pos[2] = &filtered[2][0];
-    filtered_pos[3] = &filtered[3][0];
+    const kvz_pixel *filtered_pos[4] = { 0 };
+    int filtered_stride = LCU_WIDTH;
+
+    if (planes) {
+      // Positions outside the tile may refer to rows of the planes that
+      // are not done yet, so they are replaced with a valid position. Their
+      // costs are not used.
+      int valid = -1;
+      for (int j = 0; j < 4; j++) {
+        if (within_tile[j]) {
+          filtered_pos[j] = kvz_subpel_planes_block(
+              planes,
+              block_pos.x + (mv.x + pattern[j]->x) * (1 << mv_shift),
+              block_pos.y + (mv.y + pattern[j]->y) * (1 << mv_shift));
+          valid = j;
+        }
+      }
+      for (int j = 0; j < 4 && valid >= 0; j++) {
+        if (!within_tile[j]) filtered_pos[j] = filtered_pos[valid];
+      }
+      filtered_stride = planes->stride;
+    } else {
+      filter_steps[step](state->encoder_control,
+        src.orig_topleft,
+        src.stride,
+        internal_width,
+        internal_height,
+        filtered,
+        intermediate,
+        fme_level,
+        hor_first_cols,
+        sample_off_x,
+        sample_off_y);
+
+      filtered_pos[0] = &filtered[0][0];
+      filtered_pos[1] = &filtered[1][0];
+      filtered_pos[2] = &filtered[2][0];
+      filtered_pos[3] = &filtered[3][0];
+    }
 
-    kvz_satd_any_size_quad(width, height, (const kvz_pixel **)filtered_pos, LCU_WIDTH, tmp_pic, tmp_stride, 4, costs, within_tile);
+    if (filtered_pos[0]) {
+      kvz_satd_any_size_quad(width, height, filtered_pos, filtered_stride, tmp_pic, tmp_stride, 4, costs, within_tile);
+    }
 
     for (int j = 0; j < 4; j++) {
       if (within_tile[j]) {
@@ -1129,16 +1575,16 @@ static void search_frac(inter_search_info_t *info)
 
 
 /**
- * \brief Perform inter search for a single reference frame.
+ * \brief Get the MV candidates for the reference frame of a search.
+ *
+ * \param ref_list  Returns the list, L0 or L1, the reference frame is in
+ * \param LX_idx    Returns the index of the reference frame in the list
  */
-static void search_pu_inter_ref(inter_search_info_t *info,
-                                int depth,
-                                lcu_t *lcu, cu_info_t *cur_cu,
-                                double *inter_cost,
-                                uint32_t *inter_bitcost)
+static void get_ref_mv_cand(inter_search_info_t *info,
+                            lcu_t *lcu, cu_info_t *cur_cu,
+                            int8_t *ref_list_out,
+                            int8_t *LX_idx_out)
 {
-  const kvz_config *cfg = &info->state->encoder_control->cfg;
-
   // which list, L0 or L1, ref_idx is in and in what index
   int8_t ref_list = -1;
   // the index of the ref_idx in L0 or L1 list
@@ -1185,6 +1631,181 @@ static void search_pu_inter_ref(inter_search_info_t *info,
   // store old values back
   cur_cu->inter.mv_ref[ref_list] = temp_ref_idx;
 
+  *ref_list_out = ref_list;
+  *LX_idx_out = LX_idx;
+}
+
+
+/**
+ * \brief Get the range of blocks of the motion vector cache that the PU
+ * overlaps.
+ *
+ * \param covered  only include the blocks the PU covers completely
+ * \param x0, y0   return the first block
+ * \param x1, y1   return the block after the last block
+ */
+static void get_cache_blocks(const inter_search_info_t *info,
+                             bool covered,
+                             int *x0, int *y0,
+                             int *x1, int *y1)
+{
+  const int x = SUB_SCU(info->origin.x);
+  const int y = SUB_SCU(info->origin.y);
+  const int w = MV_CACHE_BLOCK_WIDTH;
+  if (covered) {
+    *x0 = CEILDIV(x, w);
+    *y0 = CEILDIV(y, w);
+    *x1 = (x + info->width) / w;
+    *y1 = (y + info->height) / w;
+  } else {
+    *x0 = x / w;
+    *y0 = y / w;
+    *x1 = CEILDIV(x + info->width, w);
+    *y1 = CEILDIV(y + info->height, w);
+  }
+}
+
+
+static void add_cached_mv(inter_search_info_t *info, int x, int y)
+{
+  if (info->num_cached_mvs == MAX_CACHED_MVS) return;
+
+  // The zero vector is always checked.
+  if (x == 0 && y == 0) return;
+
+  for (int i = 0; i < info->num_cached_mvs; i++) {
+    if (info->cached_mvs[i].x == x && info->cached_mvs[i].y == y) return;
+  }
+
+  info->cached_mvs[info->num_cached_mvs].x = x;
+  info->cached_mvs[info->num_cached_mvs].y = y;
+  info->num_cached_mvs++;
+}
+
+
+/**
+ * \brief Get the vectors of the blocks of the PU from the motion vector
+ * cache to info->cached_mvs.
+ *
+ * The blocks are scanned in raster order. Fractional vectors are rounded to
+ * integer precision.
+ */
+static void get_cached_mvs(inter_search_info_t *info)
+{
+  info->num_cached_mvs = 0;
+
+  const inter_mv_cache_t *cache = info->state->mv_cache;
+  if (!cache) return;
+
+  int x0, y0, x1, y1;
+  get_cache_blocks(info, false, &x0, &y0, &x1, &y1);
+
+  for (int y = y0; y < y1; y++) {
+    for (int x = x0; x < x1; x++) {
+      const inter_mv_cache_entry_t *entry = &cache->entries[info->ref_idx][y][x];
+      if (!entry->valid) continue;
+
+      add_cached_mv(info, entry->int_mv.x >> 2, entry->int_mv.y >> 2);
+      if (entry->frac_valid) {
+        add_cached_mv(info, (entry->frac_mv.x + 2) >> 2, (entry->frac_mv.y + 2) >> 2);
+      }
+    }
+  }
+}
+
+
+/**
+ * \brief Check whether the integer search of the PU can be skipped.
+ *
+ * The search is skipped if every block the PU overlaps has the same integer
+ * vector in the motion vector cache and the cost per pixel of the vector
+ * for the PU is at most its cost per pixel for the PUs it was found for.
+ * The vector is then the result of the search.
+ *
+ * \return true if the search can be skipped, false otherwise
+ */
+static bool check_cached_int_mv(inter_search_info_t *info)
+{
+  const inter_mv_cache_t *cache = info->state->mv_cache;
+  if (!cache) return false;
+
+  int x0, y0, x1, y1;
+  get_cache_blocks(info, false, &x0, &y0, &x1, &y1);
+
+  const inter_mv_cache_entry_t *first = &cache->entries[info->ref_idx][y0][x0];
+  for (int y = y0; y < y1; y++) {
+    for (int x = x0; x < x1; x++) {
+      const inter_mv_cache_entry_t *entry = &cache->entries[info->ref_idx][y][x];
+      if (!entry->valid ||
+          entry->int_mv.x != first->int_mv.x ||
+          entry->int_mv.y != first->int_mv.y)
+      {
+        return false;
+      }
+    }
+  }
+
+  if (!check_mv_cost(info, first->int_mv.x >> 2, first->int_mv.y >> 2)) {
+    return false;
+  }
+
+  const uint64_t area = info->width * info->height;
+  for (int y = y0; y < y1; y++) {
+    for (int x = x0; x < x1; x++) {
+      const inter_mv_cache_entry_t *entry = &cache->entries[info->ref_idx][y][x];
+      if ((uint64_t)info->best_cost * entry->area > (uint64_t)entry->int_cost * area) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+/**
+ * \brief Store the result of the search of a PU in the motion vector cache.
+ *
+ * Only the blocks the PU covers completely are updated.
+ *
+ * \param int_mv    best integer motion vector in quarter pixels
+ * \param int_cost  cost of int_mv
+ * \param frac_mv   best fractional motion vector, or NULL if the
+ *                  fractional search was not done
+ */
+static void store_cached_mv(const inter_search_info_t *info,
+                            vector2d_t int_mv,
+                            uint32_t int_cost,
+                            const vector2d_t *frac_mv)
+{
+  inter_mv_cache_t *cache = info->state->mv_cache;
+  if (!cache || int_cost == UINT32_MAX) return;
+
+  int x0, y0, x1, y1;
+  get_cache_blocks(info, true, &x0, &y0, &x1, &y1);
+
+  for (int y = y0; y < y1; y++) {
+    for (int x = x0; x < x1; x++) {
+      inter_mv_cache_entry_t *entry = &cache->entries[info->ref_idx][y][x];
+      entry->valid      = true;
+      entry->int_mv     = int_mv;
+      entry->int_cost   = int_cost;
+      entry->area       = info->width * info->height;
+      entry->frac_valid = frac_mv != NULL;
+      if (frac_mv) {
+        entry->frac_mv = *frac_mv;
+      }
+    }
+  }
+}
+
+
+/**
+ * \brief Search the best integer motion vector in a reference frame.
+ */
+static void search_mv_integer(inter_search_info_t *info)
+{
+  const enum kvz_ime_algorithm ime_algorithm = info->state->frame->search.ime_algorithm;
+
   vector2d_t mv = { 0, 0 };
   {
     // Take starting point for MV search from previous frame.
@@ -1206,7 +1827,7 @@ static void search_pu_inter_ref(inter_search_info_t *info,
   }
 
   int search_range = 32;
-  switch (cfg->ime_algorithm) {
+  switch (ime_algorithm) {
     case KVZ_IME_FULL64: search_range = 64; break;
     case KVZ_IME_FULL32: search_range = 32; break;
     case KVZ_IME_FULL16: search_range = 16; break;
@@ -1216,7 +1837,12 @@ static void search_pu_inter_ref(inter_search_info_t *info,
 
   info->best_cost = UINT32_MAX;
 
-  switch (cfg->ime_algorithm) {
+  get_cached_mvs(info);
+  if (check_cached_int_mv(info)) {
+    return;
+  }
+
+  switch (ime_algorithm) {
     case KVZ_IME_TZ:
       tz_search(info, mv);
       break;
@@ -1233,29 +1859,46 @@ static void search_pu_inter_ref(inter_search_info_t *info,
       diamond_search(info, mv, info->state->encoder_control->cfg.me_max_steps);
       break;
 
+    case KVZ_IME_PYRAMID:
+      pyramid_search(info, mv, info->state->encoder_control->cfg.me_max_steps);
+      break;
+
     default:
       hexagon_search(info, mv, info->state->encoder_control->cfg.me_max_steps);
       break;
   }
+}
 
-  if (cfg->fme_level > 0 && info->best_cost < *inter_cost) {
-    search_frac(info);
 
-  } else if (info->best_cost < UINT32_MAX) {
-    // Recalculate inter cost with SATD.
-    info->best_cost = kvz_image_calc_satd(
-        info->state->tile->frame->source,
-        info->ref,
-        info->origin.x,
-        info->origin.y,
-        info->state->tile->offset_x + info->origin.x + (info->best_mv.x >> 2),
-        info->state->tile->offset_y + info->origin.y + (info->best_mv.y >> 2),
-        info->width,
-        info->height);
-    info->best_cost += info->best_bitcost * (int)(info->state->lambda_sqrt + 0.5);
-  }
+/**
+ * \brief Recalculate the cost of an integer motion vector with SATD.
+ */
+static void recalc_cost_satd(inter_search_info_t *info)
+{
+  info->best_cost = kvz_image_calc_satd(
+      info->state->tile->frame->source,
+      info->ref,
+      info->origin.x,
+      info->origin.y,
+      info->state->tile->offset_x + info->origin.x + (info->best_mv.x >> 2),
+      info->state->tile->offset_y + info->origin.y + (info->best_mv.y >> 2),
+      info->width,
+      info->height);
+  info->best_cost += info->best_bitcost * (int)(info->state->lambda_sqrt + 0.5);
+}
 
-  mv = info->best_mv;
+
+/**
+ * \brief Store the result of a search if it is the best so far.
+ */
+static void select_ref_result(inter_search_info_t *info,
+                              int8_t ref_list,
+                              int8_t LX_idx,
+                              cu_info_t *cur_cu,
+                              double *inter_cost,
+                              uint32_t *inter_bitcost)
+{
+  vector2d_t mv = info->best_mv;
 
   int merged = 0;
   int merge_idx = 0;
@@ -1298,6 +1941,169 @@ static void search_pu_inter_ref(inter_search_info_t *info,
 }
 
 
+/**
+ * \brief Perform inter search for a single reference frame.
+ */
+static void search_pu_inter_ref(inter_search_info_t *info,
+                                int depth,
+                                lcu_t *lcu, cu_info_t *cur_cu,
+                                double *inter_cost,
+                                uint32_t *inter_bitcost)
+{
+  const kvz_config *cfg = &info->state->encoder_control->cfg;
+
+  int8_t ref_list;
+  int8_t LX_idx;
+  get_ref_mv_cand(info, lcu, cur_cu, &ref_list, &LX_idx);
+
+  search_mv_integer(info);
+
+  const vector2d_t int_mv  = info->best_mv;
+  const uint32_t int_cost = info->best_cost;
+
+  if (cfg->fme_level > 0 && info->best_cost < *inter_cost) {
+    search_frac(info);
+    store_cached_mv(info, int_mv, int_cost, &info->best_mv);
+
+  } else {
+    store_cached_mv(info, int_mv, int_cost, NULL);
+    if (info->best_cost < UINT32_MAX) {
+      recalc_cost_satd(info);
+    }
+  }
+
+  select_ref_result(info, ref_list, LX_idx, cur_cu, inter_cost, inter_bitcost);
+}
+
+
+/**
+ * \brief Search of a single reference frame run as a job.
+ */
+typedef struct {
+  inter_search_info_t info;
+  int8_t ref_list;
+  int8_t LX_idx;
+
+  /**
+   * \brief Result of the integer search
+   */
+  vector2d_t int_mv;
+  uint32_t int_cost;
+  uint32_t int_bitcost;
+
+  threadqueue_job_t *job;
+} inter_ref_search_t;
+
+
+/**
+ * \brief Search the motion vector in a reference frame.
+ *
+ * Whether the fractional search is used depends on the results of the
+ * other reference frames, so it is done whenever it might be needed and the
+ * result of the integer search is kept as well.
+ */
+static void search_pu_inter_ref_job(void *opaque)
+{
+  inter_ref_search_t *search = opaque;
+  inter_search_info_t *info = &search->info;
+
+  search_mv_integer(info);
+
+  search->int_mv      = info->best_mv;
+  search->int_cost    = info->best_cost;
+  search->int_bitcost = info->best_bitcost;
+
+  if (info->state->encoder_control->cfg.fme_level > 0 && info->best_cost < UINT32_MAX) {
+    search_frac(info);
+  }
+}
+
+
+/**
+ * \brief Perform inter search for all reference frames in parallel jobs.
+ *
+ * The results are combined in the same order as in search_pu_inter_ref so
+ * the result is identical.
+ */
+static void search_pu_inter_ref_parallel(inter_search_info_t *info,
+                                         int depth,
+                                         lcu_t *lcu, cu_info_t *cur_cu,
+                                         double *inter_cost,
+                                         uint32_t *inter_bitcost)
+{
+  encoder_state_t *const state = info->state;
+  const encoder_control_t *const ctrl = state->encoder_control;
+  const int num_refs = state->frame->ref->used_size;
+  const int lcu_x = (state->tile->offset_x + info->origin.x) / LCU_WIDTH;
+  const int lcu_y = (state->tile->offset_y + info->origin.y) / LCU_WIDTH;
+
+  inter_ref_search_t searches[MAX_REF_PIC_COUNT];
+  assert(num_refs <= MAX_REF_PIC_COUNT);
+
+  for (int ref_idx = 0; ref_idx < num_refs; ref_idx++) {
+    inter_ref_search_t *search = &searches[ref_idx];
+    memcpy(&search->info, info, sizeof(*info));
+    search->info.ref_idx = ref_idx;
+    search->info.ref = state->frame->ref->images[ref_idx];
+
+    // The MV candidates are taken from the CU so they must be found before
+    // the CU is modified.
+    get_ref_mv_cand(&search->info, lcu, cur_cu, &search->ref_list, &search->LX_idx);
+
+    search->job = kvz_threadqueue_job_create(ctrl->threadqueue,
+                                             search_pu_inter_ref_job,
+                                             search);
+    if (search->job) {
+      kvz_threadqueue_job_set_priority(search->job,
+          kvz_encoder_state_job_priority(state, lcu_x, lcu_y));
+      kvz_threadqueue_job_set_trace_info(search->job, "ME",
+                                         state->frame->num,
+                                         state->tile->id,
+                                         lcu_x, lcu_y);
+      kvz_threadqueue_submit(ctrl->threadqueue, search->job);
+    } else {
+      search_pu_inter_ref_job(search);
+    }
+  }
+
+  for (int ref_idx = 0; ref_idx < num_refs; ref_idx++) {
+    inter_ref_search_t *search = &searches[ref_idx];
+    if (search->job) {
+      kvz_threadqueue_join(ctrl->threadqueue, search->job);
+      kvz_threadqueue_free_job(&search->job);
+    }
+
+    // The motion vector cache is updated in the same order as in
+    // search_pu_inter_ref. Each job only reads the entries of its own
+    // reference frame so the updates do not affect the running jobs.
+    if (ctrl->cfg.fme_level == 0 || search->int_cost >= *inter_cost) {
+      // Use the result of the integer search like search_pu_inter_ref.
+      store_cached_mv(&search->info, search->int_mv, search->int_cost, NULL);
+      search->info.best_mv      = search->int_mv;
+      search->info.best_cost    = search->int_cost;
+      search->info.best_bitcost = search->int_bitcost;
+      if (search->info.best_cost < UINT32_MAX) {
+        recalc_cost_satd(&search->info);
+      }
+    } else {
+      store_cached_mv(&search->info, search->int_mv, search->int_cost,
+                      &search->info.best_mv);
+    }
+
+    select_ref_result(&search->info,
+                      search->ref_list,
+                      search->LX_idx,
+                      cur_cu,
+                      inter_cost,
+                      inter_bitcost);
+  }
+
+  // Leave the info of the last reference frame for the bipred search like
+  // search_pu_inter_ref does.
+  memcpy(info, &searches[num_refs - 1].info, sizeof(*info));
+}
+
+
 /**
  * \brief Search bipred modes for a PU.
  */
@@ -1502,11 +2308,23 @@ static void search_pu_inter(encoder_state_t * const state,
   CU_SET_MV_CAND(cur_cu, 0, 0);
   CU_SET_MV_CAND(cur_cu, 1, 0);
 
-  for (int ref_idx = 0; ref_idx < state->frame->ref->used_size; ref_idx++) {
-    info.ref_idx = ref_idx;
-    info.ref = state->frame->ref->images[ref_idx];
+  // Search the reference frames of large PUs in parallel when there are
+  // threads to run the jobs.
+  const bool ref_jobs = cfg->me_ref_jobs
+    && state->frame->ref->used_size > 1
+    && width * height >= ME_REF_JOBS_MIN_PU_AREA
+    && kvz_threadqueue_pool_thread_count(
+         kvz_threadqueue_pool(state->encoder_control->threadqueue)) > 0;
 
-    search_pu_inter_ref(&info, depth, lcu, cur_cu, inter_cost, inter_bitcost);
+  if (ref_jobs) {
+    search_pu_inter_ref_parallel(&info, depth, lcu, cur_cu, inter_cost, inter_bitcost);
+  } else {
+    for (int ref_idx = 0; ref_idx < state->frame->ref->used_size; ref_idx++) {
+      info.ref_idx = ref_idx;
+      info.ref = state->frame->ref->images[ref_idx];
+
+      search_pu_inter_ref(&info, depth, lcu, cur_cu, inter_cost, inter_bitcost);
+    }
   }
 
   // Search bi-pred positions
@@ -1599,7 +2417,7 @@ void kvz_search_cu_inter(encoder_state_t * const state,
                   inter_bitcost);
 
   // Calculate more accurate cost when needed
-  if (state->encoder_control->cfg.rdo >= 2) {
+  if (state->frame->search.rdo >= 2) {
     kvz_cu_cost_inter_rd2(state,
       x, y, depth,
       lcu,
@@ -1677,7 +2495,7 @@ void kvz_search_cu_smp(encoder_state_t * const state,
   }
 
   // Calculate more accurate cost when needed
-  if (state->encoder_control->cfg.rdo >= 2) {
+  if (state->frame->search.rdo >= 2) {
     kvz_cu_cost_inter_rd2(state,
       x, y, depth,
       lcu,
@@ -1697,6 +2515,6 @@ void kvz_search_cu_smp(encoder_state_t * const state,
   // coding the CBF.
   smp_extra_bits += 6;
 
-  *inter_cost += (state->encoder_control->cfg.rdo >= 2 ? state->lambda : state->lambda_sqrt) * smp_extra_bits;
+  *inter_cost += (state->frame->search.rdo >= 2 ? state->lambda : state->lambda_sqrt) * smp_extra_bits;
   *inter_bitcost += smp_extra_bits;
 }
@@ -52,6 +52,48 @@ enum hpel_position {
   HPEL_POS_DIA = 2
 };
 
+/**
+ * \brief Width of the blocks of the motion vector cache in pixels.
+ */
+#define MV_CACHE_BLOCK_WIDTH 8
+
+/**
+ * \brief Best motion vectors found for a block of an LCU in a reference
+ * frame.
+ */
+typedef struct {
+  bool valid;
+  bool frac_valid;
+
+  /**
+   * \brief Best integer motion vector in quarter pixels and its cost
+   */
+  vector2d_t int_mv;
+  uint32_t int_cost;
+  /**
+   * \brief Area of the PU the vectors were found for
+   */
+  int32_t area;
+
+  /**
+   * \brief Best fractional motion vector in quarter pixels
+   */
+  vector2d_t frac_mv;
+} inter_mv_cache_entry_t;
+
+/**
+ * \brief Motion vectors found for the PUs of an LCU.
+ *
+ * The entry of each block holds the result of the last searched PU that
+ * covered the whole block. Blocks are indexed by reference frame, then y
+ * and x.
+ */
+typedef struct inter_mv_cache_t {
+  inter_mv_cache_entry_t entries[MAX_REF_PIC_COUNT]
+                                [LCU_WIDTH / MV_CACHE_BLOCK_WIDTH]
+                                [LCU_WIDTH / MV_CACHE_BLOCK_WIDTH];
+} inter_mv_cache_t;
+
 typedef uint32_t kvz_mvd_cost_func(const encoder_state_t *state,
                                   int x, int y,
                                   int mv_shift,
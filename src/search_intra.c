@@ -755,7 +755,7 @@ int8_t kvz_search_cu_intra_chroma(encoder_state_t * const state,
   const int8_t modes_in_depth[5] = { 1, 1, 1, 1, 2 };
   int num_modes = modes_in_depth[depth];
 
-  if (state->encoder_control->cfg.rdo == 3) {
+  if (state->frame->search.rdo == 3) {
     num_modes = 5;
   }
 
@@ -837,7 +837,7 @@ void kvz_search_cu_intra(encoder_state_t * const state,
   kvz_pixel *ref_pixels = &lcu->ref.y[lcu_px.x + lcu_px.y * LCU_WIDTH];
 
   int8_t number_of_modes;
-  bool skip_rough_search = (depth == 0 || state->encoder_control->cfg.rdo >= 3);
+  bool skip_rough_search = (depth == 0 || state->frame->search.rdo >= 3);
   if (!skip_rough_search) {
     number_of_modes = search_intra_rough(state,
                                          ref_pixels, LCU_WIDTH,
@@ -855,7 +855,7 @@ void kvz_search_cu_intra(encoder_state_t * const state,
   // Set transform depth to current depth, meaning no transform splits.
   kvz_lcu_set_trdepth(lcu, x_px, y_px, depth, depth);
   // Refine results with slower search or get some results if rough search was skipped.
-  const int32_t rdo_level = state->encoder_control->cfg.rdo;
+  const int32_t rdo_level = state->frame->search.rdo;
   if (rdo_level >= 2 || skip_rough_search) {
     int number_of_modes_to_search;
     if (rdo_level == 3) {
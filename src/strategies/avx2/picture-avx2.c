@@ -28,6 +28,7 @@
 #include <emmintrin.h>
 #include <mmintrin.h>
 #include <xmmintrin.h>
+#include <stdlib.h>
 #include <string.h>
 #include "kvazaar.h"
 #include "strategies/strategies-picture.h"
@@ -142,6 +143,100 @@ static unsigned sad_8bit_64x64_avx2(const kvz_pixel * buf1, const kvz_pixel * bu
   return m256i_horizontal_sum(sum0);
 }
 
+/**
+* \brief Calculate SAD between a block and at most four candidate blocks.
+*
+* Each row of the block is loaded once and compared with the same row of
+* every candidate.
+*/
+static INLINE void reg_sad_quad_8bit_avx2(const kvz_pixel *const data1,
+                                          const kvz_pixel *const *const data2,
+                                          const int num,
+                                          const int width, const int height,
+                                          const unsigned stride1, const unsigned stride2,
+                                          unsigned *costs_out)
+{
+  __m256i sum256[4];
+  __m128i sum128[4];
+  unsigned sum_scalar[4];
+  for (int i = 0; i < num; ++i) {
+    sum256[i] = _mm256_setzero_si256();
+    sum128[i] = _mm_setzero_si128();
+    sum_scalar[i] = 0;
+  }
+
+  for (int y = 0; y < height; ++y) {
+    const kvz_pixel *row1 = &data1[y * stride1];
+    const unsigned offset2 = y * stride2;
+
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+      const __m256i a = _mm256_loadu_si256((const __m256i*)&row1[x]);
+      for (int i = 0; i < num; ++i) {
+        const __m256i b = _mm256_loadu_si256((const __m256i*)&data2[i][offset2 + x]);
+        sum256[i] = _mm256_add_epi32(sum256[i], _mm256_sad_epu8(a, b));
+      }
+    }
+    if (x + 16 <= width) {
+      const __m128i a = _mm_loadu_si128((const __m128i*)&row1[x]);
+      for (int i = 0; i < num; ++i) {
+        const __m128i b = _mm_loadu_si128((const __m128i*)&data2[i][offset2 + x]);
+        sum128[i] = _mm_add_epi32(sum128[i], _mm_sad_epu8(a, b));
+      }
+      x += 16;
+    }
+    if (x + 8 <= width) {
+      const __m128i a = _mm_loadl_epi64((const __m128i*)&row1[x]);
+      for (int i = 0; i < num; ++i) {
+        const __m128i b = _mm_loadl_epi64((const __m128i*)&data2[i][offset2 + x]);
+        sum128[i] = _mm_add_epi32(sum128[i], _mm_sad_epu8(a, b));
+      }
+      x += 8;
+    }
+    if (x + 4 <= width) {
+      int32_t a_bytes;
+      memcpy(&a_bytes, &row1[x], sizeof(a_bytes));
+      const __m128i a = _mm_cvtsi32_si128(a_bytes);
+      for (int i = 0; i < num; ++i) {
+        int32_t b_bytes;
+        memcpy(&b_bytes, &data2[i][offset2 + x], sizeof(b_bytes));
+        const __m128i b = _mm_cvtsi32_si128(b_bytes);
+        sum128[i] = _mm_add_epi32(sum128[i], _mm_sad_epu8(a, b));
+      }
+      x += 4;
+    }
+    for (; x < width; ++x) {
+      for (int i = 0; i < num; ++i) {
+        sum_scalar[i] += abs(row1[x] - data2[i][offset2 + x]);
+      }
+    }
+  }
+
+  for (int i = 0; i < num; ++i) {
+    costs_out[i] = m256i_horizontal_sum(sum256[i]) +
+                   _mm_cvtsi128_si32(sum128[i]) +
+                   _mm_extract_epi32(sum128[i], 2) +
+                   sum_scalar[i];
+  }
+}
+
+
+static void reg_sad_multi_8bit_avx2(const kvz_pixel *const data1,
+                                    const kvz_pixel *const *const data2,
+                                    const int num,
+                                    const int width, const int height,
+                                    const unsigned stride1, const unsigned stride2,
+                                    unsigned *costs_out)
+{
+  int i = 0;
+  for (; i + 4 <= num; i += 4) {
+    reg_sad_quad_8bit_avx2(data1, &data2[i], 4, width, height, stride1, stride2, &costs_out[i]);
+  }
+  if (i < num) {
+    reg_sad_quad_8bit_avx2(data1, &data2[i], num - i, width, height, stride1, stride2, &costs_out[i]);
+  }
+}
+
 static unsigned satd_4x4_8bit_avx2(const kvz_pixel *org, const kvz_pixel *cur)
 {
 
@@ -716,6 +811,35 @@ static unsigned pixels_calc_ssd_avx2(const kvz_pixel *const ref, const kvz_pixel
   }
 }
 
+static unsigned pixel_var_8x8_8bit_avx2(const kvz_pixel *block, const int stride)
+{
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i sum    = _mm256_setzero_si256();
+  __m256i sum_sq = _mm256_setzero_si256();
+
+  // Two rows at a time as 16-bit values.
+  for (int y = 0; y < 8; y += 2) {
+    __m128i row0 = _mm_loadl_epi64((const __m128i *)&block[(y + 0) * stride]);
+    __m128i row1 = _mm_loadl_epi64((const __m128i *)&block[(y + 1) * stride]);
+    __m256i pixels = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(row0, row1));
+
+    sum    = _mm256_add_epi32(sum,    _mm256_madd_epi16(pixels, ones));
+    sum_sq = _mm256_add_epi32(sum_sq, _mm256_madd_epi16(pixels, pixels));
+  }
+
+  // Sum the lanes. The first and second dwords of each 128-bit lane
+  // become the sum and the sum of squares of the lane.
+  __m256i sums = _mm256_hadd_epi32(sum, sum_sq);
+  sums = _mm256_hadd_epi32(sums, sums);
+  __m128i total = _mm_add_epi32(_mm256_castsi256_si128(sums),
+                                _mm256_extracti128_si256(sums, 1));
+
+  const uint32_t block_sum    = _mm_cvtsi128_si32(total);
+  const uint32_t block_sum_sq = _mm_extract_epi32(total, 1);
+
+  return block_sum_sq - block_sum * block_sum / 64;
+}
+
 static void inter_recon_bipred_no_mov_avx2(
  const int height,
  const int width,
@@ -1230,6 +1354,8 @@ int kvz_strategy_register_picture_avx2(void* opaque, uint8_t bitdepth)
   // simplest code to look at for anyone interested in doing more
   // optimizations, so it's worth it to keep this maintained.
   if (bitdepth == 8){
+    success &= kvz_strategyselector_register(opaque, "reg_sad_multi", "avx2", 40, &reg_sad_multi_8bit_avx2);
+
     success &= kvz_strategyselector_register(opaque, "sad_8x8", "avx2", 40, &sad_8bit_8x8_avx2);
     success &= kvz_strategyselector_register(opaque, "sad_16x16", "avx2", 40, &sad_8bit_16x16_avx2);
     success &= kvz_strategyselector_register(opaque, "sad_32x32", "avx2", 40, &sad_8bit_32x32_avx2);
@@ -1250,6 +1376,7 @@ int kvz_strategy_register_picture_avx2(void* opaque, uint8_t bitdepth)
     success &= kvz_strategyselector_register(opaque, "satd_any_size_quad", "avx2", 40, &satd_any_size_quad_avx2);
 
     success &= kvz_strategyselector_register(opaque, "pixels_calc_ssd", "avx2", 40, &pixels_calc_ssd_avx2);
+    success &= kvz_strategyselector_register(opaque, "pixel_var_8x8", "avx2", 40, &pixel_var_8x8_8bit_avx2);
 	   success &= kvz_strategyselector_register(opaque, "inter_recon_bipred", "avx2", 40, &inter_recon_bipred_avx2);
 
   }
@@ -98,6 +98,21 @@ static unsigned reg_sad_generic(const kvz_pixel * const data1, const kvz_pixel *
   return sad;
 }
 
+/**
+ * \brief Calculate SAD between a block and several candidate blocks.
+ */
+static void reg_sad_multi_generic(const kvz_pixel * const data1,
+                                  const kvz_pixel * const * const data2,
+                                  const int num,
+                                  const int width, const int height,
+                                  const unsigned stride1, const unsigned stride2,
+                                  unsigned *costs_out)
+{
+  for (int i = 0; i < num; ++i) {
+    costs_out[i] = reg_sad_generic(data1, data2[i], width, height, stride1, stride2);
+  }
+}
+
 /**
  * \brief  Transform differences between two 4x4 blocks.
  * From HM 13.0
@@ -535,6 +550,22 @@ static unsigned pixels_calc_ssd_generic(const kvz_pixel *const ref, const kvz_pi
   return ssd >> (2*(KVZ_BIT_DEPTH-8));
 }
 
+static unsigned pixel_var_8x8_generic(const kvz_pixel *block, const int stride)
+{
+  uint64_t sum = 0;
+  uint64_t sum_sq = 0;
+
+  for (int y = 0; y < 8; ++y) {
+    for (int x = 0; x < 8; ++x) {
+      const unsigned value = block[x + y * stride];
+      sum    += value;
+      sum_sq += value * value;
+    }
+  }
+
+  return (unsigned)(sum_sq - sum * sum / 64);
+}
+
 static void inter_recon_bipred_generic(const int hi_prec_luma_rec0,
 	const int hi_prec_luma_rec1,
 	const int hi_prec_chroma_rec0,
@@ -594,6 +625,7 @@ int kvz_strategy_register_picture_generic(void* opaque, uint8_t bitdepth)
   bool success = true;
 
   success &= kvz_strategyselector_register(opaque, "reg_sad", "generic", 0, &reg_sad_generic);
+  success &= kvz_strategyselector_register(opaque, "reg_sad_multi", "generic", 0, &reg_sad_multi_generic);
 
   success &= kvz_strategyselector_register(opaque, "sad_4x4", "generic", 0, &sad_4x4_generic);
   success &= kvz_strategyselector_register(opaque, "sad_8x8", "generic", 0, &sad_8x8_generic);
@@ -622,6 +654,7 @@ int kvz_strategy_register_picture_generic(void* opaque, uint8_t bitdepth)
   success &= kvz_strategyselector_register(opaque, "satd_any_size_quad", "generic", 0, &satd_any_size_quad_generic);
 
   success &= kvz_strategyselector_register(opaque, "pixels_calc_ssd", "generic", 0, &pixels_calc_ssd_generic);
+  success &= kvz_strategyselector_register(opaque, "pixel_var_8x8", "generic", 0, &pixel_var_8x8_generic);
   success &= kvz_strategyselector_register(opaque, "inter_recon_bipred", "generic", 0, &inter_recon_bipred_generic);
 
 
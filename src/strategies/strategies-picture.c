@@ -31,6 +31,7 @@
 
 // Define function pointers.
 reg_sad_func * kvz_reg_sad = 0;
+reg_sad_multi_func * kvz_reg_sad_multi = 0;
 
 cost_pixel_nxn_func * kvz_sad_4x4 = 0;
 cost_pixel_nxn_func * kvz_sad_8x8 = 0;
@@ -61,6 +62,8 @@ cost_pixel_any_size_multi_func * kvz_satd_any_size_quad = 0;
 
 pixels_calc_ssd_func * kvz_pixels_calc_ssd = 0;
 
+pixel_var_func * kvz_pixel_var_8x8 = 0;
+
 inter_recon_bipred_func * kvz_inter_recon_bipred_blend = 0;
 
 
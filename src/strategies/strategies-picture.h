@@ -102,6 +102,23 @@ static unsigned satd_ ## n ## x ## n ## _ ## suffix ( \
 typedef unsigned(reg_sad_func)(const kvz_pixel *const data1, const kvz_pixel *const data2,
   const int width, const int height,
   const unsigned stride1, const unsigned stride2);
+
+/**
+ * \brief Calculate SAD between a block and several candidate blocks.
+ *
+ * Equal to calling reg_sad for each candidate, but the block is only loaded
+ * once for all of them. Candidates at consecutive horizontal offsets can be
+ * given as data2[i] = ref + i.
+ *
+ * \param data1     the block
+ * \param data2     top-left pixels of the num candidates
+ * \param costs_out SAD of each candidate
+ */
+typedef void (reg_sad_multi_func)(const kvz_pixel *const data1,
+  const kvz_pixel *const *const data2, const int num,
+  const int width, const int height,
+  const unsigned stride1, const unsigned stride2,
+  unsigned *costs_out);
 typedef unsigned (cost_pixel_nxn_func)(const kvz_pixel *block1, const kvz_pixel *block2);
 typedef unsigned (cost_pixel_any_size_func)(
     int width, int height,
@@ -113,6 +130,14 @@ typedef void (cost_pixel_any_size_multi_func)(int width, int height, const kvz_p
 
 typedef unsigned (pixels_calc_ssd_func)(const kvz_pixel *const ref, const kvz_pixel *const rec, const int ref_stride, const int rec_stride, const int width);
 
+/**
+ * \brief Calculate the variance of an 8x8 block.
+ *
+ * \return sum of squared differences from the mean of the block, which is
+ *         64 times the variance
+ */
+typedef unsigned (pixel_var_func)(const kvz_pixel *block, const int stride);
+
 
 typedef void (inter_recon_bipred_func)(const int hi_prec_luma_rec0,
 	const int hi_prec_luma_rec1,
@@ -133,6 +158,7 @@ typedef void (inter_recon_bipred_func)(const int hi_prec_luma_rec0,
 
 // Declare function pointers.
 extern reg_sad_func * kvz_reg_sad;
+extern reg_sad_multi_func * kvz_reg_sad_multi;
 
 extern cost_pixel_nxn_func * kvz_sad_4x4;
 extern cost_pixel_nxn_func * kvz_sad_8x8;
@@ -163,6 +189,8 @@ extern cost_pixel_any_size_multi_func *kvz_satd_any_size_quad;
 
 extern pixels_calc_ssd_func *kvz_pixels_calc_ssd;
 
+extern pixel_var_func *kvz_pixel_var_8x8;
+
 extern inter_recon_bipred_func * kvz_inter_recon_bipred_blend;
 
 int kvz_strategy_register_picture(void* opaque, uint8_t bitdepth);
@@ -173,6 +201,7 @@ cost_pixel_nxn_multi_func * kvz_pixels_get_sad_dual_func(unsigned n);
 
 #define STRATEGIES_PICTURE_EXPORTS \
   {"reg_sad", (void**) &kvz_reg_sad}, \
+  {"reg_sad_multi", (void**) &kvz_reg_sad_multi}, \
   {"sad_4x4", (void**) &kvz_sad_4x4}, \
   {"sad_8x8", (void**) &kvz_sad_8x8}, \
   {"sad_16x16", (void**) &kvz_sad_16x16}, \
@@ -196,6 +225,7 @@ cost_pixel_nxn_multi_func * kvz_pixels_get_sad_dual_func(unsigned n);
   {"satd_64x64_dual", (void**) &kvz_satd_64x64_dual}, \
   {"satd_any_size_quad", (void**) &kvz_satd_any_size_quad}, \
   {"pixels_calc_ssd", (void**) &kvz_pixels_calc_ssd}, \
+  {"pixel_var_8x8", (void**) &kvz_pixel_var_8x8}, \
   {"inter_recon_bipred", (void**) &kvz_inter_recon_bipred_blend}, \
 
 
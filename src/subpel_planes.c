@@ -0,0 +1,305 @@
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2013-2015 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * Kvazaar is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#include "subpel_planes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "encoder.h"
+#include "image.h"
+#include "strategies/strategies-ipol.h"
+#include "threads.h"
+
+
+/**
+ * \brief Allocate the interpolated planes of a picture.
+ *
+ * The planes are filled by the jobs in row_jobs, which the caller must
+ * create.
+ *
+ * \param encoder     encoder control
+ * \param rec         reconstructed picture to interpolate
+ * \param interpolate whether to interpolate the fractional positions
+ * \param sums        whether to compute the integral image
+ * \return            the planes, or NULL on failure
+ */
+subpel_planes_t * kvz_subpel_planes_alloc(const encoder_control_t *encoder,
+                                          kvz_picture *rec,
+                                          bool interpolate,
+                                          bool sums)
+{
+  subpel_planes_t *planes = calloc(1, sizeof(subpel_planes_t));
+  if (!planes) return NULL;
+
+  planes->width         = rec->width;
+  planes->height        = rec->height;
+  planes->stride        = rec->width;
+  planes->height_in_lcu = CEILDIV(rec->height, LCU_WIDTH);
+  planes->encoder       = encoder;
+  planes->refcount      = 1;
+
+  // Reserve some extra space after each plane because the SIMD versions
+  // of the SATD functions may read a few bytes past the end of a row.
+  const size_t plane_size = (size_t)planes->stride * planes->height + 16;
+
+  bool ok = true;
+  for (int i = 1; i < 16 && interpolate; i++) {
+    planes->planes[i] = MALLOC(kvz_pixel, plane_size);
+    ok = ok && planes->planes[i];
+  }
+  if (sums) {
+    planes->sums_stride = planes->width + 1;
+    planes->sums = MALLOC(uint32_t, (size_t)planes->sums_stride * (planes->height + 1));
+    ok = ok && planes->sums;
+  }
+  planes->row_jobs = calloc(planes->height_in_lcu, sizeof(threadqueue_job_t*));
+  planes->rows     = MALLOC(subpel_planes_row_t, planes->height_in_lcu);
+  if (!ok || !planes->row_jobs || !planes->rows) {
+    kvz_subpel_planes_free(&planes);
+    return NULL;
+  }
+
+  for (int y = 0; y < planes->height_in_lcu; y++) {
+    planes->rows[y].planes = planes;
+    planes->rows[y].lcu_y  = y;
+  }
+  if (planes->sums) {
+    // The first row of the integral image is not covered by any LCU row.
+    memset(planes->sums, 0, planes->sums_stride * sizeof(uint32_t));
+  }
+
+  planes->rec = kvz_image_copy_ref(rec);
+
+  return planes;
+}
+
+
+/**
+ * \brief Get a new pointer to the planes.
+ *
+ * Increment the reference count and return the planes.
+ */
+subpel_planes_t * kvz_subpel_planes_copy_ref(subpel_planes_t *planes)
+{
+  int32_t new_refcount = KVZ_ATOMIC_INC(&planes->refcount);
+  // The caller should have had another reference.
+  assert(new_refcount > 1);
+  return planes;
+}
+
+
+/**
+ * \brief Free the planes.
+ *
+ * Decrement the reference count and free the planes when no references
+ * remain. The jobs in row_jobs must not be running.
+ */
+void kvz_subpel_planes_free(subpel_planes_t **planes_ptr)
+{
+  subpel_planes_t *planes = *planes_ptr;
+  *planes_ptr = NULL;
+  if (!planes) return;
+
+  if (KVZ_ATOMIC_DEC(&planes->refcount) > 0) return;
+
+  if (planes->row_jobs) {
+    for (int y = 0; y < planes->height_in_lcu; y++) {
+      kvz_threadqueue_free_job(&planes->row_jobs[y]);
+    }
+  }
+  FREE_POINTER(planes->row_jobs);
+  FREE_POINTER(planes->rows);
+  for (int i = 1; i < 16; i++) {
+    FREE_POINTER(planes->planes[i]);
+  }
+  FREE_POINTER(planes->sums);
+  kvz_image_free(planes->rec);
+  free(planes);
+}
+
+
+/**
+ * \brief Drop a reference to the planes.
+ *
+ * Run as a job depending on the last job in row_jobs so that the
+ * reference is held until the planes are done.
+ *
+ * \param opaque  a subpel_planes_t
+ */
+void kvz_subpel_planes_worker_release(void *opaque)
+{
+  subpel_planes_t *planes = opaque;
+  kvz_subpel_planes_free(&planes);
+}
+
+
+/**
+ * \brief Compute the integral image for the pixel rows [y, y + height).
+ *
+ * The integral image must be done for the rows above.
+ */
+static void compute_sums(subpel_planes_t *planes, int32_t y, int32_t height)
+{
+  const kvz_picture *rec = planes->rec;
+  const int32_t stride = planes->sums_stride;
+
+  for (int32_t py = y; py < y + height; py++) {
+    const kvz_pixel *src = &rec->y[py * rec->stride];
+    const uint32_t *above = &planes->sums[py * stride];
+    uint32_t *dst = &planes->sums[(py + 1) * stride];
+
+    uint32_t row_sum = 0;
+    dst[0] = 0;
+    for (int32_t x = 0; x < planes->width; x++) {
+      row_sum += src[x];
+      dst[x + 1] = above[x + 1] + row_sum;
+    }
+  }
+}
+
+
+/**
+ * \brief Interpolate a row of LCUs at every fractional position and
+ * compute its integral image.
+ *
+ * The reconstruction of the row and the rows next to it must be final, and
+ * the row above must be done.
+ *
+ * \param opaque  a subpel_planes_row_t
+ */
+void kvz_subpel_planes_worker_interpolate_row(void *opaque)
+{
+  const subpel_planes_row_t *row = opaque;
+  subpel_planes_t *planes = row->planes;
+  kvz_picture *rec = planes->rec;
+
+  const int32_t y = row->lcu_y * LCU_WIDTH;
+  const int32_t height = MIN(LCU_WIDTH, planes->height - y);
+
+  if (planes->sums) {
+    compute_sums(planes, y, height);
+  }
+
+  for (int32_t x = 0; x < planes->width && planes->planes[1]; x += LCU_WIDTH) {
+    const int32_t width = MIN(LCU_WIDTH, planes->width - x);
+
+    kvz_extended_block src = { 0, 0, 0, 0 };
+    kvz_get_extended_block(x, y, 0, 0, 0, 0,
+                           rec->y, rec->width, rec->height,
+                           KVZ_LUMA_FILTER_TAPS,
+                           width, height,
+                           &src);
+
+    for (int i = 1; i < 16; i++) {
+      const int16_t mv[2] = { i & 3, i >> 2 };
+      kvz_sample_quarterpel_luma(planes->encoder,
+                                 src.orig_topleft,
+                                 src.stride,
+                                 width,
+                                 height,
+                                 planes->planes[i] + y * planes->stride + x,
+                                 planes->stride,
+                                 mv[0],
+                                 mv[1],
+                                 mv);
+    }
+
+    if (src.malloc_used) free(src.buffer);
+  }
+}
+
+
+/**
+ * \brief Get the sum of the pixels in columns [x0, x1) and rows [y0, y1)
+ * of the picture.
+ */
+static INLINE uint32_t rect_sum(const subpel_planes_t *planes,
+                                int32_t x0, int32_t y0,
+                                int32_t x1, int32_t y1)
+{
+  const uint32_t *top    = &planes->sums[y0 * planes->sums_stride];
+  const uint32_t *bottom = &planes->sums[y1 * planes->sums_stride];
+  return bottom[x1] - bottom[x0] - top[x1] + top[x0];
+}
+
+
+/**
+ * \brief Get the sum of the pixels in rows [y0, y1) of the picture and in
+ * columns [x, x + width), which may be outside the picture.
+ */
+static uint32_t padded_rows_sum(const subpel_planes_t *planes,
+                                int32_t x, int32_t width,
+                                int32_t y0, int32_t y1)
+{
+  const int32_t x0 = MAX(x, 0);
+  const int32_t x1 = MIN(x + width, planes->width);
+
+  if (x0 >= x1) {
+    // Every column is a copy of the first or the last column.
+    const int32_t edge = x < 0 ? 0 : planes->width - 1;
+    return width * rect_sum(planes, edge, y0, edge + 1, y1);
+  }
+
+  const uint32_t left  = x0 - x;
+  const uint32_t right = x + width - x1;
+  return rect_sum(planes, x0, y0, x1, y1) +
+         left  * rect_sum(planes, 0, y0, 1, y1) +
+         right * rect_sum(planes, planes->width - 1, y0, planes->width, y1);
+}
+
+
+/**
+ * \brief Get the sum of the luma pixels of a block.
+ *
+ * Pixels outside the picture are copies of the nearest pixel inside the
+ * picture, like in kvz_image_calc_sad.
+ *
+ * \param planes  planes with the integral image
+ * \param x       horizontal position of the block in pixels
+ * \param y       vertical position of the block in pixels
+ * \param width   width of the block
+ * \param height  height of the block
+ * \return        sum of the pixels of the block
+ */
+uint32_t kvz_subpel_planes_block_sum(const subpel_planes_t *planes,
+                                     int32_t x,
+                                     int32_t y,
+                                     int32_t width,
+                                     int32_t height)
+{
+  assert(planes->sums);
+
+  const int32_t y0 = MAX(y, 0);
+  const int32_t y1 = MIN(y + height, planes->height);
+
+  if (y0 >= y1) {
+    // Every row is a copy of the first or the last row.
+    const int32_t edge = y < 0 ? 0 : planes->height - 1;
+    return height * padded_rows_sum(planes, x, width, edge, edge + 1);
+  }
+
+  const uint32_t top    = y0 - y;
+  const uint32_t bottom = y + height - y1;
+  return padded_rows_sum(planes, x, width, y0, y1) +
+         top    * padded_rows_sum(planes, x, width, 0, 1) +
+         bottom * padded_rows_sum(planes, x, width, planes->height - 1, planes->height);
+}
@@ -0,0 +1,138 @@
+#ifndef SUBPEL_PLANES_H_
+#define SUBPEL_PLANES_H_
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2013-2015 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * Kvazaar is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+/**
+ * \ingroup Reconstruction
+ * \file
+ * Quarter-pixel interpolated luma planes and luma sums of reference
+ * pictures.
+ */
+
+#include "global.h" // IWYU pragma: keep
+#include "kvazaar.h"
+#include "threadqueue.h"
+
+
+// Forward declarations.
+struct encoder_control_t;
+struct subpel_planes_t;
+
+/**
+ * \brief Parameters of a job interpolating a row of LCUs.
+ */
+typedef struct subpel_planes_row_t {
+  struct subpel_planes_t *planes;
+  int32_t lcu_y;
+} subpel_planes_row_t;
+
+/**
+ * \brief Luma of a reconstructed picture interpolated at each of the 15
+ * fractional quarter-pixel positions, and the integral image of the luma.
+ *
+ * Either part is optional. The planes are filled one LCU row at a time by
+ * the jobs in row_jobs. The interpolated values are equal to those of
+ * kvz_sample_quarterpel_luma.
+ */
+typedef struct subpel_planes_t {
+  //! \brief Size of the planes in pixels, equal to the size of the picture
+  int32_t width;
+  int32_t height;
+  int32_t stride;
+  int32_t height_in_lcu;
+
+  /**
+   * \brief Plane of each fractional position.
+   *
+   * The plane at index 4 * (y & 3) + (x & 3) holds the positions with the
+   * quarter-pixel offset (x & 3, y & 3). Index 0 is NULL since the integer
+   * positions are in the picture itself. All are NULL if the picture is not
+   * interpolated.
+   */
+  kvz_pixel *planes[16];
+
+  /**
+   * \brief Integral image of the luma, or NULL
+   *
+   * The value at (x, y) is the sum of the pixels above and to the left of
+   * pixel (x, y). The image has width + 1 columns and height + 1 rows.
+   * The sums wrap around but the sums of blocks are exact.
+   */
+  uint32_t *sums;
+  int32_t sums_stride;
+
+  //! \brief Reconstructed picture that is interpolated
+  kvz_picture *rec;
+
+  const struct encoder_control_t *encoder;
+
+  /**
+   * \brief Job interpolating each LCU row.
+   *
+   * Each job depends on the job of the previous row so the rows up to and
+   * including a row are done when the job of the row is done.
+   */
+  threadqueue_job_t **row_jobs;
+
+  //! \brief Parameters of the jobs in row_jobs
+  subpel_planes_row_t *rows;
+
+  int32_t refcount;
+} subpel_planes_t;
+
+
+subpel_planes_t * kvz_subpel_planes_alloc(const struct encoder_control_t *encoder,
+                                          kvz_picture *rec,
+                                          bool interpolate,
+                                          bool sums);
+subpel_planes_t * kvz_subpel_planes_copy_ref(subpel_planes_t *planes);
+void kvz_subpel_planes_free(subpel_planes_t **planes_ptr);
+
+void kvz_subpel_planes_worker_interpolate_row(void *opaque);
+void kvz_subpel_planes_worker_release(void *opaque);
+
+uint32_t kvz_subpel_planes_block_sum(const subpel_planes_t *planes,
+                                     int32_t x,
+                                     int32_t y,
+                                     int32_t width,
+                                     int32_t height);
+
+
+/**
+ * \brief Get a pointer to the interpolated block at a position.
+ *
+ * \param planes  interpolated planes
+ * \param x       horizontal position of the block in quarter pixels
+ * \param y       vertical position of the block in quarter pixels
+ * \return        pointer to the top-left pixel of the block, rows are
+ *                planes->stride pixels apart
+ */
+static INLINE const kvz_pixel * kvz_subpel_planes_block(const subpel_planes_t *planes,
+                                                        int32_t x,
+                                                        int32_t y)
+{
+  assert(((x | y) & 3) != 0);
+  return planes->planes[((y & 3) << 2) | (x & 3)] +
+         (y >> 2) * planes->stride + (x >> 2);
+}
+
+
+#endif // SUBPEL_PLANES_H_
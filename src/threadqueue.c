@@ -33,20 +33,67 @@
 /**
  * \file
  *
- * Lock acquisition order:
+ * Every worker thread owns a queue of jobs that are ready to run. A worker
+ * takes jobs from its own queue and steals jobs from the queues of other
+ * workers when they have more urgent work or when it runs out of work.
+ * Jobs that become ready when a worker finishes a job are pushed to the
+ * queue of that worker so that the data touched by the finished job is
+ * likely to still be in its cache. Jobs submitted by threads that are not
+ * workers go to a separate injection queue that all workers steal from.
  *
- * 1. When locking a job and its dependency, the dependecy must be locked
- * first and then the job depending on it.
+ * The queues are ordered by job priority. Jobs with equal priority are run
+ * in the order they were added to the queue.
  *
- * 2. When locking a job and the thread queue, the thread queue must be
- * locked first and then the job.
+ * Jobs are allocated from a pool owned by the thread queue. When the last
+ * reference to a job is released, the job is returned to the pool and the
+ * extra dependency storage of the job to a pool of its own, so once the
+ * pools have grown to the number of jobs in flight no more memory is
+ * allocated. Each worker pushes the jobs
+ * it frees to a lock-free stack of its own. A thread creating jobs takes
+ * all of the jobs in a stack at once, so no thread ever pops a single job
+ * from a stack that another thread pushes to. Workers keep a few of the
+ * jobs they take in a cache and move the rest to a stack shared by the
+ * thread queue. Threads that are not workers, in practice the thread
+ * calling the encoder, share one list protected by a lock.
  *
- * 3. When accessing threadqueue_job_t.next, the thread queue must be
- * locked.
+ * Jobs have no locks. The state of a job and the number of dependencies it
+ * is waiting for are updated with atomic operations, and the job becomes
+ * ready when the counter reaches zero. The counter starts at one so that a
+ * job cannot become ready before it has been submitted.
+ *
+ * The jobs depending on a job are kept in a lock-free list. New entries
+ * are pushed to the head of the list with compare-and-swap. When the job
+ * is completed, the list is replaced with a marker that tells
+ * kvz_threadqueue_job_dep_add that the job is already done.
+ *
+ * The worker threads belong to a thread pool that may be shared by several
+ * thread queues, one for each encoder. Each thread queue has its own ready
+ * queues and job pool. To share the threads fairly, a thread looks for a
+ * job in the thread queues in round-robin order, starting from the queue
+ * after the one it took its previous job from. A thread queue is detached
+ * from the pool when it is stopped. Detaching waits until no thread is
+ * running a job of the queue, so the queue may be freed after that.
+ *
+ * No lock may be held while acquiring another lock.
  */
 
 #define THREADQUEUE_LIST_REALLOC_SIZE 32
 
+/**
+ * \brief Number of dependencies stored inside the job.
+ *
+ * An LCU job depends on the LCUs on the left and top-right, an LCU of a
+ * previous frame when using OWF, the rate control weights and a row of the
+ * interpolated planes of each reference frame, so eight is enough for four
+ * reference frames. Jobs waiting for whole frames use depends_chunks.
+ */
+#define THREADQUEUE_INLINE_DEPENDS 8
+
+/**
+ * \brief Maximum number of free jobs a worker keeps for creating jobs.
+ */
+#define THREADQUEUE_FREE_BATCH 16
+
 #define PTHREAD_COND_SIGNAL(c) \
   if (pthread_cond_signal((c)) != 0) { \
     fprintf(stderr, "pthread_cond_signal(%s=%p) failed!\n", #c, c); \
@@ -85,7 +132,7 @@
 
 typedef enum {
   /**
-   * \brief Job has been submitted, but is not allowed to run yet.
+   * \brief Job has been created, but is not allowed to run yet.
    */
   THREADQUEUE_JOB_STATE_PAUSED,
 
@@ -112,33 +159,80 @@ typedef enum {
 } threadqueue_job_state;
 
 
-struct threadqueue_job_t {
-  pthread_mutex_t lock;
+/**
+ * \brief Dependency between two jobs.
+ *
+ * Owned by the job that depends on the other job and linked into the list
+ * of reverse dependencies of the other job.
+ */
+typedef struct threadqueue_dep_t {
+  /**
+   * \brief Job depending on the job whose list this is in.
+   */
+  struct threadqueue_job_t *job;
+
+  /**
+   * \brief Next element in the list.
+   */
+  struct threadqueue_dep_t *next;
+} threadqueue_dep_t;
+
+
+/**
+ * \brief Block of dependency storage for jobs with many dependencies.
+ */
+typedef struct threadqueue_dep_chunk_t {
+  threadqueue_dep_t deps[THREADQUEUE_LIST_REALLOC_SIZE];
+  struct threadqueue_dep_chunk_t *next;
+} threadqueue_dep_chunk_t;
 
-  threadqueue_job_state state;
+
+/**
+ * \brief Marker for the list of reverse dependencies of a completed job.
+ */
+static threadqueue_dep_t threadqueue_rdepends_closed;
+#define THREADQUEUE_RDEPENDS_CLOSED (&threadqueue_rdepends_closed)
+
+
+struct threadqueue_job_t {
+  /**
+   * \brief State of the job, a threadqueue_job_state.
+   *
+   * Accessed with atomic operations.
+   */
+  int32_t state;
 
   /**
-   * \brief Number of dependencies that have not been completed yet.
+   * \brief Number of dependencies that have not been completed yet, plus
+   * one until the job has been submitted.
+   *
+   * Accessed with atomic operations.
    */
-  int ndepends;
+  int32_t ndepends;
 
   /**
    * \brief Reverse dependencies.
    *
-   * Array of pointers to jobs that depend on this one. They have to exist
-   * when the thread finishes, because they cannot be run before.
+   * List of jobs that depend on this one, or THREADQUEUE_RDEPENDS_CLOSED
+   * after this job has been completed. Each element holds a reference to
+   * the job depending on this one.
+   */
+  threadqueue_dep_t *rdepends;
+
+  /**
+   * \brief Number of dependencies used by this job.
    */
-  struct threadqueue_job_t **rdepends;
+  int depends_count;
 
   /**
-   * \brief Number of elements in rdepends.
+   * \brief Storage for the first dependencies of this job.
    */
-  int rdepends_count;
+  threadqueue_dep_t depends_inline[THREADQUEUE_INLINE_DEPENDS];
 
   /**
-   * \brief Allocated size of rdepends.
+   * \brief Storage for the rest of the dependencies of this job.
    */
-  int rdepends_size;
+  threadqueue_dep_chunk_t *depends_chunks;
 
   /**
    * \brief Reference count
@@ -156,14 +250,169 @@ struct threadqueue_job_t {
   void *arg;
 
   /**
-   * \brief Pointer to the next job in the queue.
+   * \brief Scheduling priority
+   *
+   * Jobs with a higher priority are run first.
+   */
+  int32_t priority;
+
+  /**
+   * \brief Position of the job in the order the jobs were added to a queue.
+   */
+  uint32_t seq;
+
+  /**
+   * \brief Thread queue whose pool the job belongs to.
+   */
+  struct threadqueue_queue_t *threadqueue;
+
+  /**
+   * \brief Next job in the pool of free jobs.
+   */
+  struct threadqueue_job_t *next_free;
+
+  /**
+   * \brief Id of the job in the trace.
+   */
+  uint32_t trace_id;
+
+  /**
+   * \brief Number of dependencies completed after being added to the job.
+   *
+   * Only counted when tracing. Accessed with atomic operations.
+   */
+  int32_t trace_flows;
+
+  /**
+   * \brief Part of the picture the job works on, for the trace.
    */
-  struct threadqueue_job_t *next;
+  kvz_trace_job_info_t trace_info;
 
 };
 
 
-struct threadqueue_queue_t {
+/**
+ * \brief Queue of ready jobs owned by a single worker thread.
+ */
+typedef struct threadqueue_worker_t {
+  pthread_mutex_t lock;
+
+  /**
+   * \brief Binary heap of jobs ready to run, most urgent job first.
+   */
+  threadqueue_job_t **jobs;
+
+  /**
+   * \brief Allocated size of jobs.
+   */
+  int jobs_size;
+
+  /**
+   * \brief Number of jobs in the queue.
+   *
+   * Written with the lock held using atomic operations so that other
+   * workers may read it without locking.
+   */
+  int32_t count;
+
+  /**
+   * \brief Priority of the first job in the queue.
+   *
+   * Written with the lock held using atomic operations so that other
+   * workers may read it without locking.
+   */
+  int32_t best_priority;
+
+  /**
+   * \brief Sequence number for the next job added to the queue.
+   */
+  uint32_t next_seq;
+
+  /**
+   * \brief Index of the worker in threadqueue_queue_t.workers.
+   */
+  int id;
+
+  /**
+   * \brief Jobs returned to the pool by the thread of this worker.
+   *
+   * Lock-free stack. Only the thread of the worker pushes jobs to it and
+   * any thread may take all of the jobs at once by exchanging the head
+   * with NULL, so a job cannot be recycled while it is being pushed.
+   *
+   * For the injection queue, a plain list used by all threads outside the
+   * pool and protected by threadqueue_queue_t.free_lock.
+   */
+  struct threadqueue_job_t *free_jobs;
+
+  /**
+   * \brief Free jobs taken by the thread of this worker for creating jobs.
+   *
+   * Only used by that thread.
+   */
+  struct threadqueue_job_t *cached_jobs;
+
+  /**
+   * \brief Nonzero while the thread of this worker is completing a job and
+   * releasing its reference to it.
+   *
+   * Accessed with atomic operations.
+   */
+  int32_t releasing;
+
+  struct threadqueue_queue_t *threadqueue;
+} threadqueue_worker_t;
+
+
+/**
+ * \brief Worker thread of a thread pool.
+ */
+typedef struct threadqueue_thread_t {
+  pthread_t thread;
+
+  /**
+   * \brief Index of the thread in threadqueue_pool_t.threads.
+   *
+   * Also the index of the ready queue of this thread in every thread queue
+   * attached to the pool.
+   */
+  int id;
+
+  /**
+   * \brief Index in threadqueue_pool_t.queues where the search for the
+   * next job starts.
+   */
+  int next_queue;
+
+  /**
+   * \brief Thread queue whose job this thread is running, or NULL.
+   *
+   * Accessed with atomic operations.
+   */
+  struct threadqueue_queue_t *current_queue;
+
+  /**
+   * \brief Whether the thread is sleeping on job_available.
+   *
+   * Protected by threadqueue_pool_t.lock.
+   */
+  bool idle;
+
+  /**
+   * \brief Time the thread went to sleep.
+   *
+   * Protected by threadqueue_pool_t.lock.
+   */
+  KVZ_CLOCK_T idle_start;
+
+  struct kvz_thread_pool *pool;
+} threadqueue_thread_t;
+
+
+struct kvz_thread_pool {
+  /**
+   * \brief Lock for sleeping and waking threads.
+   */
   pthread_mutex_t lock;
 
   /**
@@ -174,16 +423,15 @@ struct threadqueue_queue_t {
   pthread_cond_t job_available;
 
   /**
-   * \brief Job done condition variable
-   *
-   * Signalled when a job has been completed.
+   * \brief Signalled when a thread stops running a job while a thread
+   * queue is being detached.
    */
-  pthread_cond_t job_done;
+  pthread_cond_t queue_released;
 
   /**
    * Array containing spawned threads
    */
-  pthread_t *threads;
+  threadqueue_thread_t *threads;
 
   /**
    * \brief Number of threads spawned
@@ -195,260 +443,1645 @@ struct threadqueue_queue_t {
    */
   int thread_running_count;
 
-  /**
-   * \brief If true, threads should stop ASAP.
-   */
-  bool stop;
+  /**
+   * \brief If nonzero, threads should stop ASAP.
+   *
+   * Accessed with atomic operations.
+   */
+  int32_t stop;
+
+  /**
+   * \brief Thread specific pointer to the current worker thread.
+   */
+  pthread_key_t thread_key;
+
+  /**
+   * \brief Whether thread_key has been created.
+   */
+  bool thread_key_created;
+
+  /**
+   * \brief Number of jobs in the ready queues of all attached thread
+   * queues.
+   *
+   * Accessed with atomic operations.
+   */
+  int32_t ready_count;
+
+  /**
+   * \brief Number of threads sleeping on job_available.
+   *
+   * Accessed with atomic operations.
+   */
+  int32_t idle_count;
+
+  /**
+   * \brief Number of threads waiting on queue_released.
+   *
+   * Accessed with atomic operations.
+   */
+  int32_t detach_count;
+
+  /**
+   * \brief Total time in seconds the threads have slept on job_available,
+   * not counting the threads that are sleeping now.
+   *
+   * Protected by lock.
+   */
+  double idle_time;
+
+  /**
+   * \brief Lock for queues.
+   *
+   * Held for reading while looking for a job and for writing while
+   * attaching or detaching a thread queue.
+   */
+  pthread_rwlock_t queues_lock;
+
+  /**
+   * \brief Thread queues served by the pool.
+   */
+  struct threadqueue_queue_t **queues;
+
+  /**
+   * \brief Number of thread queues served by the pool.
+   */
+  int queue_count;
+
+  /**
+   * \brief Allocated size of queues.
+   */
+  int queues_size;
+
+  /**
+   * \brief Whether the workers count starved time.
+   *
+   * Set when more than one thread queue is attached and at least one of
+   * them counts starved time. Written with queues_lock held for writing and
+   * read with atomic operations.
+   */
+  int32_t count_starved_time;
+};
+
+
+struct threadqueue_queue_t {
+  /**
+   * \brief Lock for job_done.
+   */
+  pthread_mutex_t lock;
+
+  /**
+   * \brief Job done condition variable
+   *
+   * Signalled when a job has been completed.
+   */
+  pthread_cond_t job_done;
+
+  /**
+   * \brief Pool of threads running the jobs.
+   */
+  threadqueue_pool_t *pool;
+
+  /**
+   * \brief Whether the pool was created for this queue only.
+   */
+  bool owns_pool;
+
+  /**
+   * \brief If nonzero, the queue has been detached from the pool.
+   *
+   * Accessed with atomic operations.
+   */
+  int32_t stop;
+
+  /**
+   * \brief Queues of ready jobs
+   *
+   * One queue for each thread of the pool and an injection queue at index
+   * pool->thread_count for jobs submitted by other threads.
+   */
+  threadqueue_worker_t *workers;
+
+  /**
+   * \brief Number of initialized elements in workers.
+   */
+  int worker_count;
+
+  /**
+   * \brief Number of jobs in the ready queues.
+   *
+   * Accessed with atomic operations.
+   */
+  int32_t ready_count;
+
+  /**
+   * \brief Number of threads waiting on job_done.
+   *
+   * Accessed with atomic operations.
+   */
+  int32_t waiting_count;
+
+  /**
+   * \brief Time in nanoseconds worker threads have spent running jobs of
+   * other thread queues while this queue had no jobs ready, summed over
+   * threads.
+   *
+   * Accessed with atomic operations.
+   */
+  int64_t starved_time;
+
+  /**
+   * \brief Whether starved_time is counted.
+   *
+   * Protected by the queues_lock of the pool.
+   */
+  bool count_starved_time;
+
+  /**
+   * \brief Lock for the free jobs of the injection queue.
+   */
+  pthread_mutex_t free_lock;
+
+  /**
+   * \brief Free jobs moved here by the workers.
+   *
+   * Lock-free stack. Jobs are pushed with compare-and-swap and taken all at
+   * once by exchanging the head with NULL. Since no thread pops a single
+   * job, a job recycled while another thread is pushing cannot corrupt the
+   * stack.
+   */
+  threadqueue_job_t *shared_free_jobs;
+
+  /**
+   * \brief Dependency storage that is not in use.
+   *
+   * Lock-free stack used like shared_free_jobs.
+   */
+  threadqueue_dep_chunk_t *free_chunks;
+
+  /**
+   * \brief Number of memory allocations made for jobs and ready queues.
+   *
+   * Accessed with atomic operations.
+   */
+  int32_t alloc_count;
+
+  /**
+   * \brief Trace of job activity, or NULL.
+   */
+  kvz_trace_t *trace;
+
+  /**
+   * \brief Id of the previous job created while tracing.
+   *
+   * Accessed with atomic operations.
+   */
+  int32_t trace_last_id;
+};
+
+
+/**
+ * \brief Initialize a queue of ready jobs.
+ *
+ * \return 1 on success, 0 on failure
+ */
+static int threadqueue_worker_init(threadqueue_worker_t *worker,
+                                   threadqueue_queue_t *threadqueue,
+                                   int id)
+{
+  if (pthread_mutex_init(&worker->lock, NULL) != 0) {
+    fprintf(stderr, "pthread_mutex_init(worker) failed!\n");
+    return 0;
+  }
+
+  worker->jobs = MALLOC(threadqueue_job_t*, THREADQUEUE_LIST_REALLOC_SIZE);
+  if (!worker->jobs) {
+    fprintf(stderr, "Could not malloc worker->jobs!\n");
+    pthread_mutex_destroy(&worker->lock);
+    return 0;
+  }
+  worker->jobs_size     = THREADQUEUE_LIST_REALLOC_SIZE;
+  worker->count         = 0;
+  worker->best_priority = 0;
+  worker->next_seq      = 0;
+  worker->free_jobs     = NULL;
+  worker->cached_jobs   = NULL;
+  worker->releasing     = 0;
+  worker->id          = id;
+  worker->threadqueue = threadqueue;
+
+  return 1;
+}
+
+
+/**
+ * \brief Compare priorities.
+ *
+ * Priorities are compared with wrapping arithmetic so that they may be
+ * derived from ever increasing counters such as frame numbers.
+ *
+ * \return true if priority a is more urgent than priority b
+ */
+static INLINE bool threadqueue_priority_before(int32_t a, int32_t b)
+{
+  return (int32_t)((uint32_t)a - (uint32_t)b) > 0;
+}
+
+
+/**
+ * \brief Check whether job a should be run before job b.
+ */
+static INLINE bool threadqueue_job_before(const threadqueue_job_t *a,
+                                          const threadqueue_job_t *b)
+{
+  if (a->priority != b->priority) {
+    return threadqueue_priority_before(a->priority, b->priority);
+  }
+  return (int32_t)(a->seq - b->seq) < 0;
+}
+
+
+/**
+ * \brief Record an event of a job if the thread queue is traced.
+ */
+static INLINE void threadqueue_trace(threadqueue_queue_t *threadqueue,
+                                     kvz_trace_event_type type,
+                                     const threadqueue_job_t *job,
+                                     uint32_t arg)
+{
+  if (!threadqueue->trace) return;
+
+  const threadqueue_thread_t *thread = pthread_getspecific(threadqueue->pool->thread_key);
+  kvz_trace_job_event(threadqueue->trace,
+                      thread ? thread->id : -1,
+                      type,
+                      job->trace_id,
+                      arg,
+                      type == KVZ_TRACE_JOB_START ? &job->trace_info : NULL);
+}
+
+
+/**
+ * \brief Add a job to a queue of ready jobs.
+ *
+ * This function takes the ownership of the job.
+ *
+ * \return 1 on success, 0 on failure
+ */
+static int threadqueue_worker_push(threadqueue_worker_t *worker,
+                                   threadqueue_job_t *job)
+{
+  PTHREAD_LOCK(&worker->lock);
+
+  // Other threads read count with atomic operations.
+  const int count = KVZ_ATOMIC_ADD(&worker->count, 0);
+
+  if (count == worker->jobs_size) {
+    const int new_size = worker->jobs_size + THREADQUEUE_LIST_REALLOC_SIZE;
+    threadqueue_job_t **jobs = realloc(worker->jobs, new_size * sizeof(threadqueue_job_t*));
+    if (!jobs) {
+      fprintf(stderr, "Could not realloc worker->jobs!\n");
+      PTHREAD_UNLOCK(&worker->lock);
+      return 0;
+    }
+    KVZ_ATOMIC_INC(&worker->threadqueue->alloc_count);
+    worker->jobs      = jobs;
+    worker->jobs_size = new_size;
+  }
+
+  job->seq = worker->next_seq++;
+
+  // Sift the job up the heap.
+  int i = count;
+  while (i > 0) {
+    const int parent = (i - 1) / 2;
+    if (!threadqueue_job_before(job, worker->jobs[parent])) break;
+    worker->jobs[i] = worker->jobs[parent];
+    i = parent;
+  }
+  worker->jobs[i] = job;
+
+  KVZ_ATOMIC_XCHG(&worker->best_priority, worker->jobs[0]->priority);
+  KVZ_ATOMIC_INC(&worker->count);
+
+  PTHREAD_UNLOCK(&worker->lock);
+  return 1;
+}
+
+
+/**
+ * \brief Remove the most urgent job from a queue of ready jobs.
+ *
+ * The calling function receives the ownership of the job.
+ *
+ * \return the job, or NULL if the queue is empty
+ */
+static threadqueue_job_t * threadqueue_worker_pop(threadqueue_worker_t *worker)
+{
+  PTHREAD_LOCK(&worker->lock);
+
+  threadqueue_job_t *job = NULL;
+  if (KVZ_ATOMIC_ADD(&worker->count, 0) > 0) {
+    job = worker->jobs[0];
+    const int count = KVZ_ATOMIC_DEC(&worker->count);
+
+    // Sift the last job down the heap from the root.
+    threadqueue_job_t * const last = worker->jobs[count];
+    int i = 0;
+    for (;;) {
+      int child = 2 * i + 1;
+      if (child >= count) break;
+      if (child + 1 < count &&
+          threadqueue_job_before(worker->jobs[child + 1], worker->jobs[child])) {
+        child++;
+      }
+      if (!threadqueue_job_before(worker->jobs[child], last)) break;
+      worker->jobs[i] = worker->jobs[child];
+      i = child;
+    }
+    worker->jobs[i] = last;
+
+    if (count > 0) {
+      KVZ_ATOMIC_XCHG(&worker->best_priority, worker->jobs[0]->priority);
+    }
+  }
+
+  PTHREAD_UNLOCK(&worker->lock);
+  return job;
+}
+
+
+/**
+ * \brief Get the worker of the calling thread.
+ *
+ * \return the worker of the thread if it belongs to the pool, otherwise
+ *         the injection queue
+ */
+static threadqueue_worker_t * threadqueue_current_worker(threadqueue_queue_t *threadqueue)
+{
+  threadqueue_pool_t * const pool = threadqueue->pool;
+  const threadqueue_thread_t *thread = pthread_getspecific(pool->thread_key);
+  return &threadqueue->workers[thread ? thread->id : pool->thread_count];
+}
+
+
+/**
+ * \brief Add a job to the queue of jobs ready to run.
+ *
+ * This function takes the ownership of the job.
+ *
+ * When called from a worker thread of the pool, the job is added to the
+ * queue of that worker. Otherwise the job is added to the injection queue.
+ *
+ * \return 1 on success, 0 on failure
+ */
+static int threadqueue_push_job(threadqueue_queue_t * threadqueue,
+                                threadqueue_job_t *job)
+{
+  assert(KVZ_ATOMIC_ADD(&job->ndepends, 0) == 0);
+
+  threadqueue_pool_t * const pool = threadqueue->pool;
+  threadqueue_worker_t *worker = threadqueue_current_worker(threadqueue);
+
+  if (!threadqueue_worker_push(worker, job)) {
+    return 0;
+  }
+  KVZ_ATOMIC_INC(&threadqueue->ready_count);
+  KVZ_ATOMIC_INC(&pool->ready_count);
+  return 1;
+}
+
+
+/**
+ * \brief Retrieve a job from the queues of jobs ready to run.
+ *
+ * The most urgent job is taken from the worker's own queue unless another
+ * queue has a more urgent job. The calling function receives the ownership
+ * of the job.
+ *
+ * \param id  index of the worker thread in the pool
+ * \return the job, or NULL if no job was found
+ */
+static threadqueue_job_t * threadqueue_pop_job(threadqueue_queue_t *threadqueue, int id)
+{
+  const int num_queues = threadqueue->pool->thread_count + 1;
+
+  // Find the queue with the most urgent job by peeking at the published
+  // priorities without locking.
+  threadqueue_worker_t *best = NULL;
+  int32_t best_priority = 0;
+  for (int i = 0; i < num_queues; i++) {
+    // Start from the worker's own queue so that it wins ties.
+    threadqueue_worker_t *queue = &threadqueue->workers[(id + i) % num_queues];
+    if (KVZ_ATOMIC_ADD(&queue->count, 0) == 0) continue;
+
+    const int32_t priority = KVZ_ATOMIC_ADD(&queue->best_priority, 0);
+    if (!best || threadqueue_priority_before(priority, best_priority)) {
+      best = queue;
+      best_priority = priority;
+    }
+  }
+
+  threadqueue_job_t *job = best ? threadqueue_worker_pop(best) : NULL;
+
+  // The queue may have been emptied by another worker. Take any job.
+  for (int i = 0; !job && i < num_queues; i++) {
+    job = threadqueue_worker_pop(&threadqueue->workers[(id + i) % num_queues]);
+  }
+
+  if (job) {
+    KVZ_ATOMIC_DEC(&threadqueue->ready_count);
+    KVZ_ATOMIC_DEC(&threadqueue->pool->ready_count);
+  }
+  return job;
+}
+
+
+/**
+ * \brief Push a list of dependency storage to the pool of the thread queue.
+ */
+static void threadqueue_push_free_chunks(threadqueue_queue_t *threadqueue,
+                                         threadqueue_dep_chunk_t *first)
+{
+  threadqueue_dep_chunk_t *last = first;
+  while (last->next) {
+    last = last->next;
+  }
+
+  threadqueue_dep_chunk_t *head = NULL;
+  for (;;) {
+    last->next = head;
+    threadqueue_dep_chunk_t *old_head =
+      KVZ_ATOMIC_CAS_PTR(&threadqueue->free_chunks, head, first);
+    if (old_head == head) break;
+    head = old_head;
+  }
+}
+
+
+/**
+ * \brief Push a list of free jobs to a lock-free stack.
+ *
+ * \param stack  head of the stack
+ * \param first  first job of the list
+ */
+static void threadqueue_push_free_jobs(threadqueue_job_t **stack,
+                                       threadqueue_job_t *first)
+{
+  threadqueue_job_t *last = first;
+  while (last->next_free) {
+    last = last->next_free;
+  }
+
+  threadqueue_job_t *head = NULL;
+  for (;;) {
+    last->next_free = head;
+    threadqueue_job_t *old_head = KVZ_ATOMIC_CAS_PTR(stack, head, first);
+    if (old_head == head) break;
+    head = old_head;
+  }
+}
+
+
+/**
+ * \brief Take every job from the lock-free stacks of the workers.
+ *
+ * \return list of the jobs, or NULL if the stacks are empty
+ */
+static threadqueue_job_t * threadqueue_take_worker_free_jobs(threadqueue_queue_t *threadqueue)
+{
+  const int thread_count = threadqueue->pool->thread_count;
+  threadqueue_job_t *jobs = NULL;
+  for (int i = 0; i < thread_count; i++) {
+    threadqueue_job_t *job = KVZ_ATOMIC_XCHG_PTR(&threadqueue->workers[i].free_jobs, NULL);
+    while (job) {
+      threadqueue_job_t * const next = job->next_free;
+      job->next_free = jobs;
+      jobs = job;
+      job = next;
+    }
+  }
+
+  if (!jobs) {
+    // A thread waiting for a job may see it completed before the worker
+    // has released its reference. Wait for the job to be returned instead
+    // of allocating a new one.
+    bool waited = false;
+    for (int i = 0; i < thread_count; i++) {
+      while (KVZ_ATOMIC_ADD(&threadqueue->workers[i].releasing, 0)) {
+        waited = true;
+      }
+    }
+    if (waited) {
+      for (int i = 0; !jobs && i < thread_count; i++) {
+        jobs = KVZ_ATOMIC_XCHG_PTR(&threadqueue->workers[i].free_jobs, NULL);
+      }
+    }
+  }
+  return jobs;
+}
+
+
+/**
+ * \brief Take a job from the pool of the thread queue.
+ *
+ * A worker takes the job from its cache, which is refilled from its own
+ * stack, the shared stack or the stacks of the other workers, in that
+ * order. Other threads use the list of the injection queue and refill it
+ * the same way.
+ *
+ * \param job_out  set to the job, or NULL if the pool is empty
+ *
+ * \return 1 on success, 0 on failure
+ */
+static int threadqueue_take_free_job(threadqueue_queue_t *threadqueue,
+                                     threadqueue_job_t **job_out)
+{
+  threadqueue_worker_t * const worker = threadqueue_current_worker(threadqueue);
+
+  if (worker->id == threadqueue->pool->thread_count) {
+    PTHREAD_LOCK(&threadqueue->free_lock);
+    if (!worker->free_jobs) {
+      worker->free_jobs = KVZ_ATOMIC_XCHG_PTR(&threadqueue->shared_free_jobs, NULL);
+    }
+    if (!worker->free_jobs) {
+      worker->free_jobs = threadqueue_take_worker_free_jobs(threadqueue);
+    }
+    *job_out = worker->free_jobs;
+    if (*job_out) {
+      worker->free_jobs = (*job_out)->next_free;
+    }
+    PTHREAD_UNLOCK(&threadqueue->free_lock);
+    return 1;
+  }
+
+  if (!worker->cached_jobs) {
+    threadqueue_job_t *jobs = KVZ_ATOMIC_XCHG_PTR(&worker->free_jobs, NULL);
+    if (!jobs) {
+      jobs = KVZ_ATOMIC_XCHG_PTR(&threadqueue->shared_free_jobs, NULL);
+    }
+    if (!jobs) {
+      jobs = threadqueue_take_worker_free_jobs(threadqueue);
+    }
+
+    // Keep a few jobs and leave the rest to the other threads.
+    threadqueue_job_t *last_kept = jobs;
+    for (int i = 1; last_kept && i < THREADQUEUE_FREE_BATCH; i++) {
+      last_kept = last_kept->next_free;
+    }
+    if (last_kept && last_kept->next_free) {
+      threadqueue_push_free_jobs(&threadqueue->shared_free_jobs, last_kept->next_free);
+      last_kept->next_free = NULL;
+    }
+    worker->cached_jobs = jobs;
+  }
+
+  *job_out = worker->cached_jobs;
+  if (*job_out) {
+    worker->cached_jobs = (*job_out)->next_free;
+  }
+  return 1;
+}
+
+
+/**
+ * \brief Return a job to the pool of its thread queue.
+ *
+ * A worker pushes the job to its own stack without locking. Other threads
+ * add it to the list of the injection queue.
+ *
+ * \return 1 on success, 0 on failure
+ */
+static int threadqueue_return_free_job(threadqueue_job_t *job)
+{
+  threadqueue_queue_t * const threadqueue = job->threadqueue;
+  threadqueue_worker_t * const worker = threadqueue_current_worker(threadqueue);
+
+  // The job may need a different amount of storage when it is reused.
+  if (job->depends_chunks) {
+    threadqueue_push_free_chunks(threadqueue, job->depends_chunks);
+    job->depends_chunks = NULL;
+  }
+
+  job->next_free = NULL;
+  if (worker->id < threadqueue->pool->thread_count) {
+    threadqueue_push_free_jobs(&worker->free_jobs, job);
+    return 1;
+  }
+
+  PTHREAD_LOCK(&threadqueue->free_lock);
+  job->next_free = worker->free_jobs;
+  worker->free_jobs = job;
+  PTHREAD_UNLOCK(&threadqueue->free_lock);
+  return 1;
+}
+
+
+/**
+ * \brief Free the jobs in a list of free jobs.
+ */
+static void threadqueue_destroy_free_jobs(threadqueue_job_t *job)
+{
+  while (job) {
+    threadqueue_job_t * const next = job->next_free;
+    while (job->depends_chunks) {
+      threadqueue_dep_chunk_t *chunk_next = job->depends_chunks->next;
+      FREE_POINTER(job->depends_chunks);
+      job->depends_chunks = chunk_next;
+    }
+    FREE_POINTER(job);
+    job = next;
+  }
+}
+
+
+/**
+ * \brief Retrieve a job from the thread queues served by the pool.
+ *
+ * The thread queues are searched in round-robin order so that every
+ * encoder sharing the pool gets its turn. The thread is marked as running
+ * a job of the thread queue before the queues lock is released.
+ *
+ * \return the job, or NULL if no job was found
+ */
+static threadqueue_job_t * threadqueue_pool_pop_job(threadqueue_thread_t *thread)
+{
+  threadqueue_pool_t * const pool = thread->pool;
+
+  if (pthread_rwlock_rdlock(&pool->queues_lock) != 0) {
+    fprintf(stderr, "pthread_rwlock_rdlock failed!\n");
+    assert(0);
+    return NULL;
+  }
+
+  threadqueue_job_t *job = NULL;
+  const int num_queues = pool->queue_count;
+  for (int i = 0; !job && i < num_queues; i++) {
+    const int index = (thread->next_queue + i) % num_queues;
+    threadqueue_queue_t * const threadqueue = pool->queues[index];
+    if (KVZ_ATOMIC_ADD(&threadqueue->ready_count, 0) == 0) continue;
+
+    (void)KVZ_ATOMIC_XCHG_PTR(&thread->current_queue, threadqueue);
+    job = threadqueue_pop_job(threadqueue, thread->id);
+    if (job) {
+      thread->next_queue = index + 1;
+    } else {
+      (void)KVZ_ATOMIC_XCHG_PTR(&thread->current_queue, NULL);
+    }
+  }
+
+  pthread_rwlock_unlock(&pool->queues_lock);
+  return job;
+}
+
+
+/**
+ * \brief Move the cached free jobs of a thread to the shared stacks.
+ *
+ * Called before the thread goes to sleep so that the jobs it has cached
+ * are not kept from the threads creating new jobs.
+ */
+static void threadqueue_thread_flush_free_jobs(threadqueue_thread_t *thread)
+{
+  threadqueue_pool_t * const pool = thread->pool;
+
+  if (pthread_rwlock_rdlock(&pool->queues_lock) != 0) {
+    fprintf(stderr, "pthread_rwlock_rdlock failed!\n");
+    assert(0);
+    return;
+  }
+
+  for (int i = 0; i < pool->queue_count; i++) {
+    threadqueue_queue_t * const threadqueue = pool->queues[i];
+    threadqueue_worker_t * const worker = &threadqueue->workers[thread->id];
+    if (!worker->cached_jobs) continue;
+
+    threadqueue_push_free_jobs(&threadqueue->shared_free_jobs, worker->cached_jobs);
+    worker->cached_jobs = NULL;
+  }
+
+  pthread_rwlock_unlock(&pool->queues_lock);
+}
+
+
+/**
+ * \brief Mark the thread as no longer running a job of any thread queue.
+ *
+ * \return 1 on success, 0 on failure
+ */
+static int threadqueue_thread_release_queue(threadqueue_thread_t *thread)
+{
+  threadqueue_pool_t * const pool = thread->pool;
+
+  (void)KVZ_ATOMIC_XCHG_PTR(&thread->current_queue, NULL);
+
+  // A thread detaching a queue announces itself in detach_count before
+  // checking current_queue so it cannot miss this.
+  if (KVZ_ATOMIC_ADD(&pool->detach_count, 0) > 0) {
+    PTHREAD_LOCK(&pool->lock);
+    PTHREAD_COND_BROADCAST(&pool->queue_released);
+    PTHREAD_UNLOCK(&pool->lock);
+  }
+  return 1;
+}
+
+
+/**
+ * \brief Wake up sleeping worker threads.
+ *
+ * \param count   maximum number of threads to wake up
+ * \return 1 on success, 0 on failure
+ */
+static int threadqueue_wake_workers(threadqueue_pool_t * pool, int count)
+{
+  if (count <= 0 || KVZ_ATOMIC_ADD(&pool->idle_count, 0) == 0) {
+    // Nobody is sleeping. Any thread going to sleep checks ready_count
+    // after announcing itself in idle_count so it will see the new jobs.
+    return 1;
+  }
+
+  PTHREAD_LOCK(&pool->lock);
+  for (int i = 0; i < count; i++) {
+    PTHREAD_COND_SIGNAL(&pool->job_available);
+  }
+  PTHREAD_UNLOCK(&pool->lock);
+  return 1;
+}
+
+
+static int threadqueue_job_finish(threadqueue_queue_t * threadqueue,
+                                  threadqueue_job_t *job);
+
+
+/**
+ * \brief Add a job that became ready to the queues of ready jobs.
+ *
+ * If the job cannot be added, it is run in the calling thread since no
+ * other thread would ever run it. This function takes the ownership of the
+ * job.
+ *
+ * \return 1 if the job was added to a queue, 0 if it was run
+ */
+static int threadqueue_make_ready(threadqueue_queue_t * threadqueue,
+                                  threadqueue_job_t *job)
+{
+  if (threadqueue_push_job(threadqueue, job)) {
+    return 1;
+  }
+
+  if (KVZ_ATOMIC_CAS(&job->state,
+                     THREADQUEUE_JOB_STATE_READY,
+                     THREADQUEUE_JOB_STATE_RUNNING) == THREADQUEUE_JOB_STATE_READY) {
+    threadqueue_trace(threadqueue, KVZ_TRACE_JOB_START, job,
+                      KVZ_ATOMIC_ADD(&job->trace_flows, 0));
+    job->fptr(job->arg);
+    const int num_new_jobs = threadqueue_job_finish(threadqueue, job);
+    threadqueue_trace(threadqueue, KVZ_TRACE_JOB_END, job, 0);
+    threadqueue_wake_workers(threadqueue->pool, num_new_jobs);
+  }
+
+  kvz_threadqueue_free_job(&job);
+  return 0;
+}
+
+
+/**
+ * \brief Mark a job as completed and release the jobs depending on it.
+ *
+ * \return number of jobs that became ready to run
+ */
+static int threadqueue_job_finish(threadqueue_queue_t * threadqueue,
+                                  threadqueue_job_t *job)
+{
+  KVZ_ATOMIC_XCHG(&job->state, THREADQUEUE_JOB_STATE_DONE);
+
+  // Close the list so that no more dependencies are added to it.
+  threadqueue_dep_t *dep = KVZ_ATOMIC_XCHG_PTR(&job->rdepends, THREADQUEUE_RDEPENDS_CLOSED);
+  assert(dep != THREADQUEUE_RDEPENDS_CLOSED);
+
+  // Go through all the jobs that depend on this one, decreasing their
+  // ndepends. Count how many jobs can now start executing so we know how
+  // many threads to wake up.
+  int num_new_jobs = 0;
+  while (dep) {
+    // The element is stored in the job depending on this one, so read
+    // everything from it before releasing the reference.
+    threadqueue_dep_t *next = dep->next;
+    threadqueue_job_t *depjob = dep->job;
+
+    if (threadqueue->trace) {
+      threadqueue_trace(threadqueue, KVZ_TRACE_JOB_DEPENDENCY, depjob,
+                        KVZ_ATOMIC_INC(&depjob->trace_flows) - 1);
+    }
+
+    if (KVZ_ATOMIC_DEC(&depjob->ndepends) == 0 && threadqueue->pool->thread_count > 0) {
+      // Move the job to ready jobs.
+      KVZ_ATOMIC_XCHG(&depjob->state, THREADQUEUE_JOB_STATE_READY);
+      threadqueue_trace(threadqueue, KVZ_TRACE_JOB_READY, depjob, 0);
+      num_new_jobs += threadqueue_make_ready(threadqueue, kvz_threadqueue_copy_ref(depjob));
+    }
+
+    // Clear this reference to the job.
+    kvz_threadqueue_free_job(&depjob);
+    dep = next;
+  }
+
+  if (KVZ_ATOMIC_ADD(&threadqueue->waiting_count, 0) > 0) {
+    PTHREAD_LOCK(&threadqueue->lock);
+    PTHREAD_COND_BROADCAST(&threadqueue->job_done);
+    PTHREAD_UNLOCK(&threadqueue->lock);
+  }
+
+  return num_new_jobs;
+}
+
+
+/**
+ * \brief Update whether the workers of a pool count starved time.
+ *
+ * Must be called with queues_lock held for writing.
+ */
+static void threadqueue_update_count_starved_time(threadqueue_pool_t *pool)
+{
+  bool count = false;
+  if (pool->queue_count > 1) {
+    for (int i = 0; i < pool->queue_count; i++) {
+      count = count || pool->queues[i]->count_starved_time;
+    }
+  }
+  KVZ_ATOMIC_XCHG(&pool->count_starved_time, count);
+}
+
+
+/**
+ * \brief Count the time a job took as starved time of the other thread
+ * queues of the pool that have no jobs ready.
+ *
+ * \param threadqueue  queue of the job
+ * \param time         running time of the job in seconds
+ */
+static void threadqueue_add_starved_time(threadqueue_pool_t *pool,
+                                         const threadqueue_queue_t *threadqueue,
+                                         double time)
+{
+  if (pthread_rwlock_rdlock(&pool->queues_lock) != 0) {
+    fprintf(stderr, "pthread_rwlock_rdlock failed!\n");
+    assert(0);
+    return;
+  }
+
+  for (int i = 0; i < pool->queue_count; i++) {
+    threadqueue_queue_t * const other = pool->queues[i];
+    if (other == threadqueue || !other->count_starved_time ||
+        KVZ_ATOMIC_ADD(&other->ready_count, 0) > 0) {
+      continue;
+    }
+    KVZ_ATOMIC_ADD64(&other->starved_time, (int64_t)(time * 1e9));
+  }
+
+  pthread_rwlock_unlock(&pool->queues_lock);
+}
+
+
+/**
+ * \brief Function executed by worker threads.
+ */
+static void* threadqueue_worker(void* thread_opaque)
+{
+  threadqueue_thread_t * const thread = (threadqueue_thread_t *) thread_opaque;
+  threadqueue_pool_t * const pool = thread->pool;
+
+  if (pthread_setspecific(pool->thread_key, thread) != 0) {
+    fprintf(stderr, "pthread_setspecific failed!\n");
+    assert(0);
+  }
+
+  for (;;) {
+    if (KVZ_ATOMIC_ADD(&pool->stop, 0)) {
+      break;
+    }
+
+    // Get a job and remove it from the queue.
+    threadqueue_job_t *job = threadqueue_pool_pop_job(thread);
+
+    if (!job) {
+      threadqueue_thread_flush_free_jobs(thread);
+
+      // Wait until there is something to do in the queue.
+      PTHREAD_LOCK(&pool->lock);
+      KVZ_ATOMIC_INC(&pool->idle_count);
+      thread->idle = true;
+      KVZ_GET_TIME(&thread->idle_start);
+      while (!KVZ_ATOMIC_ADD(&pool->stop, 0) &&
+             KVZ_ATOMIC_ADD(&pool->ready_count, 0) == 0) {
+        PTHREAD_COND_WAIT(&pool->job_available, &pool->lock);
+      }
+      KVZ_CLOCK_T idle_end;
+      KVZ_GET_TIME(&idle_end);
+      pool->idle_time += KVZ_CLOCK_T_DIFF(thread->idle_start, idle_end);
+      thread->idle = false;
+      KVZ_ATOMIC_DEC(&pool->idle_count);
+      PTHREAD_UNLOCK(&pool->lock);
+      continue;
+    }
+
+    threadqueue_queue_t * const threadqueue = job->threadqueue;
+    threadqueue_worker_t * const worker = &threadqueue->workers[thread->id];
+
+    if (KVZ_ATOMIC_CAS(&job->state,
+                       THREADQUEUE_JOB_STATE_READY,
+                       THREADQUEUE_JOB_STATE_RUNNING) != THREADQUEUE_JOB_STATE_READY) {
+      // The job was run by kvz_threadqueue_join.
+      KVZ_ATOMIC_XCHG(&worker->releasing, 1);
+      kvz_threadqueue_free_job(&job);
+      KVZ_ATOMIC_XCHG(&worker->releasing, 0);
+      threadqueue_thread_release_queue(thread);
+      continue;
+    }
+
+    threadqueue_trace(threadqueue, KVZ_TRACE_JOB_START, job,
+                      KVZ_ATOMIC_ADD(&job->trace_flows, 0));
+
+    // Counting starved time walks the queues of the pool so it is done only
+    // when some other queue needs it.
+    const bool count_starved_time = KVZ_ATOMIC_ADD(&pool->count_starved_time, 0);
+    KVZ_CLOCK_T job_start, job_end;
+    if (count_starved_time) {
+      KVZ_GET_TIME(&job_start);
+    }
+
+    job->fptr(job->arg);
+
+    if (count_starved_time) {
+      KVZ_GET_TIME(&job_end);
+    }
+
+    KVZ_ATOMIC_XCHG(&worker->releasing, 1);
+
+    const int num_new_jobs = threadqueue_job_finish(threadqueue, job);
+
+    threadqueue_trace(threadqueue, KVZ_TRACE_JOB_END, job, 0);
+
+    kvz_threadqueue_free_job(&job);
+
+    KVZ_ATOMIC_XCHG(&worker->releasing, 0);
+
+    if (count_starved_time) {
+      threadqueue_add_starved_time(pool, threadqueue,
+                                   KVZ_CLOCK_T_DIFF(job_start, job_end));
+    }
+
+    // The thread queue may be freed after this.
+    threadqueue_thread_release_queue(thread);
+
+    // The current thread will process one of the new jobs so we wake up
+    // one threads less than the the number of new jobs.
+    threadqueue_wake_workers(pool, num_new_jobs - 1);
+  }
+
+  PTHREAD_LOCK(&pool->lock);
+  pool->thread_running_count--;
+  PTHREAD_UNLOCK(&pool->lock);
+  return NULL;
+}
+
+
+/**
+ * \brief Stop all threads of a pool after they finish the current jobs.
+ *
+ * Block until all threads have stopped.
+ *
+ * \return 1 on success, 0 on failure
+ */
+static int threadqueue_pool_stop(threadqueue_pool_t * const pool)
+{
+  PTHREAD_LOCK(&pool->lock);
+
+  if (KVZ_ATOMIC_ADD(&pool->stop, 0)) {
+    // The pool should have stopped already.
+    assert(pool->thread_running_count == 0);
+    PTHREAD_UNLOCK(&pool->lock);
+    return 1;
+  }
+
+  // Tell all threads to stop.
+  KVZ_ATOMIC_XCHG(&pool->stop, 1);
+  PTHREAD_COND_BROADCAST(&pool->job_available);
+  PTHREAD_UNLOCK(&pool->lock);
+
+  // Wait for them to stop.
+  for (int i = 0; i < pool->thread_count; i++) {
+    if (pthread_join(pool->threads[i].thread, NULL) != 0) {
+      fprintf(stderr, "pthread_join failed!\n");
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/**
+ * \brief Create a pool of worker threads.
+ *
+ * \param thread_count  number of threads, 0 to run jobs in the thread
+ *                      submitting them
+ * \return the pool, or NULL on failure
+ */
+threadqueue_pool_t * kvz_threadqueue_pool_init(int thread_count)
+{
+  threadqueue_pool_t *pool = MALLOC(threadqueue_pool_t, 1);
+  if (!pool) {
+    return NULL;
+  }
+
+  pool->threads              = NULL;
+  pool->thread_count         = 0;
+  pool->thread_running_count = 0;
+  pool->stop                 = 0;
+  pool->thread_key_created   = false;
+  pool->ready_count          = 0;
+  pool->idle_count           = 0;
+  pool->detach_count         = 0;
+  pool->idle_time            = 0;
+  pool->queues               = NULL;
+  pool->queue_count          = 0;
+  pool->count_starved_time   = 0;
+  pool->queues_size          = 0;
+
+  // kvz_threadqueue_pool_free may only be called after the locks have been
+  // initialized.
+  if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+    fprintf(stderr, "pthread_mutex_init failed!\n");
+    goto failed_lock;
+  }
+
+  if (pthread_cond_init(&pool->job_available, NULL) != 0) {
+    fprintf(stderr, "pthread_cond_init failed!\n");
+    goto failed_job_available;
+  }
+
+  if (pthread_cond_init(&pool->queue_released, NULL) != 0) {
+    fprintf(stderr, "pthread_cond_init failed!\n");
+    goto failed_queue_released;
+  }
+
+  if (pthread_rwlock_init(&pool->queues_lock, NULL) != 0) {
+    fprintf(stderr, "pthread_rwlock_init failed!\n");
+    goto failed_queues_lock;
+  }
+
+  if (pthread_key_create(&pool->thread_key, NULL) != 0) {
+    fprintf(stderr, "pthread_key_create failed!\n");
+    goto failed;
+  }
+  pool->thread_key_created = true;
+
+  pool->threads = MALLOC(threadqueue_thread_t, thread_count);
+  if (!pool->threads) {
+    fprintf(stderr, "Could not malloc pool->threads!\n");
+    goto failed;
+  }
+
+  // The injection queues are at index thread_count so it must be set
+  // before any thread starts.
+  pool->thread_count = thread_count;
+
+  // Lock the pool before creating threads, to ensure they all have correct information.
+  PTHREAD_LOCK(&pool->lock);
+  for (int i = 0; i < thread_count; i++) {
+    threadqueue_thread_t *thread = &pool->threads[i];
+    thread->id            = i;
+    thread->next_queue    = 0;
+    thread->current_queue = NULL;
+    thread->idle          = false;
+    thread->pool          = pool;
+    if (pthread_create(&thread->thread, NULL, threadqueue_worker, thread) != 0) {
+        fprintf(stderr, "pthread_create failed!\n");
+        // Stop the threads that were already created.
+        KVZ_ATOMIC_XCHG(&pool->stop, 1);
+        PTHREAD_COND_BROADCAST(&pool->job_available);
+        PTHREAD_UNLOCK(&pool->lock);
+        for (int j = 0; j < i; j++) {
+          pthread_join(pool->threads[j].thread, NULL);
+        }
+        pool->thread_running_count = 0;
+        goto failed;
+    }
+    pool->thread_running_count++;
+  }
+  PTHREAD_UNLOCK(&pool->lock);
+
+  return pool;
 
-  /**
-   * \brief Pointer to the first ready job
-   */
-  threadqueue_job_t *first;
+failed:
+  kvz_threadqueue_pool_free(pool);
+  return NULL;
 
-  /**
-   * \brief Pointer to the last ready job
-   */
-  threadqueue_job_t *last;
-};
+failed_queues_lock:
+  pthread_cond_destroy(&pool->queue_released);
+failed_queue_released:
+  pthread_cond_destroy(&pool->job_available);
+failed_job_available:
+  pthread_mutex_destroy(&pool->lock);
+failed_lock:
+  FREE_POINTER(pool);
+  return NULL;
+}
 
 
 /**
- * \brief Add a job to the queue of jobs ready to run.
+ * \brief Bind the worker threads of a pool to CPUs.
  *
- * The caller must have locked the thread queue and the job. This function
- * takes the ownership of the job.
+ * Should be called before any jobs are submitted so that the memory the
+ * workers touch first is allocated close to the CPUs they run on.
+ *
+ * \return 1 on success, 0 on failure
  */
-static void threadqueue_push_job(threadqueue_queue_t * threadqueue,
-                                 threadqueue_job_t *job)
+int kvz_threadqueue_pool_set_affinity(threadqueue_pool_t *pool, const kvz_affinity_t *affinity)
 {
-  assert(job->ndepends == 0);
-  job->state = THREADQUEUE_JOB_STATE_READY;
-
-  if (threadqueue->first == NULL) {
-    threadqueue->first = job;
-  } else {
-    threadqueue->last->next = job;
+  for (int i = 0; i < pool->thread_count; i++) {
+    if (!kvz_affinity_bind(affinity, pool->threads[i].thread, i)) {
+      return 0;
+    }
   }
+  return 1;
+}
 
-  threadqueue->last = job;
-  job->next = NULL;
+
+/**
+ * \brief Get the number of worker threads in a pool.
+ */
+int kvz_threadqueue_pool_thread_count(const threadqueue_pool_t *pool)
+{
+  return pool->thread_count;
 }
 
 
 /**
- * \brief Retrieve a job from the queue of jobs ready to run.
+ * \brief Get the total time the threads of a pool have been idle.
  *
- * The caller must have locked the thread queue. The calling function
- * receives the ownership of the job.
+ * \return idle time in seconds summed over all threads
  */
-static threadqueue_job_t * threadqueue_pop_job(threadqueue_queue_t * threadqueue)
+double kvz_threadqueue_pool_idle_time(threadqueue_pool_t *pool)
 {
-  assert(threadqueue->first != NULL);
+  if (pthread_mutex_lock(&pool->lock) != 0) {
+    fprintf(stderr, "pthread_mutex_lock(pool->lock) failed!\n");
+    assert(0);
+    return 0;
+  }
 
-  threadqueue_job_t *job = threadqueue->first;
-  threadqueue->first = job->next;
-  job->next = NULL;
+  double idle_time = pool->idle_time;
 
-  if (threadqueue->first == NULL) {
-    threadqueue->last = NULL;
+  KVZ_CLOCK_T now;
+  KVZ_GET_TIME(&now);
+  for (int i = 0; i < pool->thread_count; i++) {
+    if (pool->threads[i].idle) {
+      idle_time += KVZ_CLOCK_T_DIFF(pool->threads[i].idle_start, now);
+    }
   }
 
-  return job;
+  pthread_mutex_unlock(&pool->lock);
+  return idle_time;
 }
 
 
 /**
- * \brief Function executed by worker threads.
+ * \brief Stop the threads of a pool and free it.
+ *
+ * All thread queues using the pool must have been freed.
  */
-static void* threadqueue_worker(void* threadqueue_opaque)
+void kvz_threadqueue_pool_free(threadqueue_pool_t *pool)
 {
-  threadqueue_queue_t * const threadqueue = (threadqueue_queue_t *) threadqueue_opaque;
+  if (pool == NULL) return;
 
-  PTHREAD_LOCK(&threadqueue->lock);
+  assert(pool->queue_count == 0);
 
-  for (;;) {
-    while (!threadqueue->stop && threadqueue->first == NULL) {
-      // Wait until there is something to do in the queue.
-      PTHREAD_COND_WAIT(&threadqueue->job_available, &threadqueue->lock);
-    }
+  threadqueue_pool_stop(pool);
 
-    if (threadqueue->stop) {
-      break;
-    }
+  FREE_POINTER(pool->threads);
+  pool->thread_count = 0;
+  FREE_POINTER(pool->queues);
 
-    // Get a job and remove it from the queue.
-    threadqueue_job_t *job = threadqueue_pop_job(threadqueue);
+  if (pool->thread_key_created) {
+    pthread_key_delete(pool->thread_key);
+    pool->thread_key_created = false;
+  }
 
-    PTHREAD_LOCK(&job->lock);
-    assert(job->state == THREADQUEUE_JOB_STATE_READY);
-    job->state = THREADQUEUE_JOB_STATE_RUNNING;
-    PTHREAD_UNLOCK(&job->lock);
-    PTHREAD_UNLOCK(&threadqueue->lock);
+  if (pthread_mutex_destroy(&pool->lock) != 0) {
+    fprintf(stderr, "pthread_mutex_destroy failed!\n");
+  }
 
-    job->fptr(job->arg);
+  if (pthread_cond_destroy(&pool->job_available) != 0) {
+    fprintf(stderr, "pthread_cond_destroy failed!\n");
+  }
 
-    PTHREAD_LOCK(&threadqueue->lock);
-    PTHREAD_LOCK(&job->lock);
-    assert(job->state == THREADQUEUE_JOB_STATE_RUNNING);
-    job->state = THREADQUEUE_JOB_STATE_DONE;
-
-    PTHREAD_COND_SIGNAL(&threadqueue->job_done);
-
-    // Go through all the jobs that depend on this one, decreasing their
-    // ndepends. Count how many jobs can now start executing so we know how
-    // many threads to wake up.
-    int num_new_jobs = 0;
-    for (int i = 0; i < job->rdepends_count; ++i) {
-      threadqueue_job_t * const depjob = job->rdepends[i];
-      // The dependency (job) is locked before the job depending on it.
-      // This must be the same order as in kvz_threadqueue_job_dep_add.
-      PTHREAD_LOCK(&depjob->lock);
-
-      assert(depjob->state == THREADQUEUE_JOB_STATE_WAITING ||
-             depjob->state == THREADQUEUE_JOB_STATE_PAUSED);
-      assert(depjob->ndepends > 0);
-      depjob->ndepends--;
-
-      if (depjob->ndepends == 0 && depjob->state == THREADQUEUE_JOB_STATE_WAITING) {
-        // Move the job to ready jobs.
-        threadqueue_push_job(threadqueue, kvz_threadqueue_copy_ref(depjob));
-        num_new_jobs++;
-      }
+  if (pthread_cond_destroy(&pool->queue_released) != 0) {
+    fprintf(stderr, "pthread_cond_destroy failed!\n");
+  }
 
-      // Clear this reference to the job.
-      PTHREAD_UNLOCK(&depjob->lock);
-      kvz_threadqueue_free_job(&job->rdepends[i]);
-    }
-    job->rdepends_count = 0;
+  if (pthread_rwlock_destroy(&pool->queues_lock) != 0) {
+    fprintf(stderr, "pthread_rwlock_destroy failed!\n");
+  }
 
-    PTHREAD_UNLOCK(&job->lock);
-    kvz_threadqueue_free_job(&job);
+  FREE_POINTER(pool);
+}
 
-    // The current thread will process one of the new jobs so we wake up
-    // one threads less than the the number of new jobs.
-    for (int i = 0; i < num_new_jobs - 1; i++) {
-      pthread_cond_signal(&threadqueue->job_available);
+
+/**
+ * \brief Add a thread queue to the queues served by its pool.
+ *
+ * \return 1 on success, 0 on failure
+ */
+static int threadqueue_attach(threadqueue_queue_t *threadqueue)
+{
+  threadqueue_pool_t * const pool = threadqueue->pool;
+
+  if (pthread_rwlock_wrlock(&pool->queues_lock) != 0) {
+    fprintf(stderr, "pthread_rwlock_wrlock failed!\n");
+    return 0;
+  }
+
+  if (pool->queue_count == pool->queues_size) {
+    const int new_size = pool->queues_size + THREADQUEUE_LIST_REALLOC_SIZE;
+    threadqueue_queue_t **queues = realloc(pool->queues, new_size * sizeof(threadqueue_queue_t*));
+    if (!queues) {
+      fprintf(stderr, "Could not realloc pool->queues!\n");
+      pthread_rwlock_unlock(&pool->queues_lock);
+      return 0;
     }
+    pool->queues      = queues;
+    pool->queues_size = new_size;
   }
+  pool->queues[pool->queue_count++] = threadqueue;
+  threadqueue_update_count_starved_time(pool);
 
-  threadqueue->thread_running_count--;
-  PTHREAD_UNLOCK(&threadqueue->lock);
-  return NULL;
+  pthread_rwlock_unlock(&pool->queues_lock);
+  return 1;
 }
 
 
 /**
- * \brief Initialize the queue.
+ * \brief Remove a thread queue from the queues served by its pool.
+ *
+ * Block until no thread of the pool is running a job of the queue.
  *
  * \return 1 on success, 0 on failure
  */
-threadqueue_queue_t * kvz_threadqueue_init(int thread_count)
+static int threadqueue_detach(threadqueue_queue_t *threadqueue)
+{
+  threadqueue_pool_t * const pool = threadqueue->pool;
+
+  if (pthread_rwlock_wrlock(&pool->queues_lock) != 0) {
+    fprintf(stderr, "pthread_rwlock_wrlock failed!\n");
+    return 0;
+  }
+  for (int i = 0; i < pool->queue_count; i++) {
+    if (pool->queues[i] == threadqueue) {
+      pool->queue_count--;
+      memmove(&pool->queues[i], &pool->queues[i + 1],
+              (pool->queue_count - i) * sizeof(threadqueue_queue_t*));
+      break;
+    }
+  }
+  threadqueue_update_count_starved_time(pool);
+  pthread_rwlock_unlock(&pool->queues_lock);
+
+  // Threads can no longer take jobs from the queue. Wait for the threads
+  // that are running its jobs.
+  PTHREAD_LOCK(&pool->lock);
+  KVZ_ATOMIC_INC(&pool->detach_count);
+  for (;;) {
+    bool busy = false;
+    for (int i = 0; i < pool->thread_count; i++) {
+      threadqueue_queue_t * const none = NULL;
+      // Atomic load of the pointer.
+      if (KVZ_ATOMIC_CAS_PTR(&pool->threads[i].current_queue, none, none) == threadqueue) {
+        busy = true;
+        break;
+      }
+    }
+    if (!busy) break;
+    PTHREAD_COND_WAIT(&pool->queue_released, &pool->lock);
+  }
+  KVZ_ATOMIC_DEC(&pool->detach_count);
+  PTHREAD_UNLOCK(&pool->lock);
+
+  // The jobs left in the queue will not be run.
+  KVZ_ATOMIC_ADD(&pool->ready_count, -KVZ_ATOMIC_ADD(&threadqueue->ready_count, 0));
+
+  return 1;
+}
+
+
+/**
+ * \brief Create a thread queue using a shared pool of threads.
+ *
+ * \return the thread queue, or NULL on failure
+ */
+threadqueue_queue_t * kvz_threadqueue_init_shared(threadqueue_pool_t *pool)
 {
   threadqueue_queue_t *threadqueue = MALLOC(threadqueue_queue_t, 1);
   if (!threadqueue) {
-    goto failed;
+    return NULL;
   }
 
+  threadqueue->pool          = pool;
+  threadqueue->owns_pool     = false;
+  threadqueue->stop          = 1;
+  threadqueue->workers       = NULL;
+  threadqueue->worker_count  = 0;
+  threadqueue->ready_count   = 0;
+  threadqueue->waiting_count = 0;
+  threadqueue->starved_time  = 0;
+  threadqueue->count_starved_time = false;
+  threadqueue->shared_free_jobs = NULL;
+  threadqueue->free_chunks   = NULL;
+  threadqueue->alloc_count   = 0;
+  threadqueue->trace         = NULL;
+  threadqueue->trace_last_id = 0;
+
+  // kvz_threadqueue_free may only be called after the locks have been
+  // initialized.
   if (pthread_mutex_init(&threadqueue->lock, NULL) != 0) {
     fprintf(stderr, "pthread_mutex_init failed!\n");
-    goto failed;
+    goto failed_lock;
   }
 
-  if (pthread_cond_init(&threadqueue->job_available, NULL) != 0) {
-    fprintf(stderr, "pthread_cond_init failed!\n");
-    goto failed;
+  if (pthread_mutex_init(&threadqueue->free_lock, NULL) != 0) {
+    fprintf(stderr, "pthread_mutex_init failed!\n");
+    goto failed_free_lock;
   }
 
   if (pthread_cond_init(&threadqueue->job_done, NULL) != 0) {
     fprintf(stderr, "pthread_cond_init failed!\n");
-    goto failed;
+    goto failed_job_done;
   }
 
-  threadqueue->threads = MALLOC(pthread_t, thread_count);
-  if (!threadqueue->threads) {
-    fprintf(stderr, "Could not malloc threadqueue->threads!\n");
+  // One queue for each thread and one for jobs submitted from elsewhere.
+  const int thread_count = pool->thread_count;
+  threadqueue->workers = MALLOC(threadqueue_worker_t, thread_count + 1);
+  if (!threadqueue->workers) {
+    fprintf(stderr, "Could not malloc threadqueue->workers!\n");
     goto failed;
   }
-  threadqueue->thread_count = 0;
-  threadqueue->thread_running_count = 0;
-
-  threadqueue->stop = false;
-
-  threadqueue->first              = NULL;
-  threadqueue->last               = NULL;
-
-  // Lock the queue before creating threads, to ensure they all have correct information.
-  PTHREAD_LOCK(&threadqueue->lock);
-  for (int i = 0; i < thread_count; i++) {
-    if (pthread_create(&threadqueue->threads[i], NULL, threadqueue_worker, threadqueue) != 0) {
-        fprintf(stderr, "pthread_create failed!\n");
-        goto failed;
+  for (int i = 0; i < thread_count + 1; i++) {
+    if (!threadqueue_worker_init(&threadqueue->workers[i], threadqueue, i)) {
+      goto failed;
     }
-    threadqueue->thread_count++;
-    threadqueue->thread_running_count++;
+    threadqueue->worker_count++;
   }
-  PTHREAD_UNLOCK(&threadqueue->lock);
+
+  if (!threadqueue_attach(threadqueue)) {
+    goto failed;
+  }
+  threadqueue->stop = 0;
 
   return threadqueue;
 
 failed:
   kvz_threadqueue_free(threadqueue);
   return NULL;
+
+failed_job_done:
+  pthread_mutex_destroy(&threadqueue->free_lock);
+failed_free_lock:
+  pthread_mutex_destroy(&threadqueue->lock);
+failed_lock:
+  FREE_POINTER(threadqueue);
+  return NULL;
+}
+
+
+/**
+ * \brief Initialize the queue.
+ *
+ * Creates a pool of threads used only by this queue.
+ *
+ * \return the thread queue, or NULL on failure
+ */
+threadqueue_queue_t * kvz_threadqueue_init(int thread_count)
+{
+  threadqueue_pool_t *pool = kvz_threadqueue_pool_init(thread_count);
+  if (!pool) {
+    return NULL;
+  }
+
+  threadqueue_queue_t *threadqueue = kvz_threadqueue_init_shared(pool);
+  if (!threadqueue) {
+    kvz_threadqueue_pool_free(pool);
+    return NULL;
+  }
+  threadqueue->owns_pool = true;
+
+  return threadqueue;
+}
+
+
+/**
+ * \brief Bind the worker threads of the queue to CPUs.
+ *
+ * \return 1 on success, 0 on failure
+ */
+int kvz_threadqueue_set_affinity(threadqueue_queue_t *threadqueue, const kvz_affinity_t *affinity)
+{
+  return kvz_threadqueue_pool_set_affinity(threadqueue->pool, affinity);
+}
+
+
+/**
+ * \brief Count the time the worker threads run jobs of other queues as idle
+ * time of the queue.
+ *
+ * The time is counted only while other queues share the pool. Each counted
+ * job walks the queues of the pool, so this is enabled only for the queues
+ * that need kvz_threadqueue_idle_time.
+ *
+ * \return 1 on success, 0 on failure
+ */
+int kvz_threadqueue_count_starved_time(threadqueue_queue_t *threadqueue)
+{
+  threadqueue_pool_t * const pool = threadqueue->pool;
+
+  if (pthread_rwlock_wrlock(&pool->queues_lock) != 0) {
+    fprintf(stderr, "pthread_rwlock_wrlock failed!\n");
+    return 0;
+  }
+  threadqueue->count_starved_time = true;
+  threadqueue_update_count_starved_time(pool);
+  pthread_rwlock_unlock(&pool->queues_lock);
+  return 1;
+}
+
+
+/**
+ * \brief Get the total time the worker threads have had nothing to do for
+ * the queue.
+ *
+ * Counts the time the threads were idle. If enabled with
+ * kvz_threadqueue_count_starved_time, also counts the time they ran jobs of
+ * other queues sharing the pool while this queue had no jobs ready, so it
+ * does not depend on how busy the other queues keep the threads.
+ *
+ * \return time in seconds summed over all threads
+ */
+double kvz_threadqueue_idle_time(threadqueue_queue_t *threadqueue)
+{
+  return kvz_threadqueue_pool_idle_time(threadqueue->pool) +
+         KVZ_ATOMIC_ADD64(&threadqueue->starved_time, 0) / 1e9;
+}
+
+
+/**
+ * \brief Get the number of jobs of the queue that are ready to run but
+ * not running yet.
+ */
+int kvz_threadqueue_ready_count(threadqueue_queue_t *threadqueue)
+{
+  return KVZ_ATOMIC_ADD(&threadqueue->ready_count, 0);
+}
+
+
+/**
+ * \brief Get the thread pool running the jobs of the queue.
+ */
+threadqueue_pool_t * kvz_threadqueue_pool(threadqueue_queue_t *threadqueue)
+{
+  return threadqueue->pool;
+}
+
+
+/**
+ * \brief Record the activity of the queue to a trace.
+ *
+ * Must be called before any jobs are created.
+ */
+void kvz_threadqueue_set_trace(threadqueue_queue_t *threadqueue, kvz_trace_t *trace)
+{
+  threadqueue->trace = trace;
 }
 
 
 /**
  * \brief Create a job and return a pointer to it.
  *
- * The job is created in a paused state. Function kvz_threadqueue_submit
- * must be called on the job in order to have it run.
+ * The job is taken from the pool of the thread queue, or allocated if the
+ * pool is empty. The job is created in a paused state. Function
+ * kvz_threadqueue_submit must be called on the job in order to have it run.
  *
  * \return pointer to the job, or NULL on failure
  */
-threadqueue_job_t * kvz_threadqueue_job_create(void (*fptr)(void *arg), void *arg)
+threadqueue_job_t * kvz_threadqueue_job_create(threadqueue_queue_t *threadqueue,
+                                               void (*fptr)(void *arg),
+                                               void *arg)
 {
-  threadqueue_job_t *job = MALLOC(threadqueue_job_t, 1);
-  if (!job) {
-    fprintf(stderr, "Could not alloc job!\n");
+  threadqueue_job_t *job = NULL;
+  if (!threadqueue_take_free_job(threadqueue, &job)) {
     return NULL;
   }
 
-  if (pthread_mutex_init(&job->lock, NULL) != 0) {
-    fprintf(stderr, "pthread_mutex_init(job) failed!\n");
-    return NULL;
+  if (!job) {
+    job = MALLOC(threadqueue_job_t, 1);
+    if (!job) {
+      fprintf(stderr, "Could not alloc job!\n");
+      return NULL;
+    }
+    KVZ_ATOMIC_INC(&threadqueue->alloc_count);
+
+    job->depends_chunks = NULL;
+    job->threadqueue    = threadqueue;
   }
 
-  job->state = THREADQUEUE_JOB_STATE_PAUSED;
-  job->ndepends       = 0;
+  job->state          = THREADQUEUE_JOB_STATE_PAUSED;
+  job->ndepends       = 1;
   job->rdepends       = NULL;
-  job->rdepends_count = 0;
-  job->rdepends_size  = 0;
+  job->depends_count  = 0;
   job->refcount       = 1;
   job->fptr           = fptr;
   job->arg            = arg;
+  job->priority       = 0;
+  job->seq            = 0;
+  job->next_free      = NULL;
+  job->trace_id       = 0;
+  job->trace_flows    = 0;
+  job->trace_info.name  = NULL;
+  job->trace_info.frame = -1;
+  job->trace_info.tile  = -1;
+  job->trace_info.lcu_x = -1;
+  job->trace_info.lcu_y = -1;
+
+  if (threadqueue->trace) {
+    job->trace_id = (uint32_t)KVZ_ATOMIC_INC(&threadqueue->trace_last_id);
+  }
 
   return job;
 }
 
 
+/**
+ * \brief Set the part of the picture a job works on.
+ *
+ * Only used for tracing. Pass -1 for the fields that do not apply.
+ *
+ * \param name   kind of the job, a string constant
+ */
+void kvz_threadqueue_job_set_trace_info(threadqueue_job_t *job,
+                                        const char *name,
+                                        int32_t frame,
+                                        int32_t tile,
+                                        int32_t lcu_x,
+                                        int32_t lcu_y)
+{
+  job->trace_info.name  = name;
+  job->trace_info.frame = frame;
+  job->trace_info.tile  = tile;
+  job->trace_info.lcu_x = lcu_x;
+  job->trace_info.lcu_y = lcu_y;
+}
+
+
+/**
+ * \brief Set the scheduling priority of a job.
+ *
+ * Among the jobs that are ready to run, jobs with a higher priority are
+ * run first. Priorities are compared with wrapping arithmetic, so only
+ * their differences matter. Must be called before the job is submitted.
+ */
+void kvz_threadqueue_job_set_priority(threadqueue_job_t *job, int32_t priority)
+{
+  assert(KVZ_ATOMIC_ADD(&job->state, 0) == THREADQUEUE_JOB_STATE_PAUSED);
+  job->priority = priority;
+}
+
+
 int kvz_threadqueue_submit(threadqueue_queue_t * const threadqueue, threadqueue_job_t *job)
 {
-  PTHREAD_LOCK(&threadqueue->lock);
-  PTHREAD_LOCK(&job->lock);
-  assert(job->state == THREADQUEUE_JOB_STATE_PAUSED);
+  assert(KVZ_ATOMIC_ADD(&job->state, 0) == THREADQUEUE_JOB_STATE_PAUSED);
+
+  threadqueue_trace(threadqueue, KVZ_TRACE_JOB_SUBMIT, job, 0);
 
-  if (threadqueue->thread_count == 0) {
+  if (threadqueue->pool->thread_count == 0) {
     // When not using threads, run the job immediately.
+    KVZ_ATOMIC_XCHG(&job->state, THREADQUEUE_JOB_STATE_RUNNING);
+    threadqueue_trace(threadqueue, KVZ_TRACE_JOB_START, job,
+                      KVZ_ATOMIC_ADD(&job->trace_flows, 0));
     job->fptr(job->arg);
-    job->state = THREADQUEUE_JOB_STATE_DONE;
-  } else if (job->ndepends == 0) {
-    threadqueue_push_job(threadqueue, kvz_threadqueue_copy_ref(job));
-    pthread_cond_signal(&threadqueue->job_available);
-  } else {
-    job->state = THREADQUEUE_JOB_STATE_WAITING;
+    threadqueue_job_finish(threadqueue, job);
+    threadqueue_trace(threadqueue, KVZ_TRACE_JOB_END, job, 0);
+    return 1;
+  }
+
+  KVZ_ATOMIC_XCHG(&job->state, THREADQUEUE_JOB_STATE_WAITING);
+
+  // Drop the reference that kept the job from becoming ready before it was
+  // submitted.
+  if (KVZ_ATOMIC_DEC(&job->ndepends) == 0) {
+    KVZ_ATOMIC_XCHG(&job->state, THREADQUEUE_JOB_STATE_READY);
+    threadqueue_trace(threadqueue, KVZ_TRACE_JOB_READY, job, 0);
+    if (threadqueue_make_ready(threadqueue, kvz_threadqueue_copy_ref(job))) {
+      threadqueue_wake_workers(threadqueue->pool, 1);
+    }
   }
-  PTHREAD_UNLOCK(&job->lock);
-  PTHREAD_UNLOCK(&threadqueue->lock);
 
   return 1;
 }
@@ -465,29 +2098,65 @@ int kvz_threadqueue_submit(threadqueue_queue_t * const threadqueue, threadqueue_
  */
 int kvz_threadqueue_job_dep_add(threadqueue_job_t *job, threadqueue_job_t *dependency)
 {
-  // Lock the dependency first and then the job depending on it.
-  // This must be the same order as in threadqueue_worker.
-  PTHREAD_LOCK(&dependency->lock);
+  // Dependencies may only be added before the job is submitted and only
+  // by one thread at a time.
+  assert(KVZ_ATOMIC_ADD(&job->state, 0) == THREADQUEUE_JOB_STATE_PAUSED);
 
-  if (dependency->state == THREADQUEUE_JOB_STATE_DONE) {
+  if (KVZ_ATOMIC_ADD(&dependency->state, 0) == THREADQUEUE_JOB_STATE_DONE) {
     // The dependency has been completed already so there is nothing to do.
-    PTHREAD_UNLOCK(&dependency->lock);
     return 1;
   }
 
-  PTHREAD_LOCK(&job->lock);
-  job->ndepends++;
-  PTHREAD_UNLOCK(&job->lock);
-
-  // Add the reverse dependency
-  if (dependency->rdepends_count >= dependency->rdepends_size) {
-    dependency->rdepends_size += THREADQUEUE_LIST_REALLOC_SIZE;
-    size_t bytes = dependency->rdepends_size * sizeof(threadqueue_job_t*);
-    dependency->rdepends = realloc(dependency->rdepends, bytes);
+  // Get storage for the dependency from the job.
+  threadqueue_dep_t *dep;
+  if (job->depends_count < THREADQUEUE_INLINE_DEPENDS) {
+    dep = &job->depends_inline[job->depends_count];
+  } else {
+    const int index = job->depends_count - THREADQUEUE_INLINE_DEPENDS;
+    threadqueue_dep_chunk_t **chunk = &job->depends_chunks;
+    for (int i = 0; i < index / THREADQUEUE_LIST_REALLOC_SIZE; i++) {
+      chunk = &(*chunk)->next;
+    }
+    if (!*chunk) {
+      // Take all of the free storage and put back what is not needed.
+      *chunk = KVZ_ATOMIC_XCHG_PTR(&job->threadqueue->free_chunks, NULL);
+      if (*chunk) {
+        if ((*chunk)->next) {
+          threadqueue_push_free_chunks(job->threadqueue, (*chunk)->next);
+        }
+      } else {
+        *chunk = MALLOC(threadqueue_dep_chunk_t, 1);
+        if (!*chunk) {
+          fprintf(stderr, "Could not malloc dependency storage!\n");
+          return 0;
+        }
+        KVZ_ATOMIC_INC(&job->threadqueue->alloc_count);
+      }
+      (*chunk)->next = NULL;
+    }
+    dep = &(*chunk)->deps[index % THREADQUEUE_LIST_REALLOC_SIZE];
   }
-  dependency->rdepends[dependency->rdepends_count++] = kvz_threadqueue_copy_ref(job);
 
-  PTHREAD_UNLOCK(&dependency->lock);
+  // Count the dependency before it becomes visible to the thread running
+  // the dependency.
+  KVZ_ATOMIC_INC(&job->ndepends);
+  dep->job = kvz_threadqueue_copy_ref(job);
+
+  // Add the reverse dependency.
+  threadqueue_dep_t *head = NULL;
+  for (;;) {
+    if (head == THREADQUEUE_RDEPENDS_CLOSED) {
+      // The dependency was completed while we were adding it.
+      KVZ_ATOMIC_DEC(&job->ndepends);
+      kvz_threadqueue_free_job(&dep->job);
+      return 1;
+    }
+    dep->next = head;
+    threadqueue_dep_t *old_head = KVZ_ATOMIC_CAS_PTR(&dependency->rdepends, head, dep);
+    if (old_head == head) break;
+    head = old_head;
+  }
+  job->depends_count++;
 
   return 1;
 }
@@ -512,7 +2181,7 @@ threadqueue_job_t *kvz_threadqueue_copy_ref(threadqueue_job_t *job)
  * \brief Free a job.
  *
  * Decrement reference count of the job. If no references exist any more,
- * deallocate associated memory and destroy mutexes.
+ * return the job to the pool of its thread queue.
  *
  * Sets the job pointer to NULL.
  */
@@ -530,14 +2199,16 @@ void kvz_threadqueue_free_job(threadqueue_job_t **job_ptr)
 
   assert(new_refcount == 0);
 
-  for (int i = 0; i < job->rdepends_count; i++) {
-    kvz_threadqueue_free_job(&job->rdepends[i]);
+  // Release the jobs depending on this one if it was never completed.
+  threadqueue_dep_t *dep = job->rdepends;
+  job->rdepends = NULL;
+  while (dep && dep != THREADQUEUE_RDEPENDS_CLOSED) {
+    threadqueue_dep_t *next = dep->next;
+    kvz_threadqueue_free_job(&dep->job);
+    dep = next;
   }
-  job->rdepends_count = 0;
 
-  FREE_POINTER(job->rdepends);
-  pthread_mutex_destroy(&job->lock);
-  FREE_POINTER(job);
+  threadqueue_return_free_job(job);
 }
 
 
@@ -548,45 +2219,76 @@ void kvz_threadqueue_free_job(threadqueue_job_t **job_ptr)
  */
 int kvz_threadqueue_waitfor(threadqueue_queue_t * threadqueue, threadqueue_job_t * job)
 {
-  PTHREAD_LOCK(&job->lock);
-  while (job->state != THREADQUEUE_JOB_STATE_DONE) {
-    PTHREAD_COND_WAIT(&threadqueue->job_done, &job->lock);
+  PTHREAD_LOCK(&threadqueue->lock);
+  // Workers only signal job_done when somebody is waiting. Announce this
+  // thread before checking the state of the job so that the signal is not
+  // missed.
+  KVZ_ATOMIC_INC(&threadqueue->waiting_count);
+  while (KVZ_ATOMIC_ADD(&job->state, 0) != THREADQUEUE_JOB_STATE_DONE) {
+    PTHREAD_COND_WAIT(&threadqueue->job_done, &threadqueue->lock);
   }
-  PTHREAD_UNLOCK(&job->lock);
+  KVZ_ATOMIC_DEC(&threadqueue->waiting_count);
+  PTHREAD_UNLOCK(&threadqueue->lock);
 
   return 1;
 }
 
 
 /**
- * \brief Stop all threads after they finish the current jobs.
+ * \brief Wait for a job to be completed, running it if no thread has
+ * started it yet.
  *
- * Block until all threads have stopped.
+ * Meant for jobs submitted from inside another job. The calling thread
+ * does the work itself instead of blocking while the job waits in the
+ * queue, so waiting does not tie up a worker thread.
  *
  * \return 1 on success, 0 on failure
  */
-int kvz_threadqueue_stop(threadqueue_queue_t * const threadqueue)
+int kvz_threadqueue_join(threadqueue_queue_t * threadqueue, threadqueue_job_t * job)
 {
-  PTHREAD_LOCK(&threadqueue->lock);
+  if (KVZ_ATOMIC_CAS(&job->state,
+                     THREADQUEUE_JOB_STATE_READY,
+                     THREADQUEUE_JOB_STATE_RUNNING) != THREADQUEUE_JOB_STATE_READY) {
+    // The job is running, done or waiting for its dependencies.
+    return kvz_threadqueue_waitfor(threadqueue, job);
+  }
 
-  if (threadqueue->stop) {
-    // The threadqueue should have stopped already.
-    assert(threadqueue->thread_running_count == 0);
-    PTHREAD_UNLOCK(&threadqueue->lock);
+  // The job stays in the queue of ready jobs. The worker that takes it
+  // from there sees that it is no longer ready and drops it.
+  threadqueue_trace(threadqueue, KVZ_TRACE_JOB_START, job,
+                    KVZ_ATOMIC_ADD(&job->trace_flows, 0));
+  job->fptr(job->arg);
+  const int num_new_jobs = threadqueue_job_finish(threadqueue, job);
+  threadqueue_trace(threadqueue, KVZ_TRACE_JOB_END, job, 0);
+
+  threadqueue_wake_workers(threadqueue->pool, num_new_jobs);
+
+  return 1;
+}
+
+
+/**
+ * \brief Stop running the jobs of the queue.
+ *
+ * Jobs that have not been started will not be run. Block until no thread
+ * is running a job of the queue. If the queue has its own pool of threads,
+ * stop the threads.
+ *
+ * \return 1 on success, 0 on failure
+ */
+int kvz_threadqueue_stop(threadqueue_queue_t * const threadqueue)
+{
+  if (KVZ_ATOMIC_XCHG(&threadqueue->stop, 1)) {
+    // The threadqueue has been stopped already.
     return 1;
   }
 
-  // Tell all threads to stop.
-  threadqueue->stop = true;
-  PTHREAD_COND_BROADCAST(&threadqueue->job_available);
-  PTHREAD_UNLOCK(&threadqueue->lock);
+  if (!threadqueue_detach(threadqueue)) {
+    return 0;
+  }
 
-  // Wait for them to stop.
-  for (int i = 0; i < threadqueue->thread_count; i++) {
-    if (pthread_join(threadqueue->threads[i], NULL) != 0) {
-      fprintf(stderr, "pthread_join failed!\n");
-      return 0;
-    }
+  if (threadqueue->owns_pool) {
+    return threadqueue_pool_stop(threadqueue->pool);
   }
 
   return 1;
@@ -594,9 +2296,9 @@ int kvz_threadqueue_stop(threadqueue_queue_t * const threadqueue)
 
 
 /**
- * \brief Stop all threads and free allocated resources.
+ * \brief Stop the queue and free allocated resources.
  *
- * \return 1 on success, 0 on failure
+ * If the queue has its own pool of threads, free the pool too.
  */
 void kvz_threadqueue_free(threadqueue_queue_t *threadqueue)
 {
@@ -605,27 +2307,60 @@ void kvz_threadqueue_free(threadqueue_queue_t *threadqueue)
   kvz_threadqueue_stop(threadqueue);
 
   // Free all jobs.
-  while (threadqueue->first) {
-    threadqueue_job_t *next = threadqueue->first->next;
-    kvz_threadqueue_free_job(&threadqueue->first);
-    threadqueue->first = next;
+  for (int i = 0; i < threadqueue->worker_count; i++) {
+    threadqueue_worker_t *worker = &threadqueue->workers[i];
+    threadqueue_job_t *job;
+    while ((job = threadqueue_worker_pop(worker)) != NULL) {
+      kvz_threadqueue_free_job(&job);
+    }
   }
-  threadqueue->last = NULL;
 
-  FREE_POINTER(threadqueue->threads);
-  threadqueue->thread_count = 0;
+  // Free the pooled jobs. All jobs must have been freed by now.
+  for (int i = 0; i < threadqueue->worker_count; i++) {
+    threadqueue_worker_t *worker = &threadqueue->workers[i];
+    threadqueue_destroy_free_jobs(worker->free_jobs);
+    threadqueue_destroy_free_jobs(worker->cached_jobs);
+    FREE_POINTER(worker->jobs);
+    pthread_mutex_destroy(&worker->lock);
+  }
+  FREE_POINTER(threadqueue->workers);
+  threadqueue->worker_count = 0;
+  threadqueue->ready_count = 0;
+  threadqueue_destroy_free_jobs(threadqueue->shared_free_jobs);
+  threadqueue->shared_free_jobs = NULL;
+  while (threadqueue->free_chunks) {
+    threadqueue_dep_chunk_t *next = threadqueue->free_chunks->next;
+    FREE_POINTER(threadqueue->free_chunks);
+    threadqueue->free_chunks = next;
+  }
 
   if (pthread_mutex_destroy(&threadqueue->lock) != 0) {
     fprintf(stderr, "pthread_mutex_destroy failed!\n");
   }
 
-  if (pthread_cond_destroy(&threadqueue->job_available) != 0) {
-    fprintf(stderr, "pthread_cond_destroy failed!\n");
+  if (pthread_mutex_destroy(&threadqueue->free_lock) != 0) {
+    fprintf(stderr, "pthread_mutex_destroy failed!\n");
   }
 
   if (pthread_cond_destroy(&threadqueue->job_done) != 0) {
     fprintf(stderr, "pthread_cond_destroy failed!\n");
   }
 
+  if (threadqueue->owns_pool) {
+    kvz_threadqueue_pool_free(threadqueue->pool);
+  }
+
   FREE_POINTER(threadqueue);
 }
+
+
+/**
+ * \brief Get the number of memory allocations made by the thread queue.
+ *
+ * Counts allocations of jobs, their dependency storage and the ready queues after kvz_threadqueue_init. Once the pool has warmed up,
+ * encoding more frames should not increase the count.
+ */
+int kvz_threadqueue_alloc_count(threadqueue_queue_t *threadqueue)
+{
+  return KVZ_ATOMIC_ADD(&threadqueue->alloc_count, 0);
+}
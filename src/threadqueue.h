@@ -30,12 +30,38 @@
 
 #include <pthread.h>
 
+#include "affinity.h"
+#include "trace.h"
+
 typedef struct threadqueue_job_t threadqueue_job_t;
 typedef struct threadqueue_queue_t threadqueue_queue_t;
+typedef struct kvz_thread_pool threadqueue_pool_t;
+
+threadqueue_pool_t * kvz_threadqueue_pool_init(int thread_count);
+int kvz_threadqueue_pool_set_affinity(threadqueue_pool_t *pool, const kvz_affinity_t *affinity);
+int kvz_threadqueue_pool_thread_count(const threadqueue_pool_t *pool);
+double kvz_threadqueue_pool_idle_time(threadqueue_pool_t *pool);
+void kvz_threadqueue_pool_free(threadqueue_pool_t *pool);
 
 threadqueue_queue_t * kvz_threadqueue_init(int thread_count);
+threadqueue_queue_t * kvz_threadqueue_init_shared(threadqueue_pool_t *pool);
+int kvz_threadqueue_set_affinity(threadqueue_queue_t *threadqueue, const kvz_affinity_t *affinity);
+void kvz_threadqueue_set_trace(threadqueue_queue_t *threadqueue, kvz_trace_t *trace);
+threadqueue_pool_t * kvz_threadqueue_pool(threadqueue_queue_t *threadqueue);
+int kvz_threadqueue_ready_count(threadqueue_queue_t *threadqueue);
+int kvz_threadqueue_count_starved_time(threadqueue_queue_t *threadqueue);
+double kvz_threadqueue_idle_time(threadqueue_queue_t *threadqueue);
 
-threadqueue_job_t * kvz_threadqueue_job_create(void (*fptr)(void *arg), void *arg);
+threadqueue_job_t * kvz_threadqueue_job_create(threadqueue_queue_t *threadqueue,
+                                               void (*fptr)(void *arg),
+                                               void *arg);
+void kvz_threadqueue_job_set_priority(threadqueue_job_t *job, int32_t priority);
+void kvz_threadqueue_job_set_trace_info(threadqueue_job_t *job,
+                                        const char *name,
+                                        int32_t frame,
+                                        int32_t tile,
+                                        int32_t lcu_x,
+                                        int32_t lcu_y);
 int kvz_threadqueue_submit(threadqueue_queue_t * threadqueue, threadqueue_job_t *job);
 
 int kvz_threadqueue_job_dep_add(threadqueue_job_t *job, threadqueue_job_t *dependency);
@@ -45,7 +71,10 @@ threadqueue_job_t *kvz_threadqueue_copy_ref(threadqueue_job_t *job);
 void kvz_threadqueue_free_job(threadqueue_job_t **job_ptr);
 
 int kvz_threadqueue_waitfor(threadqueue_queue_t * threadqueue, threadqueue_job_t * job);
+int kvz_threadqueue_join(threadqueue_queue_t * threadqueue, threadqueue_job_t * job);
 int kvz_threadqueue_stop(threadqueue_queue_t * threadqueue);
 void kvz_threadqueue_free(threadqueue_queue_t * threadqueue);
 
+int kvz_threadqueue_alloc_count(threadqueue_queue_t *threadqueue);
+
 #endif // THREADQUEUE_H_
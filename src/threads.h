@@ -55,6 +55,12 @@
 
 #define KVZ_ATOMIC_INC(ptr)                     __sync_add_and_fetch((volatile int32_t*)ptr, 1)
 #define KVZ_ATOMIC_DEC(ptr)                     __sync_add_and_fetch((volatile int32_t*)ptr, -1)
+#define KVZ_ATOMIC_ADD(ptr, val)                __sync_add_and_fetch((volatile int32_t*)ptr, val)
+#define KVZ_ATOMIC_ADD64(ptr, val)              __sync_add_and_fetch((volatile int64_t*)ptr, val)
+#define KVZ_ATOMIC_XCHG(ptr, val)               __atomic_exchange_n((volatile int32_t*)ptr, val, __ATOMIC_SEQ_CST)
+#define KVZ_ATOMIC_XCHG_PTR(ptr, val)           __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+#define KVZ_ATOMIC_CAS(ptr, oldval, newval)     __sync_val_compare_and_swap((volatile int32_t*)ptr, oldval, newval)
+#define KVZ_ATOMIC_CAS_PTR(ptr, oldval, newval) __sync_val_compare_and_swap(ptr, oldval, newval)
 
 #else //__GNUC__
 //TODO: we assume !GCC => Windows... this may be bad
@@ -69,6 +75,12 @@
 
 #define KVZ_ATOMIC_INC(ptr)                     InterlockedIncrement((volatile LONG*)ptr)
 #define KVZ_ATOMIC_DEC(ptr)                     InterlockedDecrement((volatile LONG*)ptr)
+#define KVZ_ATOMIC_ADD(ptr, val)                (InterlockedExchangeAdd((volatile LONG*)ptr, val) + (val))
+#define KVZ_ATOMIC_ADD64(ptr, val)              (InterlockedExchangeAdd64((volatile LONG64*)ptr, val) + (val))
+#define KVZ_ATOMIC_XCHG(ptr, val)               InterlockedExchange((volatile LONG*)ptr, val)
+#define KVZ_ATOMIC_XCHG_PTR(ptr, val)           InterlockedExchangePointer((PVOID volatile*)ptr, val)
+#define KVZ_ATOMIC_CAS(ptr, oldval, newval)     InterlockedCompareExchange((volatile LONG*)ptr, newval, oldval)
+#define KVZ_ATOMIC_CAS_PTR(ptr, oldval, newval) InterlockedCompareExchangePointer((PVOID volatile*)ptr, newval, oldval)
 
 #endif //__GNUC__
 
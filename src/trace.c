@@ -0,0 +1,367 @@
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2013-2015 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * Kvazaar is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+/*
+ * Trace of thread queue activity.
+ *
+ * Every thread records events to a buffer of its own without locking. When
+ * the buffer is full, the thread converts the events to JSON and appends
+ * them to the file while holding the lock of the trace. The remaining
+ * events of all threads are written when the trace is closed.
+ *
+ * The file is in the Chrome trace event format, which can be viewed with
+ * chrome://tracing or https://ui.perfetto.dev. Jobs are shown as slices on
+ * the thread that ran them, submitting a job and a job becoming ready are
+ * shown as instant events and completed dependencies are shown as flow
+ * arrows from the end of the dependency to the start of the job.
+ */
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "threads.h"
+
+
+#define TRACE_BUFFER_SIZE 4096
+
+/**
+ * \brief Maximum number of dependency arrows drawn to a job.
+ */
+#define TRACE_MAX_FLOWS 0x10000
+
+
+typedef struct {
+  /**
+   * \brief Time of the event in microseconds since the trace was opened.
+   */
+  double ts;
+
+  kvz_trace_job_info_t info;
+  uint32_t job_id;
+  uint32_t arg;
+  kvz_trace_event_type type;
+} trace_event_t;
+
+
+typedef struct trace_buffer_t {
+  trace_event_t events[TRACE_BUFFER_SIZE];
+
+  /**
+   * \brief Number of events in the buffer.
+   */
+  int count;
+
+  /**
+   * \brief Thread id used in the trace.
+   */
+  int tid;
+
+  struct trace_buffer_t *next;
+} trace_buffer_t;
+
+
+struct kvz_trace_t {
+  /**
+   * \brief Lock for file and buffers.
+   */
+  pthread_mutex_t lock;
+
+  FILE *file;
+
+  /**
+   * \brief Whether no events have been written to the file.
+   */
+  bool empty;
+
+  /**
+   * \brief Thread specific pointer to the buffer of the thread.
+   */
+  pthread_key_t key;
+
+  /**
+   * \brief Buffers of all threads that have recorded events.
+   */
+  trace_buffer_t *buffers;
+
+  int buffer_count;
+
+  KVZ_CLOCK_T start;
+};
+
+
+/**
+ * \brief Begin a new event in the file.
+ */
+static void trace_begin_event(kvz_trace_t *trace, const char *ph, double ts, int tid)
+{
+  fprintf(trace->file, "%s\n{\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+          trace->empty ? "" : ",", ph, ts, tid);
+  trace->empty = false;
+}
+
+
+static void trace_write_info(kvz_trace_t *trace, const trace_event_t *event)
+{
+  const kvz_trace_job_info_t *info = &event->info;
+
+  fprintf(trace->file, ",\"name\":\"%s\",\"cat\":\"job\",\"args\":{\"job\":%u",
+          info->name ? info->name : "job", event->job_id);
+  if (info->frame >= 0) fprintf(trace->file, ",\"frame\":%d", info->frame);
+  if (info->tile  >= 0) fprintf(trace->file, ",\"tile\":%d",  info->tile);
+  if (info->lcu_x >= 0) fprintf(trace->file, ",\"lcu_x\":%d", info->lcu_x);
+  if (info->lcu_y >= 0) fprintf(trace->file, ",\"lcu_y\":%d", info->lcu_y);
+  fputs("}}", trace->file);
+}
+
+
+/**
+ * \brief Write a dependency arrow endpoint.
+ *
+ * Each completed dependency of a job gets its own arrow identified by the
+ * job and the index of the dependency.
+ */
+static void trace_write_flow(kvz_trace_t *trace,
+                             const char *ph,
+                             double ts,
+                             int tid,
+                             uint32_t job_id,
+                             uint32_t index)
+{
+  trace_begin_event(trace, ph, ts, tid);
+  fprintf(trace->file, ",\"name\":\"dependency\",\"cat\":\"dependency\",\"id\":\"0x%llx\"%s}",
+          (unsigned long long)job_id * TRACE_MAX_FLOWS + index,
+          ph[0] == 'f' ? ",\"bp\":\"e\"" : "");
+}
+
+
+/**
+ * \brief Write the events in a buffer to the file and empty the buffer.
+ *
+ * Must be called with the lock held.
+ */
+static void trace_flush_buffer(kvz_trace_t *trace, trace_buffer_t *buffer)
+{
+  for (int i = 0; i < buffer->count; i++) {
+    const trace_event_t *event = &buffer->events[i];
+
+    switch (event->type) {
+      case KVZ_TRACE_JOB_SUBMIT:
+      case KVZ_TRACE_JOB_READY:
+        trace_begin_event(trace, "i", event->ts, buffer->tid);
+        fputs(",\"s\":\"t\"", trace->file);
+        // Name the instant after the event so that it is not mistaken for
+        // the job itself.
+        fprintf(trace->file, ",\"name\":\"%s\",\"cat\":\"queue\",\"args\":{\"job\":%u}}",
+                event->type == KVZ_TRACE_JOB_SUBMIT ? "submit" : "ready",
+                event->job_id);
+        break;
+
+      case KVZ_TRACE_JOB_START:
+        trace_begin_event(trace, "B", event->ts, buffer->tid);
+        trace_write_info(trace, event);
+        for (uint32_t dep = 0; dep < event->arg && dep < TRACE_MAX_FLOWS; dep++) {
+          trace_write_flow(trace, "f", event->ts, buffer->tid, event->job_id, dep);
+        }
+        break;
+
+      case KVZ_TRACE_JOB_END:
+        trace_begin_event(trace, "E", event->ts, buffer->tid);
+        fputs("}", trace->file);
+        break;
+
+      case KVZ_TRACE_JOB_DEPENDENCY:
+        if (event->arg < TRACE_MAX_FLOWS) {
+          trace_write_flow(trace, "s", event->ts, buffer->tid, event->job_id, event->arg);
+        }
+        break;
+    }
+  }
+  buffer->count = 0;
+}
+
+
+/**
+ * \brief Get the buffer of the calling thread, creating it if needed.
+ *
+ * \param worker  index of the calling worker thread, or -1
+ * \return the buffer, or NULL on failure
+ */
+static trace_buffer_t * trace_get_buffer(kvz_trace_t *trace, int worker)
+{
+  trace_buffer_t *buffer = pthread_getspecific(trace->key);
+  if (buffer) return buffer;
+
+  buffer = MALLOC(trace_buffer_t, 1);
+  if (!buffer) {
+    return NULL;
+  }
+  buffer->count = 0;
+
+  if (pthread_mutex_lock(&trace->lock) != 0) {
+    free(buffer);
+    return NULL;
+  }
+  buffer->tid = trace->buffer_count++;
+  buffer->next = trace->buffers;
+  trace->buffers = buffer;
+
+  trace_begin_event(trace, "M", 0, buffer->tid);
+  if (worker >= 0) {
+    fprintf(trace->file, ",\"name\":\"thread_name\",\"args\":{\"name\":\"worker %d\"}}", worker);
+  } else {
+    fputs(",\"name\":\"thread_name\",\"args\":{\"name\":\"encoder\"}}", trace->file);
+  }
+  pthread_mutex_unlock(&trace->lock);
+
+  pthread_setspecific(trace->key, buffer);
+  return buffer;
+}
+
+
+/**
+ * \brief Create a trace and open the file it is written to.
+ *
+ * \return the trace, or NULL on failure
+ */
+kvz_trace_t * kvz_trace_open(const char *filename)
+{
+  kvz_trace_t *trace = MALLOC(kvz_trace_t, 1);
+  if (!trace) {
+    return NULL;
+  }
+
+  trace->file = fopen(filename, "w");
+  if (!trace->file) {
+    fprintf(stderr, "Could not open trace file \"%s\".\n", filename);
+    free(trace);
+    return NULL;
+  }
+
+  if (pthread_mutex_init(&trace->lock, NULL) != 0) {
+    fprintf(stderr, "pthread_mutex_init failed!\n");
+    fclose(trace->file);
+    free(trace);
+    return NULL;
+  }
+
+  if (pthread_key_create(&trace->key, NULL) != 0) {
+    fprintf(stderr, "pthread_key_create failed!\n");
+    pthread_mutex_destroy(&trace->lock);
+    fclose(trace->file);
+    free(trace);
+    return NULL;
+  }
+
+  trace->empty        = true;
+  trace->buffers      = NULL;
+  trace->buffer_count = 0;
+  KVZ_GET_TIME(&trace->start);
+
+  fputs("{\"traceEvents\":[", trace->file);
+  trace_begin_event(trace, "M", 0, 0);
+  fputs(",\"name\":\"process_name\",\"args\":{\"name\":\"kvazaar\"}}", trace->file);
+
+  return trace;
+}
+
+
+/**
+ * \brief Write the remaining events and close the trace.
+ *
+ * No thread may record events to the trace during or after this call.
+ *
+ * \return 1 on success, 0 if writing the file failed
+ */
+int kvz_trace_close(kvz_trace_t *trace)
+{
+  if (!trace) return 1;
+
+  trace_buffer_t *buffer = trace->buffers;
+  while (buffer) {
+    trace_buffer_t *next = buffer->next;
+    trace_flush_buffer(trace, buffer);
+    free(buffer);
+    buffer = next;
+  }
+
+  fputs("\n]}\n", trace->file);
+  int success = !ferror(trace->file);
+  if (fclose(trace->file) != 0) {
+    success = 0;
+  }
+  if (!success) {
+    fprintf(stderr, "Could not write the trace file.\n");
+  }
+
+  pthread_key_delete(trace->key);
+  pthread_mutex_destroy(&trace->lock);
+  free(trace);
+
+  return success;
+}
+
+
+/**
+ * \brief Record an event of a job.
+ *
+ * \param trace   the trace
+ * \param worker  index of the calling worker thread, or -1
+ * \param type    type of the event
+ * \param job_id  id of the job
+ * \param arg     argument depending on the type of the event
+ * \param info    part of the picture the job works on, or NULL
+ */
+void kvz_trace_job_event(kvz_trace_t *trace,
+                         int worker,
+                         kvz_trace_event_type type,
+                         uint32_t job_id,
+                         uint32_t arg,
+                         const kvz_trace_job_info_t *info)
+{
+  trace_buffer_t *buffer = trace_get_buffer(trace, worker);
+  if (!buffer) return;
+
+  if (buffer->count == TRACE_BUFFER_SIZE) {
+    if (pthread_mutex_lock(&trace->lock) != 0) return;
+    trace_flush_buffer(trace, buffer);
+    pthread_mutex_unlock(&trace->lock);
+  }
+
+  KVZ_CLOCK_T now;
+  KVZ_GET_TIME(&now);
+
+  trace_event_t *event = &buffer->events[buffer->count++];
+  event->ts     = KVZ_CLOCK_T_DIFF(trace->start, now) * 1e6;
+  event->job_id = job_id;
+  event->arg    = arg;
+  event->type   = type;
+  if (info) {
+    event->info = *info;
+  } else {
+    event->info.name  = NULL;
+    event->info.frame = -1;
+    event->info.tile  = -1;
+    event->info.lcu_x = -1;
+    event->info.lcu_y = -1;
+  }
+}
@@ -0,0 +1,94 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2013-2015 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * Kvazaar is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+/**
+ * \ingroup Threading
+ * \file
+ * Recording of thread queue activity in Chrome trace event format.
+ */
+
+#include "global.h" // IWYU pragma: keep
+
+
+typedef struct kvz_trace_t kvz_trace_t;
+
+typedef enum {
+  /**
+   * \brief Job was submitted to the thread queue.
+   */
+  KVZ_TRACE_JOB_SUBMIT,
+
+  /**
+   * \brief All dependencies of the job were completed.
+   */
+  KVZ_TRACE_JOB_READY,
+
+  /**
+   * \brief Job started running.
+   *
+   * The argument is the number of dependencies that were completed after
+   * being added to the job.
+   */
+  KVZ_TRACE_JOB_START,
+
+  /**
+   * \brief Job stopped running.
+   */
+  KVZ_TRACE_JOB_END,
+
+  /**
+   * \brief A dependency of the job was completed.
+   *
+   * Recorded by the thread running the dependency. The argument is the
+   * index of the dependency among the completed dependencies of the job.
+   */
+  KVZ_TRACE_JOB_DEPENDENCY,
+} kvz_trace_event_type;
+
+/**
+ * \brief Part of the picture a job works on.
+ *
+ * Fields that do not apply to the job are set to -1.
+ */
+typedef struct {
+  /**
+   * \brief Kind of the job, a string constant.
+   */
+  const char *name;
+
+  int32_t frame;
+  int32_t tile;
+  int32_t lcu_x;
+  int32_t lcu_y;
+} kvz_trace_job_info_t;
+
+kvz_trace_t * kvz_trace_open(const char *filename);
+int kvz_trace_close(kvz_trace_t *trace);
+
+void kvz_trace_job_event(kvz_trace_t *trace,
+                         int worker,
+                         kvz_trace_event_type type,
+                         uint32_t job_id,
+                         uint32_t arg,
+                         const kvz_trace_job_info_t *info);
+
+#endif // TRACE_H_
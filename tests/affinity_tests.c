@@ -0,0 +1,196 @@
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2017 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "greatest/greatest.h"
+
+#include "src/affinity.h"
+#include "src/kvazaar.h"
+#include "src/threadqueue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#define NUM_THREADS 4
+#define NUM_JOBS 32
+
+TEST test_parse_cpu_list(void)
+{
+  int32_t *cpus = NULL;
+  int32_t count = 0;
+
+  ASSERT(kvz_affinity_parse_cpu_list("0-3,8,10-11\n", &cpus, &count));
+  ASSERT_EQ(7, count);
+  const int32_t expected[] = { 0, 1, 2, 3, 8, 10, 11 };
+  for (int i = 0; i < 7; ++i) {
+    ASSERT_EQ(expected[i], cpus[i]);
+  }
+  free(cpus);
+
+  ASSERT_FALSE(kvz_affinity_parse_cpu_list("3-1", &cpus, &count));
+  ASSERT_FALSE(kvz_affinity_parse_cpu_list("1,x", &cpus, &count));
+  ASSERT_FALSE(kvz_affinity_parse_cpu_list("-1", &cpus, &count));
+  ASSERT_FALSE(kvz_affinity_parse_cpu_list("0-100000", &cpus, &count));
+
+  PASS();
+}
+
+#ifdef __linux__
+
+typedef struct {
+  cpu_set_t mask;
+  int ok;
+} affinity_job_t;
+
+static void affinity_job_run(void *opaque)
+{
+  affinity_job_t *job = opaque;
+  CPU_ZERO(&job->mask);
+  job->ok = sched_getaffinity(0, sizeof(job->mask), &job->mask) == 0;
+}
+
+/**
+ * \brief Run jobs on workers placed with the given settings and record the
+ * CPU affinity each job saw.
+ */
+static int run_affinity_jobs(int8_t mode,
+                             const int32_t *cpu_list,
+                             int32_t cpu_list_count,
+                             int32_t numa_node,
+                             affinity_job_t *results)
+{
+  kvz_affinity_t affinity;
+  if (!kvz_affinity_init(&affinity, mode, cpu_list, cpu_list_count, numa_node)) {
+    return 0;
+  }
+
+  threadqueue_queue_t *threadqueue = kvz_threadqueue_init(NUM_THREADS);
+  if (!threadqueue || !kvz_threadqueue_set_affinity(threadqueue, &affinity)) {
+    kvz_affinity_free(&affinity);
+    kvz_threadqueue_free(threadqueue);
+    return 0;
+  }
+  kvz_affinity_free(&affinity);
+
+  threadqueue_job_t *jobs[NUM_JOBS];
+  for (int i = 0; i < NUM_JOBS; ++i) {
+    results[i].ok = 0;
+    jobs[i] = kvz_threadqueue_job_create(threadqueue, affinity_job_run, &results[i]);
+    kvz_threadqueue_submit(threadqueue, jobs[i]);
+  }
+  for (int i = 0; i < NUM_JOBS; ++i) {
+    kvz_threadqueue_waitfor(threadqueue, jobs[i]);
+    kvz_threadqueue_free_job(&jobs[i]);
+  }
+
+  kvz_threadqueue_stop(threadqueue);
+  kvz_threadqueue_free(threadqueue);
+  return 1;
+}
+
+TEST test_compact_pins_single_cpu(void)
+{
+  cpu_set_t available;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(available), &available));
+
+  affinity_job_t results[NUM_JOBS];
+  ASSERT(run_affinity_jobs(KVZ_THREAD_AFFINITY_COMPACT, NULL, 0, -1, results));
+
+  for (int i = 0; i < NUM_JOBS; ++i) {
+    ASSERT(results[i].ok);
+    ASSERT_EQ(1, CPU_COUNT(&results[i].mask));
+    cpu_set_t allowed;
+    CPU_AND(&allowed, &results[i].mask, &available);
+    ASSERT_EQ(1, CPU_COUNT(&allowed));
+  }
+
+  PASS();
+}
+
+TEST test_cpu_list(void)
+{
+  cpu_set_t available;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(available), &available));
+
+  int32_t cpu = 0;
+  while (!CPU_ISSET(cpu, &available)) ++cpu;
+
+  affinity_job_t results[NUM_JOBS];
+  ASSERT(run_affinity_jobs(KVZ_THREAD_AFFINITY_LIST, &cpu, 1, -1, results));
+
+  for (int i = 0; i < NUM_JOBS; ++i) {
+    ASSERT(results[i].ok);
+    ASSERT_EQ(1, CPU_COUNT(&results[i].mask));
+    ASSERT(CPU_ISSET(cpu, &results[i].mask));
+  }
+
+  PASS();
+}
+
+TEST test_numa_node(void)
+{
+  int32_t *node_cpus = NULL;
+  int32_t node_cpu_count = 0;
+  char buf[4096];
+  FILE *f = fopen("/sys/devices/system/node/node0/cpulist", "r");
+  if (!f) SKIPm("no NUMA information");
+  if (!fgets(buf, sizeof(buf), f)) buf[0] = '\0';
+  fclose(f);
+  ASSERT(kvz_affinity_parse_cpu_list(buf, &node_cpus, &node_cpu_count));
+
+  cpu_set_t expected;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(expected), &expected));
+  cpu_set_t on_node;
+  CPU_ZERO(&on_node);
+  for (int i = 0; i < node_cpu_count; ++i) {
+    CPU_SET(node_cpus[i], &on_node);
+  }
+  free(node_cpus);
+  CPU_AND(&expected, &expected, &on_node);
+  if (CPU_COUNT(&expected) == 0) SKIPm("no usable CPUs on node 0");
+
+  affinity_job_t results[NUM_JOBS];
+  ASSERT(run_affinity_jobs(KVZ_THREAD_AFFINITY_NONE, NULL, 0, 0, results));
+
+  for (int i = 0; i < NUM_JOBS; ++i) {
+    ASSERT(results[i].ok);
+    ASSERT(CPU_EQUAL(&expected, &results[i].mask));
+  }
+
+  PASS();
+}
+
+#endif // __linux__
+
+SUITE(affinity_tests)
+{
+  RUN_TEST(test_parse_cpu_list);
+#ifdef __linux__
+  RUN_TEST(test_compact_pins_single_cpu);
+  RUN_TEST(test_cpu_list);
+  RUN_TEST(test_numa_node);
+#endif
+}
@@ -0,0 +1,123 @@
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2017 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#include "greatest/greatest.h"
+
+#include "src/encoder.h"
+#include "src/image.h"
+#include "src/kvazaar.h"
+#include "src/kvazaar_internal.h"
+#include "src/lookahead.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define WIDTH 128
+#define HEIGHT 128
+#define GOP_LEN 8
+#define NUM_GOPS 4
+// The frames of NUM_GOPS GOPs and the first intra frame.
+#define NUM_FRAMES (GOP_LEN * NUM_GOPS + 1)
+
+static void fill_frame(kvz_picture *pic, int frame)
+{
+  // A detailed pattern moving slowly to the left, so that most of each
+  // frame is predicted from the frames around it.
+  for (int y = 0; y < HEIGHT; y++) {
+    for (int x = 0; x < WIDTH; x++) {
+      const uint32_t v = (uint32_t)((x + frame) / 3 * 2654435761u) ^ (y / 3 * 40503u);
+      pic->y[y * pic->stride + x] = (kvz_pixel)(v >> 13);
+    }
+  }
+  memset(pic->u, 128, (WIDTH / 2) * (HEIGHT / 2));
+  memset(pic->v, 128, (WIDTH / 2) * (HEIGHT / 2));
+}
+
+TEST test_cutree_gop8_anchors(void)
+{
+  const kvz_api *api = kvz_api_get(8);
+  kvz_config *cfg = api->config_alloc();
+  ASSERT(cfg != NULL);
+  ASSERT(api->config_init(cfg));
+  ASSERT(api->config_parse(cfg, "preset", "ultrafast"));
+  ASSERT(api->config_parse(cfg, "input-res", "128x128"));
+  ASSERT(api->config_parse(cfg, "gop", "8"));
+  ASSERT(api->config_parse(cfg, "period", "0"));
+  ASSERT(api->config_parse(cfg, "lookahead", "16"));
+  ASSERT(api->config_parse(cfg, "cutree", "1"));
+  ASSERT(api->config_parse(cfg, "threads", "2"));
+
+  kvz_encoder *encoder = api->encoder_open(cfg);
+  ASSERT(encoder != NULL);
+  lookahead_t *lookahead = kvz_lookahead_init(encoder->control);
+  ASSERT(lookahead != NULL);
+
+  int num_out = 0;
+  for (int frame = 0; frame < NUM_FRAMES; frame++) {
+    // The lookahead keeps a reference to the picture.
+    kvz_picture *pic = api->picture_alloc(WIDTH, HEIGHT);
+    ASSERT(pic != NULL);
+    fill_frame(pic, frame);
+    ASSERT(kvz_lookahead_push(lookahead, pic));
+    api->picture_free(pic);
+    bool scenecut;
+    kvz_picture *out;
+    while ((out = kvz_lookahead_pop(lookahead, false, &scenecut))) {
+      kvz_image_free(out);
+      num_out++;
+    }
+  }
+  bool scenecut;
+  kvz_picture *out;
+  while ((out = kvz_lookahead_pop(lookahead, true, &scenecut))) {
+    kvz_image_free(out);
+    num_out++;
+  }
+  ASSERT_EQ(NUM_FRAMES, num_out);
+
+  double offsets[NUM_FRAMES];
+  for (int frame = 0; frame < NUM_FRAMES; frame++) {
+    lookahead_frame_t *analysis = kvz_lookahead_take(lookahead, frame);
+    ASSERT(analysis != NULL);
+    offsets[frame] = kvz_lookahead_qp_offset(analysis, 0, 0, WIDTH, HEIGHT);
+    kvz_lookahead_frame_free(&analysis);
+  }
+
+  // Each anchor is referenced, directly or through the other pictures, by
+  // every picture of its GOP and by the anchor of the next GOP, so it gets
+  // the largest negative offset. The anchor of the last GOP is referenced
+  // only by its own GOP.
+  for (int gop = 0; gop < NUM_GOPS - 1; gop++) {
+    const int anchor = (gop + 1) * GOP_LEN;
+    ASSERT(offsets[anchor] < 0.0);
+    for (int i = 1; i < GOP_LEN; i++) {
+      ASSERT(offsets[anchor] < offsets[gop * GOP_LEN + i]);
+    }
+  }
+
+  kvz_lookahead_free(lookahead);
+  api->encoder_close(encoder);
+  api->config_destroy(cfg);
+  PASS();
+}
+
+SUITE(lookahead_tests)
+{
+  RUN_TEST(test_cutree_gop8_anchors);
+}
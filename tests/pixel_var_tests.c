@@ -0,0 +1,80 @@
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2017 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#include "greatest/greatest.h"
+
+#include "test_strategies.h"
+
+#include <string.h>
+
+#define TEST_STRIDE 24
+
+static kvz_pixel flat_block[8 * TEST_STRIDE];
+static kvz_pixel checker_block[8 * TEST_STRIDE];
+static kvz_pixel ramp_block[8 * TEST_STRIDE];
+
+static void setup()
+{
+  // Fill the pixels outside the 8x8 blocks with values that would change
+  // the results if they were read.
+  for (int y = 0; y < 8; y++) {
+    for (int x = 0; x < TEST_STRIDE; x++) {
+      const bool inside = x < 8;
+      flat_block[x + y * TEST_STRIDE]    = inside ? 100 : 7;
+      checker_block[x + y * TEST_STRIDE] = inside ? ((x + y) % 2) * 255 : 7;
+      ramp_block[x + y * TEST_STRIDE]    = inside ? x + 8 * y : 200;
+    }
+  }
+}
+
+TEST test_pixel_var_flat()
+{
+  ASSERT_EQ(kvz_pixel_var_8x8(flat_block, TEST_STRIDE), 0);
+  PASS();
+}
+
+TEST test_pixel_var_checker()
+{
+  // 64 * 127.5^2
+  ASSERT_EQ(kvz_pixel_var_8x8(checker_block, TEST_STRIDE), 1040400);
+  PASS();
+}
+
+TEST test_pixel_var_ramp()
+{
+  // Sum of i^2 for i = 0..63 minus 2016^2 / 64
+  ASSERT_EQ(kvz_pixel_var_8x8(ramp_block, TEST_STRIDE), 21840);
+  PASS();
+}
+
+SUITE(pixel_var_tests)
+{
+  setup();
+
+  for (volatile int i = 0; i < strategies.count; ++i) {
+    if (strcmp(strategies.strategies[i].type, "pixel_var_8x8") != 0) {
+      continue;
+    }
+
+    kvz_pixel_var_8x8 = strategies.strategies[i].fptr;
+    RUN_TEST(test_pixel_var_flat);
+    RUN_TEST(test_pixel_var_checker);
+    RUN_TEST(test_pixel_var_ramp);
+  }
+}
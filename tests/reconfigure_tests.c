@@ -0,0 +1,212 @@
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2017 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#include "greatest/greatest.h"
+
+#include "src/kvazaar.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define WIDTH 128
+#define HEIGHT 128
+// Number of frames coded before and after the encoder is reconfigured.
+#define NUM_FRAMES 24
+// Number of the last frames before and after the reconfiguration whose
+// QP is compared.
+#define QP_FRAMES 8
+
+typedef struct {
+  const kvz_api *api;
+  kvz_config *cfg;
+  kvz_encoder *encoder;
+  kvz_picture *pic;
+  int frames_in;
+  int frames_out;
+  int idr_frames;
+  int qp_sum;
+} encode_test_t;
+
+static int init_config(encode_test_t *test, const char * const *options)
+{
+  memset(test, 0, sizeof(*test));
+  test->api = kvz_api_get(8);
+  test->cfg = test->api->config_alloc();
+  if (!test->cfg || !test->api->config_init(test->cfg)) return 0;
+
+  static const char * const common[] = {
+    "preset", "ultrafast",
+    "input-res", "128x128",
+    "period", "0",
+    "gop", "0",
+    "owf", "1",
+    NULL
+  };
+  for (int i = 0; common[i]; i += 2) {
+    if (!test->api->config_parse(test->cfg, common[i], common[i + 1])) return 0;
+  }
+  for (int i = 0; options[i]; i += 2) {
+    if (!test->api->config_parse(test->cfg, options[i], options[i + 1])) return 0;
+  }
+  return 1;
+}
+
+static int open_encoder(encode_test_t *test)
+{
+  test->encoder = test->api->encoder_open(test->cfg);
+  test->pic = test->api->picture_alloc(WIDTH, HEIGHT);
+  return test->encoder && test->pic;
+}
+
+static void close_encoder(encode_test_t *test)
+{
+  test->api->picture_free(test->pic);
+  test->api->encoder_close(test->encoder);
+  test->api->config_destroy(test->cfg);
+}
+
+/**
+ * \brief Encode frames and sum the QPs of the frames output last.
+ */
+static int encode_frames(encode_test_t *test, int num_frames)
+{
+  test->qp_sum = 0;
+  for (int i = 0; i < num_frames; i++) {
+    const int frame = test->frames_in++;
+    // A detailed pattern moving to the left so that the bitrate depends
+    // strongly on the QP.
+    for (int y = 0; y < HEIGHT; y++) {
+      for (int x = 0; x < WIDTH; x++) {
+        const uint32_t v = (uint32_t)((x + 3 * frame) * 2654435761u) ^ (y * 40503u);
+        test->pic->y[y * test->pic->stride + x] = (kvz_pixel)(v >> 13);
+      }
+    }
+    memset(test->pic->u, 128, (WIDTH / 2) * (HEIGHT / 2));
+    memset(test->pic->v, 128, (WIDTH / 2) * (HEIGHT / 2));
+
+    kvz_data_chunk *chunks = NULL;
+    kvz_frame_info info;
+    if (!test->api->encoder_encode(test->encoder, test->pic, &chunks, NULL,
+                                   NULL, NULL, &info)) {
+      return 0;
+    }
+    if (chunks) {
+      if (test->frames_out > 0 &&
+          (info.nal_unit_type == KVZ_NAL_IDR_W_RADL ||
+           info.nal_unit_type == KVZ_NAL_IDR_N_LP ||
+           info.slice_type == KVZ_SLICE_I)) {
+        test->idr_frames++;
+      }
+      if (i >= num_frames - QP_FRAMES) {
+        test->qp_sum += info.qp;
+      }
+      test->frames_out++;
+    }
+    test->api->chunk_free(chunks);
+  }
+  return 1;
+}
+
+TEST test_reconfigure_bitrate(void)
+{
+  static const char * const options[] = { "bitrate", "100000", NULL };
+  encode_test_t test;
+  ASSERT(init_config(&test, options));
+  ASSERT(open_encoder(&test));
+
+  ASSERT(encode_frames(&test, NUM_FRAMES));
+  const int qp_before = test.qp_sum;
+
+  ASSERT(test.api->config_parse(test.cfg, "bitrate", "3000000"));
+  ASSERT(test.api->encoder_reconfigure(test.encoder, test.cfg));
+  ASSERT(encode_frames(&test, NUM_FRAMES));
+  const int qp_after = test.qp_sum;
+
+  // The higher bitrate lowers the QP without starting a new sequence.
+  ASSERT(qp_after + 3 * QP_FRAMES <= qp_before);
+  ASSERT_EQ(0, test.idr_frames);
+
+  close_encoder(&test);
+  PASS();
+}
+
+TEST test_reconfigure_vbv_maxrate(void)
+{
+  static const char * const options[] = {
+    "qp", "22",
+    "vbv-maxrate", "4000000",
+    "vbv-bufsize", "200000",
+    NULL
+  };
+  encode_test_t test;
+  ASSERT(init_config(&test, options));
+  // Without timing information, the rate is not signalled in the SPS.
+  test.cfg->framerate_num = 0;
+  ASSERT(open_encoder(&test));
+
+  ASSERT(encode_frames(&test, NUM_FRAMES));
+  const int qp_before = test.qp_sum;
+
+  ASSERT(test.api->config_parse(test.cfg, "vbv-maxrate", "100000"));
+  ASSERT(test.api->encoder_reconfigure(test.encoder, test.cfg));
+  ASSERT(encode_frames(&test, NUM_FRAMES));
+  const int qp_after = test.qp_sum;
+
+  // The lower rate at which the buffer is filled raises the QP.
+  ASSERT(qp_after >= qp_before + 3 * QP_FRAMES);
+  ASSERT_EQ(0, test.idr_frames);
+
+  close_encoder(&test);
+  PASS();
+}
+
+TEST test_reconfigure_vbv_rejected(void)
+{
+  static const char * const options[] = {
+    "qp", "22",
+    "vbv-maxrate", "4000000",
+    "vbv-bufsize", "200000",
+    NULL
+  };
+  encode_test_t test;
+  ASSERT(init_config(&test, options));
+  ASSERT(open_encoder(&test));
+  ASSERT(encode_frames(&test, 2));
+
+  // The rate is signalled in the HRD parameters of the SPS.
+  ASSERT(test.api->config_parse(test.cfg, "vbv-maxrate", "100000"));
+  ASSERT_FALSE(test.api->encoder_reconfigure(test.encoder, test.cfg));
+
+  ASSERT(test.api->config_parse(test.cfg, "vbv-maxrate", "4000000"));
+  ASSERT(test.api->config_parse(test.cfg, "vbv-bufsize", "100000"));
+  ASSERT_FALSE(test.api->encoder_reconfigure(test.encoder, test.cfg));
+
+  ASSERT(test.api->config_parse(test.cfg, "vbv-bufsize", "200000"));
+  ASSERT(test.api->encoder_reconfigure(test.encoder, test.cfg));
+
+  close_encoder(&test);
+  PASS();
+}
+
+SUITE(reconfigure_tests)
+{
+  RUN_TEST(test_reconfigure_bitrate);
+  RUN_TEST(test_reconfigure_vbv_maxrate);
+  RUN_TEST(test_reconfigure_vbv_rejected);
+}
@@ -320,6 +320,43 @@ TEST test_reg_sad_overflow(void)
 }
 
 
+TEST test_reg_sad_multi(void)
+{
+  unsigned width = sad_test_env.width;
+  unsigned height = sad_test_env.height;
+  unsigned stride = 64;
+
+  // Candidates in different pictures and at different offsets, and a number
+  // of them that is not a multiple of four.
+  const kvz_pixel *candidates[5] = {
+    g_big_ref->y,
+    g_big_ref->y + (64 - width),
+    g_big_pic->y + (64 - height) * stride,
+    g_64x64_zero->y,
+    g_64x64_max->y,
+  };
+  unsigned costs[5];
+
+  void(*tested_func)(const kvz_pixel *, const kvz_pixel *const *, int, int, int, unsigned, unsigned, unsigned *) = sad_test_env.tested_func;
+  tested_func(g_big_pic->y, candidates, 5, width, height, stride, stride, costs);
+
+  sprintf(sad_test_env.msg, "%s(%ux%u):%s",
+          sad_test_env.strategy->type,
+          width,
+          height,
+          sad_test_env.strategy->strategy_name);
+
+  for (int i = 0; i < 5; ++i) {
+    unsigned correct_result = simple_sad(g_big_pic->y, candidates[i], stride, width, height);
+    if (costs[i] != correct_result) {
+      FAILm(sad_test_env.msg);
+    }
+  }
+
+  PASSm(sad_test_env.msg);
+}
+
+
 //////////////////////////////////////////////////////////////////////////
 // TEST FIXTURES
 SUITE(sad_tests)
@@ -329,6 +366,19 @@ SUITE(sad_tests)
 
   setup_tests();
 
+  struct dimension {
+    int width;
+    int height;
+  };
+  static const struct dimension tested_dims[] = {
+    // Square motion partitions
+    {64, 64}, {32, 32}, {16, 16}, {8, 8},
+    // Symmetric motion partitions
+    {64, 32}, {32, 64}, {32, 16}, {16, 32}, {16, 8}, {8, 16}, {8, 4}, {4, 8},
+    // Asymmetric motion partitions
+    {48, 16}, {16, 48}, {24, 16}, {16, 24}, {12, 4}, {4, 12}
+  };
+
   for (volatile unsigned i = 0; i < strategies.count; ++i) {
     if (strcmp(strategies.strategies[i].type, "reg_sad") != 0) {
       continue;
@@ -362,19 +412,6 @@ SUITE(sad_tests)
     RUN_TEST(test_bottom_out);
     RUN_TEST(test_bottomright_out);
 
-    struct dimension {
-      int width;
-      int height;
-    };
-    static const struct dimension tested_dims[] = {
-      // Square motion partitions
-      {64, 64}, {32, 32}, {16, 16}, {8, 8},
-      // Symmetric motion partitions
-      {64, 32}, {32, 64}, {32, 16}, {16, 32}, {16, 8}, {8, 16}, {8, 4}, {4, 8},
-      // Asymmetric motion partitions
-      {48, 16}, {16, 48}, {24, 16}, {16, 24}, {12, 4}, {4, 12}
-    };
-
     sad_test_env.tested_func = strategies.strategies[i].fptr;
     sad_test_env.strategy = &strategies.strategies[i];
     int num_dim_tests = sizeof(tested_dims) / sizeof(tested_dims[0]);
@@ -385,6 +422,21 @@ SUITE(sad_tests)
       RUN_TEST(test_reg_sad_overflow);
     }
   }
+
+  for (volatile unsigned i = 0; i < strategies.count; ++i) {
+    if (strcmp(strategies.strategies[i].type, "reg_sad_multi") != 0) {
+      continue;
+    }
+
+    sad_test_env.tested_func = strategies.strategies[i].fptr;
+    sad_test_env.strategy = &strategies.strategies[i];
+    int num_dim_tests = sizeof(tested_dims) / sizeof(tested_dims[0]);
+    for (volatile int dim_test = 0; dim_test < num_dim_tests; ++dim_test) {
+      sad_test_env.width = tested_dims[dim_test].width;
+      sad_test_env.height = tested_dims[dim_test].height;
+      RUN_TEST(test_reg_sad_multi);
+    }
+  }
   
   tear_down_tests();
 }
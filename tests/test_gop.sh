@@ -12,6 +12,12 @@ valgrind_test 264x130 20 $common_args --gop=8 -p16 --owf=0
 valgrind_test 264x130 10 $common_args --gop=8 -p1 --owf=4
 valgrind_test 264x130 10 $common_args --gop=lp-g4d3t1 -p5 --owf=4
 valgrind_test 264x130 10 $common_args --gop=8 -p8 --owf=4 --no-open-gop
+valgrind_test 264x130 10 $common_args --gop=8 -p0 --owf=4 --lookahead=4
+valgrind_test 264x130 10 $common_args --gop=lp-g4d3t1 -p5 --owf=4 --lookahead=2 --lookahead-scale=4
+valgrind_test 264x130 20 $common_args --gop=8 -p0 --owf=4 --lookahead=8 --cutree
+valgrind_test 264x130 20 $common_args --gop=8 -p0 --owf=4 --scenecut=100
+valgrind_test 264x130 20 $common_args --gop=8 -p16 --owf=2 --no-open-gop --scenecut=100 --lookahead=3
+valgrind_test 264x130 10 $common_args --gop=lp-g4d3t1 -p0 --owf=2 --scenecut=100
 # Do more extensive tests in a private gitlab CI runner
 if [ ! -z ${GITLAB_CI+x} ];then valgrind_test 264x130 20 $common_args --gop=8 -p8 --owf=0 --no-open-gop; fi
 if [ ! -z ${GITLAB_CI+x} ];then valgrind_test 264x130 40 $common_args --gop=8 -p32 --owf=4 --no-open-gop; fi
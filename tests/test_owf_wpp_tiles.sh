@@ -16,4 +16,13 @@ valgrind_test 264x130 10 $common_args -r2 --owf=1 --threads=2 --tiles-height-spl
 valgrind_test 264x130 10 $common_args -r2 --owf=0 --threads=2 --tiles-height-split=u2 --no-wpp
 valgrind_test 512x512  3 $common_args -r2 --owf=1 --threads=2 --tiles=2x2 --no-wpp
 valgrind_test 512x512  3 $common_args -r2 --owf=0 --threads=2 --tiles=2x2 --no-wpp
+valgrind_test 264x130 10 $common_args -r2 --owf=2 --threads=2 --wpp --inter-ref-window=0
+valgrind_test 264x130 10 $common_args -r2 --owf=2 --threads=2 --wpp --inter-ref-window=3x2
+valgrind_test 264x130 10 $common_args -r2 --owf=2 --threads=2 --wpp --inter-ref-window=auto --me=full64
+valgrind_test 264x130 10 $common_args -r2 --owf=2 --threads=2 --wpp --inter-ref-window=auto --me=pyramid
+valgrind_test 264x130 10 $common_args -r2 --owf=2 --threads=2 --wpp --subme=4 --subme-cache
+valgrind_test 512x512  3 $common_args -r2 --owf=1 --threads=2 --tiles=2x2 --no-wpp --subme=4 --subme-cache
+valgrind_test 512x512  3 $common_args -r2 --owf=1 --threads=2 --tiles=2x2 --no-wpp --me=full16
+valgrind_test 264x130 10 $common_args -r2 --owf=2 --threads=2 --wpp --subme=4 --me-cache --me-ref-jobs
+valgrind_test 264x130 10 $common_args -r2 --owf=1 --threads=2 --wpp --owf-adaptive --owf-max=3
 if [ ! -z ${GITLAB_CI+x} ];then valgrind_test 512x512 30 $common_args -r2 --owf=0 --threads=2 --tiles=2x2 --no-wpp --bipred; fi
@@ -4,4 +4,19 @@ set -eu
 . "${0%/*}/util.sh"
 
 valgrind_test 264x130 10 --bitrate=500000 -p0 -r1 --owf=1 --threads=2 --rd=0 --no-rdoq --no-deblock --no-sao --no-signhide --subme=0 --pu-depth-inter=1-3 --pu-depth-intra=2-3
+
+statsfile="$(mktemp)"
+valgrind_test 264x130 10 --pass=1 --stats="${statsfile}" -p0 -r1 --owf=1 --threads=2
+valgrind_test 264x130 10 --pass=2 --stats="${statsfile}" --bitrate=500000 -p0 -r1 --owf=1 --threads=2 --rd=0 --no-rdoq --subme=0
+encode_test 264x130 10 1 --pass=2 --stats="${statsfile}" --bitrate=500000 --gop=8 -p0 -r1 --owf=1 --threads=2
+encode_test 264x130 10 1 --pass=2 --stats="${statsfile}" --bitrate=500000 -p8 -r1 --owf=1 --threads=2
+encode_test 264x130 9 1 --pass=2 --stats="${statsfile}" --bitrate=500000 -p0 -r1 --owf=1 --threads=2
+encode_test 264x130 11 1 --pass=2 --stats="${statsfile}" --bitrate=500000 -p0 -r1 --owf=1 --threads=2
+rm -f "${statsfile}"
 if [ ! -z ${GITLAB_CI+x} ];then valgrind_test 512x512 30 --bitrate=100000 -p0 -r1 --owf=1 --threads=2 --rd=0 --no-rdoq --no-deblock --no-sao --no-signhide --subme=2 --pu-depth-inter=1-3 --pu-depth-intra=2-3 --bipred; fi
+valgrind_test 264x130 10 --vbv-maxrate=300000 --vbv-bufsize=200000 -p0 -r1 --owf=1 --threads=2 --rd=0 --no-rdoq --no-deblock --no-sao --no-signhide --subme=0 --pu-depth-inter=1-3 --pu-depth-intra=2-3
+valgrind_test 264x130 10 --vbv-maxrate=300000 --vbv-bufsize=200000 --bitrate=200000 --gop=8 -p8 --owf=2 --threads=2 --rd=0 --no-rdoq --subme=0
+vbv_test 264x130 20 15000 60000 -p8 --owf=0 --rd=0 --no-rdoq --subme=0
+vbv_test 264x130 20 15000 60000 --bitrate=60000 -p8 --owf=0 --rd=0 --no-rdoq --subme=0
+vbv_test 264x130 20 20000 80000 --qp=22 --gop=8 -p8 --owf=2 --threads=2 --wpp --rd=0 --no-rdoq --subme=0
+valgrind_test 264x130 10 --crf=28 --gop=8 -p8 --owf=2 --threads=2 --rd=0 --no-rdoq --subme=0
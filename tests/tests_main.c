@@ -32,7 +32,12 @@ extern SUITE(dct_tests);
 
 extern SUITE(coeff_sum_tests);
 extern SUITE(mv_cand_tests);
+extern SUITE(pixel_var_tests);
 extern SUITE(inter_recon_bipred_tests);
+extern SUITE(threadqueue_tests);
+extern SUITE(affinity_tests);
+extern SUITE(reconfigure_tests);
+extern SUITE(lookahead_tests);
 
 int main(int argc, char **argv)
 {
@@ -58,6 +63,16 @@ int main(int argc, char **argv)
 
   RUN_SUITE(mv_cand_tests);
 
+  RUN_SUITE(pixel_var_tests);
+
+  RUN_SUITE(threadqueue_tests);
+
+  RUN_SUITE(affinity_tests);
+
+  RUN_SUITE(reconfigure_tests);
+
+  RUN_SUITE(lookahead_tests);
+
   // Doesn't work in git
   //RUN_SUITE(inter_recon_bipred_tests);
 
@@ -0,0 +1,571 @@
+/*****************************************************************************
+ * This file is part of Kvazaar HEVC encoder.
+ *
+ * Copyright (C) 2017 Tampere University of Technology and others (see
+ * COPYING file).
+ *
+ * Kvazaar is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Kvazaar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kvazaar.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#include "greatest/greatest.h"
+
+#include "src/encoder.h"
+#include "src/kvazaar.h"
+#include "src/kvazaar_internal.h"
+#include "src/threadqueue.h"
+#include "src/threads.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A small WPP-like grid of jobs, each depending on the job on the left
+// and the job on the top right.
+#define GRID_WIDTH 8
+#define GRID_HEIGHT 6
+#define NUM_FRAMES 10
+
+typedef struct {
+  int32_t done[GRID_WIDTH * GRID_HEIGHT];
+  int32_t order_errors;
+} grid_t;
+
+typedef struct {
+  grid_t *grid;
+  int x;
+  int y;
+} grid_job_t;
+
+static void grid_job_run(void *opaque)
+{
+  grid_job_t *job = opaque;
+  grid_t *grid = job->grid;
+
+  if (job->x > 0 &&
+      !KVZ_ATOMIC_ADD(&grid->done[job->y * GRID_WIDTH + job->x - 1], 0)) {
+    KVZ_ATOMIC_INC(&grid->order_errors);
+  }
+  if (job->y > 0) {
+    const int above_x = MIN(job->x + 1, GRID_WIDTH - 1);
+    if (!KVZ_ATOMIC_ADD(&grid->done[(job->y - 1) * GRID_WIDTH + above_x], 0)) {
+      KVZ_ATOMIC_INC(&grid->order_errors);
+    }
+  }
+
+  KVZ_ATOMIC_INC(&grid->done[job->y * GRID_WIDTH + job->x]);
+}
+
+static int run_grid(threadqueue_queue_t *threadqueue, grid_t *grid)
+{
+  grid_job_t args[GRID_WIDTH * GRID_HEIGHT];
+  threadqueue_job_t *jobs[GRID_WIDTH * GRID_HEIGHT];
+
+  memset(grid, 0, sizeof(*grid));
+
+  for (int y = 0; y < GRID_HEIGHT; y++) {
+    for (int x = 0; x < GRID_WIDTH; x++) {
+      const int i = y * GRID_WIDTH + x;
+      args[i].grid = grid;
+      args[i].x = x;
+      args[i].y = y;
+      jobs[i] = kvz_threadqueue_job_create(threadqueue, grid_job_run, &args[i]);
+      if (!jobs[i]) return 0;
+      kvz_threadqueue_job_set_priority(jobs[i], -(x + 2 * y));
+
+      if (x > 0) {
+        kvz_threadqueue_job_dep_add(jobs[i], jobs[i - 1]);
+      }
+      if (y > 0) {
+        kvz_threadqueue_job_dep_add(jobs[i], jobs[i - GRID_WIDTH + MIN(1, GRID_WIDTH - 1 - x)]);
+      }
+      kvz_threadqueue_submit(threadqueue, jobs[i]);
+    }
+  }
+
+  kvz_threadqueue_waitfor(threadqueue, jobs[GRID_WIDTH * GRID_HEIGHT - 1]);
+
+  for (int i = 0; i < GRID_WIDTH * GRID_HEIGHT; i++) {
+    kvz_threadqueue_free_job(&jobs[i]);
+  }
+  return 1;
+}
+
+TEST test_dependency_order(int thread_count)
+{
+  threadqueue_queue_t *threadqueue = kvz_threadqueue_init(thread_count);
+  ASSERT(threadqueue != NULL);
+
+  grid_t grid;
+  for (int frame = 0; frame < NUM_FRAMES; frame++) {
+    ASSERT(run_grid(threadqueue, &grid));
+    ASSERT_EQ(0, grid.order_errors);
+    for (int i = 0; i < GRID_WIDTH * GRID_HEIGHT; i++) {
+      ASSERT_EQ(1, grid.done[i]);
+    }
+  }
+
+  kvz_threadqueue_free(threadqueue);
+  PASS();
+}
+
+TEST test_no_allocs_after_warmup(int thread_count)
+{
+  threadqueue_queue_t *threadqueue = kvz_threadqueue_init(thread_count);
+  ASSERT(threadqueue != NULL);
+
+  grid_t grid;
+  ASSERT(run_grid(threadqueue, &grid));
+  const int warmup_allocs = kvz_threadqueue_alloc_count(threadqueue);
+  ASSERT(warmup_allocs > 0);
+
+  // Threads creating jobs wait for the workers to return the jobs they
+  // have completed, so the jobs are always recycled after the first frame.
+  for (int frame = 1; frame < 10 * NUM_FRAMES; frame++) {
+    ASSERT(run_grid(threadqueue, &grid));
+    ASSERT_EQ_FMT(warmup_allocs, kvz_threadqueue_alloc_count(threadqueue), "%d");
+  }
+
+  kvz_threadqueue_free(threadqueue);
+  PASS();
+}
+
+#define ENCODER_WIDTH 256
+#define ENCODER_HEIGHT 256
+
+static int encode_frame(const kvz_api *api, kvz_encoder *encoder,
+                        kvz_picture *pic, int frame)
+{
+  // A moving pattern so that the frames are coded with inter prediction.
+  for (int y = 0; y < ENCODER_HEIGHT; y++) {
+    for (int x = 0; x < ENCODER_WIDTH; x++) {
+      pic->y[y * pic->stride + x] = (kvz_pixel)(((x + 2 * frame) ^ y) * 3);
+    }
+  }
+  memset(pic->u, 128, (ENCODER_WIDTH / 2) * (ENCODER_HEIGHT / 2));
+  memset(pic->v, 128, (ENCODER_WIDTH / 2) * (ENCODER_HEIGHT / 2));
+
+  kvz_data_chunk *chunks = NULL;
+  if (!api->encoder_encode(encoder, pic, &chunks, NULL, NULL, NULL, NULL)) {
+    return 0;
+  }
+  api->chunk_free(chunks);
+  return 1;
+}
+
+TEST test_encoder_no_allocs_after_warmup(void)
+{
+  const kvz_api *api = kvz_api_get(8);
+  kvz_config *cfg = api->config_alloc();
+  ASSERT(cfg != NULL);
+  ASSERT(api->config_init(cfg));
+  ASSERT(api->config_parse(cfg, "preset", "ultrafast"));
+  ASSERT(api->config_parse(cfg, "input-res", "256x256"));
+  ASSERT(api->config_parse(cfg, "threads", "4"));
+  ASSERT(api->config_parse(cfg, "owf", "2"));
+  ASSERT(api->config_parse(cfg, "wpp", "1"));
+
+  kvz_encoder *encoder = api->encoder_open(cfg);
+  ASSERT(encoder != NULL);
+  kvz_picture *pic = api->picture_alloc(ENCODER_WIDTH, ENCODER_HEIGHT);
+  ASSERT(pic != NULL);
+  threadqueue_queue_t *threadqueue = encoder->control->threadqueue;
+
+  int frame = 0;
+  for (; frame < 4 * NUM_FRAMES; frame++) {
+    ASSERT(encode_frame(api, encoder, pic, frame));
+  }
+  const int warmup_allocs = kvz_threadqueue_alloc_count(threadqueue);
+  ASSERT(warmup_allocs > 0);
+
+  for (; frame < 8 * NUM_FRAMES; frame++) {
+    ASSERT(encode_frame(api, encoder, pic, frame));
+    ASSERT_EQ_FMT(warmup_allocs, kvz_threadqueue_alloc_count(threadqueue), "%d");
+  }
+
+  api->picture_free(pic);
+  api->encoder_close(encoder);
+  api->config_destroy(cfg);
+  PASS();
+}
+
+typedef struct {
+  threadqueue_queue_t *threadqueue;
+  int order_errors;
+} grid_thread_t;
+
+static void* grid_thread_run(void *opaque)
+{
+  grid_thread_t *arg = opaque;
+  grid_t grid;
+  for (int frame = 0; frame < NUM_FRAMES; frame++) {
+    if (!run_grid(arg->threadqueue, &grid)) {
+      arg->order_errors++;
+    }
+    arg->order_errors += grid.order_errors;
+  }
+  return NULL;
+}
+
+TEST test_shared_pool(int thread_count)
+{
+  threadqueue_pool_t *pool = kvz_threadqueue_pool_init(thread_count);
+  ASSERT(pool != NULL);
+  ASSERT_EQ(thread_count, kvz_threadqueue_pool_thread_count(pool));
+
+  grid_thread_t args[2];
+  pthread_t threads[2];
+  for (int i = 0; i < 2; i++) {
+    args[i].threadqueue = kvz_threadqueue_init_shared(pool);
+    args[i].order_errors = 0;
+    ASSERT(args[i].threadqueue != NULL);
+  }
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, grid_thread_run, &args[i]));
+  }
+  for (int i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+    ASSERT_EQ(0, args[i].order_errors);
+  }
+
+  // A queue may be freed while another one is still using the pool.
+  kvz_threadqueue_free(args[0].threadqueue);
+  grid_thread_run(&args[1]);
+  ASSERT_EQ(0, args[1].order_errors);
+  kvz_threadqueue_free(args[1].threadqueue);
+
+  kvz_threadqueue_pool_free(pool);
+  PASS();
+}
+
+#define FAIRNESS_JOBS 100
+
+typedef struct {
+  int32_t *gate;
+  int32_t *counter;
+  int32_t order;
+} fairness_job_t;
+
+static void fairness_job_run(void *opaque)
+{
+  fairness_job_t *job = opaque;
+  if (job->gate) {
+    while (!KVZ_ATOMIC_ADD(job->gate, 0)) {}
+  }
+  job->order = KVZ_ATOMIC_INC(job->counter);
+}
+
+TEST test_shared_pool_fairness(void)
+{
+  // With one thread the jobs are run in the order the thread picks them.
+  threadqueue_pool_t *pool = kvz_threadqueue_pool_init(1);
+  ASSERT(pool != NULL);
+  threadqueue_queue_t *queue_a = kvz_threadqueue_init_shared(pool);
+  threadqueue_queue_t *queue_b = kvz_threadqueue_init_shared(pool);
+  ASSERT(queue_a != NULL);
+  ASSERT(queue_b != NULL);
+
+  int32_t gate = 0;
+  int32_t counter = 0;
+  fairness_job_t args_a[FAIRNESS_JOBS + 1];
+  fairness_job_t args_b[FAIRNESS_JOBS / 10];
+  threadqueue_job_t *jobs_a[FAIRNESS_JOBS + 1];
+  threadqueue_job_t *jobs_b[FAIRNESS_JOBS / 10];
+
+  // Keep the thread busy until queue A has a long backlog of jobs when
+  // the jobs of queue B arrive.
+  for (int i = 0; i < FAIRNESS_JOBS + 1; i++) {
+    args_a[i].gate = i == 0 ? &gate : NULL;
+    args_a[i].counter = &counter;
+    jobs_a[i] = kvz_threadqueue_job_create(queue_a, fairness_job_run, &args_a[i]);
+    kvz_threadqueue_submit(queue_a, jobs_a[i]);
+  }
+  for (int i = 0; i < FAIRNESS_JOBS / 10; i++) {
+    args_b[i].gate = NULL;
+    args_b[i].counter = &counter;
+    jobs_b[i] = kvz_threadqueue_job_create(queue_b, fairness_job_run, &args_b[i]);
+    kvz_threadqueue_submit(queue_b, jobs_b[i]);
+  }
+  KVZ_ATOMIC_INC(&gate);
+
+  for (int i = 0; i < FAIRNESS_JOBS / 10; i++) {
+    kvz_threadqueue_waitfor(queue_b, jobs_b[i]);
+    kvz_threadqueue_free_job(&jobs_b[i]);
+  }
+  for (int i = 0; i < FAIRNESS_JOBS + 1; i++) {
+    kvz_threadqueue_waitfor(queue_a, jobs_a[i]);
+    kvz_threadqueue_free_job(&jobs_a[i]);
+  }
+
+  // The queues take turns, so queue B does not wait for the backlog of A.
+  for (int i = 0; i < FAIRNESS_JOBS / 10; i++) {
+    ASSERT(args_b[i].order <= 2 * (i + 2));
+  }
+
+  kvz_threadqueue_free(queue_a);
+  kvz_threadqueue_free(queue_b);
+  kvz_threadqueue_pool_free(pool);
+  PASS();
+}
+
+TEST test_pool_idle_time(void)
+{
+  threadqueue_pool_t *pool = kvz_threadqueue_pool_init(2);
+  ASSERT(pool != NULL);
+
+  // Both threads sleep since there is nothing to do.
+  KVZ_CLOCK_T start, now;
+  KVZ_GET_TIME(&start);
+  do {
+    KVZ_GET_TIME(&now);
+  } while (KVZ_CLOCK_T_DIFF(start, now) < 0.1);
+  const double idle_time = kvz_threadqueue_pool_idle_time(pool);
+  ASSERT(idle_time > 0.05);
+  ASSERT(idle_time < 10);
+  ASSERT(kvz_threadqueue_pool_idle_time(pool) >= idle_time);
+
+  kvz_threadqueue_pool_free(pool);
+  PASS();
+}
+
+static void busy_job_run(void *opaque)
+{
+  (void)opaque;
+  KVZ_CLOCK_T start, now;
+  KVZ_GET_TIME(&start);
+  do {
+    KVZ_GET_TIME(&now);
+  } while (KVZ_CLOCK_T_DIFF(start, now) < 0.2);
+}
+
+TEST test_queue_idle_time(void)
+{
+  threadqueue_pool_t *pool = kvz_threadqueue_pool_init(1);
+  ASSERT(pool != NULL);
+  threadqueue_queue_t *queue_a = kvz_threadqueue_init_shared(pool);
+  threadqueue_queue_t *queue_b = kvz_threadqueue_init_shared(pool);
+  ASSERT(queue_a != NULL);
+  ASSERT(queue_b != NULL);
+  ASSERT(kvz_threadqueue_count_starved_time(queue_a));
+
+  // The thread is busy with a job of queue B while queue A has nothing
+  // to do, so the time is idle time only for queue A.
+  const double idle_a = kvz_threadqueue_idle_time(queue_a);
+  const double idle_b = kvz_threadqueue_idle_time(queue_b);
+  threadqueue_job_t *job = kvz_threadqueue_job_create(queue_b, busy_job_run, NULL);
+  ASSERT(job != NULL);
+  kvz_threadqueue_submit(queue_b, job);
+  kvz_threadqueue_waitfor(queue_b, job);
+  kvz_threadqueue_free_job(&job);
+
+  ASSERT(kvz_threadqueue_idle_time(queue_a) - idle_a >= 0.2);
+  ASSERT(kvz_threadqueue_idle_time(queue_b) - idle_b < 0.1);
+
+  kvz_threadqueue_free(queue_a);
+  kvz_threadqueue_free(queue_b);
+  kvz_threadqueue_pool_free(pool);
+  PASS();
+}
+
+#define NUM_SUBJOBS 16
+
+typedef struct {
+  threadqueue_queue_t *threadqueue;
+  int32_t runs[NUM_SUBJOBS];
+  int32_t missing;
+} subjob_parent_t;
+
+static void subjob_run(void *opaque)
+{
+  KVZ_ATOMIC_INC((int32_t*)opaque);
+}
+
+static void subjob_parent_run(void *opaque)
+{
+  subjob_parent_t *parent = opaque;
+  threadqueue_job_t *jobs[NUM_SUBJOBS];
+
+  for (int i = 0; i < NUM_SUBJOBS; i++) {
+    jobs[i] = kvz_threadqueue_job_create(parent->threadqueue, subjob_run, &parent->runs[i]);
+    kvz_threadqueue_submit(parent->threadqueue, jobs[i]);
+  }
+  for (int i = 0; i < NUM_SUBJOBS; i++) {
+    kvz_threadqueue_join(parent->threadqueue, jobs[i]);
+    if (KVZ_ATOMIC_ADD(&parent->runs[i], 0) != 1) {
+      parent->missing++;
+    }
+    kvz_threadqueue_free_job(&jobs[i]);
+  }
+}
+
+TEST test_join_from_job(int thread_count)
+{
+  // With a single thread the job can only finish if joining runs the
+  // jobs it waits for.
+  threadqueue_queue_t *threadqueue = kvz_threadqueue_init(thread_count);
+  ASSERT(threadqueue != NULL);
+
+  for (int round = 0; round < NUM_FRAMES; round++) {
+    subjob_parent_t parent;
+    memset(&parent, 0, sizeof(parent));
+    parent.threadqueue = threadqueue;
+
+    threadqueue_job_t *job =
+      kvz_threadqueue_job_create(threadqueue, subjob_parent_run, &parent);
+    ASSERT(job != NULL);
+    kvz_threadqueue_submit(threadqueue, job);
+    kvz_threadqueue_waitfor(threadqueue, job);
+    kvz_threadqueue_free_job(&job);
+
+    ASSERT_EQ(0, parent.missing);
+    for (int i = 0; i < NUM_SUBJOBS; i++) {
+      ASSERT_EQ(1, parent.runs[i]);
+    }
+  }
+
+  kvz_threadqueue_stop(threadqueue);
+  kvz_threadqueue_free(threadqueue);
+  PASS();
+}
+
+// More than fit in the job itself and in one chunk of dependencies.
+#define NUM_DEPENDS 50
+
+typedef struct {
+  int32_t done;
+  int32_t done_before_last;
+} depends_t;
+
+static void depends_run(void *opaque)
+{
+  depends_t *depends = opaque;
+  KVZ_ATOMIC_INC(&depends->done);
+}
+
+static void depends_last_run(void *opaque)
+{
+  depends_t *depends = opaque;
+  depends->done_before_last = KVZ_ATOMIC_ADD(&depends->done, 0);
+}
+
+TEST test_many_dependencies(int thread_count)
+{
+  threadqueue_queue_t *threadqueue = kvz_threadqueue_init(thread_count);
+  ASSERT(threadqueue != NULL);
+
+  for (int round = 0; round < NUM_FRAMES; round++) {
+    depends_t depends = { 0, 0 };
+    threadqueue_job_t *jobs[NUM_DEPENDS];
+    threadqueue_job_t *last =
+      kvz_threadqueue_job_create(threadqueue, depends_last_run, &depends);
+    ASSERT(last != NULL);
+
+    for (int i = 0; i < NUM_DEPENDS; i++) {
+      jobs[i] = kvz_threadqueue_job_create(threadqueue, depends_run, &depends);
+      ASSERT(jobs[i] != NULL);
+      ASSERT(kvz_threadqueue_job_dep_add(last, jobs[i]));
+    }
+    for (int i = 0; i < NUM_DEPENDS; i++) {
+      kvz_threadqueue_submit(threadqueue, jobs[i]);
+    }
+    kvz_threadqueue_submit(threadqueue, last);
+    kvz_threadqueue_waitfor(threadqueue, last);
+
+    ASSERT_EQ(NUM_DEPENDS, depends.done_before_last);
+
+    kvz_threadqueue_free_job(&last);
+    for (int i = 0; i < NUM_DEPENDS; i++) {
+      kvz_threadqueue_free_job(&jobs[i]);
+    }
+  }
+
+  kvz_threadqueue_free(threadqueue);
+  PASS();
+}
+
+static int count_substrings(const char *str, const char *sub)
+{
+  int count = 0;
+  for (const char *pos = strstr(str, sub); pos; pos = strstr(pos + 1, sub)) {
+    count++;
+  }
+  return count;
+}
+
+TEST test_trace(int thread_count)
+{
+  const char *filename = "threadqueue_trace_test.json";
+
+  kvz_trace_t *trace = kvz_trace_open(filename);
+  ASSERT(trace != NULL);
+
+  threadqueue_queue_t *threadqueue = kvz_threadqueue_init(thread_count);
+  ASSERT(threadqueue != NULL);
+  kvz_threadqueue_set_trace(threadqueue, trace);
+
+  grid_t grid;
+  ASSERT(run_grid(threadqueue, &grid));
+
+  kvz_threadqueue_stop(threadqueue);
+  kvz_threadqueue_free(threadqueue);
+  ASSERT(kvz_trace_close(trace));
+
+  FILE *f = fopen(filename, "rb");
+  ASSERT(f != NULL);
+  char *json = calloc(1, 1 << 20);
+  const size_t length = fread(json, 1, (1 << 20) - 1, f);
+  fclose(f);
+  remove(filename);
+  ASSERT(length > 0);
+
+  const int num_jobs = GRID_WIDTH * GRID_HEIGHT;
+  ASSERT_EQ(num_jobs, count_substrings(json, "\"ph\":\"B\""));
+  ASSERT_EQ(num_jobs, count_substrings(json, "\"ph\":\"E\""));
+  ASSERT_EQ(num_jobs, count_substrings(json, "\"name\":\"submit\""));
+  // Every dependency arrow has both ends.
+  ASSERT_EQ(count_substrings(json, "\"ph\":\"s\""),
+            count_substrings(json, "\"ph\":\"f\""));
+  ASSERT_EQ(0, strncmp(json, "{\"traceEvents\":[", 16));
+  ASSERT(strstr(json, "]}") != NULL);
+
+  free(json);
+  PASS();
+}
+
+SUITE(threadqueue_tests)
+{
+  // Without threads the jobs are run immediately when submitted.
+  RUN_TEST1(test_dependency_order, 0);
+  RUN_TEST1(test_dependency_order, 1);
+  RUN_TEST1(test_dependency_order, 4);
+
+  RUN_TEST1(test_no_allocs_after_warmup, 0);
+  RUN_TEST1(test_no_allocs_after_warmup, 4);
+  RUN_TEST(test_encoder_no_allocs_after_warmup);
+
+  RUN_TEST1(test_shared_pool, 0);
+  RUN_TEST1(test_shared_pool, 4);
+  RUN_TEST(test_shared_pool_fairness);
+  RUN_TEST(test_pool_idle_time);
+  RUN_TEST(test_queue_idle_time);
+
+  RUN_TEST1(test_join_from_job, 0);
+  RUN_TEST1(test_join_from_job, 1);
+  RUN_TEST1(test_join_from_job, 4);
+
+  RUN_TEST1(test_many_dependencies, 0);
+  RUN_TEST1(test_many_dependencies, 4);
+
+  RUN_TEST1(test_trace, 0);
+  RUN_TEST1(test_trace, 4);
+}
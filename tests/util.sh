@@ -54,6 +54,44 @@ valgrind_test() {
     cleanup
 }
 
+# Encode with a VBV buffer and check from the sizes of the frames printed by
+# the encoder that the buffer never underflows. The buffer is filled at the
+# maximum rate at 25 frames per second starting from 90% full.
+vbv_test() {
+    dimensions="$1"
+    shift
+    frames="$1"
+    shift
+    bufsize="$1"
+    shift
+    maxrate="$1"
+    shift
+
+    prepare "${dimensions}" "${frames}"
+
+    logfile="$(mktemp)"
+    print_and_run \
+        libtool execute \
+            ../src/kvazaar -i "${yuvfile}" "--input-res=${dimensions}" -o "${hevcfile}" \
+                "--vbv-bufsize=${bufsize}" "--vbv-maxrate=${maxrate}" "$@" \
+                2> "${logfile}"
+
+    awk -v bufsize="${bufsize}" -v maxrate="${maxrate}" '
+        BEGIN { fullness = 0.9 * bufsize; status = 0 }
+        /^POC/ {
+            if ($6 > fullness) {
+                printf "VBV underflow at POC %d: %d bits, buffer %d bits\n", $2, $6, fullness
+                status = 1
+            }
+            fullness = fullness - $6 + maxrate / 25
+            if (fullness > bufsize) fullness = bufsize
+        }
+        END { exit status }' "${logfile}" || { rm -f "${logfile}"; return 1; }
+    rm -f "${logfile}"
+
+    cleanup
+}
+
 encode_test() {
     dimensions="$1"
     shift